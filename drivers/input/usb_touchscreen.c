@@ -2,6 +2,11 @@
 #include "usb.h"
 #include "hid.h"
 #include "input.h"
+#include "../../kernel/softirq.h"
+
+// Raw reports waiting for the tasklet (the interrupt handler only copies)
+#define TS_REPORT_QUEUE 8
+#define TS_REPORT_SIZE  64
 
 typedef struct {
     uint16_t x;
@@ -22,7 +27,15 @@ typedef struct {
     
     // Current state
     touch_point_t contacts[10];
-    spinlock_t lock;
+    spinlock_t lock;  // Protects the report queue
+    
+    // Reports from the interrupt handler, parsed in the tasklet
+    uint8_t reports[TS_REPORT_QUEUE][TS_REPORT_SIZE];
+    uint8_t report_len[TS_REPORT_QUEUE];
+    uint32_t report_head;
+    uint32_t report_tail;
+    uint32_t dropped;  // Queue was full
+    tasklet_t tasklet;
     
     // Calibration for Acer T230H
     uint32_t cal_x_min;
@@ -31,12 +44,15 @@ typedef struct {
     uint32_t cal_y_max;
 } usb_touchscreen_t;
 
+static void touchscreen_tasklet(void* data);
+
 void usb_touchscreen_probe(usb_device_t* device, uint8_t interface) {
     usb_touchscreen_t* ts = kmalloc(sizeof(usb_touchscreen_t));
     memset(ts, 0, sizeof(usb_touchscreen_t));
     
     ts->device = device;
     ts->interface = interface;
+    tasklet_init(&ts->tasklet, touchscreen_tasklet, ts);
     
     // Get HID report descriptor
     uint8_t report_desc[256];
@@ -99,7 +115,30 @@ void usb_touchscreen_probe(usb_device_t* device, uint8_t interface) {
 void touchscreen_interrupt_handler(void* data, uint8_t* buffer, int length) {
     usb_touchscreen_t* ts = (usb_touchscreen_t*)data;
     
+    // Just queue the report, parsing and input events happen in the tasklet
     spin_lock(&ts->lock);
+    if (ts->report_head - ts->report_tail < TS_REPORT_QUEUE) {
+        uint32_t slot = ts->report_head % TS_REPORT_QUEUE;
+        if (length > TS_REPORT_SIZE) length = TS_REPORT_SIZE;
+        if (length < 0) length = 0;
+        memcpy(ts->reports[slot], buffer, length);
+        ts->report_len[slot] = length;
+        ts->report_head++;
+    } else {
+        ts->dropped++;
+    }
+    spin_unlock(&ts->lock);
+    
+    tasklet_schedule(&ts->tasklet);
+    
+    // Resubmit interrupt transfer
+    usb_interrupt_transfer(ts->device, ts->endpoint,
+                         touchscreen_interrupt_handler, ts,
+                         64, 10);
+}
+
+static void touchscreen_parse_report(usb_touchscreen_t* ts, uint8_t* buffer, int length) {
+    if (length < 1) return;
     
     // Parse HID report based on report ID
     uint8_t report_id = buffer[0];
@@ -180,13 +219,26 @@ void touchscreen_interrupt_handler(void* data, uint8_t* buffer, int length) {
         
         input_sync();
     }
+}
+
+static void touchscreen_tasklet(void* data) {
+    usb_touchscreen_t* ts = (usb_touchscreen_t*)data;
+    uint8_t buffer[TS_REPORT_SIZE];
     
-    spin_unlock(&ts->lock);
-    
-    // Resubmit interrupt transfer
-    usb_interrupt_transfer(ts->device, ts->endpoint,
-                         touchscreen_interrupt_handler, ts,
-                         64, 10);
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&ts->lock);
+        if (ts->report_tail == ts->report_head) {
+            spin_unlock_irqrestore(&ts->lock, flags);
+            break;
+        }
+        uint32_t slot = ts->report_tail % TS_REPORT_QUEUE;
+        int length = ts->report_len[slot];
+        memcpy(buffer, ts->reports[slot], length);
+        ts->report_tail++;
+        spin_unlock_irqrestore(&ts->lock, flags);
+        
+        touchscreen_parse_report(ts, buffer, length);
+    }
 }
 
 uint16_t touchscreen_calibrate_x(usb_touchscreen_t* ts, uint16_t raw_x) {
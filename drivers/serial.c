@@ -63,3 +63,35 @@ void serial_write(const char* str) {
         serial_putchar(str[i]);
     }
 }
+
+// Write an unsigned number in decimal
+void serial_write_dec(uint64_t value) {
+    char buf[21];  // 2^64 has 20 digits, plus the terminator
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+
+    // Fill the buffer backwards, one digit at a time
+    do {
+        buf[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    serial_write(&buf[i]);
+}
+
+// Write an unsigned number in hex with a 0x prefix (handy for addresses)
+void serial_write_hex(uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    char buf[19];  // "0x" + 16 digits + terminator
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+
+    do {
+        buf[--i] = digits[value & 0xF];
+        value >>= 4;
+    } while (value);
+
+    buf[--i] = 'x';
+    buf[--i] = '0';
+    serial_write(&buf[i]);
+}
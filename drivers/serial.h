@@ -22,6 +22,10 @@ void serial_putchar(char c);
 // This is your printf for now (until we get proper console output working)
 void serial_write(const char* str);
 
+// Write numbers to the serial port (no printf yet, so these will have to do)
+void serial_write_dec(uint64_t value);
+void serial_write_hex(uint64_t value);
+
 // Port I/O helpers (inline assembly because we're talking directly to hardware)
 // outb = output byte, inb = input byte (classic x86 I/O instructions)
 static inline void outb(uint16_t port, uint8_t value) {
@@ -34,4 +38,20 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+// 16 bits (PCI config writes narrower than a dword need these)
+static inline void outw(uint16_t port, uint16_t value) {
+    __asm__ volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Same for 32 bits (PCI config space goes through 0xCF8/0xCFC with these)
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
 #endif // SERIAL_H
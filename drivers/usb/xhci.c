@@ -1,6 +1,10 @@
 // drivers/usb/xhci.c
 #include "xhci.h"
-#include "pci.h"
+#include "../../kernel/pci.h"
+#include "../../kernel/msi.h"
+#include "../../kernel/pmm.h"
+#include "../../kernel/vmm.h"
+#include "../../kernel/scheduler.h"
 
 typedef struct {
     volatile uint32_t* op_regs;     // Operational registers
@@ -16,6 +20,7 @@ typedef struct {
     uint32_t cmd_ring_enqueue;
     uint32_t event_ring_dequeue;
     spinlock_t lock;
+    int vector;           // Interrupter 0's vector (MSI-X entry 0)
 } xhci_controller_t;
 
 void xhci_init(pci_device_t* device) {
@@ -23,7 +28,7 @@ void xhci_init(pci_device_t* device) {
     
     // Map MMIO registers
     uint64_t bar0 = pci_read_bar(device, 0);
-    xhci->op_regs = (uint32_t*)vmm_map_mmio(bar0, 0x1000);
+    xhci->op_regs = (uint32_t*)vmm_map_mmio(bar0, 0x1000, VMM_CACHE_UC);
     
     // Get capability registers
     uint32_t* cap_regs = (uint32_t*)xhci->op_regs;
@@ -48,14 +53,12 @@ void xhci_init(pci_device_t* device) {
     uint32_t max_slots = (hcsparams1 >> 0) & 0xFF;
     
     // Device Context Base Address Array
-    xhci->dcbaa = (uint64_t*)alloc_pages(1);
-    memset(xhci->dcbaa, 0, 4096);
+    xhci->dcbaa = (uint64_t*)pmm_alloc_zeroed_page_zone(PMM_ZONE_DMA32);
     xhci->op_regs[XHCI_DCBAAP_LO] = (uint32_t)(uintptr_t)xhci->dcbaa;
     xhci->op_regs[XHCI_DCBAAP_HI] = (uint32_t)((uintptr_t)xhci->dcbaa >> 32);
     
     // Command ring
-    xhci->cmd_ring = (xhci_trb_t*)alloc_pages(1);
-    memset(xhci->cmd_ring, 0, 4096);
+    xhci->cmd_ring = (xhci_trb_t*)pmm_alloc_zeroed_page_zone(PMM_ZONE_DMA32);
     xhci->cmd_ring[255].control = TRB_TYPE(TRB_LINK) | TRB_TC;
     xhci->cmd_ring[255].parameter = (uint64_t)xhci->cmd_ring;
     
@@ -64,9 +67,8 @@ void xhci_init(pci_device_t* device) {
     xhci->op_regs[XHCI_CRCR_HI] = (uint32_t)(cmd_ring_addr >> 32);
     
     // Event ring segment table
-    xhci_erst_entry_t* erst = (xhci_erst_entry_t*)alloc_pages(1);
-    xhci->event_ring = (xhci_trb_t*)alloc_pages(1);
-    memset(xhci->event_ring, 0, 4096);
+    xhci_erst_entry_t* erst = (xhci_erst_entry_t*)pmm_alloc_zeroed_page_zone(PMM_ZONE_DMA32);
+    xhci->event_ring = (xhci_trb_t*)pmm_alloc_zeroed_page_zone(PMM_ZONE_DMA32);
     
     erst[0].ring_segment_base = (uint64_t)xhci->event_ring;
     erst[0].ring_segment_size = 256;
@@ -86,8 +88,9 @@ void xhci_init(pci_device_t* device) {
     // Start controller
     xhci->op_regs[XHCI_USBCMD] |= USBCMD_RUN | USBCMD_INTE;
     
-    // Register interrupt handler
-    register_interrupt_handler(device->irq, xhci_interrupt_handler, xhci);
+    // Interrupter 0 gets its own MSI-X vector on the least busy CPU, so it
+    // doesn't share a line (or a core) with the NIC
+    xhci->vector = pci_alloc_irq(device, 0, SCHED_ANY_CPU, "xhci", xhci_interrupt_handler, xhci);
     
     // Enable interrupts
     xhci->runtime_regs[XHCI_IMAN(0)] |= 0x2;
@@ -114,12 +117,11 @@ void xhci_enumerate_device(xhci_controller_t* xhci, int port) {
     uint32_t slot_id = xhci_send_command(xhci, &enable_slot);
     
     // Allocate device context
-    xhci_device_context_t* dev_ctx = (xhci_device_context_t*)alloc_pages(1);
-    memset(dev_ctx, 0, sizeof(xhci_device_context_t));
+    xhci_device_context_t* dev_ctx = (xhci_device_context_t*)pmm_alloc_zeroed_page_zone(PMM_ZONE_DMA32);
     xhci->dcbaa[slot_id] = (uint64_t)dev_ctx;
     
     // Allocate input context
-    xhci_input_context_t* input_ctx = (xhci_input_context_t*)alloc_pages(2);
+    xhci_input_context_t* input_ctx = (xhci_input_context_t*)pmm_alloc_pages_zone(PMM_ZONE_DMA32, 1);
     memset(input_ctx, 0, sizeof(xhci_input_context_t));
     
     // Configure slot context
@@ -130,8 +132,7 @@ void xhci_enumerate_device(xhci_controller_t* xhci, int port) {
     input_ctx->slot.speed = xhci_get_port_speed(xhci, port);
     
     // Configure endpoint 0
-    xhci_trb_t* ep0_ring = (xhci_trb_t*)alloc_pages(1);
-    memset(ep0_ring, 0, 4096);
+    xhci_trb_t* ep0_ring = (xhci_trb_t*)pmm_alloc_zeroed_page_zone(PMM_ZONE_DMA32);
     
     input_ctx->endpoints[0].tr_dequeue_ptr = (uint64_t)ep0_ring | 1;
     input_ctx->endpoints[0].ep_type = EP_TYPE_CONTROL;
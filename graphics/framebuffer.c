@@ -3,6 +3,11 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "../kernel/heap.h"
+#include "../kernel/fpu.h"
+#include "../kernel/memory.h"
+#include "../kernel/vmm.h"
+#include "../kernel/spinlock.h"
+#include "../kernel/rcu.h"
 
 // Missing type definitions
 typedef struct {
@@ -15,29 +20,8 @@ typedef struct window {
     // Other fields can be added as needed
 } window_t;
 
-typedef struct {
-    volatile int locked;
-} spinlock_t;
-
 typedef void* EFI_GRAPHICS_OUTPUT_PROTOCOL;
 
-static inline void spin_lock(spinlock_t* lock) {
-    while (__sync_lock_test_and_set(&lock->locked, 1)) {
-        __asm__ volatile("pause");
-    }
-}
-
-static inline void spin_unlock(spinlock_t* lock) {
-    __sync_lock_release(&lock->locked);
-}
-
-static inline void* memcpy(void* dest, const void* src, size_t n) {
-    uint8_t* d = dest;
-    const uint8_t* s = src;
-    for (size_t i = 0; i < n; i++) d[i] = s[i];
-    return dest;
-}
-
 static inline bool rect_intersects(rect_t* a, rect_t* b) {
     return !(a->x + a->width < b->x || b->x + b->width < a->x ||
              a->y + a->height < b->y || b->y + b->height < a->y);
@@ -48,7 +32,7 @@ void window_composite(window_t* win, uint32_t* buffer, rect_t* rect);
 void framebuffer_wait_vsync(void);
 void framebuffer_create_default_cursor(void);
 
-// Placeholder window list
+// Placeholder window list (RCU: walked every frame without a lock)
 static window_t* window_list = NULL;
 
 // Placeholder for missing pixel format enum
@@ -87,13 +71,20 @@ void framebuffer_init(EFI_GRAPHICS_OUTPUT_PROTOCOL* gop) {
     fb.bpp = 32;
 
     // Allocate backbuffer for double buffering
+    // (2MB pages: ~8MB scanned every frame would thrash the TLB with 4KB pages)
     if (fb.address) {
         size_t buffer_size = fb.height * fb.pitch;
-        fb.backbuffer = (uint32_t*)kmalloc(buffer_size);
+        fb.backbuffer = (uint32_t*)vmm_alloc_huge_buffer(buffer_size);
         if (fb.backbuffer) {
             memcpy(fb.backbuffer, fb.address, buffer_size);
         }
 
+        // Scanout memory through the identity map is WB/UC (whatever the
+        // MTRRs say), which makes every pixel store its own bus write. Map
+        // it write-combining so the flip goes out in full lines.
+        uint32_t* wc = (uint32_t*)vmm_map_mmio((uint64_t)fb.address, buffer_size, VMM_CACHE_WC);
+        if (wc) fb.address = wc;
+
         // Allocate cursor data
         fb.cursor_data = kmalloc(64 * 64 * 4);  // 64x64 cursor
         if (fb.cursor_data) {
@@ -150,11 +141,13 @@ void compositor_composite(void) {
         if (rect->y + rect->height > fb.height) rect->height = fb.height - rect->y;
         
         // Composite windows in this region
-        for (window_t* win = window_list; win; win = win->next) {
+        rcu_read_lock();
+        for (window_t* win = rcu_dereference(window_list); win; win = rcu_dereference(win->next)) {
             if (rect_intersects(&win->bounds, rect)) {
                 window_composite(win, fb.backbuffer, rect);
             }
         }
+        rcu_read_unlock();
     }
     
     // Swap buffers (vsync if available)
@@ -162,16 +155,18 @@ void compositor_composite(void) {
     
     spin_lock(&fb.flip_lock);
     
-    // Copy only damaged regions to front buffer
+    // Copy only damaged regions to front buffer (non-temporal, it's WC: the
+    // stores skip the cache and go out as full 64-byte bursts)
     for (int i = 0; i < compositor.damage_count; i++) {
         rect_t* rect = &compositor.damage_rects[i];
         
         for (int y = rect->y; y < rect->y + rect->height; y++) {
             uint32_t* src = fb.backbuffer + y * (fb.pitch / 4) + rect->x;
             uint32_t* dst = fb.address + y * (fb.pitch / 4) + rect->x;
-            memcpy(dst, src, rect->width * 4);
+            memcpy_nt(dst, src, rect->width * 4);
         }
     }
+    memory_nt_fence();
     
     spin_unlock(&fb.flip_lock);
     
@@ -195,11 +190,89 @@ void window_composite(window_t* win, uint32_t* buffer, rect_t* rect) {
     // TODO: Implement window compositing
 }
 
-// Accelerated graphics operations using SIMD (disabled for now - needs proper includes)
+// Source-over blend of one ARGB pixel: src * a + dst * (255 - a), with the
+// result alpha src_a + dst_a * (1 - src_a). (x + 128 + ((x + 128) >> 8)) >> 8
+// is x / 255 rounded, without a divide.
+static inline uint32_t blend_pixel(uint32_t dst, uint32_t src) {
+    uint32_t a = src >> 24;
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t s = (src >> shift) & 0xFF;
+        uint32_t d = (dst >> shift) & 0xFF;
+        uint32_t x = s * (shift == 24 ? 255 : a) + d * (255 - a) + 128;
+        out |= ((x + (x >> 8)) >> 8) << shift;
+    }
+    return out;
+}
+
+// Word constants for the SSE2 blend (8 x 16 bits)
+static const uint16_t blend_alpha_lane[8] __attribute__((aligned(16))) = { 0, 0, 0, 0xFF, 0, 0, 0, 0xFF };
+static const uint16_t blend_255[8] __attribute__((aligned(16))) = { 255, 255, 255, 255, 255, 255, 255, 255 };
+static const uint16_t blend_128[8] __attribute__((aligned(16))) = { 128, 128, 128, 128, 128, 128, 128, 128 };
+
+// Two pixels of xmm0 (src) / xmm1 (dst), unpacked to words with `unpack`,
+// blended into xmm2 (xmm8 = 0, xmm9-11 = the constants above)
+#define BLEND_HALF(unpack) \
+    "movdqa %%xmm0, %%xmm2\n\t" \
+    unpack " %%xmm8, %%xmm2\n\t"          /* src words */ \
+    "movdqa %%xmm1, %%xmm3\n\t" \
+    unpack " %%xmm8, %%xmm3\n\t"          /* dst words */ \
+    "pshuflw $0xFF, %%xmm2, %%xmm4\n\t"   /* a in every lane of each pixel */ \
+    "pshufhw $0xFF, %%xmm4, %%xmm4\n\t" \
+    "movdqa %%xmm10, %%xmm5\n\t" \
+    "psubw %%xmm4, %%xmm5\n\t"            /* 255 - a */ \
+    "por %%xmm9, %%xmm4\n\t"              /* src alpha counts in full */ \
+    "pmullw %%xmm4, %%xmm2\n\t" \
+    "pmullw %%xmm5, %%xmm3\n\t" \
+    "paddw %%xmm3, %%xmm2\n\t" \
+    "paddw %%xmm11, %%xmm2\n\t" \
+    "movdqa %%xmm2, %%xmm3\n\t" \
+    "psrlw $8, %%xmm3\n\t" \
+    "paddw %%xmm3, %%xmm2\n\t" \
+    "psrlw $8, %%xmm2\n\t"
+
+// Alpha blend a width x height block of ARGB pixels from src onto dst
+// (strides in pixels). Four pixels per SSE2 step inside a kernel_fpu
+// section; the same math one pixel at a time when vector registers aren't
+// available here.
 void framebuffer_blit_alpha_sse2(uint32_t* dst, uint32_t* src,
                                  int width, int height,
                                  int dst_stride, int src_stride) {
-    // TODO: Implement SSE2 alpha blending (needs emmintrin.h)
-    (void)dst; (void)src; (void)width; (void)height;
-    (void)dst_stride; (void)src_stride;
+    if (width <= 0 || height <= 0) return;
+
+    bool simd = kernel_fpu_usable();
+    if (simd) {
+        kernel_fpu_begin();
+        // XMM registers aren't clobbers here: the kernel is built with
+        // -mgeneral-regs-only, GCC keeps nothing in them
+        __asm__ volatile(
+            "pxor %%xmm8, %%xmm8\n\t"
+            "movdqa %0, %%xmm9\n\t"
+            "movdqa %1, %%xmm10\n\t"
+            "movdqa %2, %%xmm11"
+            : : "m"(blend_alpha_lane), "m"(blend_255), "m"(blend_128));
+    }
+
+    for (int y = 0; y < height; y++) {
+        uint32_t* d = dst + (size_t)y * dst_stride;
+        const uint32_t* s = src + (size_t)y * src_stride;
+        int x = 0;
+
+        if (simd) {
+            for (; x + 4 <= width; x += 4) {
+                __asm__ volatile(
+                    "movdqu (%1), %%xmm0\n\t"
+                    "movdqu (%0), %%xmm1\n\t"
+                    BLEND_HALF("punpcklbw")
+                    "movdqa %%xmm2, %%xmm6\n\t"
+                    BLEND_HALF("punpckhbw")
+                    "packuswb %%xmm2, %%xmm6\n\t"
+                    "movdqu %%xmm6, (%0)"
+                    : : "r"(d + x), "r"(s + x) : "memory");
+            }
+        }
+        for (; x < width; x++) d[x] = blend_pixel(d[x], s[x]);
+    }
+
+    if (simd) kernel_fpu_end();
 }
@@ -0,0 +1,177 @@
+// kernel/acpi.c
+// ACPI tables
+// All the tables sit in RAM or firmware-reserved memory below 4GB, which
+// is identity mapped, so physical addresses are used directly.
+//
+// Created by: floof<3
+
+#include "acpi.h"
+#include "../drivers/serial.h"
+
+typedef struct {
+    char signature[8];      // "RSD PTR "
+    uint8_t checksum;       // First 20 bytes
+    char oem_id[6];
+    uint8_t revision;       // 0 = ACPI 1.0 (RSDT only), 2+ = has the XSDT fields
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+// MADT entry types we care about
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_OVERRIDE       2
+#define MADT_LAPIC_ADDRESS  5
+#define MADT_X2APIC         9
+
+#define MADT_LAPIC_ENABLED  (1 << 0)  // Bit 1 = "can be turned on later", we don't do hotplug
+
+static const acpi_header_t* root = NULL;  // RSDT or XSDT
+static bool root_is_xsdt = false;
+static acpi_madt_info_t madt_info;
+static bool have_madt = false;
+
+static bool acpi_checksum(const void* data, uint32_t length) {
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) sum += bytes[i];
+    return sum == 0;
+}
+
+static bool acpi_signature(const char* a, const char* b, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+// The RSDP is on a 16-byte boundary somewhere in [start, end)
+static const acpi_rsdp_t* acpi_scan(uint64_t start, uint64_t end) {
+    for (uint64_t addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+        const acpi_rsdp_t* rsdp = (const acpi_rsdp_t*)addr;
+        if (acpi_signature(rsdp->signature, "RSD PTR ", 8) && acpi_checksum(rsdp, 20)) return rsdp;
+    }
+    return NULL;
+}
+
+const acpi_header_t* acpi_find_table(const char* signature) {
+    if (!root) return NULL;
+
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t count = (root->length - sizeof(acpi_header_t)) / entry_size;
+    const uint8_t* entries = (const uint8_t*)root + sizeof(acpi_header_t);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t addr = root_is_xsdt ? *(const uint64_t*)(entries + i * 8)
+                                     : *(const uint32_t*)(entries + i * 4);
+        const acpi_header_t* table = (const acpi_header_t*)addr;
+        if (table && acpi_signature(table->signature, signature, 4) &&
+            acpi_checksum(table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+static void acpi_add_lapic(uint32_t apic_id, uint32_t flags) {
+    if (!(flags & MADT_LAPIC_ENABLED) || madt_info.lapic_count == ACPI_MAX_LAPICS) return;
+
+    // Some firmware lists a CPU as both a LAPIC and an x2APIC
+    for (uint32_t i = 0; i < madt_info.lapic_count; i++) {
+        if (madt_info.lapic_ids[i] == apic_id) return;
+    }
+    madt_info.lapic_ids[madt_info.lapic_count++] = apic_id;
+}
+
+static void acpi_parse_madt(const acpi_header_t* madt) {
+    const uint8_t* p = (const uint8_t*)madt + sizeof(acpi_header_t);
+    const uint8_t* end = (const uint8_t*)madt + madt->length;
+
+    madt_info.lapic_address = *(const uint32_t*)p;
+    p += 8;  // LAPIC address + flags
+
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+            case MADT_LAPIC:
+                acpi_add_lapic(p[3], *(const uint32_t*)(p + 4));
+                break;
+
+            case MADT_X2APIC:
+                acpi_add_lapic(*(const uint32_t*)(p + 4), *(const uint32_t*)(p + 8));
+                break;
+
+            case MADT_IOAPIC:
+                if (madt_info.ioapic_count < ACPI_MAX_IOAPICS) {
+                    acpi_ioapic_t* io = &madt_info.ioapics[madt_info.ioapic_count++];
+                    io->id = p[2];
+                    io->address = *(const uint32_t*)(p + 4);
+                    io->gsi_base = *(const uint32_t*)(p + 8);
+                }
+                break;
+
+            case MADT_OVERRIDE:
+                if (madt_info.override_count < ACPI_MAX_OVERRIDES) {
+                    acpi_override_t* o = &madt_info.overrides[madt_info.override_count++];
+                    o->irq = p[3];
+                    o->gsi = *(const uint32_t*)(p + 4);
+                    o->flags = *(const uint16_t*)(p + 8);
+                }
+                break;
+
+            case MADT_LAPIC_ADDRESS:
+                madt_info.lapic_address = *(const uint64_t*)(p + 4);
+                break;
+        }
+        p += p[1];
+    }
+    have_madt = true;
+}
+
+bool acpi_init(void) {
+    // EBDA segment lives in the BIOS data area, then the BIOS ROM area
+    // (the empty asm hides the address from GCC, which treats anything in
+    // the first page as a NULL dereference)
+    uint64_t bda = 0x40E;
+    __asm__("" : "+r"(bda));
+    uint64_t ebda = (uint64_t)(*(volatile uint16_t*)bda) << 4;
+    const acpi_rsdp_t* rsdp = NULL;
+    if (ebda) rsdp = acpi_scan(ebda, ebda + 1024);
+    if (!rsdp) rsdp = acpi_scan(0xE0000, 0x100000);
+    if (!rsdp) {
+        serial_write("ACPI: No RSDP found\n");
+        return false;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address && acpi_checksum(rsdp, rsdp->length)) {
+        root = (const acpi_header_t*)rsdp->xsdt_address;
+        root_is_xsdt = true;
+    } else {
+        root = (const acpi_header_t*)(uint64_t)rsdp->rsdt_address;
+    }
+    if (!acpi_checksum(root, root->length)) {
+        serial_write("ACPI: ERROR - Bad RSDT/XSDT checksum\n");
+        root = NULL;
+        return false;
+    }
+
+    const acpi_header_t* madt = acpi_find_table("APIC");
+    if (!madt) {
+        serial_write("ACPI: No MADT\n");
+        return false;
+    }
+    acpi_parse_madt(madt);
+
+    serial_write("ACPI: ");
+    serial_write_dec(madt_info.lapic_count);
+    serial_write(" CPUs, ");
+    serial_write_dec(madt_info.ioapic_count);
+    serial_write(" IO APICs\n");
+    return true;
+}
+
+const acpi_madt_info_t* acpi_madt(void) {
+    return have_madt ? &madt_info : NULL;
+}
@@ -0,0 +1,64 @@
+// kernel/acpi.h
+// ACPI table lookup, plus the interrupt controller layout from the MADT
+// (which CPUs exist, where the IO APICs are, how legacy IRQs are wired)
+//
+// Created by: floof<3
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ACPI_MAX_LAPICS    32
+#define ACPI_MAX_IOAPICS   4
+#define ACPI_MAX_OVERRIDES 16
+
+// Common header of every ACPI table
+typedef struct {
+    char signature[4];
+    uint32_t length;        // Whole table, header included
+    uint8_t revision;
+    uint8_t checksum;       // All bytes of the table sum to 0
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    uint8_t id;
+    uint32_t address;       // Physical address of its registers
+    uint32_t gsi_base;      // First global system interrupt it handles
+} acpi_ioapic_t;
+
+// ISA IRQ that isn't wired to the GSI with the same number
+typedef struct {
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;         // MPS INTI flags (polarity bits 0-1, trigger mode bits 2-3)
+} acpi_override_t;
+
+typedef struct {
+    uint64_t lapic_address;
+    uint32_t lapic_count;
+    uint32_t lapic_ids[ACPI_MAX_LAPICS];    // Usable CPUs, in MADT order
+    uint32_t ioapic_count;
+    acpi_ioapic_t ioapics[ACPI_MAX_IOAPICS];
+    uint32_t override_count;
+    acpi_override_t overrides[ACPI_MAX_OVERRIDES];
+} acpi_madt_info_t;
+
+// Find the RSDP (EBDA, then the BIOS area) and parse the MADT
+// False if there's no ACPI (or no MADT), we're single CPU then
+bool acpi_init(void);
+
+// Table with this signature ("APIC", "HPET", ...), NULL if there is none
+const acpi_header_t* acpi_find_table(const char* signature);
+
+// What acpi_init() found in the MADT (NULL without one)
+const acpi_madt_info_t* acpi_madt(void);
+
+#endif // ACPI_H
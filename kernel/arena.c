@@ -0,0 +1,139 @@
+// kernel/arena.c
+// Arena allocator implementation
+// An arena is a stack of chunks (whole pages from the PMM). Allocations
+// bump a pointer through the newest chunk, and when it's full we push a
+// new one. Rolling back pops chunks until we're back at the mark. The
+// oldest chunk is kept on reset so a reused arena doesn't go back to the
+// PMM every time.
+//
+// Created by: floof<3
+
+#include "arena.h"
+#include "pmm.h"
+#include "heap.h"
+#include "memory.h"
+#include "percpu.h"
+#include "../drivers/serial.h"
+
+struct karena_chunk {
+    karena_chunk_t* prev;  // Older chunk (NULL = first one)
+    uint64_t pages;        // Size of this chunk in pages
+};
+
+// Chunk data starts after the header, keeping KARENA_ALIGN alignment
+#define CHUNK_HEADER ((sizeof(karena_chunk_t) + KARENA_ALIGN - 1) & ~(size_t)(KARENA_ALIGN - 1))
+
+// One scratch arena per CPU (all zeroes = empty arena, no setup needed)
+static karena_t scratch_arenas[MAX_CPUS];
+
+static inline uint8_t* chunk_data(karena_chunk_t* chunk) {
+    return (uint8_t*)chunk + CHUNK_HEADER;
+}
+
+static inline uint8_t* chunk_end(karena_chunk_t* chunk) {
+    return (uint8_t*)chunk + chunk->pages * PAGE_SIZE;
+}
+
+static inline size_t arena_chunk_size(karena_t* arena) {
+    return arena->chunk_size ? arena->chunk_size : KARENA_DEFAULT_CHUNK;
+}
+
+void karena_init(karena_t* arena, size_t chunk_size) {
+    arena->chunk = NULL;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena->chunk_size = chunk_size;
+}
+
+karena_t* karena_create(size_t chunk_size) {
+    karena_t* arena = kmalloc(sizeof(karena_t));
+    if (arena) karena_init(arena, chunk_size);
+    return arena;
+}
+
+// Current chunk is full: push a new one big enough for this allocation
+void* karena_alloc_slow(karena_t* arena, size_t size, size_t align) {
+    size_t bytes = CHUNK_HEADER + size + align;
+    if (bytes < size) return NULL;  // Overflow, nobody needs that much
+    if (bytes < arena_chunk_size(arena)) bytes = arena_chunk_size(arena);
+
+    uint64_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    karena_chunk_t* chunk = pmm_alloc_pages_exact(pages);
+    if (!chunk) {
+        serial_write("Arena: ERROR - Out of memory!\n");
+        return NULL;
+    }
+
+    chunk->prev = arena->chunk;
+    chunk->pages = pages;
+
+    arena->chunk = chunk;
+    arena->ptr = chunk_data(chunk);
+    arena->end = chunk_end(chunk);
+
+    // Guaranteed to fit now
+    return karena_alloc_aligned(arena, size, align);
+}
+
+void* karena_zalloc(karena_t* arena, size_t size) {
+    void* ptr = karena_alloc(arena, size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+char* karena_strndup(karena_t* arena, const char* str, size_t len) {
+    char* copy = karena_alloc_aligned(arena, len + 1, 1);
+    if (!copy) return NULL;
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Pop chunks back to the mark
+void karena_restore(karena_t* arena, karena_mark_t mark) {
+    while (arena->chunk && arena->chunk != mark.chunk) {
+        karena_chunk_t* chunk = arena->chunk;
+
+        // Back to an empty arena: keep the first chunk if it's a normal one
+        if (!chunk->prev && chunk->pages * PAGE_SIZE <= arena_chunk_size(arena) + PAGE_SIZE) {
+            arena->ptr = chunk_data(chunk);
+            arena->end = chunk_end(chunk);
+            return;
+        }
+
+        arena->chunk = chunk->prev;
+        pmm_free_pages_exact(chunk, chunk->pages);
+    }
+
+    if (arena->chunk) {
+        arena->ptr = mark.ptr;
+        arena->end = chunk_end(arena->chunk);
+    } else {
+        arena->ptr = arena->end = NULL;
+    }
+}
+
+void karena_reset(karena_t* arena) {
+    karena_mark_t empty = { NULL, NULL };
+    karena_restore(arena, empty);
+}
+
+void karena_fini(karena_t* arena) {
+    while (arena->chunk) {
+        karena_chunk_t* chunk = arena->chunk;
+        arena->chunk = chunk->prev;
+        pmm_free_pages_exact(chunk, chunk->pages);
+    }
+    arena->ptr = arena->end = NULL;
+}
+
+void karena_destroy(karena_t* arena) {
+    if (!arena) return;
+    karena_fini(arena);
+    kfree(arena);
+}
+
+karena_t* karena_scratch(void) {
+    return &scratch_arenas[cpu_id()];
+}
@@ -0,0 +1,109 @@
+// kernel/arena.h
+// Arena allocator - bump a pointer, free everything at once
+// For short-lived stuff (building a packet, parsing a request): allocating
+// is a pointer increment and there's no kfree, you reset the whole arena
+// (or roll back to a mark) when the work is done.
+//
+// Created by: floof<3
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define KARENA_ALIGN 16                 // Default alignment of karena_alloc()
+#define KARENA_DEFAULT_CHUNK (16 * 1024) // Chunk size when you pass 0
+
+typedef struct karena_chunk karena_chunk_t;
+
+typedef struct {
+    karena_chunk_t* chunk;  // Chunk we're bumping in (newest), NULL until first use
+    uint8_t* ptr;           // Next free byte in it
+    uint8_t* end;           // End of it
+    size_t chunk_size;      // Size of normal chunks (big allocations get their own)
+} karena_t;
+
+// Position in an arena, karena_restore() throws away everything after it
+typedef struct {
+    karena_chunk_t* chunk;
+    uint8_t* ptr;
+} karena_mark_t;
+
+// Set up an arena in place (no memory is taken until the first alloc)
+// chunk_size = 0 for the default
+void karena_init(karena_t* arena, size_t chunk_size);
+
+// Allocate a karena_t and set it up
+karena_t* karena_create(size_t chunk_size);
+
+// Free every chunk of a karena_init arena
+void karena_fini(karena_t* arena);
+
+// Free every chunk and the arena itself (karena_create arenas)
+void karena_destroy(karena_t* arena);
+
+// Throw away every allocation but keep the first chunk for next time
+// (a karena_t that's all zeroes is a valid empty arena with default chunks)
+void karena_reset(karena_t* arena);
+
+// Slow path: the current chunk is full, get a new one
+void* karena_alloc_slow(karena_t* arena, size_t size, size_t align);
+
+// Allocate `size` bytes aligned to `align` (a power of two), NOT zeroed
+static inline void* karena_alloc_aligned(karena_t* arena, size_t size, size_t align) {
+    uint8_t* p = (uint8_t*)(((uint64_t)arena->ptr + align - 1) & ~(uint64_t)(align - 1));
+    if (arena->chunk && p + size <= arena->end && p + size >= p) {
+        arena->ptr = p + size;
+        return p;
+    }
+    return karena_alloc_slow(arena, size, align);
+}
+
+static inline void* karena_alloc(karena_t* arena, size_t size) {
+    return karena_alloc_aligned(arena, size, KARENA_ALIGN);
+}
+
+// Zeroed allocation
+void* karena_zalloc(karena_t* arena, size_t size);
+
+// Copy a string into the arena
+char* karena_strndup(karena_t* arena, const char* str, size_t len);
+
+// Remember the current position / roll back to it (marks nest like a stack)
+static inline karena_mark_t karena_mark(karena_t* arena) {
+    karena_mark_t mark = { arena->chunk, arena->ptr };
+    return mark;
+}
+
+void karena_restore(karena_t* arena, karena_mark_t mark);
+
+// Per-CPU scratch arena
+// For work that starts and finishes on one CPU (packet building,
+// formatting). begin/end run it with preemption off, so the thread can't
+// migrate and another thread on this CPU can't roll the arena back under
+// it - which also means no sleeping in between (thread_sleep,
+// thread_block). Always pair begin/end, nesting is fine:
+//
+//     karena_mark_t mark = karena_scratch_begin();
+//     void* buf = karena_alloc(karena_scratch(), len);
+//     ...
+//     karena_scratch_end(mark);
+karena_t* karena_scratch(void);
+
+// From scheduler.h (not included, it drags the whole uvm in)
+void preempt_disable(void);
+void preempt_enable(void);
+
+static inline karena_mark_t karena_scratch_begin(void) {
+    preempt_disable();
+    return karena_mark(karena_scratch());
+}
+
+static inline void karena_scratch_end(karena_mark_t mark) {
+    karena_restore(karena_scratch(), mark);
+    preempt_enable();
+}
+
+#endif // ARENA_H
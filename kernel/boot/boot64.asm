@@ -3,7 +3,7 @@
 ; This is where the magic happens (switching from 32-bit to 64-bit)
 
 MULTIBOOT_MAGIC    equ 0x1BADB002
-MULTIBOOT_FLAGS    equ 0x00000000
+MULTIBOOT_FLAGS    equ 0x00000002  ; Bit 1 = please give us memory info (mem_* and the mmap)
 MULTIBOOT_CHECKSUM equ -(MULTIBOOT_MAGIC + MULTIBOOT_FLAGS)  ; Must add to zero or GRUB gets mad
 
 section .multiboot
@@ -19,7 +19,9 @@ extern kernel_main
 
 _start:
     ; Save multiboot info (EBX has pointer to multiboot info struct from GRUB)
-    mov edi, ebx
+    ; ESI because nothing below touches it: the BSS clear needs EDI, and
+    ; pushing it wouldn't help since the stack is what that clear zeroes
+    mov esi, ebx
     
     ; Set up stack (we need this before calling any functions)
     mov esp, stack_top
@@ -158,7 +160,9 @@ long_mode_start:
     rep stosb  ; Fast memset using x86 string operations
 
     ; Call kernel main (finally! we made it!)
-    ; RDI already has multiboot info pointer from earlier
+    ; First argument = the multiboot info pointer we kept in ESI (the mov
+    ; zero-extends it into RDI)
+    mov edi, esi
     call kernel_main
 
     ; If kernel returns (it shouldn't), halt forever
@@ -0,0 +1,76 @@
+// kernel/clock.c
+// TSC clock
+// Conversions are fixed point: ns = cycles * ns_mult >> 32, the 128-bit
+// product keeps it exact enough for years of uptime.
+//
+// Created by: floof<3
+
+#include "clock.h"
+#include "cpu.h"
+#include "pit.h"
+#include "../drivers/serial.h"
+
+#define CLOCK_CALIBRATE_ROUNDS 3
+#define CLOCK_CALIBRATE_TICKS  (PIT_FREQUENCY / 100)  // 10ms a round
+
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_boot = 0;    // TSC at clock_init(), clock_ns() counts from here
+static uint64_t ns_mult = 0;     // ns per cycle << 32
+static uint64_t tsc_mult = 0;    // Cycles per ns << 32
+static bool tsc_invariant = false;
+
+void clock_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpu_cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = edx & (1 << 8);
+    }
+
+    // Shortest of a few rounds: an SMI or a slow PIT read only ever makes
+    // a round look longer
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < CLOCK_CALIBRATE_ROUNDS; i++) {
+        pit_oneshot_start(CLOCK_CALIBRATE_TICKS);
+        uint64_t start = cpu_rdtsc();
+        while (!pit_oneshot_done()) cpu_pause();
+        uint64_t cycles = cpu_rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    tsc_hz = best * PIT_FREQUENCY / CLOCK_CALIBRATE_TICKS;
+
+    // (1e9 << 32) still fits in 64 bits, tsc_hz << 32 doesn't: split it
+    ns_mult = (NS_PER_SEC << 32) / tsc_hz;
+    tsc_mult = ((tsc_hz / NS_PER_SEC) << 32) + ((tsc_hz % NS_PER_SEC) << 32) / NS_PER_SEC;
+    tsc_boot = cpu_rdtsc();
+
+    serial_write("CLOCK: TSC at ");
+    serial_write_dec(tsc_hz / 1000000);
+    serial_write(" MHz");
+    if (!tsc_invariant) serial_write(" (WARNING - not invariant, time may drift in sleep states)");
+    serial_write("\n");
+}
+
+uint64_t clock_tsc_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * ns_mult) >> 32);
+}
+
+uint64_t clock_ns_to_tsc(uint64_t ns) {
+    return (uint64_t)(((unsigned __int128)ns * tsc_mult) >> 32);
+}
+
+uint64_t clock_ns(void) {
+    return clock_tsc_to_ns(cpu_rdtsc() - tsc_boot);
+}
+
+uint64_t clock_tsc_at(uint64_t ns) {
+    return tsc_boot + clock_ns_to_tsc(ns);
+}
+
+uint64_t clock_tsc_hz(void) {
+    return tsc_hz;
+}
+
+bool clock_tsc_invariant(void) {
+    return tsc_invariant;
+}
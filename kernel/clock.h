@@ -0,0 +1,38 @@
+// kernel/clock.h
+// Monotonic clock off the TSC
+// The TSC is calibrated against the PIT once at boot; after that reading
+// the time is one rdtsc and a multiply, no locks, on any CPU. Needs an
+// invariant TSC (same rate in every P/C-state) to be trustworthy, which
+// everything we run on has - we warn if it's missing.
+//
+// Created by: floof<3
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+// Measure the TSC (about 30ms of PIT time). clock_ns() is 0 until then.
+void clock_init(void);
+
+// Nanoseconds since clock_init()
+uint64_t clock_ns(void);
+
+// TSC cycles <-> nanoseconds (durations)
+uint64_t clock_tsc_to_ns(uint64_t cycles);
+uint64_t clock_ns_to_tsc(uint64_t ns);
+
+// TSC value at clock_ns() time `ns` (for the TSC-deadline timer)
+uint64_t clock_tsc_at(uint64_t ns);
+
+uint64_t clock_tsc_hz(void);
+
+// Does the TSC keep a constant rate through sleep states and frequency changes?
+bool clock_tsc_invariant(void);
+
+#endif // CLOCK_H
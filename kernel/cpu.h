@@ -0,0 +1,154 @@
+// kernel/cpu.h
+// Tiny wrappers around x86_64 instructions we need all over the kernel
+// (interrupt flag juggling, spin-wait hints, that kind of thing)
+//
+// Created by: floof<3
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CPU_FLAGS_IF (1 << 9)  // RFLAGS.IF - interrupts enabled
+
+// Disable interrupts and return the old RFLAGS so we can put them back later
+// (nesting-safe, unlike a plain cli/sti pair)
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enable interrupts only if they were on before cpu_irq_save()
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & CPU_FLAGS_IF) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
+// Are interrupts currently enabled?
+static inline bool cpu_irqs_enabled(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0" : "=r"(flags));
+    return (flags & CPU_FLAGS_IF) != 0;
+}
+
+// Spin-wait hint (tells the CPU we're busy waiting so it can chill a bit)
+static inline void cpu_pause(void) {
+    __asm__ volatile("pause" : : : "memory");
+}
+
+// Time stamp counter (cycles at a constant rate on anything from this decade)
+static inline uint64_t cpu_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// CPUID (leaf in EAX, subleaf in ECX)
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+// Page table root
+static inline uint64_t cpu_read_cr3(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void cpu_write_cr3(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+// Control register 0 (the FPU bits, paging is set up once at boot)
+#define CPU_CR0_MP (1 << 1)   // Monitor coprocessor (fwait honors TS)
+#define CPU_CR0_EM (1 << 2)   // x87/SSE emulation: every FPU instruction traps
+#define CPU_CR0_TS (1 << 3)   // Task switched: next FPU instruction raises #NM
+
+static inline uint64_t cpu_read_cr0(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void cpu_write_cr0(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+// CR0.TS on/off (clts doesn't need a read-modify-write)
+static inline void cpu_stts(void) {
+    cpu_write_cr0(cpu_read_cr0() | CPU_CR0_TS);
+}
+
+static inline void cpu_clts(void) {
+    __asm__ volatile("clts" : : : "memory");
+}
+
+// Control register 4 (paging/SSE feature switches)
+#define CPU_CR4_PGE        (1 << 7)   // Global pages
+#define CPU_CR4_OSFXSR     (1 << 9)   // SSE instructions + fxsave/fxrstor
+#define CPU_CR4_OSXMMEXCPT (1 << 10)  // SIMD exceptions raise #XM
+#define CPU_CR4_PCIDE      (1 << 17)  // Process context IDs in CR3[11:0]
+#define CPU_CR4_OSXSAVE    (1 << 18)  // xsave/xgetbv/xsetbv, needed for AVX
+
+static inline uint64_t cpu_read_cr4(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void cpu_write_cr4(uint64_t value) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+// Model specific registers
+#define CPU_MSR_PAT  0x277        // Page attribute table
+#define CPU_MSR_EFER 0xC0000080   // Extended features (long mode, NX)
+#define CPU_MSR_GS_BASE 0xC0000101  // GS segment base (per-CPU data)
+
+#define CPU_EFER_LME (1 << 8)     // Long mode enable
+#define CPU_EFER_LMA (1 << 10)    // Long mode active (read only)
+#define CPU_EFER_NXE (1 << 11)    // Honor the NX bit in page tables
+
+static inline uint64_t cpu_rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpu_wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+// Extended control register 0: which register sets xsave manages (and AVX
+// only works once YMM is in there)
+#define CPU_XCR0_X87 (1 << 0)
+#define CPU_XCR0_SSE (1 << 1)
+#define CPU_XCR0_YMM (1 << 2)
+
+static inline uint64_t cpu_xgetbv(uint32_t index) {
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpu_xsetbv(uint32_t index, uint64_t value) {
+    __asm__ volatile("xsetbv" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+// Write back and invalidate all caches (slow, only for memory type changes)
+static inline void cpu_wbinvd(void) {
+    __asm__ volatile("wbinvd" : : : "memory");
+}
+
+// Drop one page's translation from the TLB
+static inline void cpu_invlpg(uint64_t addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+#endif // CPU_H
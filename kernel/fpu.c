@@ -0,0 +1,244 @@
+// kernel/fpu.c
+// SSE/AVX enable, lazy FPU switching and the kernel_fpu_begin() sections
+//
+// Threads that use the FPU get their own XSAVE area, but the registers only
+// change hands when somebody actually needs them: a switch just writes the
+// outgoing owner's registers back and sets CR0.TS, and the next FPU
+// instruction of another thread traps (#NM) and loads its state then.
+// Coming back to the CPU that still has your registers costs nothing.
+// kernel_fpu_begin() writes the owner back too and leaves the registers to
+// nobody, so kernel SIMD never clobbers anyone's state.
+//
+// Invariant (outside kernel_fpu sections): CR0.TS is clear exactly when
+// this CPU's fpu_owner is the running thread.
+//
+// Created by: floof<3
+
+#include "fpu.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "scheduler.h"
+#include "heap.h"
+#include "memory.h"
+#include "../drivers/serial.h"
+
+static uint32_t features = 0;  // Decided by the BSP, every AP gets the same
+static uint32_t state_size = 512;  // fxsave's, XSAVE is whatever XCR0 needs
+static uint64_t xcr0_mask = 0;
+
+// CPUID bits
+#define CPUID_1_EDX_SSE2   (1 << 26)
+#define CPUID_1_ECX_XSAVE  (1 << 26)
+#define CPUID_1_ECX_AVX    (1 << 28)
+#define CPUID_7_EBX_AVX2   (1 << 5)
+#define CPUID_D1_EAX_XSAVEOPT (1 << 0)
+
+// Reset values, what fninit + a fresh MXCSR give you
+#define FPU_FCW_DEFAULT    0x037F  // All x87 exceptions masked, 64-bit precision
+#define FPU_MXCSR_DEFAULT  0x1F80  // All SSE exceptions masked, round to nearest
+#define FPU_MXCSR_OFFSET   24      // In the legacy (fxsave) part of the area
+#define FPU_STATE_ALIGN    64      // XSAVE wants it, fxsave only 16
+
+static uint32_t fpu_detect(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t found = 0;
+
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (edx & CPUID_1_EDX_SSE2) found |= FPU_FEATURE_SSE2;
+    if ((ecx & CPUID_1_ECX_XSAVE) && max_leaf >= 0xD) {
+        found |= FPU_FEATURE_XSAVE;
+        if (ecx & CPUID_1_ECX_AVX) found |= FPU_FEATURE_AVX;
+
+        cpu_cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        if (eax & CPUID_D1_EAX_XSAVEOPT) found |= FPU_FEATURE_XSAVEOPT;
+    }
+
+    if ((found & FPU_FEATURE_AVX) && max_leaf >= 7) {
+        cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx & CPUID_7_EBX_AVX2) found |= FPU_FEATURE_AVX2;
+    }
+    return found;
+}
+
+void fpu_init_cpu(void) {
+    bool bsp = !features;
+    if (bsp) features = fpu_detect();
+
+    // Real FPU, no trapping on use (until the end of this)
+    uint64_t cr0 = cpu_read_cr0();
+    cpu_write_cr0((cr0 | CPU_CR0_MP) & ~(CPU_CR0_EM | CPU_CR0_TS));
+
+    uint64_t cr4 = cpu_read_cr4() | CPU_CR4_OSFXSR | CPU_CR4_OSXMMEXCPT;
+    if (features & FPU_FEATURE_XSAVE) cr4 |= CPU_CR4_OSXSAVE;
+    cpu_write_cr4(cr4);
+
+    if (features & FPU_FEATURE_XSAVE) {
+        uint64_t xcr0 = CPU_XCR0_X87 | CPU_XCR0_SSE;
+        if (features & FPU_FEATURE_AVX) xcr0 |= CPU_XCR0_YMM;
+        cpu_xsetbv(0, xcr0);
+
+        if (bsp) {
+            // Area size for exactly what's in XCR0 now
+            uint32_t eax, ebx, ecx, edx;
+            cpu_cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+            state_size = ebx;
+            xcr0_mask = xcr0;
+        }
+    }
+    __asm__ volatile("fninit");
+
+    // Nobody's state is in the registers, the first thread to want them traps
+    cpu_stts();
+    this_cpu()->fpu_owner = NULL;
+
+    if (bsp) {
+        serial_write("FPU: SSE2");
+        if (features & FPU_FEATURE_AVX) serial_write(" AVX");
+        if (features & FPU_FEATURE_AVX2) serial_write(" AVX2");
+        serial_write(features & FPU_FEATURE_XSAVEOPT ? ", xsaveopt " :
+                     features & FPU_FEATURE_XSAVE ? ", xsave " : ", fxsave ");
+        serial_write_dec(state_size);
+        serial_write(" bytes per thread\n");
+    }
+}
+
+uint32_t fpu_features(void) {
+    return features;
+}
+
+// Registers -> area / area -> registers (CR0.TS must be clear)
+static void fpu_save(void* area) {
+    uint32_t lo = xcr0_mask, hi = xcr0_mask >> 32;
+    if (features & FPU_FEATURE_XSAVEOPT) {
+        // Skips whatever wasn't touched since the xrstor from this area
+        __asm__ volatile("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else if (features & FPU_FEATURE_XSAVE) {
+        __asm__ volatile("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        __asm__ volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(void* area) {
+    uint32_t lo = xcr0_mask, hi = xcr0_mask >> 32;
+    if (features & FPU_FEATURE_XSAVE) {
+        __asm__ volatile("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+// A thread's first area: everything at its reset value (an all-zero XSAVE
+// header means "init state" for every component)
+static void* fpu_state_alloc(void) {
+    uint8_t* area = kmalloc_aligned(state_size, FPU_STATE_ALIGN);
+    if (!area) return NULL;
+    memset(area, 0, state_size);
+    *(uint16_t*)area = FPU_FCW_DEFAULT;
+    *(uint32_t*)(area + FPU_MXCSR_OFFSET) = FPU_MXCSR_DEFAULT;
+    return area;
+}
+
+// Are `thread`'s live registers on this CPU (maybe newer than its area)?
+// Being named owner isn't enough: it may have loaded them on another CPU
+// since, and then what's here is stale and TS is set.
+static bool fpu_live_here(percpu_t* self, thread_t* thread, uint32_t cpu) {
+    return thread && self->fpu_owner == thread && thread->fpu_state && thread->fpu_cpu == cpu &&
+           !(cpu_read_cr0() & CPU_CR0_TS);
+}
+
+void fpu_switch(thread_t* prev, thread_t* next) {
+    if (!features) return;
+
+    uint32_t cpu = cpu_id();
+    percpu_t* self = this_cpu();
+
+    // It may have changed its registers since it got them. They stay
+    // loaded, so if it comes back here before anyone else needs them, it's
+    // a clts and nothing more. A stale owner is just forgotten.
+    if (fpu_live_here(self, prev, cpu)) fpu_save(prev->fpu_state);
+    else if (self->fpu_owner == prev) self->fpu_owner = NULL;
+
+    // Its registers are still here if nobody took them in the meantime,
+    // and it hasn't loaded them on another CPU since
+    bool loaded = self->fpu_owner == next && next->fpu_cpu == cpu;
+    bool ts = cpu_read_cr0() & CPU_CR0_TS;
+    if (loaded && ts) cpu_clts();
+    else if (!loaded && !ts) cpu_stts();
+}
+
+bool fpu_trap(void) {
+    thread_t* thread = thread_current();
+    percpu_t* self = this_cpu();
+
+    // The kernel itself only touches vector registers inside kernel_fpu
+    // sections (TS is clear there), so this is someone's bug
+    if (!features || !thread || self->irq_depth || self->in_kernel_fpu) return false;
+
+    if (!thread->fpu_state && !(thread->fpu_state = fpu_state_alloc())) {
+        serial_write("FPU: ERROR - No memory for ");
+        serial_write(thread->name);
+        serial_write("'s FPU state\n");
+        return false;
+    }
+
+    // Whoever had the registers got written back when they were switched
+    // out (fpu_switch) or when a kernel section took them, so just load ours
+    cpu_clts();
+    fpu_restore(thread->fpu_state);
+    self->fpu_owner = thread;
+    thread->fpu_cpu = cpu_id();
+    return true;
+}
+
+void fpu_thread_free(thread_t* thread) {
+    // No CPU may keep naming it: kmalloc hands the thread_t out again, and
+    // the new thread would look like it owns registers it never had
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        percpu_t* pc = percpu_get(cpu);
+        thread_t* expected = thread;
+        if (pc) __atomic_compare_exchange_n(&pc->fpu_owner, &expected, NULL, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+    if (thread->fpu_state) kfree(thread->fpu_state);
+    thread->fpu_state = NULL;
+    thread->fpu_cpu = FPU_CPU_NONE;
+}
+
+bool kernel_fpu_usable(void) {
+    // Interrupt handlers are fine too: the owner gets written back first,
+    // and a section can't start inside another one
+    if (!features || !thread_current()) return false;
+
+    uint64_t flags = cpu_irq_save();
+    bool usable = !this_cpu()->in_kernel_fpu;
+    cpu_irq_restore(flags);
+    return usable;
+}
+
+void kernel_fpu_begin(void) {
+    preempt_disable();
+
+    uint64_t flags = cpu_irq_save();
+    percpu_t* self = this_cpu();
+    self->in_kernel_fpu = true;
+
+    // Only the running thread's registers can be newer than its area
+    // (check before clts, TS says whether they're live)
+    thread_t* current = thread_current();
+    bool live = fpu_live_here(self, current, cpu_id());
+    cpu_clts();
+    if (live) fpu_save(current->fpu_state);
+    self->fpu_owner = NULL;
+    cpu_irq_restore(flags);
+}
+
+void kernel_fpu_end(void) {
+    // The registers hold our leftovers, whoever wants theirs back traps
+    cpu_stts();
+    this_cpu()->in_kernel_fpu = false;
+    preempt_enable();
+}
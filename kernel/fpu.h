@@ -0,0 +1,65 @@
+// kernel/fpu.h
+// Vector registers (SSE/AVX): per-thread state and kernel code
+// Every thread that uses the FPU gets its own XSAVE area, switched lazily
+// (CR0.TS + #NM, see fpu.c). The kernel is built with -mgeneral-regs-only,
+// so nothing touches the XMM/YMM registers behind our back. Code that wants
+// them (string.c's copy loops, the compositor's blits) brackets the use
+// with kernel_fpu_begin() / kernel_fpu_end(): the current owner's registers
+// are written back first and preemption is off in between.
+//
+//   if (kernel_fpu_usable()) {
+//       kernel_fpu_begin();
+//       ... SSE/AVX ...
+//       kernel_fpu_end();
+//   }
+//
+// Created by: floof<3
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// What this CPU can do with the vector registers turned on
+#define FPU_FEATURE_SSE2   (1 << 0)   // Always there on x86_64
+#define FPU_FEATURE_XSAVE  (1 << 1)
+#define FPU_FEATURE_AVX    (1 << 2)   // Only if the OS side (XCR0) is enabled too
+#define FPU_FEATURE_AVX2   (1 << 3)
+#define FPU_FEATURE_XSAVEOPT (1 << 4)  // xsave that skips untouched state
+
+#define FPU_CPU_NONE 0xFFFFFFFF  // thread->fpu_cpu before its first FPU use
+
+struct thread;
+
+// Turn on SSE (CR4.OSFXSR) and, when the CPU has it, AVX (CR4.OSXSAVE +
+// XCR0) on this CPU. BSP first (it decides the features), then every AP.
+// Leaves CR0.TS set: the first FPU instruction of any thread traps.
+void fpu_init_cpu(void);
+
+// FPU_FEATURE_* bits
+uint32_t fpu_features(void);
+
+// Scheduler hook: write prev's registers back if it owns them, set CR0.TS
+// unless next's are still loaded here (interrupts off, before the stack switch)
+void fpu_switch(struct thread* prev, struct thread* next);
+
+// #NM handler: the current thread used the FPU with CR0.TS set, give it its
+// registers (allocating its area the first time). False if that's a bug.
+bool fpu_trap(void);
+
+// Free a dead thread's area and drop it as this CPU's owner
+void fpu_thread_free(struct thread* thread);
+
+// Can we use vector registers right here? Yes in threads, interrupt
+// handlers and softirqs, no before the scheduler is up and inside another
+// kernel_fpu_begin() section.
+bool kernel_fpu_usable(void);
+
+// Vector registers are ours until kernel_fpu_end() (only after
+// kernel_fpu_usable() said yes). Don't sleep in between, and don't expect
+// them to survive past kernel_fpu_end().
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif // FPU_H
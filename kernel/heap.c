@@ -1,167 +1,634 @@
 // kernel/heap.c
 // Kernel heap allocator implementation
-// Uses a simple free-list allocator (not the fastest but it gets the job done)
-// Think of it like a parking lot manager but for memory chunks
+// kmalloc is a thin layer over three allocators:
+//   - up to 4KB:    slab size classes (16, 32, ... 4096 bytes), O(1) alloc/free
+//   - up to 128KB:  boundary-tag heap (below), so 5KB doesn't eat an 8KB block
+//   - bigger:       exact page count, contiguous from the buddy allocator if
+//                   possible, vmalloc otherwise, remembered in a hash table
+// kfree asks the PMM who owns the page to figure out which one to call.
+//
+// Boundary-tag heap: memory comes in 512KB segments from the buddy allocator.
+// Every block has the same tag (size | used bit) at both ends, so from any
+// block we can see whether the block before it and the block after it are
+// free and merge with both in O(1). Free blocks sit in segregated lists
+// (one per power of two) with a bitmap of which lists aren't empty.
 //
 // Created by: floof<3
 
 #include "heap.h"
 #include "pmm.h"
+#include "slab.h"
+#include "vmm.h"
+#include "spinlock.h"
 #include "../drivers/serial.h"
 
-// Block header for tracking allocated memory
-// Every allocation gets a header with size and status info
-// It's like a label on a box that says "this box is 256 bytes and currently being used"
-typedef struct heap_block {
-    size_t size;                // Size of this block (not including header, obviously)
-    bool is_free;               // Is this block free or allocated? (true = free parking spot)
-    struct heap_block* next;    // Next block in the list (linked list gang gang)
-} heap_block_t;
+// Segment = one buddy block, laid out as:
+// [prologue tag][block][block]...[block][epilogue tag]
+// The prologue/epilogue are fake used tags so merging stops at the edges
+#define HEAP_SEGMENT_ORDER 7
+#define HEAP_SEGMENT_SIZE  ((uint64_t)PAGE_SIZE << HEAP_SEGMENT_ORDER)
+
+#define HEAP_ALIGN     16   // Every payload is at least 16-byte aligned
+#define HEAP_TAG_SIZE  8
+#define HEAP_TAG_USED  1    // Low bits of a tag are free, sizes are multiples of 16
+#define HEAP_MIN_BLOCK 32   // Header + free list links + footer
+#define HEAP_BINS      16   // Bin n holds free blocks of 2^(n+5) .. 2^(n+6)-1 bytes
+
+// Biggest request the boundary-tag heap takes (anything bigger is a large
+// allocation), and the biggest alignment
+#define HEAP_MAX_SIZE  (HEAP_SEGMENT_SIZE / 4)
+#define HEAP_MAX_ALIGN PAGE_SIZE
+
+#define LARGE_HASH_BUCKETS 256
+
+typedef struct large_alloc {
+    struct large_alloc* next;  // Hash chain
+    void* addr;
+    uint64_t pages;
+    bool vmalloced;            // Came from vmalloc, not the buddy allocator
+} large_alloc_t;
+
+typedef uint64_t heap_tag_t;
 
-// Start of the heap (first block in the chain)
-static heap_block_t* heap_start = NULL;
+// Lives in the payload of a free block
+typedef struct heap_free {
+    struct heap_free* next;
+    struct heap_free* prev;
+} heap_free_t;
+
+static heap_free_t* heap_bins[HEAP_BINS];
+static uint32_t heap_bin_map = 0;  // Bit n set = heap_bins[n] isn't empty
+static uint64_t heap_segments = 0;
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+static large_alloc_t* large_hash[LARGE_HASH_BUCKETS];
+static kmem_cache_t* large_cache = NULL;
+static spinlock_t large_lock = SPINLOCK_INIT;
+
+// Block helpers (a block pointer points at its header tag)
+
+static inline uint64_t block_size(uint8_t* block) {
+    return *(heap_tag_t*)block & ~(uint64_t)(HEAP_ALIGN - 1);
+}
+
+static inline bool block_used(uint8_t* block) {
+    return *(heap_tag_t*)block & HEAP_TAG_USED;
+}
+
+static inline void block_set(uint8_t* block, uint64_t size, bool used) {
+    heap_tag_t tag = size | (used ? HEAP_TAG_USED : 0);
+    *(heap_tag_t*)block = tag;
+    *(heap_tag_t*)(block + size - HEAP_TAG_SIZE) = tag;
+}
+
+static inline heap_free_t* block_node(uint8_t* block) {
+    return (heap_free_t*)(block + HEAP_TAG_SIZE);
+}
+
+static inline uint8_t* node_block(heap_free_t* node) {
+    return (uint8_t*)node - HEAP_TAG_SIZE;
+}
+
+// Fibonacci hash of the page number, top 8 bits pick the bucket
+static inline uint32_t large_hash_index(void* addr) {
+    return ((uint64_t)addr >> 12) * 0x9E3779B97F4A7C15ULL >> 56;
+}
+
+static inline uint32_t heap_bin(uint64_t size) {
+    uint32_t bin = 63 - __builtin_clzll(size) - 5;
+    return bin < HEAP_BINS ? bin : HEAP_BINS - 1;
+}
+
+// Free list helpers (heap lock held)
+
+static void bin_insert(uint8_t* block) {
+    uint32_t bin = heap_bin(block_size(block));
+    heap_free_t* node = block_node(block);
+
+    node->prev = NULL;
+    node->next = heap_bins[bin];
+    if (node->next) node->next->prev = node;
+    heap_bins[bin] = node;
+    heap_bin_map |= 1u << bin;
+}
+
+static void bin_remove(uint8_t* block) {
+    uint32_t bin = heap_bin(block_size(block));
+    heap_free_t* node = block_node(block);
+
+    if (node->prev) node->prev->next = node->next;
+    else heap_bins[bin] = node->next;
+    if (node->next) node->next->prev = node->prev;
+
+    if (!heap_bins[bin]) heap_bin_map &= ~(1u << bin);
+}
+
+// Find a free block of at least `size` bytes (NULL if there isn't one)
+static uint8_t* bin_find(uint64_t size) {
+    uint32_t bin = heap_bin(size);
+
+    // Anything in a higher bin is big enough, take the smallest such bin (O(1))
+    uint32_t higher = heap_bin_map & ~((2u << bin) - 1);
+    if (higher) return node_block(heap_bins[__builtin_ctz(higher)]);
+
+    // Otherwise our own bin has blocks both smaller and bigger than us, first-fit in it
+    for (heap_free_t* node = heap_bins[bin]; node; node = node->next) {
+        if (block_size(node_block(node)) >= size) return node_block(node);
+    }
+    return NULL;
+}
+
+// Add a fresh segment from the buddy allocator as one big free block
+static bool heap_grow(void) {
+    uint8_t* segment = pmm_alloc_pages(HEAP_SEGMENT_ORDER);
+    if (!segment) return false;
+
+    pmm_set_owner(segment, HEAP_SEGMENT_ORDER, PMM_OWNER_HEAP);
+
+    *(heap_tag_t*)segment = HEAP_TAG_USED;                                          // Prologue
+    *(heap_tag_t*)(segment + HEAP_SEGMENT_SIZE - HEAP_TAG_SIZE) = HEAP_TAG_USED;    // Epilogue
+
+    uint8_t* block = segment + HEAP_TAG_SIZE;
+    block_set(block, HEAP_SEGMENT_SIZE - 2 * HEAP_TAG_SIZE, false);
+    bin_insert(block);
+    heap_segments++;
+    return true;
+}
+
+// Allocate from the boundary-tag heap (heap lock held)
+static void* heap_block_alloc(size_t size, size_t alignment) {
+    uint64_t need = ((size + HEAP_ALIGN - 1) & ~(uint64_t)(HEAP_ALIGN - 1)) + 2 * HEAP_TAG_SIZE;
+    if (need < HEAP_MIN_BLOCK) need = HEAP_MIN_BLOCK;
+
+    // Over-aligned requests need room to cut a free block off the front
+    uint64_t search = need;
+    if (alignment > HEAP_ALIGN) search += alignment + HEAP_MIN_BLOCK;
+
+    uint8_t* block = bin_find(search);
+    if (!block) {
+        if (!heap_grow()) return NULL;
+        block = bin_find(search);
+        if (!block) return NULL;
+    }
+    bin_remove(block);
+
+    uint64_t size_have = block_size(block);
+
+    // Push the payload up to the alignment, the gap in front becomes its own
+    // free block (its left neighbour is used, free blocks are always merged)
+    if (alignment > HEAP_ALIGN) {
+        uint64_t payload = (uint64_t)block + HEAP_TAG_SIZE;
+        uint64_t aligned = (payload + alignment - 1) & ~(uint64_t)(alignment - 1);
+        if (aligned != payload) {
+            while (aligned - payload < HEAP_MIN_BLOCK) aligned += alignment;
+
+            uint64_t gap = aligned - payload;
+            block_set(block, gap, false);
+            bin_insert(block);
+
+            block += gap;
+            size_have -= gap;
+        }
+    }
+
+    // Split off the tail if it's big enough to be a block
+    if (size_have - need >= HEAP_MIN_BLOCK) {
+        block_set(block + need, size_have - need, false);
+        bin_insert(block + need);
+        size_have = need;
+    }
+
+    block_set(block, size_have, true);
+    return block + HEAP_TAG_SIZE;
+}
+
+// Free into the boundary-tag heap, merging with both neighbours
+static void heap_block_free(void* ptr) {
+    uint8_t* block = (uint8_t*)ptr - HEAP_TAG_SIZE;
+    uint8_t* segment_to_free = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    uint64_t size = block_size(block);
+    if (!block_used(block) || *(heap_tag_t*)(block + size - HEAP_TAG_SIZE) != *(heap_tag_t*)block) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        serial_write("Heap: WARNING - kfree() of a corrupted or already-free block\n");
+        return;
+    }
+
+    // Previous block's footer is right in front of our header
+    heap_tag_t prev_tag = *(heap_tag_t*)(block - HEAP_TAG_SIZE);
+    if (!(prev_tag & HEAP_TAG_USED)) {
+        uint64_t prev_size = prev_tag & ~(uint64_t)(HEAP_ALIGN - 1);
+        block -= prev_size;
+        bin_remove(block);
+        size += prev_size;
+    }
+
+    // Next block's header is right after our footer
+    uint8_t* next = block + size;
+    if (!block_used(next)) {
+        bin_remove(next);
+        size += block_size(next);
+    }
+
+    block_set(block, size, false);
+
+    // Whole segment is free again, give it back (but keep one around so a
+    // single alloc/free pair doesn't bounce a segment in and out of the PMM)
+    if (size == HEAP_SEGMENT_SIZE - 2 * HEAP_TAG_SIZE && heap_segments > 1) {
+        segment_to_free = block - HEAP_TAG_SIZE;
+        heap_segments--;
+    } else {
+        bin_insert(block);
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (segment_to_free) pmm_free_pages(segment_to_free, HEAP_SEGMENT_ORDER);
+}
+
+static void* heap_alloc(size_t size, size_t alignment) {
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    void* ptr = heap_block_alloc(size, alignment);
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (!ptr) serial_write("Heap: ERROR - Out of memory!\n");
+    return ptr;
+}
 
 // Initialize the kernel heap
 void heap_init(void) {
     serial_write("Heap: Initializing kernel heap...\n");
-    
-    // Allocate first page for heap (gotta start somewhere)
-    void* first_page = pmm_alloc_page();
-    if (!first_page) {
-        serial_write("Heap: ERROR - Failed to allocate initial page!\n");
+
+    slab_init();
+    large_cache = kmem_cache_create("kmalloc-large", sizeof(large_alloc_t), 0);
+
+    // First segment up front so early allocations don't have to wait for it
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    bool ok = heap_grow();
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (!ok) {
+        serial_write("Heap: ERROR - Failed to allocate initial segment!\n");
         return;  // Well fuck, that's not good
     }
-    
-    // Set up first block (initially one big free block)
-    // It's like having an empty parking lot - one giant space
-    heap_start = (heap_block_t*)first_page;
-    heap_start->size = PAGE_SIZE - sizeof(heap_block_t);
-    heap_start->is_free = true;
-    heap_start->next = NULL;  // No other blocks yet
-    
+
     serial_write("Heap: Initialization complete\n");
 }
 
-// Find a free block that's big enough (first-fit algorithm)
-// We just walk the list and take the first one that fits (not fancy but it works)
-static heap_block_t* find_free_block(size_t size) {
-    heap_block_t* current = heap_start;
-    
-    while (current) {
-        if (current->is_free && current->size >= size) {
-            return current;  // Found one! Lucky us
+// Large allocations (> HEAP_MAX_SIZE): exact page counts, physically
+// contiguous if the buddy allocator can do it, vmalloc'd otherwise.
+// Tracked in a hash keyed by address so kfree finds the size in O(1).
+static void* kmalloc_large(size_t size, bool contiguous_only) {
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    large_alloc_t* entry = kmem_cache_alloc(large_cache);
+    if (!entry) return NULL;
+
+    entry->pages = pages;
+    entry->vmalloced = false;
+    entry->addr = pmm_alloc_pages_exact(pages);
+
+    // Too big for one buddy block (or memory is too fragmented), settle
+    // for virtually contiguous
+    if (!entry->addr && !contiguous_only) {
+        entry->addr = vmalloc(size);
+        entry->vmalloced = true;
+    }
+
+    if (!entry->addr) {
+        kmem_cache_free(large_cache, entry);
+        serial_write("Heap: ERROR - Out of memory!\n");
+        return NULL;  // We're fucked, out of RAM
+    }
+
+    large_alloc_t** bucket = &large_hash[large_hash_index(entry->addr)];
+    uint64_t flags = spin_lock_irqsave(&large_lock);
+    entry->next = *bucket;
+    *bucket = entry;
+    spin_unlock_irqrestore(&large_lock, flags);
+
+    return entry->addr;
+}
+
+// Free a large allocation, false if ptr isn't one
+static bool kfree_large(void* ptr) {
+    large_alloc_t** link = &large_hash[large_hash_index(ptr)];
+
+    uint64_t flags = spin_lock_irqsave(&large_lock);
+    while (*link && (*link)->addr != ptr) link = &(*link)->next;
+    large_alloc_t* entry = *link;
+    if (entry) *link = entry->next;
+    spin_unlock_irqrestore(&large_lock, flags);
+
+    if (!entry) return false;
+
+    if (entry->vmalloced) vfree(entry->addr);
+    else pmm_free_pages_exact(entry->addr, entry->pages);
+
+    kmem_cache_free(large_cache, entry);
+    return true;
+}
+
+// Pick an allocator by size (kmalloc minus the profiling hook)
+static void* kmalloc_raw(size_t size) {
+    kmem_cache_t* cache = slab_size_cache(size);
+    if (cache) return kmem_cache_alloc(cache);
+
+    if (size <= HEAP_MAX_SIZE) return heap_alloc(size, HEAP_ALIGN);
+
+    return kmalloc_large(size, false);
+}
+
+// Hand a pointer back to whichever allocator owns it
+static void kfree_raw(void* ptr) {
+    switch (pmm_get_owner(ptr, NULL)) {
+    case PMM_OWNER_SLAB:
+        slab_free(ptr);
+        break;
+
+    case PMM_OWNER_HEAP:
+        heap_block_free(ptr);
+        break;
+
+    default:
+        // Large allocations aren't tagged (vmalloc'd ones aren't even in the
+        // page array), they're in the hash
+        if (!kfree_large(ptr)) {
+            serial_write("Heap: WARNING - kfree() of a pointer kmalloc never gave out\n");
         }
-        current = current->next;
+        break;
     }
-    
-    return NULL;  // No suitable block found (sad times)
 }
 
-// Split a block if it's too big (avoid wasting memory like a dumbass)
-static void split_block(heap_block_t* block, size_t size) {
-    // Only split if there's enough space left over for a new block
-    // No point in creating a 16-byte free block, that's just wasteful
-    if (block->size > size + sizeof(heap_block_t) + 16) {
-        // Create a new block in the leftover space
-        heap_block_t* new_block = (heap_block_t*)((uint8_t*)block + sizeof(heap_block_t) + size);
-        new_block->size = block->size - size - sizeof(heap_block_t);
-        new_block->is_free = true;
-        new_block->next = block->next;
-        
-        // Shrink the original block to fit
-        block->size = size;
-        block->next = new_block;
+// Aligned version of kmalloc_raw
+// Small ones: size classes are aligned to their own size, pick a big enough class
+// Medium ones: the boundary-tag heap cuts the misaligned front off as a free block
+// Huge ones: exact page allocations are aligned to the next power of two of
+// their page count, so we ask for at least `alignment` worth of pages
+// Every result can go straight to kfree()
+static void* kmalloc_aligned_raw(size_t size, size_t alignment) {
+    if (alignment & (alignment - 1)) {
+        serial_write("Heap: ERROR - kmalloc_aligned() alignment isn't a power of two\n");
+        return NULL;
+    }
+
+    size_t needed = size > alignment ? size : alignment;
+    if (needed <= SLAB_MAX_SIZE) {
+        // Round up to the class size so the class alignment covers `alignment`
+        size_t class_size = SLAB_MIN_SIZE;
+        while (class_size < needed) class_size <<= 1;
+        return kmem_cache_alloc(slab_size_cache(class_size));
+    }
+
+    if (size <= HEAP_MAX_SIZE && alignment <= HEAP_MAX_ALIGN) {
+        return heap_alloc(size, alignment < HEAP_ALIGN ? HEAP_ALIGN : alignment);
+    }
+
+    // vmalloc is only page aligned, past that it has to be one buddy block
+    return kmalloc_large(needed, alignment > PAGE_SIZE);
+}
+
+#ifdef HEAP_PROFILE
+// Heap profiler (build with HEAP_PROFILE=1)
+// Remembers every live allocation's size and callsite in fixed tables (no
+// allocating from inside the allocator), so we can see who holds how much
+// memory and who never gives it back. heap_profile_dump() prints it all.
+
+#define PROFILE_MAX_SITES 512      // Distinct kmalloc callers we keep apart
+#define PROFILE_MAX_LIVE  16384    // Live allocations we can track at once
+#define PROFILE_BUCKETS   25       // Size histogram: <=16B, <=32B, ... <=256MB
+#define PROFILE_TOP       16       // Callsites shown in the report
+
+typedef struct {
+    void* caller;         // Return address of the kmalloc call (NULL = unused slot)
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;  // High-water mark of live_bytes
+    uint64_t total_bytes; // Everything this site ever asked for
+} profile_site_t;
+
+typedef struct {
+    void* ptr;            // NULL = empty slot
+    uint64_t size;
+    uint32_t site;
+} profile_live_t;
+
+static profile_site_t profile_sites[PROFILE_MAX_SITES];
+static profile_live_t profile_live[PROFILE_MAX_LIVE];
+static uint64_t profile_histogram[PROFILE_BUCKETS];
+static uint64_t profile_live_bytes = 0;
+static uint64_t profile_peak_bytes = 0;
+static uint64_t profile_allocs = 0;
+static uint64_t profile_frees = 0;
+static uint64_t profile_untracked = 0;  // Allocations that didn't fit in the tables
+static spinlock_t profile_lock = SPINLOCK_INIT;
+
+static inline uint32_t profile_hash(void* key, uint32_t table_size) {
+    return ((uint64_t)key * 0x9E3779B97F4A7C15ULL >> 32) & (table_size - 1);
+}
+
+// Find or add a callsite (profile lock held), PROFILE_MAX_SITES if the table is full
+static uint32_t profile_site(void* caller) {
+    uint32_t i = profile_hash(caller, PROFILE_MAX_SITES);
+    for (uint32_t n = 0; n < PROFILE_MAX_SITES; n++, i = (i + 1) & (PROFILE_MAX_SITES - 1)) {
+        if (profile_sites[i].caller == caller) return i;
+        if (!profile_sites[i].caller) {
+            profile_sites[i].caller = caller;
+            return i;
+        }
+    }
+    return PROFILE_MAX_SITES;
+}
+
+// Remove live slot i without leaving a tombstone: shift later entries of
+// the same probe run back into the hole (profile lock held)
+static void profile_live_remove(uint32_t i) {
+    uint32_t j = i;
+    for (;;) {
+        profile_live[i].ptr = NULL;
+        for (;;) {
+            j = (j + 1) & (PROFILE_MAX_LIVE - 1);
+            if (!profile_live[j].ptr) return;
+
+            // Entry j can fill the hole only if its home slot isn't in (i, j]
+            uint32_t home = profile_hash(profile_live[j].ptr, PROFILE_MAX_LIVE);
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+            break;
+        }
+        profile_live[i] = profile_live[j];
+        i = j;
     }
 }
 
+static void profile_alloc(void* ptr, size_t size, void* caller) {
+    if (!ptr) return;
+
+    uint32_t bucket = size <= 16 ? 0 : 64 - __builtin_clzll(size - 1) - 4;
+    if (bucket >= PROFILE_BUCKETS) bucket = PROFILE_BUCKETS - 1;
+
+    uint64_t flags = spin_lock_irqsave(&profile_lock);
+
+    profile_allocs++;
+    profile_histogram[bucket]++;
+
+    uint32_t site = profile_site(caller);
+    uint32_t slot = profile_hash(ptr, PROFILE_MAX_LIVE);
+    uint32_t n = 0;
+    while (profile_live[slot].ptr && n++ < PROFILE_MAX_LIVE) {
+        slot = (slot + 1) & (PROFILE_MAX_LIVE - 1);
+    }
+
+    if (site == PROFILE_MAX_SITES || profile_live[slot].ptr) {
+        profile_untracked++;
+    } else {
+        profile_live[slot].ptr = ptr;
+        profile_live[slot].size = size;
+        profile_live[slot].site = site;
+
+        profile_site_t* s = &profile_sites[site];
+        s->allocs++;
+        s->total_bytes += size;
+        s->live_bytes += size;
+        if (s->live_bytes > s->peak_bytes) s->peak_bytes = s->live_bytes;
+
+        profile_live_bytes += size;
+        if (profile_live_bytes > profile_peak_bytes) profile_peak_bytes = profile_live_bytes;
+    }
+
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+static void profile_free(void* ptr) {
+    uint64_t flags = spin_lock_irqsave(&profile_lock);
+
+    profile_frees++;
+
+    uint32_t slot = profile_hash(ptr, PROFILE_MAX_LIVE);
+    for (uint32_t n = 0; n < PROFILE_MAX_LIVE && profile_live[slot].ptr; n++) {
+        if (profile_live[slot].ptr == ptr) {
+            profile_site_t* s = &profile_sites[profile_live[slot].site];
+            s->frees++;
+            s->live_bytes -= profile_live[slot].size;
+            profile_live_bytes -= profile_live[slot].size;
+            profile_live_remove(slot);
+            break;
+        }
+        slot = (slot + 1) & (PROFILE_MAX_LIVE - 1);
+    }
+
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+// Print the profile over serial
+void heap_profile_dump(void) {
+    uint64_t flags = spin_lock_irqsave(&profile_lock);
+
+    serial_write("Heap profile: ");
+    serial_write_dec(profile_allocs);
+    serial_write(" allocs, ");
+    serial_write_dec(profile_frees);
+    serial_write(" frees, ");
+    serial_write_dec(profile_live_bytes);
+    serial_write(" bytes live, ");
+    serial_write_dec(profile_peak_bytes);
+    serial_write(" bytes peak, ");
+    serial_write_dec(profile_untracked);
+    serial_write(" untracked\n");
+
+    serial_write("Heap profile: size histogram\n");
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        if (!profile_histogram[i]) continue;
+        serial_write("  <= ");
+        serial_write_dec(16ULL << i);
+        serial_write(" bytes: ");
+        serial_write_dec(profile_histogram[i]);
+        serial_write("\n");
+    }
+
+    // Biggest holders first - at the top of this list after a long uptime
+    // is where the leaks are (live bytes that keep growing, frees < allocs)
+    serial_write("Heap profile: top callsites by live bytes\n");
+    bool shown[PROFILE_MAX_SITES] = { false };
+    for (int rank = 0; rank < PROFILE_TOP; rank++) {
+        int best = -1;
+        for (int i = 0; i < PROFILE_MAX_SITES; i++) {
+            if (!profile_sites[i].caller || shown[i]) continue;
+            if (best < 0 || profile_sites[i].live_bytes > profile_sites[best].live_bytes) best = i;
+        }
+        if (best < 0) break;
+        shown[best] = true;
+
+        profile_site_t* s = &profile_sites[best];
+        serial_write("  ");
+        serial_write_hex((uint64_t)s->caller);
+        serial_write(": ");
+        serial_write_dec(s->live_bytes);
+        serial_write(" bytes live in ");
+        serial_write_dec(s->allocs - s->frees);
+        serial_write(" blocks, peak ");
+        serial_write_dec(s->peak_bytes);
+        serial_write(", ");
+        serial_write_dec(s->allocs);
+        serial_write(" allocs / ");
+        serial_write_dec(s->frees);
+        serial_write(" frees, ");
+        serial_write_dec(s->total_bytes);
+        serial_write(" bytes total\n");
+    }
+
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+// Forget everything (handy to profile just one workload)
+// Allocations made before the reset are untracked when they're freed
+void heap_profile_reset(void) {
+    uint64_t flags = spin_lock_irqsave(&profile_lock);
+
+    for (int i = 0; i < PROFILE_MAX_SITES; i++) profile_sites[i] = (profile_site_t){ 0 };
+    for (int i = 0; i < PROFILE_MAX_LIVE; i++) profile_live[i].ptr = NULL;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) profile_histogram[i] = 0;
+    profile_live_bytes = profile_peak_bytes = 0;
+    profile_allocs = profile_frees = profile_untracked = 0;
+
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+#else
+#define profile_alloc(ptr, size, caller) ((void)0)
+#define profile_free(ptr) ((void)0)
+
+void heap_profile_dump(void) {
+    serial_write("Heap profile: not compiled in (build with HEAP_PROFILE=1)\n");
+}
+
+void heap_profile_reset(void) {
+}
+#endif
+
 // Allocate memory from the heap (this is the money maker)
 void* kmalloc(size_t size) {
     if (size == 0) return NULL;  // Allocating 0 bytes? Really?
-    
-    // Align size to 8 bytes (makes things faster and cleaner)
-    // CPU likes aligned data, we like CPU being happy
-    size = (size + 7) & ~7;
-    
-    // Try to find a free block that fits
-    heap_block_t* block = find_free_block(size);
-    
-    if (!block) {
-        // No free block big enough, need to expand heap
-        // Time to ask PMM for more pages (like asking for more parking spaces)
-        size_t pages_needed = (size + sizeof(heap_block_t) + PAGE_SIZE - 1) / PAGE_SIZE;
-        
-        // Find last block in the chain
-        heap_block_t* last = heap_start;
-        while (last->next) last = last->next;
-        
-        // Allocate the pages we need
-        for (size_t i = 0; i < pages_needed; i++) {
-            void* page = pmm_alloc_page();
-            if (!page) {
-                serial_write("Heap: ERROR - Out of memory!\n");
-                return NULL;  // We're fucked, out of RAM
-            }
-            
-            // Add new block at the end of the list
-            heap_block_t* new_block = (heap_block_t*)page;
-            new_block->size = PAGE_SIZE - sizeof(heap_block_t);
-            new_block->is_free = true;
-            new_block->next = NULL;
-            
-            last->next = new_block;
-            last = new_block;
-        }
-        
-        // Try again to find a block (should work now)
-        block = find_free_block(size);
-        if (!block) return NULL;  // Still failed somehow? wtf
-    }
-    
-    // Split the block if it's way too big (don't waste memory like an idiot)
-    split_block(block, size);
-    
-    // Mark as allocated (this parking spot is now taken)
-    block->is_free = false;
-    
-    // Return pointer to data (skip the header, user doesn't need to see that shit)
-    return (void*)((uint8_t*)block + sizeof(heap_block_t));
+
+    void* ptr = kmalloc_raw(size);
+    profile_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
 }
 
 // Free memory back to the heap (give the parking spot back)
 void kfree(void* ptr) {
     if (!ptr) return;  // Freeing NULL is a no-op (like regular free, we're not assholes about it)
-    
-    // Get block header (it's right before the data pointer)
-    // We hid it there earlier like a sneaky bastard
-    heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - sizeof(heap_block_t));
-    
-    // Mark as free (parking spot available!)
-    block->is_free = true;
-    
-    // Coalesce with next block if it's also free (merge adjacent free blocks)
-    // It's like combining two empty parking spots into one big one
-    if (block->next && block->next->is_free) {
-        block->size += sizeof(heap_block_t) + block->next->size;
-        block->next = block->next->next;
-    }
-    
-    // TODO: Could also coalesce with previous block but that requires a doubly-linked list
-    // Maybe later when we're not lazy
+
+    profile_free(ptr);
+    kfree_raw(ptr);
 }
 
 // Allocate aligned memory (for when you need shit aligned to specific boundaries)
 void* kmalloc_aligned(size_t size, size_t alignment) {
-    // Allocate extra space for alignment adjustment (we'll waste a bit but whatever)
-    void* ptr = kmalloc(size + alignment + sizeof(void*));
-    if (!ptr) return NULL;
-    
-    // Calculate aligned address (bit twiddling magic)
-    uintptr_t addr = (uintptr_t)ptr;
-    uintptr_t aligned = (addr + alignment - 1) & ~(alignment - 1);
-    
-    // Store original pointer before aligned address (so we can free it later)
-    // This is important or we'll leak memory like a sieve
-    *((void**)(aligned - sizeof(void*))) = ptr;
-    
-    return (void*)aligned;
+    if (size == 0) return NULL;
+
+    void* ptr = kmalloc_aligned_raw(size, alignment);
+    profile_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
 }
@@ -15,6 +15,8 @@ void heap_init(void);
 
 // Allocate memory from the heap (like malloc)
 // Returns NULL if out of memory
+// Anything over 128KB is page granular and usually physically contiguous,
+// but can be vmalloc'd when RAM is fragmented - use the PMM for DMA buffers
 void* kmalloc(size_t size);
 
 // Free memory back to the heap (like free)
@@ -23,4 +25,10 @@ void kfree(void* ptr);
 // Allocate aligned memory (useful for page-aligned allocations)
 void* kmalloc_aligned(size_t size, size_t alignment);
 
+// Heap profiler (only does anything in a HEAP_PROFILE=1 build)
+// Tracks live bytes, peak and alloc/free counts per kmalloc callsite plus a
+// size histogram. Callsites are return addresses, feed them to addr2line.
+void heap_profile_dump(void);   // Print the report over serial
+void heap_profile_reset(void);  // Start counting from zero
+
 #endif // HEAP_H
@@ -0,0 +1,201 @@
+// kernel/idt.c
+// IDT, the interrupt entry stubs and CPU exceptions
+//
+// Everything runs in ring 0 for now, so the entry path doesn't bother with
+// swapgs or a TSS: the CPU pushes its frame on the current (thread) stack
+// and we go from there. Gates are interrupt gates, handlers start with
+// interrupts off.
+//
+// Created by: floof<3
+
+#include "idt.h"
+#include "irq.h"
+#include "uvm.h"
+#include "fpu.h"
+#include "../drivers/serial.h"
+
+#define IDT_KERNEL_CS   0x08  // Same slot in boot64.asm's GDT and the AP trampoline's
+#define IDT_GATE_INTR   0x8E  // Present, DPL 0, 64-bit interrupt gate
+#define IDT_STUB_SIZE   16
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t reserved;
+} __attribute__((packed)) idt_gate_t;
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) idt_ptr_t;
+
+static idt_gate_t idt[IDT_VECTORS] __attribute__((aligned(16)));
+
+void kernel_panic(const char* message, uint32_t error_code);
+
+// Entry stubs, one per vector at a fixed stride
+// The CPU only pushes an error code for some exceptions, the others push a
+// 0 so every frame looks the same. .org (instead of .balign) makes the
+// assembler complain if a stub ever outgrows its slot.
+// The common part saves what the C code may clobber (all of the GPRs, so
+// the frame is complete for exception dumps), calls interrupt_dispatch()
+// and irets. 22 quadwords on top of the CPU's 16-byte aligned frame keep
+// the stack aligned for the call.
+__asm__(
+    ".pushsection .text\n"
+    ".balign 16\n"
+    ".global idt_stubs\n"
+    "idt_stubs:\n"
+    ".set idt_vec, 0\n"
+    ".rept 256\n"
+    ".org idt_stubs + idt_vec * 16, 0xCC\n"
+    ".if !(idt_vec == 8 || (idt_vec >= 10 && idt_vec <= 14) || idt_vec == 17 || idt_vec == 21 || idt_vec == 29 || idt_vec == 30)\n"
+    "    pushq $0\n"
+    ".endif\n"
+    "    pushq $idt_vec\n"
+    "    jmp idt_common\n"
+    ".set idt_vec, idt_vec + 1\n"
+    ".endr\n"
+
+    "idt_common:\n"
+    "    cld\n"
+    "    pushq %rax\n"
+    "    pushq %rbx\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
+    "    pushq %rdi\n"
+    "    pushq %rbp\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    pushq %r11\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, %rdi\n"
+    "    call interrupt_dispatch\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %r11\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
+    "    popq %rbp\n"
+    "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    popq %rbx\n"
+    "    popq %rax\n"
+    "    addq $16, %rsp\n"                          // Vector + error code
+    "    iretq\n"
+    ".popsection\n"
+);
+
+extern const uint8_t idt_stubs[];
+
+static const char* const exception_names[IDT_EXCEPTIONS] = {
+    "#DE divide error", "#DB debug", "NMI", "#BP breakpoint",
+    "#OF overflow", "#BR bound range", "#UD invalid opcode", "#NM no FPU",
+    "#DF double fault", "coprocessor overrun", "#TS invalid TSS", "#NP segment not present",
+    "#SS stack fault", "#GP general protection", "#PF page fault", "reserved",
+    "#MF x87 error", "#AC alignment check", "#MC machine check", "#XM SIMD error",
+    "#VE virtualization", "#CP control protection", "reserved", "reserved",
+    "reserved", "reserved", "reserved", "reserved",
+    "#HV hypervisor injection", "#VC VMM communication", "#SX security", "reserved",
+};
+
+static inline uint64_t read_cr2(void) {
+    uint64_t value;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static void exception_dump(interrupt_frame_t* frame, uint64_t cr2) {
+    serial_write("EXCEPTION: ");
+    serial_write(exception_names[frame->vector]);
+    serial_write(" error ");
+    serial_write_hex(frame->error);
+    serial_write(" at ");
+    serial_write_hex(frame->rip);
+    if (frame->vector == IDT_PAGE_FAULT) {
+        serial_write(" address ");
+        serial_write_hex(cr2);
+    }
+    serial_write("\n  rsp ");
+    serial_write_hex(frame->rsp);
+    serial_write(" rflags ");
+    serial_write_hex(frame->rflags);
+    serial_write(" rax ");
+    serial_write_hex(frame->rax);
+    serial_write(" rdi ");
+    serial_write_hex(frame->rdi);
+    serial_write(" rsi ");
+    serial_write_hex(frame->rsi);
+    serial_write("\n");
+}
+
+static void exception_handle(interrupt_frame_t* frame) {
+    uint64_t cr2 = 0;
+
+    switch (frame->vector) {
+    case IDT_PAGE_FAULT:
+        // Read CR2 first, the fault handler can fault again
+        cr2 = read_cr2();
+        if (uvm_page_fault(cr2, frame->error)) return;
+        break;
+    case IDT_NO_FPU:
+        // This thread's FPU state isn't loaded yet
+        if (fpu_trap()) return;
+        break;
+    case IDT_NMI:
+        serial_write("IDT: NMI (watchdog or hardware error), carrying on\n");
+        return;
+    case IDT_BREAKPOINT:
+        serial_write("IDT: Breakpoint at ");
+        serial_write_hex(frame->rip);
+        serial_write("\n");
+        return;
+    }
+
+    exception_dump(frame, cr2);
+    kernel_panic(exception_names[frame->vector], frame->vector);
+}
+
+// Called by idt_common with the frame it built
+__attribute__((used)) void interrupt_dispatch(interrupt_frame_t* frame) {
+    if (frame->vector < IDT_EXCEPTIONS) exception_handle(frame);
+    else irq_dispatch(frame->vector);
+}
+
+static void idt_set_gate(uint32_t vector, uint64_t handler) {
+    idt_gate_t* gate = &idt[vector];
+    gate->offset_low = handler & 0xFFFF;
+    gate->selector = IDT_KERNEL_CS;
+    gate->ist = 0;
+    gate->type_attr = IDT_GATE_INTR;
+    gate->offset_mid = (handler >> 16) & 0xFFFF;
+    gate->offset_high = handler >> 32;
+    gate->reserved = 0;
+}
+
+void idt_load(void) {
+    idt_ptr_t ptr = { sizeof(idt) - 1, (uint64_t)idt };
+    __asm__ volatile("lidt %0" : : "m"(ptr) : "memory");
+}
+
+void idt_init(void) {
+    for (uint32_t vector = 0; vector < IDT_VECTORS; vector++) {
+        idt_set_gate(vector, (uint64_t)idt_stubs + vector * IDT_STUB_SIZE);
+    }
+    idt_load();
+    serial_write("IDT: 256 vectors loaded\n");
+}
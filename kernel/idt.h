@@ -0,0 +1,40 @@
+// kernel/idt.h
+// Interrupt descriptor table
+// All 256 gates point into one block of tiny stubs (16 bytes each, so
+// vector N's stub is at idt_stubs + N * 16). A stub pushes its vector and
+// jumps to the common entry, which saves the registers and calls
+// interrupt_dispatch(): CPU exceptions (0-31) are dealt with in idt.c,
+// everything else goes to irq_dispatch().
+//
+// Created by: floof<3
+
+#ifndef IDT_H
+#define IDT_H
+
+#include <stdint.h>
+
+#define IDT_VECTORS    256
+#define IDT_EXCEPTIONS 32   // 0-31 belong to the CPU
+
+// Exceptions we do something about
+#define IDT_NMI         2
+#define IDT_BREAKPOINT  3
+#define IDT_NO_FPU      7    // #NM: FPU used with CR0.TS set (lazy FPU switching)
+#define IDT_PAGE_FAULT  14
+
+// What the stub leaves on the stack (the CPU's part at the end)
+typedef struct {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t error;         // Exception error code, 0 for vectors without one
+    uint64_t rip, cs, rflags, rsp, ss;
+} interrupt_frame_t;
+
+// Fill in the gates and load the IDT on this CPU (BSP, early)
+void idt_init(void);
+
+// Load the (already filled in) IDT on an AP
+void idt_load(void);
+
+#endif // IDT_H
@@ -1,10 +1,11 @@
 #ifndef INTERRUPTS_H
 #define INTERRUPTS_H
 
+#include "idt.h"
+#include "irq.h"
+#include "ioapic.h"
+
 void gdt_init(void);
-void idt_init(void);
-void pic_init(void);
-void apic_init(void);
 void sti(void);
 
 #endif
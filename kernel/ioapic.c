@@ -0,0 +1,191 @@
+// kernel/ioapic.c
+// IO APIC driver (and the last word on the 8259s)
+//
+// The registers are indirect: write the index to IOREGSEL, then read or
+// write IOWIN. That's two accesses, so they go under one lock for all
+// IO APICs.
+//
+// PCI INTx lines would need the ACPI _PRT (AML) to map properly, we trust
+// the line the firmware put in config space and treat it as a GSI.
+//
+// Created by: floof<3
+
+#include "ioapic.h"
+#include "acpi.h"
+#include "vmm.h"
+#include "spinlock.h"
+#include "../drivers/serial.h"
+
+#define IOAPIC_REGSEL     0x00
+#define IOAPIC_WIN        0x10
+#define IOAPIC_REG_VER    0x01   // Bits 16-23: highest redirection entry
+#define IOAPIC_REG_REDIR  0x10   // Two registers per pin
+
+// Redirection entry, low dword (delivery mode fixed, physical destination)
+#define IOAPIC_REDIR_ACTIVE_LOW (1 << 13)
+#define IOAPIC_REDIR_LEVEL      (1 << 15)
+#define IOAPIC_REDIR_MASKED     (1 << 16)
+
+// 8259 ports
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+
+typedef struct {
+    volatile uint32_t* regs;
+    uint32_t gsi_base;
+    uint32_t pins;
+} ioapic_t;
+
+static ioapic_t ioapics[ACPI_MAX_IOAPICS];
+static uint32_t ioapic_count = 0;
+static spinlock_t ioapic_lock = SPINLOCK_INIT;
+
+static uint32_t ioapic_read(ioapic_t* io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(ioapic_t* io, uint32_t reg, uint32_t value) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WIN / 4] = value;
+}
+
+static ioapic_t* ioapic_for_gsi(uint32_t gsi, uint32_t* pin) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        ioapic_t* io = &ioapics[i];
+        if (gsi >= io->gsi_base && gsi < io->gsi_base + io->pins) {
+            *pin = gsi - io->gsi_base;
+            return io;
+        }
+    }
+    return NULL;
+}
+
+// Remap the 8259s to IRQ_PIC_BASE (their default 0x08-0x0F would look like
+// exceptions) and mask every line, the IO APIC does the real work
+static void pic_disable(void) {
+    outb(PIC1_CMD, 0x11);               // ICW1: initialize, ICW4 follows
+    outb(PIC2_CMD, 0x11);
+    outb(PIC1_DATA, IRQ_PIC_BASE);      // ICW2: vector offsets
+    outb(PIC2_DATA, IRQ_PIC_BASE + 8);
+    outb(PIC1_DATA, 4);                 // ICW3: slave on IRQ 2
+    outb(PIC2_DATA, 2);
+    outb(PIC1_DATA, 1);                 // ICW4: 8086 mode
+    outb(PIC2_DATA, 1);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
+
+bool ioapic_init(void) {
+    pic_disable();
+
+    const acpi_madt_info_t* madt = acpi_madt();
+    if (!madt || !madt->ioapic_count) {
+        serial_write("IOAPIC: None found, no legacy interrupts\n");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < madt->ioapic_count; i++) {
+        ioapic_t* io = &ioapics[ioapic_count];
+        io->regs = vmm_map_mmio(madt->ioapics[i].address, 0x20, VMM_CACHE_UC);
+        if (!io->regs) {
+            serial_write("IOAPIC: ERROR - Can't map registers\n");
+            continue;
+        }
+        io->gsi_base = madt->ioapics[i].gsi_base;
+        io->pins = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+
+        for (uint32_t pin = 0; pin < io->pins; pin++) {
+            ioapic_write(io, IOAPIC_REG_REDIR + pin * 2, IOAPIC_REDIR_MASKED);
+            ioapic_write(io, IOAPIC_REG_REDIR + pin * 2 + 1, 0);
+        }
+        ioapic_count++;
+
+        serial_write("IOAPIC: GSI ");
+        serial_write_dec(io->gsi_base);
+        serial_write("-");
+        serial_write_dec(io->gsi_base + io->pins - 1);
+        serial_write("\n");
+    }
+    return ioapic_count != 0;
+}
+
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint16_t flags) {
+    uint32_t pin;
+    ioapic_t* io = ioapic_for_gsi(gsi, &pin);
+    if (!io) return false;
+
+    uint32_t low = vector;
+    if ((flags & 0x3) == IOAPIC_POLARITY_LOW) low |= IOAPIC_REDIR_ACTIVE_LOW;
+    if ((flags & 0xC) == IOAPIC_TRIGGER_LEVEL) low |= IOAPIC_REDIR_LEVEL;
+
+    // Destination first, the entry goes live with the unmasked low half
+    uint64_t irq = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2 + 1, apic_id << 24);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2, low);
+    spin_unlock_irqrestore(&ioapic_lock, irq);
+    return true;
+}
+
+void ioapic_mask(uint32_t gsi) {
+    uint32_t pin;
+    ioapic_t* io = ioapic_for_gsi(gsi, &pin);
+    if (!io) return;
+
+    uint64_t irq = spin_lock_irqsave(&ioapic_lock);
+    uint32_t low = ioapic_read(io, IOAPIC_REG_REDIR + pin * 2);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2, low | IOAPIC_REDIR_MASKED);
+    spin_unlock_irqrestore(&ioapic_lock, irq);
+}
+
+uint32_t ioapic_isa_gsi(uint32_t irq, uint16_t* flags) {
+    *flags = 0;
+    const acpi_madt_info_t* madt = acpi_madt();
+    if (!madt || irq >= IOAPIC_ISA_IRQS) return irq;
+
+    for (uint32_t i = 0; i < madt->override_count; i++) {
+        if (madt->overrides[i].irq == irq) {
+            *flags = madt->overrides[i].flags;
+            return madt->overrides[i].gsi;
+        }
+    }
+    return irq;
+}
+
+// irq_set_affinity(): only the destination changes
+static void ioapic_retarget(void* data, uint8_t vector, uint32_t apic_id) {
+    (void)vector;
+    uint32_t pin;
+    ioapic_t* io = ioapic_for_gsi((uint32_t)(uintptr_t)data, &pin);
+    if (!io) return;
+
+    uint64_t irq = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2 + 1, apic_id << 24);
+    spin_unlock_irqrestore(&ioapic_lock, irq);
+}
+
+int ioapic_alloc_irq(uint32_t irq, uint16_t flags, uint32_t cpu, const char* name,
+                     irq_handler_t handler, void* ctx) {
+    uint16_t override_flags;
+    uint32_t gsi = ioapic_isa_gsi(irq, &override_flags);
+    if (!flags) flags = override_flags;
+
+    uint32_t pin;
+    if (!ioapic_for_gsi(gsi, &pin)) return -1;
+
+    int vector = irq_alloc_vector(cpu, name, handler, ctx);
+    if (vector < 0) return -1;
+
+    irq_set_source(vector, ioapic_retarget, (void*)(uintptr_t)gsi);
+    irq_set_level(vector, (flags & 0xC) == IOAPIC_TRIGGER_LEVEL);
+    ioapic_route(gsi, vector, irq_vector_apic_id(vector), flags);
+    return vector;
+}
+
+void ioapic_free_irq(uint32_t irq, int vector) {
+    uint16_t flags;
+    ioapic_mask(ioapic_isa_gsi(irq, &flags));
+    irq_free_vector(vector);
+}
@@ -0,0 +1,49 @@
+// kernel/ioapic.h
+// IO APICs - where the ISA IRQs and PCI INTx lines come in
+// Every pin starts masked. ioapic_alloc_irq() gives a line its own vector
+// (irq.h) and points its pin at one CPU; irq_set_affinity() can move it
+// later. The 8259 PICs get remapped out of the exception range and masked
+// for good.
+//
+// Created by: floof<3
+
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "irq.h"
+
+#define IOAPIC_ISA_IRQS 16
+
+// MPS INTI flags (same encoding as acpi_override_t.flags), 0 = bus default
+#define IOAPIC_POLARITY_HIGH  0x1
+#define IOAPIC_POLARITY_LOW   0x3
+#define IOAPIC_TRIGGER_EDGE   (0x1 << 2)
+#define IOAPIC_TRIGGER_LEVEL  (0x3 << 2)
+#define IOAPIC_FLAGS_PCI      (IOAPIC_POLARITY_LOW | IOAPIC_TRIGGER_LEVEL)
+
+// Silence the 8259s, map the IO APICs from the MADT and mask all their
+// pins (after acpi_init and vmm_init). False if there's no IO APIC.
+bool ioapic_init(void);
+
+// Deliver GSI `gsi` as `vector` to the CPU with `apic_id` and unmask it.
+// False if no IO APIC has that GSI.
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint16_t flags);
+void ioapic_mask(uint32_t gsi);
+
+// GSI an ISA IRQ comes in on (after the MADT overrides), flags gets the
+// override's polarity/trigger (0 if there's none)
+uint32_t ioapic_isa_gsi(uint32_t irq, uint16_t* flags);
+
+// Give legacy line `irq` its own vector on `cpu` (SCHED_ANY_CPU = least
+// busy) and unmask it. ISA IRQs (0-15) go through the overrides, flags 0
+// means ISA defaults (edge, active high); PCI INTx wants IOAPIC_FLAGS_PCI.
+// No sharing: one handler per line. Returns the vector or -1.
+int ioapic_alloc_irq(uint32_t irq, uint16_t flags, uint32_t cpu, const char* name,
+                     irq_handler_t handler, void* ctx);
+
+// Mask the line and give its vector back
+void ioapic_free_irq(uint32_t irq, int vector);
+
+#endif // IOAPIC_H
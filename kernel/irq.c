@@ -0,0 +1,245 @@
+// kernel/irq.c
+// Vector table, per-vector CPU affinity and counters
+//
+// A handler pointer is published last (release) and read with acquire, so
+// an interrupt never sees a half filled in descriptor. Freeing clears it
+// and then waits an RCU grace period: a handler is between two quiescent
+// states of its CPU, so after that nobody is still running it.
+//
+// Created by: floof<3
+
+#include "irq.h"
+#include "idt.h"
+#include "lapic.h"
+#include "smp.h"
+#include "softirq.h"
+#include "scheduler.h"
+#include "percpu.h"
+#include "rcu.h"
+#include "spinlock.h"
+#include "../drivers/serial.h"
+
+#define IRQ_CPU_LOCAL 0xFFFFFFFF  // Local vector, every CPU takes its own
+
+typedef struct {
+    const char* name;           // NULL = free
+    irq_handler_t handler;      // NULL = nobody home (counted and dropped)
+    void* ctx;
+    uint32_t cpu;               // Where it's delivered (IRQ_CPU_LOCAL for LAPIC vectors)
+    irq_retarget_t retarget;    // How to move it, NULL = it can't be
+    void* source;
+    bool level;                 // Level-triggered, EOI after the handler
+} irq_desc_t;
+
+static void irq_timer(void* ctx) {
+    (void)ctx;
+    scheduler_tick();
+}
+
+static void irq_ipi(void* ctx) {
+    (void)ctx;
+    smp_handle_ipi();
+}
+
+static irq_desc_t irq_descs[IDT_VECTORS] = {
+    [LAPIC_TIMER_VECTOR]    = { "timer",    irq_timer, NULL, IRQ_CPU_LOCAL, NULL, NULL, false },
+    [SMP_RESCHED_VECTOR]    = { "resched",  irq_ipi,   NULL, IRQ_CPU_LOCAL, NULL, NULL, false },
+    [SMP_TLB_VECTOR]        = { "tlb",      irq_ipi,   NULL, IRQ_CPU_LOCAL, NULL, NULL, false },
+    [SMP_CALL_VECTOR]       = { "call",     irq_ipi,   NULL, IRQ_CPU_LOCAL, NULL, NULL, false },
+    [LAPIC_SPURIOUS_VECTOR] = { "spurious", NULL,      NULL, IRQ_CPU_LOCAL, NULL, NULL, false },
+};
+
+// Each CPU only ever bumps its own row, no atomics needed
+static uint64_t irq_counts[MAX_CPUS][IDT_VECTORS] __attribute__((aligned(64)));
+
+static uint32_t irq_cpu_load[MAX_CPUS];  // Device vectors delivered to each CPU
+static spinlock_t irq_lock = SPINLOCK_INIT;
+
+static bool irq_device_vector(int vector) {
+    return vector >= IRQ_VECTOR_FIRST && vector <= IRQ_VECTOR_LAST;
+}
+
+// The BSP counts as online before smp_init() has run
+static bool irq_cpu_online(uint32_t cpu) {
+    return cpu == 0 || (cpu < MAX_CPUS && (smp_online_mask() & (1ULL << cpu)));
+}
+
+// Online CPU with the fewest device vectors (irq_lock held)
+static uint32_t irq_pick_cpu(void) {
+    uint32_t best = 0;
+    for (uint32_t cpu = 1; cpu < MAX_CPUS; cpu++) {
+        if (irq_cpu_online(cpu) && irq_cpu_load[cpu] < irq_cpu_load[best]) best = cpu;
+    }
+    return best;
+}
+
+int irq_alloc_vector(uint32_t cpu, const char* name, irq_handler_t handler, void* ctx) {
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+
+    if (cpu == SCHED_ANY_CPU) cpu = irq_pick_cpu();
+    if (!irq_cpu_online(cpu)) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return -1;
+    }
+
+    for (int vector = IRQ_VECTOR_FIRST; vector <= IRQ_VECTOR_LAST; vector++) {
+        irq_desc_t* desc = &irq_descs[vector];
+        if (desc->name) continue;
+
+        for (uint32_t i = 0; i < MAX_CPUS; i++) irq_counts[i][vector] = 0;
+        desc->name = name ? name : "?";
+        desc->ctx = ctx;
+        desc->cpu = cpu;
+        desc->retarget = NULL;
+        desc->source = NULL;
+        desc->level = false;
+        __atomic_store_n(&desc->handler, handler, __ATOMIC_RELEASE);
+        irq_cpu_load[cpu]++;
+
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return vector;
+    }
+
+    spin_unlock_irqrestore(&irq_lock, flags);
+    serial_write("IRQ: ERROR - Out of vectors for ");
+    serial_write(name ? name : "?");
+    serial_write("\n");
+    return -1;
+}
+
+void irq_free_vector(int vector) {
+    if (!irq_device_vector(vector)) return;
+    irq_desc_t* desc = &irq_descs[vector];
+
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    if (!desc->name) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return;
+    }
+    __atomic_store_n(&desc->handler, NULL, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&irq_lock, flags);
+
+    // Let handlers that already loaded the pointer finish
+    synchronize_rcu();
+
+    flags = spin_lock_irqsave(&irq_lock);
+    irq_cpu_load[desc->cpu]--;
+    desc->retarget = NULL;
+    desc->source = NULL;
+    desc->ctx = NULL;
+    desc->name = NULL;
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+void irq_set_source(int vector, irq_retarget_t retarget, void* data) {
+    if (!irq_device_vector(vector)) return;
+
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    irq_descs[vector].retarget = retarget;
+    irq_descs[vector].source = data;
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+void irq_set_level(int vector, bool level) {
+    if (!irq_device_vector(vector)) return;
+
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    irq_descs[vector].level = level;
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+bool irq_set_affinity(int vector, uint32_t cpu) {
+    if (!irq_device_vector(vector) || !irq_cpu_online(cpu)) return false;
+    irq_desc_t* desc = &irq_descs[vector];
+
+    uint64_t flags = spin_lock_irqsave(&irq_lock);
+    if (!desc->name || !desc->retarget) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        return false;
+    }
+
+    // One already in flight still lands on the old CPU, that's fine
+    irq_cpu_load[desc->cpu]--;
+    irq_cpu_load[cpu]++;
+    desc->cpu = cpu;
+    desc->retarget(desc->source, vector, percpu_get(cpu)->apic_id);
+
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return true;
+}
+
+uint32_t irq_vector_cpu(int vector) {
+    if (!irq_device_vector(vector)) return 0;
+    return irq_descs[vector].cpu;
+}
+
+uint32_t irq_vector_apic_id(int vector) {
+    return percpu_get(irq_vector_cpu(vector))->apic_id;
+}
+
+uint64_t irq_count_cpu(int vector, uint32_t cpu) {
+    if (vector < 0 || vector >= IDT_VECTORS || cpu >= MAX_CPUS) return 0;
+    return irq_counts[cpu][vector];
+}
+
+uint64_t irq_count(int vector) {
+    uint64_t total = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) total += irq_count_cpu(vector, cpu);
+    return total;
+}
+
+void irq_stats_dump(void) {
+    serial_write("IRQ: vector name target total (per CPU)\n");
+    for (int vector = IDT_EXCEPTIONS; vector < IDT_VECTORS; vector++) {
+        irq_desc_t* desc = &irq_descs[vector];
+        uint64_t total = irq_count(vector);
+        if (!desc->name && !total) continue;
+
+        // Racy reads of the other CPUs' rows, good enough for a dump
+        serial_write("IRQ: ");
+        serial_write_hex(vector);
+        serial_write(" ");
+        serial_write(desc->name ? desc->name : "(none)");
+        if (desc->cpu == IRQ_CPU_LOCAL) {
+            serial_write(" local ");
+        } else {
+            serial_write(" cpu");
+            serial_write_dec(desc->cpu);
+            serial_write(" ");
+        }
+        serial_write_dec(total);
+        serial_write(" (");
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (!irq_cpu_online(cpu)) continue;
+            if (cpu) serial_write(" ");
+            serial_write_dec(irq_counts[cpu][vector]);
+        }
+        serial_write(")\n");
+    }
+}
+
+void irq_dispatch(uint32_t vector) {
+    irq_counts[cpu_id()][vector]++;
+
+    // Spurious ones don't get an EOI: the LAPIC never marked them in
+    // service, and the 8259s are masked (a spurious IRQ 7/15 is all they
+    // can still send)
+    if (vector == LAPIC_SPURIOUS_VECTOR) return;
+    if (vector >= IRQ_PIC_BASE && vector < IRQ_PIC_BASE + 16) return;
+
+    irq_enter();
+
+    // Edges get their EOI first, so one that comes in while the handler
+    // runs is latched instead of lost. A level-triggered line is still
+    // asserted until the handler acks the device: an EOI now would just
+    // make the IO APIC send it again, so it waits.
+    irq_desc_t* desc = &irq_descs[vector];
+    bool level = desc->level;
+    if (!level) lapic_eoi();
+
+    irq_handler_t handler = __atomic_load_n(&desc->handler, __ATOMIC_ACQUIRE);
+    if (handler) handler(desc->ctx);
+
+    if (level) lapic_eoi();
+    irq_exit();
+}
@@ -0,0 +1,75 @@
+// kernel/irq.h
+// Interrupt vectors above the exceptions: who handles them, which CPU they
+// land on and how often they fired
+//
+// Vector map:
+//   0x00-0x1F  CPU exceptions (idt.c)
+//   0x20-0x2F  the 8259s, remapped out of the way and masked (only ever
+//              spurious)
+//   0x30-0xEF  device vectors, handed out by irq_alloc_vector() to the IO
+//              APIC (ioapic.c) and to MSI/MSI-X (msi.c)
+//   0xF0-0xF3  LAPIC timer and IPIs (same handler on every CPU)
+//   0xFF       LAPIC spurious
+//
+// The IDT is shared, so a device vector is global: it's delivered to one
+// CPU (its affinity), which can be changed on the fly by reprogramming
+// whatever sends it. Every CPU counts every vector it takes.
+//
+// Created by: floof<3
+
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IRQ_PIC_BASE      0x20
+#define IRQ_VECTOR_FIRST  0x30
+#define IRQ_VECTOR_LAST   0xEF
+
+// Runs in interrupt context between irq_enter() and irq_exit(), with
+// interrupts off: acknowledge the device and queue the rest. Edge and MSI
+// vectors are EOI'd before it, level-triggered ones after it (the line has
+// to be deasserted by then, or it fires again right away).
+typedef void (*irq_handler_t)(void* ctx);
+
+// Point whatever raises `vector` at another CPU (an IO APIC pin, an MSI
+// address, an MSI-X table entry). Set by whoever routed the vector.
+typedef void (*irq_retarget_t)(void* data, uint8_t vector, uint32_t apic_id);
+
+// Claim a free device vector delivered to `cpu` (SCHED_ANY_CPU = the
+// online CPU with the fewest device vectors so far, so two busy devices
+// end up on different cores). -1 when they're all taken.
+int irq_alloc_vector(uint32_t cpu, const char* name, irq_handler_t handler, void* ctx);
+
+// Give a vector back (its source has to be masked already). Waits for
+// handlers still running on other CPUs, so not from interrupt context.
+void irq_free_vector(int vector);
+
+// How to move the vector's source to another CPU (data belongs to the caller)
+void irq_set_source(int vector, irq_retarget_t retarget, void* data);
+
+// The vector comes from a level-triggered IO APIC pin: EOI it only once the
+// handler has quieted the device
+void irq_set_level(int vector, bool level);
+
+// Move a device vector to `cpu`. False if it isn't allocated, the CPU
+// isn't online or nothing knows how to retarget it.
+bool irq_set_affinity(int vector, uint32_t cpu);
+
+// CPU a device vector is delivered to, and that CPU's APIC ID (what goes
+// into the IO APIC entry or MSI address when routing it)
+uint32_t irq_vector_cpu(int vector);
+uint32_t irq_vector_apic_id(int vector);
+
+// Times `vector` fired on `cpu`, and on all CPUs together
+uint64_t irq_count_cpu(int vector, uint32_t cpu);
+uint64_t irq_count(int vector);
+
+// Print every vector that has a handler or fired, with per-CPU counts
+void irq_stats_dump(void);
+
+// Called by interrupt_dispatch() for vectors 32-255
+void irq_dispatch(uint32_t vector);
+
+#endif // IRQ_H
@@ -11,17 +11,28 @@
 #include <stddef.h>
 #include "../drivers/serial.h"  // For debug output (so we can actually see what's going on)
 #include "pmm.h"   // Physical memory manager
+#include "vmm.h"   // Virtual memory manager (page tables)
 #include "heap.h"  // Heap allocator (kmalloc/kfree)
+#include "uvm.h"   // User address spaces (demand paging, copy-on-write)
+#include "percpu.h" // Per-CPU data (GS base)
+#include "acpi.h"   // ACPI tables (where the other CPUs are)
+#include "clock.h"  // TSC clock (nanoseconds since boot)
+#include "timer.h"  // Timer wheel
+#include "lapic.h" // Local APIC (timer tick)
+#include "smp.h"    // The other cores (AP bring-up, IPIs)
+#include "scheduler.h"  // Threads (multitasking go brrr)
+#include "softirq.h"    // Bottom halves (softirqs, tasklets)
+#include "rcu.h"        // Read-copy-update (lock-free readers)
+#include "workqueue.h"  // Deferred work that may sleep
+#include "spinlock.h"   // Lock contention counters
+#include "idt.h"        // Interrupt descriptor table + exceptions
+#include "ioapic.h"     // Legacy IRQ routing (and goodbye 8259)
+#include "fpu.h"        // SSE/AVX for the copy loops
+#include "memory.h"     // memcpy & co. (picked per CPU)
 
 // Forward declarations for stub functions that aren't implemented yet
-// (We removed pmm_init, heap_init since those are now real)
+// (We removed pmm_init, heap_init, vmm_init since those are now real)
 void gdt_init(void);
-void idt_init(void);
-void pic_init(void);
-void apic_init(void);
-void scheduler_init(void);
-void vmm_init(void);
-void vmm_map_page(uint64_t* pml, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
 void pci_scan(void);
 void usb_init(void);
 void graphics_init(void* gop_ptr);
@@ -37,14 +48,6 @@ typedef struct {
     uint8_t gap[256];  // Reserved space (idk what this is for but it's here)
 } BootParams;
 
-// Memory management constants
-#define PAGE_SIZE 4096  // 4KB pages because that's what x86_64 uses
-#define PAGE_PRESENT (1 << 0)  // page is in memory
-#define PAGE_WRITE (1 << 1)  // page is writable
-
-// Global variables (yes I know globals are bad but this is a kernel so shut up)
-static uint64_t* kernel_pml4 = NULL;
-
 // Kernel panic handler (oh shit moment)
 void kernel_panic(const char* message, uint32_t error_code) {
     // TODO: Display error message on screen
@@ -65,72 +68,6 @@ void gdt_init(void) {
     // honestly GDT is kinda pointless in 64-bit mode but we need it anyway
 }
 
-// IDT (Interrupt Descriptor Table) initialization  
-void idt_init(void) {
-    // TODO: Set up IDT with 256 entries
-    // Install exception handlers (divide by zero, page fault, etc.)
-    // Install IRQ handlers
-    // this is where we tell the CPU what to do when shit hits the fan
-}
-
-// PIC (Programmable Interrupt Controller) initialization
-void pic_init(void) {
-    // TODO: Remap PIC to avoid conflicts with CPU exceptions
-    // Master PIC: IRQ 0-7 -> INT 32-39
-    // Slave PIC: IRQ 8-15 -> INT 40-47
-    // the PIC is old as fuck but we still need to configure it
-}
-
-// APIC (Advanced Programmable Interrupt Controller) initialization
-void apic_init(void) {
-    // TODO: Detect and initialize Local APIC and IO APIC
-    // Disable legacy PIC (bye bye old hardware)
-    // Configure APIC timer for preemptive multitasking
-    // APIC is way better than PIC but also way more complicated
-}
-
-// Scheduler initialization (multitasking go brrr)
-void scheduler_init(void) {
-    // TODO: Initialize task list
-    // Set up timer interrupt for context switching
-    // Create idle task (the task that does nothing when there's nothing to do)
-}
-
-// VMM (Virtual Memory Manager) initialization
-void vmm_init(void) {
-    // Allocate PML4 (Page Map Level 4) table
-    kernel_pml4 = (uint64_t*)0x1000;  // Temporary physical address (this is kinda sketchy but whatever)
-    
-    // Clear PML4 (zero it out so we start fresh)
-    for (int i = 0; i < 512; i++) {
-        kernel_pml4[i] = 0;
-    }
-    
-    // Identity map first 4GB for kernel and devices
-    // (virtual addr = physical addr, makes life easier)
-    for (uint64_t addr = 0; addr < 0x100000000; addr += 0x200000) {
-        // Using 2MB pages for simplicity (requires PAGE_SIZE flag)
-        vmm_map_page(kernel_pml4, addr, addr, PAGE_PRESENT | PAGE_WRITE | PAGE_SIZE); //was missing an underscore.
-    }
-    
-    // Load CR3 with new page table (tell the CPU about our fancy new page tables)
-    __asm__ volatile("mov %0, %%cr3" :: "r"(kernel_pml4));
-}
-
-// Map a virtual page to physical page
-void vmm_map_page(uint64_t* pml, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) { //Flags?? more like.. FAGS LMAOOO :3
-    (void)pml;
-    (void)virtual_addr;
-    (void)physical_addr;
-    (void)flags;
-    
-    // TODO: Implement 4-level page table mapping
-    // Extract indices from virtual address (bit twiddling time)
-    // Allocate intermediate tables if needed (PDPT, PD, PT)
-    // Set leaf entry to physical address with flags
-    // x86_64 paging is a pain in the ass btw
-}
-
 // PCI bus scanning (find all the hardware)
 void pci_scan(void) {
     // TODO: Scan PCI configuration space
@@ -191,18 +128,68 @@ void pkg_init(void) {
 // Main kernel entry point (called from boot64.asm in 64-bit mode)
 // RDI contains pointer to multiboot info struct
 void kernel_main(void* multiboot_info) {
-    (void)multiboot_info;
-
     // Initialize serial for debugging
     serial_init();
 
+    // We're CPU 0 (cpu_id() reads GS, so this goes before anything per-CPU)
+    percpu_init(0);
+
+    // Exceptions and interrupt vectors (a fault from here on at least says what happened)
+    idt_init();
+
+    // SSE/AVX on, then the fastest memcpy/memset this CPU has
+    fpu_init_cpu();
+    string_init();
+
     // Print boot message
     serial_write("TouchOS Kernel Started!\n");
     serial_write("Kernel successfully loaded by GRUB.\n");
 
-    // Halt
-    serial_write("Entering halt loop.\n");
-    while(1) {
-        __asm__ volatile("hlt");
-    }
+    // Set up physical memory from GRUB's memory map
+    // (EBX was a 32-bit register, so only trust the low half of RDI)
+    pmm_init_multiboot((void*)((uint64_t)multiboot_info & 0xFFFFFFFF));
+
+    // Real page tables (boot64.asm only mapped the first 512MB)
+    vmm_init();
+
+    // Heap can use all of RAM now that it's mapped
+    heap_init();
+
+    // Shared zero page for user memory that's read before it's written
+    uvm_init();
+
+    // Calibrate the TSC against the PIT, then start the timer wheels on it
+    clock_init();
+    timer_init();
+
+    // Timer tick + run queues, this context becomes the BSP's idle thread
+    lapic_init();
+    scheduler_init();
+
+    // Wake up the other cores, each ends up in its own idle loop
+    acpi_init();
+    smp_init();
+
+    // IO APIC pins from the MADT, all masked until a driver asks for one
+    ioapic_init();
+
+    // Deferred interrupt work: ksoftirqd and kworker on every online CPU
+    rcu_init();
+    softirq_init();
+    workqueue_init();
+
+#ifdef STRING_BENCH
+    // memcpy/memset flavors, 8 bytes to 8MB (make STRING_BENCH=1)
+    string_benchmark();
+#endif
+
+    // How much the bring-up fought over the shared locks
+    lock_stats_dump();
+
+    // Everything's wired up, let the interrupts in (the APs already did)
+    __asm__ volatile("sti" : : : "memory");
+
+    // Idle (run threads, pre-zero pages for the pool, then sleep until the next interrupt)
+    serial_write("Entering idle loop.\n");
+    scheduler_start();
 }
@@ -0,0 +1,159 @@
+// kernel/lapic.c
+// Local APIC driver (xAPIC, memory mapped registers)
+//
+// Created by: floof<3
+
+#include "lapic.h"
+#include "cpu.h"
+#include "vmm.h"
+#include "pit.h"
+#include "../drivers/serial.h"
+
+// Register offsets (each one is a 32-bit register on a 16-byte boundary)
+#define LAPIC_REG_ID          0x020
+#define LAPIC_REG_TPR         0x080  // Task priority (0 = accept everything)
+#define LAPIC_REG_EOI         0x0B0
+#define LAPIC_REG_SVR         0x0F0  // Spurious vector + software enable
+#define LAPIC_REG_ICR_LOW     0x300  // Writing this sends the IPI
+#define LAPIC_REG_ICR_HIGH    0x310  // Destination APIC ID in bits 24-31
+#define LAPIC_REG_LVT_TIMER   0x320
+#define LAPIC_REG_TIMER_INIT  0x380
+#define LAPIC_REG_TIMER_CUR   0x390
+#define LAPIC_REG_TIMER_DIV   0x3E0
+
+#define LAPIC_SVR_ENABLE      (1 << 8)
+#define LAPIC_LVT_MASKED      (1 << 16)
+#define LAPIC_TIMER_PERIODIC  (1 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_TIMER_DIV_16    0x3
+
+#define LAPIC_ICR_INIT        (5 << 8)
+#define LAPIC_ICR_STARTUP     (6 << 8)
+#define LAPIC_ICR_PENDING     (1 << 12)  // Delivery status: still sending
+#define LAPIC_ICR_ASSERT      (1 << 14)
+
+#define CPU_MSR_APIC_BASE     0x1B
+#define CPU_MSR_TSC_DEADLINE  0x6E0
+#define APIC_BASE_ENABLE      (1 << 11)
+
+#define PIT_CALIBRATE_HZ 100   // Measure the timer for 1/100th of a second
+
+static volatile uint32_t* lapic_regs = NULL;
+static uint32_t timer_ticks_per_sec = 0;  // At divide-by-16
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic_regs[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_regs[reg / 4] = value;
+}
+
+bool lapic_init(void) {
+    if (!lapic_regs) {
+        uint32_t eax, ebx, ecx, edx;
+        cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        if (!(edx & (1 << 9))) {
+            serial_write("LAPIC: ERROR - No local APIC!\n");
+            return false;
+        }
+
+        // Every CPU's LAPIC sits at the same physical address, the one we
+        // map is always our own
+        uint64_t base = cpu_rdmsr(CPU_MSR_APIC_BASE) & VMM_ADDR_MASK;
+        lapic_regs = vmm_map_mmio(base, 0x1000, VMM_CACHE_UC);
+        if (!lapic_regs) {
+            serial_write("LAPIC: ERROR - Can't map registers\n");
+            return false;
+        }
+    }
+
+    cpu_wrmsr(CPU_MSR_APIC_BASE, cpu_rdmsr(CPU_MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    return true;
+}
+
+uint32_t lapic_id(void) {
+    return lapic_regs ? lapic_read(LAPIC_REG_ID) >> 24 : 0;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+// Count LAPIC timer ticks over 10ms of PIT time
+static uint32_t lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    pit_oneshot_start(PIT_FREQUENCY / PIT_CALIBRATE_HZ);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+    while (!pit_oneshot_done()) cpu_pause();
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CUR);
+
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    return elapsed * PIT_CALIBRATE_HZ;
+}
+
+void lapic_timer_start(uint32_t hz) {
+    if (!lapic_regs || !hz) return;
+
+    if (!timer_ticks_per_sec) {
+        timer_ticks_per_sec = lapic_timer_calibrate();
+        serial_write("LAPIC: Timer runs at ");
+        serial_write_dec(timer_ticks_per_sec * 16ULL / 1000);
+        serial_write(" kHz\n");
+    }
+
+    uint32_t initial = timer_ticks_per_sec / hz;
+    if (!initial) initial = 1;
+
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_REG_TIMER_INIT, initial);
+}
+
+bool lapic_timer_has_deadline(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return lapic_regs && (ecx & (1 << 24));
+}
+
+void lapic_timer_deadline(uint64_t tsc) {
+    if (!lapic_regs) return;
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_TSC_DEADLINE);
+    // The SDM wants the mode switch to land before the deadline write
+    __asm__ volatile("mfence" : : : "memory");
+    cpu_wrmsr(CPU_MSR_TSC_DEADLINE, tsc ? tsc : 1);  // 0 would disarm it
+}
+
+void lapic_timer_stop(void) {
+    if (!lapic_regs) return;
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+}
+
+// Write the ICR and wait until the LAPIC has sent it
+// (interrupts off: an IPI sent from an interrupt in between would clobber ICR_HIGH)
+static void lapic_send(uint32_t apic_id, uint32_t low) {
+    if (!lapic_regs) return;
+
+    uint64_t flags = cpu_irq_save();
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, low);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) cpu_pause();
+    cpu_irq_restore(flags);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, vector);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    lapic_send(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint8_t page) {
+    lapic_send(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | page);
+}
@@ -0,0 +1,50 @@
+// kernel/lapic.h
+// Local APIC - the per-CPU interrupt controller
+// Enables it, runs the scheduler tick off its timer (calibrated against the
+// PIT) or a one-shot TSC deadline, acknowledges interrupts and sends IPIs to
+// other CPUs.
+//
+// Created by: floof<3
+
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Vectors the LAPIC delivers (high so they beat device interrupts)
+#define LAPIC_TIMER_VECTOR    0xF0
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Map the LAPIC and enable it on this CPU (the first call maps the registers)
+// False if the CPU has no APIC (CPUID 1 EDX bit 9)
+bool lapic_init(void);
+
+// This CPU's APIC ID
+uint32_t lapic_id(void);
+
+// Tell the LAPIC we're done with the current interrupt
+void lapic_eoi(void);
+
+// Fire LAPIC_TIMER_VECTOR `hz` times a second on this CPU
+// The timer frequency is measured against PIT channel 2 on the first call
+// (about 10ms), later CPUs reuse the result.
+void lapic_timer_start(uint32_t hz);
+
+// Does this CPU have the TSC-deadline timer mode? (CPUID 1 ECX bit 24)
+bool lapic_timer_has_deadline(void);
+
+// One-shot LAPIC_TIMER_VECTOR when the TSC reaches `tsc` (replaces the
+// periodic tick until the next lapic_timer_start)
+void lapic_timer_deadline(uint64_t tsc);
+
+// Stop this CPU's timer
+void lapic_timer_stop(void);
+
+// Inter-processor interrupts, by APIC ID
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+void lapic_send_init(uint32_t apic_id);
+// Start an AP (after INIT) in real mode at physical address page * 4KB
+void lapic_send_startup(uint32_t apic_id, uint8_t page);
+
+#endif // LAPIC_H
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "spinlock.h"
 
 typedef struct {
     uint32_t Type;
@@ -12,14 +13,29 @@ typedef struct {
     uint64_t Attribute;
 } EFI_MEMORY_DESCRIPTOR;
 
-typedef struct {
-    uint32_t lock;
-} spinlock_t;
-
-void spin_lock(spinlock_t* lock);
-void spin_unlock(spinlock_t* lock);
+// kernel/string.c (GCC also emits calls to these on its own)
 void* memset(void* dest, int val, size_t count);
 void* memcpy(void* dest, const void* src, size_t count);
+void* memmove(void* dest, const void* src, size_t count);
+int memcmp(const void* a, const void* b, size_t count);
+
+// Same, but the stores bypass the cache: for big one-shot copies and for
+// write-combined memory (VRAM). They're weakly ordered, so call
+// memory_nt_fence() before anyone else may look at the data.
+void* memcpy_nt(void* dest, const void* src, size_t count);
+void* memset_nt(void* dest, int val, size_t count);
+
+static inline void memory_nt_fence(void) {
+    __asm__ volatile("sfence" : : : "memory");
+}
+
+// Pick the copy/fill loops for this CPU (after fpu_init_cpu())
+void string_init(void);
+
+#ifdef STRING_BENCH
+void string_benchmark(void);
+#endif
+
 void* kmalloc(size_t size);
 void kfree(void* ptr);
 
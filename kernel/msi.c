@@ -0,0 +1,196 @@
+// kernel/msi.c
+// MSI / MSI-X setup, with INTx through the IO APIC as the last resort
+//
+// Every vector handed out here remembers where its message lives (the MSI
+// capability or one MSI-X table entry, mapped on its own), which is all
+// irq_set_affinity() needs to steer it somewhere else.
+//
+// Created by: floof<3
+
+#include "msi.h"
+#include "idt.h"
+#include "ioapic.h"
+#include "heap.h"
+#include "vmm.h"
+#include "../drivers/serial.h"
+
+// MSI capability
+#define MSI_CTRL            0x02
+#define MSI_ADDR_LOW        0x04
+#define MSI_ADDR_HIGH       0x08   // Only with MSI_CTRL_64BIT
+#define MSI_DATA_32         0x08
+#define MSI_DATA_64         0x0C
+#define MSI_CTRL_ENABLE     (1 << 0)
+#define MSI_CTRL_MME_MASK   (7 << 4)  // Vectors enabled (log2), we only ever use 1
+#define MSI_CTRL_64BIT      (1 << 7)
+
+// MSI-X capability
+#define MSIX_CTRL           0x02
+#define MSIX_TABLE          0x04   // BAR index in bits 0-2, offset in the rest
+#define MSIX_CTRL_SIZE_MASK 0x7FF  // Table size - 1
+#define MSIX_CTRL_MASKALL   (1 << 14)
+#define MSIX_CTRL_ENABLE    (1 << 15)
+
+// MSI-X table entry (16 bytes)
+#define MSIX_ENTRY_SIZE     16
+#define MSIX_ENTRY_ADDR_LOW 0
+#define MSIX_ENTRY_ADDR_HIGH 1
+#define MSIX_ENTRY_DATA     2
+#define MSIX_ENTRY_CTRL     3
+#define MSIX_ENTRY_MASKED   (1 << 0)
+
+#define PCI_IRQ_NONE 0xFF  // Interrupt line nobody wired up
+
+typedef enum {
+    MSI_KIND_MSIX,
+    MSI_KIND_MSI,
+    MSI_KIND_INTX,
+} msi_kind_t;
+
+typedef struct {
+    pci_device_t dev;           // Our own copy, the caller's can go away
+    msi_kind_t kind;
+    uint8_t cap;                // Capability offset (MSI, MSI-X)
+    volatile uint32_t* entry;   // Mapped MSI-X table entry
+} msi_source_t;
+
+static msi_source_t* msi_sources[IDT_VECTORS];
+
+static uint32_t msi_address(uint32_t apic_id) {
+    return MSI_ADDRESS_BASE | (apic_id << 12);
+}
+
+// Point the message at `apic_id` (edge triggered, fixed delivery)
+static void msi_write_message(msi_source_t* src, uint8_t vector, uint32_t apic_id) {
+    if (src->kind == MSI_KIND_MSIX) {
+        // Masked while it's half written, or the device could send a mix
+        volatile uint32_t* entry = src->entry;
+        entry[MSIX_ENTRY_CTRL] |= MSIX_ENTRY_MASKED;
+        entry[MSIX_ENTRY_ADDR_LOW] = msi_address(apic_id);
+        entry[MSIX_ENTRY_ADDR_HIGH] = 0;
+        entry[MSIX_ENTRY_DATA] = vector;
+        entry[MSIX_ENTRY_CTRL] &= ~MSIX_ENTRY_MASKED;
+    } else {
+        // The data word never changes after setup, the address is one write
+        uint16_t ctrl = pci_config_read16(&src->dev, src->cap + MSI_CTRL);
+        pci_config_write32(&src->dev, src->cap + MSI_ADDR_LOW, msi_address(apic_id));
+        if (ctrl & MSI_CTRL_64BIT) {
+            pci_config_write32(&src->dev, src->cap + MSI_ADDR_HIGH, 0);
+            pci_config_write16(&src->dev, src->cap + MSI_DATA_64, vector);
+        } else {
+            pci_config_write16(&src->dev, src->cap + MSI_DATA_32, vector);
+        }
+    }
+}
+
+static void msi_retarget(void* data, uint8_t vector, uint32_t apic_id) {
+    msi_write_message(data, vector, apic_id);
+}
+
+// Map MSI-X table entry `index`, NULL if there's no such entry
+static volatile uint32_t* msix_map_entry(const pci_device_t* dev, uint8_t cap, uint32_t index) {
+    uint16_t ctrl = pci_config_read16(dev, cap + MSIX_CTRL);
+    if (index > (ctrl & MSIX_CTRL_SIZE_MASK)) return NULL;
+
+    uint32_t table = pci_config_read32(dev, cap + MSIX_TABLE);
+    uint64_t bar = pci_read_bar(dev, table & 0x7);
+    if (!bar) return NULL;
+
+    uint64_t phys = bar + (table & ~0x7u) + index * MSIX_ENTRY_SIZE;
+    return vmm_map_mmio(phys, MSIX_ENTRY_SIZE, VMM_CACHE_UC);
+}
+
+static void msix_enable(msi_source_t* src, uint8_t vector, uint32_t apic_id) {
+    // Function masked while the entry is filled in, INTx off for good
+    uint16_t ctrl = pci_config_read16(&src->dev, src->cap + MSIX_CTRL);
+    pci_config_write16(&src->dev, src->cap + MSIX_CTRL, ctrl | MSIX_CTRL_ENABLE | MSIX_CTRL_MASKALL);
+    pci_config_write16(&src->dev, PCI_COMMAND,
+                       pci_config_read16(&src->dev, PCI_COMMAND) | PCI_COMMAND_INTX_DISABLE);
+
+    msi_write_message(src, vector, apic_id);
+    pci_config_write16(&src->dev, src->cap + MSIX_CTRL, (ctrl | MSIX_CTRL_ENABLE) & ~MSIX_CTRL_MASKALL);
+}
+
+static void msi_enable(msi_source_t* src, uint8_t vector, uint32_t apic_id) {
+    msi_write_message(src, vector, apic_id);
+    pci_config_write16(&src->dev, PCI_COMMAND,
+                       pci_config_read16(&src->dev, PCI_COMMAND) | PCI_COMMAND_INTX_DISABLE);
+
+    uint16_t ctrl = pci_config_read16(&src->dev, src->cap + MSI_CTRL);
+    ctrl = (ctrl & ~MSI_CTRL_MME_MASK) | MSI_CTRL_ENABLE;
+    pci_config_write16(&src->dev, src->cap + MSI_CTRL, ctrl);
+}
+
+int pci_alloc_irq(const pci_device_t* dev, uint32_t index, uint32_t cpu, const char* name,
+                  irq_handler_t handler, void* ctx) {
+    msi_source_t* src = kmalloc(sizeof(msi_source_t));
+    if (!src) return -1;
+    src->dev = *dev;
+    src->entry = NULL;
+
+    if ((src->cap = pci_find_capability(dev, PCI_CAP_MSIX)) &&
+        (src->entry = msix_map_entry(dev, src->cap, index))) {
+        src->kind = MSI_KIND_MSIX;
+    } else if (index == 0 && (src->cap = pci_find_capability(dev, PCI_CAP_MSI))) {
+        src->kind = MSI_KIND_MSI;
+    } else {
+        src->kind = MSI_KIND_INTX;
+    }
+
+    int vector;
+    if (src->kind == MSI_KIND_INTX) {
+        vector = -1;
+        if (index == 0 && dev->irq != PCI_IRQ_NONE) {
+            vector = ioapic_alloc_irq(dev->irq, IOAPIC_FLAGS_PCI, cpu, name, handler, ctx);
+        }
+    } else {
+        vector = irq_alloc_vector(cpu, name, handler, ctx);
+    }
+    if (vector < 0) {
+        if (src->entry) vmm_unmap_mmio((void*)src->entry, MSIX_ENTRY_SIZE);
+        kfree(src);
+        serial_write("MSI: ERROR - No interrupt for ");
+        serial_write(name ? name : "?");
+        serial_write("\n");
+        return -1;
+    }
+    msi_sources[vector] = src;
+
+    if (src->kind == MSI_KIND_MSIX) msix_enable(src, vector, irq_vector_apic_id(vector));
+    else if (src->kind == MSI_KIND_MSI) msi_enable(src, vector, irq_vector_apic_id(vector));
+    if (src->kind != MSI_KIND_INTX) irq_set_source(vector, msi_retarget, src);
+
+    serial_write("MSI: ");
+    serial_write(name ? name : "?");
+    serial_write(src->kind == MSI_KIND_MSIX ? " MSI-X" : src->kind == MSI_KIND_MSI ? " MSI" : " INTx");
+    serial_write(" vector ");
+    serial_write_hex(vector);
+    serial_write(" on CPU ");
+    serial_write_dec(irq_vector_cpu(vector));
+    serial_write("\n");
+    return vector;
+}
+
+void pci_free_irq(int vector) {
+    if (vector < 0 || vector >= IDT_VECTORS || !msi_sources[vector]) return;
+    msi_source_t* src = msi_sources[vector];
+    msi_sources[vector] = NULL;
+
+    switch (src->kind) {
+    case MSI_KIND_MSIX:
+        src->entry[MSIX_ENTRY_CTRL] |= MSIX_ENTRY_MASKED;
+        irq_free_vector(vector);
+        vmm_unmap_mmio((void*)src->entry, MSIX_ENTRY_SIZE);
+        break;
+    case MSI_KIND_MSI: {
+        uint16_t ctrl = pci_config_read16(&src->dev, src->cap + MSI_CTRL);
+        pci_config_write16(&src->dev, src->cap + MSI_CTRL, ctrl & ~MSI_CTRL_ENABLE);
+        irq_free_vector(vector);
+        break;
+    }
+    case MSI_KIND_INTX:
+        ioapic_free_irq(src->dev.irq, vector);
+        break;
+    }
+    kfree(src);
+}
@@ -0,0 +1,31 @@
+// kernel/msi.h
+// Message signalled interrupts for PCI devices
+// An MSI is just a memory write the device sends to the target CPU's LAPIC,
+// so there's no shared line and no IO APIC in the way: every interrupt gets
+// its own vector, and moving it to another CPU means rewriting one address.
+// MSI-X gives each table entry its own message (a NIC can have one per
+// queue, each on its own core).
+//
+// Created by: floof<3
+
+#ifndef MSI_H
+#define MSI_H
+
+#include <stdint.h>
+#include "pci.h"
+#include "irq.h"
+
+#define MSI_ADDRESS_BASE 0xFEE00000  // LAPIC window, destination APIC ID in bits 12-19
+
+// Give interrupt `index` of a device its own vector on `cpu` (SCHED_ANY_CPU
+// = least busy CPU) and enable it. Takes the best the device can do: entry
+// `index` of its MSI-X table, else its MSI capability, else its INTx line
+// through the IO APIC (those two only have index 0).
+// Returns the vector (irq_set_affinity() moves it), -1 on failure.
+int pci_alloc_irq(const pci_device_t* dev, uint32_t index, uint32_t cpu, const char* name,
+                  irq_handler_t handler, void* ctx);
+
+// Mask it at the device and give the vector back (not from interrupt context)
+void pci_free_irq(int vector);
+
+#endif // MSI_H
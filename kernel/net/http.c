@@ -4,10 +4,11 @@
 
 #include "http.h"
 #include "../heap.h"
+#include "../arena.h"
 #include <string.h>
 #include <stdio.h>
 
-int http_parse_url(const char* url, char** host, uint16_t* port, char** path) {
+int http_parse_url(const char* url, karena_t* arena, char** host, uint16_t* port, char** path) {
     // Parse URL: http://host:port/path
     const char* start = url;
 
@@ -29,11 +30,8 @@ int http_parse_url(const char* url, char** host, uint16_t* port, char** path) {
     }
 
     // Extract host
-    size_t host_len = host_end - start;
-    *host = kmalloc(host_len + 1);
+    *host = karena_strndup(arena, start, host_end - start);
     if (!*host) return -1;
-    memcpy(*host, start, host_len);
-    (*host)[host_len] = '\0';
 
     // Check for port
     if (*host_end == ':') {
@@ -51,13 +49,8 @@ int http_parse_url(const char* url, char** host, uint16_t* port, char** path) {
         path_start = "/";
     }
 
-    size_t path_len = strlen(path_start);
-    *path = kmalloc(path_len + 1);
-    if (!*path) {
-        kfree(*host);
-        return -1;
-    }
-    strcpy(*path, path_start);
+    *path = karena_strndup(arena, path_start, strlen(path_start));
+    if (!*path) return -1;
 
     return 0;
 }
@@ -67,7 +60,12 @@ int http_get(const char* url, http_response_t* response) {
     uint16_t port = 80;
     char* path = NULL;
 
-    if (http_parse_url(url, &host, &port, &path) != 0) {
+    // Everything temporary for this request lives in one arena, freed in one go
+    karena_t arena;
+    karena_init(&arena, 4096);  // URLs are small, one page is plenty
+
+    if (http_parse_url(url, &arena, &host, &port, &path) != 0) {
+        karena_fini(&arena);
         return -1;
     }
 
@@ -82,8 +80,7 @@ int http_get(const char* url, http_response_t* response) {
 
     FILE* fp = popen(cmd, "r");
     if (!fp) {
-        kfree(host);
-        kfree(path);
+        karena_fini(&arena);
         return -1;
     }
 
@@ -110,8 +107,7 @@ int http_get(const char* url, http_response_t* response) {
         unlink(temp_file);
     }
 
-    kfree(host);
-    kfree(path);
+    karena_fini(&arena);
 
     return response->status_code == 200 ? 0 : -1;
 }
@@ -121,7 +117,12 @@ int http_post(const char* url, const void* data, size_t len, http_response_t* re
     uint16_t port = 80;
     char* path = NULL;
 
-    if (http_parse_url(url, &host, &port, &path) != 0) {
+    // Everything temporary for this request lives in one arena, freed in one go
+    karena_t arena;
+    karena_init(&arena, 4096);  // URLs are small, one page is plenty
+
+    if (http_parse_url(url, &arena, &host, &port, &path) != 0) {
+        karena_fini(&arena);
         return -1;
     }
 
@@ -147,8 +148,7 @@ int http_post(const char* url, const void* data, size_t len, http_response_t* re
     FILE* fp = popen(cmd, "r");
     if (!fp) {
         unlink(temp_data);
-        kfree(host);
-        kfree(path);
+        karena_fini(&arena);
         return -1;
     }
 
@@ -176,8 +176,7 @@ int http_post(const char* url, const void* data, size_t len, http_response_t* re
 
     unlink(temp_data);
     unlink(temp_response);
-    kfree(host);
-    kfree(path);
+    karena_fini(&arena);
 
     return response->status_code == 200 ? 0 : -1;
 }
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "network.h"
+#include "../arena.h"
 
 // HTTP methods
 typedef enum {
@@ -44,7 +45,7 @@ int http_post(const char* url, const void* data, size_t len, http_response_t* re
 int http_download_file(const char* url, const char* output_path);
 
 // Utility functions
-int http_parse_url(const char* url, char** host, uint16_t* port, char** path);
+int http_parse_url(const char* url, karena_t* arena, char** host, uint16_t* port, char** path);
 void http_free_response(http_response_t* response);
 
 #endif // HTTP_H
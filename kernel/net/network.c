@@ -4,22 +4,35 @@
 
 #include "network.h"
 #include "../heap.h"
+#include "../memory.h"
+#include "../arena.h"
+#include "../rcu.h"
+#include "../spinlock.h"
 #include "../../drivers/serial.h"
 #include <string.h>
 
 // Network interfaces
+// Read on every packet, written when a NIC shows up: RCU, readers don't lock
 static netif_t* interfaces[4] = {0};
-static int interface_count = 0;
+static volatile int interface_count = 0;
+static spinlock_t netif_lock = SPINLOCK_INIT;  // Writers only
 
 // ARP cache
+// Entries are never changed in place: a new reply swaps in a new entry and
+// the old one is freed after a grace period, so a lookup never sees an IP
+// with half of a MAC
 #define ARP_CACHE_SIZE 128
 typedef struct {
+    rcu_head_t rcu;  // First, rcu_kfree frees it through this
     uint32_t ip;
     uint8_t mac[ETH_ADDR_LEN];
     uint64_t timestamp;
 } arp_entry_t;
 
-static arp_entry_t arp_cache[ARP_CACHE_SIZE];
+static arp_entry_t* arp_cache[ARP_CACHE_SIZE];
+static spinlock_t arp_lock = SPINLOCK_INIT;  // Writers only
+
+static void arp_cache_update(uint32_t ip, const uint8_t* mac);
 
 // TCP connections
 #define MAX_TCP_CONNECTIONS 64
@@ -54,17 +67,22 @@ void net_init(void) {
 // ============================================================================
 
 netif_t* netif_create(const char* name) {
-    if (interface_count >= 4) {
-        return NULL;
-    }
-
     netif_t* netif = kmalloc(sizeof(netif_t));
     if (!netif) return NULL;
 
     memset(netif, 0, sizeof(netif_t));
     strncpy(netif->name, name, sizeof(netif->name) - 1);
 
-    interfaces[interface_count++] = netif;
+    // Publish the pointer first, then the count that makes readers look at it
+    uint64_t flags = spin_lock_irqsave(&netif_lock);
+    if (interface_count >= 4) {
+        spin_unlock_irqrestore(&netif_lock, flags);
+        kfree(netif);
+        return NULL;
+    }
+    rcu_assign_pointer(interfaces[interface_count], netif);
+    __atomic_store_n(&interface_count, interface_count + 1, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&netif_lock, flags);
 
     serial_write("Network: Created interface ");
     serial_write(name);
@@ -83,6 +101,27 @@ void netif_set_addr(netif_t* netif, uint32_t ip, uint32_t netmask, uint32_t gate
     serial_write("\n");
 }
 
+netif_t* netif_route(uint32_t dst_ip) {
+    netif_t* fallback = NULL;
+    netif_t* found = NULL;
+
+    rcu_read_lock();
+    int count = __atomic_load_n(&interface_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        netif_t* netif = rcu_dereference(interfaces[i]);
+        if (!netif->is_up) continue;
+        if (((netif->ip_addr ^ dst_ip) & netif->netmask) == 0) {
+            found = netif;
+            break;
+        }
+        if (!fallback && netif->gateway) fallback = netif;
+    }
+    rcu_read_unlock();
+
+    // Interfaces are never removed, so the pointer stays good
+    return found ? found : fallback;
+}
+
 void netif_set_mac(netif_t* netif, const uint8_t* mac) {
     memcpy(netif->mac_addr, mac, ETH_ADDR_LEN);
 }
@@ -130,14 +169,7 @@ void net_rx_packet(netif_t* netif, const void* data, size_t len) {
                 uint16_t op = __builtin_bswap16(arp->operation);
 
                 if (op == ARP_OP_REPLY) {
-                    // Add to ARP cache
-                    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-                        if (arp_cache[i].ip == 0 || arp_cache[i].ip == arp->sender_ip) {
-                            arp_cache[i].ip = arp->sender_ip;
-                            memcpy(arp_cache[i].mac, arp->sender_mac, ETH_ADDR_LEN);
-                            break;
-                        }
-                    }
+                    arp_cache_update(arp->sender_ip, arp->sender_mac);
                 }
             }
             break;
@@ -178,6 +210,9 @@ uint16_t ip_checksum(const void* data, size_t len) {
 
 int ip_send_packet(netif_t* netif, uint32_t dst_ip, uint8_t protocol,
                    const void* payload, size_t payload_len) {
+    // No interface given: look one up for dst_ip
+    if (!netif && !(netif = netif_route(dst_ip))) return -1;
+
     // Resolve MAC address via ARP
     uint8_t dst_mac[ETH_ADDR_LEN];
     if (arp_resolve(netif, dst_ip, dst_mac) != 0) {
@@ -185,10 +220,14 @@ int ip_send_packet(netif_t* netif, uint32_t dst_ip, uint8_t protocol,
         return -1;  // Need to retry after ARP resolves
     }
 
-    // Build packet
+    // Build packet (in the per-CPU scratch arena, it's gone once it's sent)
     size_t total_len = sizeof(eth_header_t) + sizeof(ip_header_t) + payload_len;
-    uint8_t* packet = kmalloc(total_len);
-    if (!packet) return -1;
+    karena_mark_t mark = karena_scratch_begin();
+    uint8_t* packet = karena_alloc(karena_scratch(), total_len);
+    if (!packet) {
+        karena_scratch_end(mark);
+        return -1;
+    }
 
     // Ethernet header
     eth_header_t* eth = (eth_header_t*)packet;
@@ -215,7 +254,7 @@ int ip_send_packet(netif_t* netif, uint32_t dst_ip, uint8_t protocol,
 
     // Send packet
     int result = net_tx_packet(netif, packet, total_len);
-    kfree(packet);
+    karena_scratch_end(mark);
 
     return result;
 }
@@ -224,18 +263,48 @@ int ip_send_packet(netif_t* netif, uint32_t dst_ip, uint8_t protocol,
 // ARP Functions
 // ============================================================================
 
+// Add or replace the cache entry for ip (first free slot if it's new)
+static void arp_cache_update(uint32_t ip, const uint8_t* mac) {
+    arp_entry_t* entry = kmalloc(sizeof(arp_entry_t));
+    if (!entry) return;
+    entry->ip = ip;
+    memcpy(entry->mac, mac, ETH_ADDR_LEN);
+    entry->timestamp = 0;
+
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    int slot = -1;
+    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+        if (arp_cache[i] && arp_cache[i]->ip == ip) {
+            slot = i;
+            break;
+        }
+        if (!arp_cache[i] && slot < 0) slot = i;
+    }
+    arp_entry_t* old = slot >= 0 ? arp_cache[slot] : NULL;
+    if (slot >= 0) rcu_assign_pointer(arp_cache[slot], entry);
+    spin_unlock_irqrestore(&arp_lock, flags);
+
+    if (slot < 0) kfree(entry);  // Cache full
+    if (old) call_rcu(&old->rcu, rcu_kfree);
+}
+
 int arp_resolve(netif_t* netif, uint32_t ip, uint8_t* mac_out) {
     (void)netif;
+    int result = -1;  // Not found
 
     // Check cache
+    rcu_read_lock();
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].ip == ip) {
-            memcpy(mac_out, arp_cache[i].mac, ETH_ADDR_LEN);
-            return 0;
+        arp_entry_t* entry = rcu_dereference(arp_cache[i]);
+        if (entry && entry->ip == ip) {
+            memcpy(mac_out, entry->mac, ETH_ADDR_LEN);
+            result = 0;
+            break;
         }
     }
+    rcu_read_unlock();
 
-    return -1;  // Not found
+    return result;
 }
 
 void arp_send_request(netif_t* netif, uint32_t target_ip) {
@@ -345,8 +414,12 @@ void tcp_close(tcp_conn_t* conn) {
 int udp_send(netif_t* netif, uint32_t dst_ip, uint16_t dst_port,
              uint16_t src_port, const void* data, size_t len) {
     size_t packet_len = sizeof(udp_header_t) + len;
-    uint8_t* packet = kmalloc(packet_len);
-    if (!packet) return -1;
+    karena_mark_t mark = karena_scratch_begin();
+    uint8_t* packet = karena_alloc(karena_scratch(), packet_len);
+    if (!packet) {
+        karena_scratch_end(mark);
+        return -1;
+    }
 
     udp_header_t* udp = (udp_header_t*)packet;
     udp->src_port = __builtin_bswap16(src_port);
@@ -356,8 +429,9 @@ int udp_send(netif_t* netif, uint32_t dst_ip, uint16_t dst_port,
 
     memcpy(udp->data, data, len);
 
+    // ip_send_packet nests its own scratch mark on top of ours
     int result = ip_send_packet(netif, dst_ip, IP_PROTOCOL_UDP, packet, packet_len);
-    kfree(packet);
+    karena_scratch_end(mark);
 
     return result;
 }
@@ -402,30 +476,6 @@ int sprintf(char* str, const char* format, ...) {
     return 0;  // TODO: Implement
 }
 
-void* memmove(void* dest, const void* src, size_t n) {
-    char* d = dest;
-    const char* s = src;
-    if (d < s) {
-        for (size_t i = 0; i < n; i++) d[i] = s[i];
-    } else {
-        for (size_t i = n; i > 0; i--) d[i-1] = s[i-1];
-    }
-    return dest;
-}
-
-void* memset(void* s, int c, size_t n) {
-    unsigned char* p = s;
-    while (n--) *p++ = (unsigned char)c;
-    return s;
-}
-
-void* memcpy(void* dest, const void* src, size_t n) {
-    char* d = dest;
-    const char* s = src;
-    while (n--) *d++ = *s++;
-    return dest;
-}
-
 size_t strlen(const char* s) {
     size_t len = 0;
     while (s[len]) len++;
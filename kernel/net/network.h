@@ -158,6 +158,9 @@ void net_init(void);
 
 // Network interface management
 netif_t* netif_create(const char* name);
+// Interface to send to dst_ip on: the one whose subnet has it, else the
+// first one with a gateway (NULL if nothing's up). Lock-free, fine per packet.
+netif_t* netif_route(uint32_t dst_ip);
 void netif_set_addr(netif_t* netif, uint32_t ip, uint32_t netmask, uint32_t gateway);
 void netif_set_mac(netif_t* netif, const uint8_t* mac);
 void netif_up(netif_t* netif);
@@ -169,6 +172,7 @@ int net_tx_packet(netif_t* netif, const void* data, size_t len);
 
 // IP functions
 uint16_t ip_checksum(const void* data, size_t len);
+// netif NULL = whatever netif_route() picks for dst_ip (same for udp_send)
 int ip_send_packet(netif_t* netif, uint32_t dst_ip, uint8_t protocol,
                    const void* payload, size_t payload_len);
 
@@ -0,0 +1,92 @@
+// kernel/pci.c
+// PCI configuration space access
+// Selecting a register and reading it are two port accesses, so they go
+// under a lock (with interrupts off, handlers may poke config space too).
+//
+// Created by: floof<3
+
+#include "pci.h"
+#include "spinlock.h"
+#include "../drivers/serial.h"
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_BAR_IO        (1 << 0)
+#define PCI_BAR_TYPE_64   (2 << 1)
+#define PCI_BAR_TYPE_MASK (3 << 1)
+
+#define PCI_CAP_MAX 48  // Bail out of broken capability lists
+
+static spinlock_t pci_lock = SPINLOCK_INIT;
+
+static uint32_t pci_address(const pci_device_t* dev, uint8_t offset) {
+    return (1u << 31) | ((uint32_t)dev->bus << 16) | ((uint32_t)dev->slot << 11) |
+           ((uint32_t)dev->func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_config_read32(const pci_device_t* dev, uint8_t offset) {
+    uint64_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock_irqrestore(&pci_lock, flags);
+    return value;
+}
+
+uint16_t pci_config_read16(const pci_device_t* dev, uint8_t offset) {
+    return pci_config_read32(dev, offset) >> ((offset & 2) * 8);
+}
+
+uint8_t pci_config_read8(const pci_device_t* dev, uint8_t offset) {
+    return pci_config_read32(dev, offset) >> ((offset & 3) * 8);
+}
+
+void pci_config_write32(const pci_device_t* dev, uint8_t offset, uint32_t value) {
+    uint64_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    outl(PCI_CONFIG_DATA, value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+// Narrower writes go straight to their bytes of the data window: a
+// read-modify-write of the dword would write back whatever RW1C bits were
+// set next to them (STATUS sits right above COMMAND) and clear them
+void pci_config_write16(const pci_device_t* dev, uint8_t offset, uint16_t value) {
+    uint64_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    outw(PCI_CONFIG_DATA + (offset & 2), value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+void pci_config_write8(const pci_device_t* dev, uint8_t offset, uint8_t value) {
+    uint64_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    outb(PCI_CONFIG_DATA + (offset & 3), value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+uint64_t pci_read_bar(const pci_device_t* dev, int bar) {
+    if (bar < 0 || bar > 5) return 0;
+
+    uint8_t offset = PCI_BAR0 + bar * 4;
+    uint32_t low = pci_config_read32(dev, offset);
+    if (low & PCI_BAR_IO) return 0;
+
+    uint64_t addr = low & ~0xFu;
+    if ((low & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64 && bar < 5) {
+        addr |= (uint64_t)pci_config_read32(dev, offset + 4) << 32;
+    }
+    return addr;
+}
+
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t id) {
+    if (!(pci_config_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST)) return 0;
+
+    uint8_t cap = pci_config_read8(dev, PCI_CAP_POINTER) & 0xFC;
+    for (int i = 0; cap && i < PCI_CAP_MAX; i++) {
+        uint16_t header = pci_config_read16(dev, cap);
+        if ((header & 0xFF) == id) return cap;
+        cap = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+// kernel/pci.h
+// PCI configuration space (port 0xCF8/0xCFC, mechanism #1)
+// Just enough for drivers to find their BARs and capabilities and for
+// msi.c to set up message signalled interrupts. Bus enumeration is still
+// pci_scan()'s job.
+//
+// Created by: floof<3
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Config space offsets
+#define PCI_VENDOR_ID      0x00
+#define PCI_COMMAND        0x04
+#define PCI_STATUS         0x06
+#define PCI_BAR0           0x10
+#define PCI_CAP_POINTER    0x34
+#define PCI_INTERRUPT_LINE 0x3C
+
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAP_LIST      (1 << 4)
+
+// Capability IDs
+#define PCI_CAP_MSI   0x05
+#define PCI_CAP_MSIX  0x11
+
+typedef struct {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq;            // INTx line the firmware assigned (config 0x3C)
+} pci_device_t;
+
+uint32_t pci_config_read32(const pci_device_t* dev, uint8_t offset);
+uint16_t pci_config_read16(const pci_device_t* dev, uint8_t offset);
+uint8_t pci_config_read8(const pci_device_t* dev, uint8_t offset);
+void pci_config_write32(const pci_device_t* dev, uint8_t offset, uint32_t value);
+void pci_config_write16(const pci_device_t* dev, uint8_t offset, uint16_t value);
+void pci_config_write8(const pci_device_t* dev, uint8_t offset, uint8_t value);
+
+// Physical address behind BAR `bar` (both halves of a 64-bit BAR), 0 for
+// I/O port BARs
+uint64_t pci_read_bar(const pci_device_t* dev, int bar);
+
+// Config space offset of capability `id`, 0 if the device doesn't have it
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t id);
+
+#endif // PCI_H
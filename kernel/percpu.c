@@ -0,0 +1,20 @@
+// kernel/percpu.c
+// Per-CPU data blocks
+//
+// Created by: floof<3
+
+#include "percpu.h"
+#include "cpu.h"
+
+static percpu_t percpu_areas[MAX_CPUS];
+
+void percpu_init(uint32_t cpu) {
+    percpu_t* area = &percpu_areas[cpu];
+    area->self = area;
+    area->cpu_id = cpu;
+    cpu_wrmsr(CPU_MSR_GS_BASE, (uint64_t)area);
+}
+
+percpu_t* percpu_get(uint32_t cpu) {
+    return cpu < MAX_CPUS ? &percpu_areas[cpu] : NULL;
+}
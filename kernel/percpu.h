@@ -0,0 +1,55 @@
+// kernel/percpu.h
+// Per-CPU data helpers
+// Anything "per-CPU" is an array indexed by cpu_id(), so each core only
+// ever touches its own slot (no locks, no cache lines bouncing around).
+// Each CPU's GS base points at its percpu_t, so finding out who we are is
+// one GS-relative load.
+//
+// Created by: floof<3
+
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// i5-8250U / i7-8550U = 4 cores, 8 threads
+#define MAX_CPUS 8
+
+typedef struct percpu {
+    struct percpu* self;            // Plain pointer to this block (GS:0)
+    uint32_t cpu_id;                // 0 = BSP, APs numbered in boot order
+    uint32_t apic_id;               // Where IPIs for this CPU go
+    volatile uint32_t ipi_pending;  // SMP_IPI_* bits not handled yet
+    volatile bool online;           // Running and taking IPIs
+    uint32_t irq_depth;             // Interrupt handlers we're inside of
+    volatile uint32_t softirq_pending;  // Raised softirqs (bit per SOFTIRQ_*)
+    bool in_softirq;                // Running softirqs right now
+    bool in_kernel_fpu;             // Between kernel_fpu_begin() and kernel_fpu_end()
+    struct thread* fpu_owner;       // Whose FPU state is in the registers (NULL = nobody's)
+} __attribute__((aligned(64))) percpu_t;
+
+// Which CPU are we running on?
+// (volatile: a thread can move to another CPU between two calls)
+static inline uint32_t cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(percpu_t, cpu_id)));
+    return id;
+}
+
+// This CPU's block
+static inline percpu_t* this_cpu(void) {
+    percpu_t* self;
+    __asm__ volatile("movq %%gs:%c1, %0" : "=r"(self) : "i"(offsetof(percpu_t, self)));
+    return self;
+}
+
+// Point GS at CPU `cpu`'s block (first thing every CPU does, cpu_id()
+// doesn't work before this)
+void percpu_init(uint32_t cpu);
+
+// Some CPU's block, NULL if cpu is out of range
+percpu_t* percpu_get(uint32_t cpu);
+
+#endif // PERCPU_H
@@ -0,0 +1,45 @@
+// kernel/pit.c
+// PIT channel 2 one-shots
+// Channel 2's output can be read back on port 0x61, so we can poll for the
+// end of a countdown without an interrupt (channel 0's IRQ is useless to us
+// anyway, the LAPIC timer does the ticking).
+//
+// Created by: floof<3
+
+#include "pit.h"
+#include "cpu.h"
+#include "../drivers/serial.h"
+
+#define PIT_CH2_DATA 0x42
+#define PIT_COMMAND  0x43
+#define PIT_CH2_GATE 0x61  // Bit 0 = gate, bit 1 = speaker, bit 5 = output
+
+#define PIT_CHUNK_US 50000
+
+void pit_oneshot_start(uint16_t ticks) {
+    // Gate low and speaker off while we load the count
+    outb(PIT_CH2_GATE, inb(PIT_CH2_GATE) & ~0x03);
+    outb(PIT_COMMAND, 0xB0);  // Channel 2, lo/hi byte, mode 0 (output goes high at 0)
+    outb(PIT_CH2_DATA, ticks & 0xFF);
+    outb(PIT_CH2_DATA, ticks >> 8);
+
+    // Raising the gate starts the countdown
+    outb(PIT_CH2_GATE, inb(PIT_CH2_GATE) | 0x01);
+}
+
+bool pit_oneshot_done(void) {
+    return (inb(PIT_CH2_GATE) & 0x20) != 0;
+}
+
+void pit_delay_us(uint32_t us) {
+    while (us) {
+        uint32_t chunk = us > PIT_CHUNK_US ? PIT_CHUNK_US : us;
+        uint32_t ticks = (uint32_t)(((uint64_t)chunk * PIT_FREQUENCY + 999999) / 1000000);
+        if (!ticks) ticks = 1;
+
+        pit_oneshot_start(ticks);
+        while (!pit_oneshot_done()) cpu_pause();
+        us -= chunk;
+    }
+    outb(PIT_CH2_GATE, inb(PIT_CH2_GATE) & ~0x01);
+}
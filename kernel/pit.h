@@ -0,0 +1,24 @@
+// kernel/pit.h
+// 8254 PIT channel 2, the one fixed-frequency clock every PC has
+// Only used to measure other clocks and for short busy waits during bring-up.
+//
+// Created by: floof<3
+
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PIT_FREQUENCY 1193182  // Hz
+
+// Count `ticks` PIT ticks down on channel 2 (one-shot, at most 65535)
+void pit_oneshot_start(uint16_t ticks);
+
+// Has the count from pit_oneshot_start() run out?
+bool pit_oneshot_done(void);
+
+// Busy wait at least `us` microseconds (long waits are done in 50ms chunks)
+void pit_delay_us(uint32_t us);
+
+#endif // PIT_H
@@ -1,130 +1,985 @@
 // kernel/pmm.c
 // Physical Memory Manager Implementation
-// Manages physical RAM using a bitmap allocator
-// Each bit represents one 4KB page (0 = free, 1 = used)
+// Manages physical RAM with a binary buddy allocator
+// Free memory lives in blocks of 2^order pages, one free list per order.
+// Allocating splits a bigger block in half until it fits, freeing merges
+// a block with its buddy for as long as the buddy is free too.
+//
+// RAM is split into zones (DMA32 below 4GB, NORMAL above) built from the
+// firmware memory map. Holes and reserved regions never enter a free list,
+// so they cost nothing at allocation time.
+//
+// Single pages go through per-CPU hot/cold lists first. Each CPU only
+// touches its own lists (with interrupts off, no lock), and they refill
+// from / drain to the zone free lists in batches, so the zone lock is
+// taken once per PCP_BATCH pages instead of once per page. It's still the
+// one lock every CPU allocates through, so it's an MCS lock.
+//
+// There's also a pool of pages that were zeroed while the CPU was idle
+// (with non-temporal stores, so zeroing doesn't trash the cache), so
+// pmm_alloc_zeroed_page() usually doesn't have to memset anything.
 //
 // Created by: floof<3
 
 #include "pmm.h"
+#include "memory.h"
+#include "percpu.h"
+#include "spinlock.h"
 #include "../drivers/serial.h"
 
-// Bitmap to track page usage (one bit per page)
-static uint8_t* page_bitmap = NULL;
-static uint64_t total_pages = 0;
-static uint64_t used_pages = 0;
+// Per-page bookkeeping (one entry per physical page frame)
+// Free-list links are page frame numbers instead of pointers so the
+// entry stays small (12 bytes per 4KB page = 48MB for 16GB of RAM)
+typedef struct {
+    uint32_t next;   // Next block in the free list (PMM_NO_PAGE = end)
+    uint32_t prev;   // Previous block in the free list
+    uint8_t order;   // Order of the block this page heads
+    uint8_t flags;   // PAGE_FREE / PAGE_RESERVED / PAGE_PCP / PAGE_ZEROED
+    uint8_t owner;   // PMM_OWNER_* of an allocated block (set on every page of it)
+} page_t;
+
+#define PMM_NO_PAGE 0xFFFFFFFFu
+
+#define PAGE_FREE     (1 << 0)  // Page heads a block sitting in a free list
+#define PAGE_RESERVED (1 << 1)  // Never hand this out (BIOS, kernel, holes, PMM itself)
+#define PAGE_PCP      (1 << 2)  // Sitting in a per-CPU page list
+#define PAGE_ZEROED   (1 << 3)  // Sitting in the pre-zeroed pool
+
+// Free lists, one per order
+typedef struct {
+    uint32_t head;
+    uint64_t count;  // Number of blocks in this list
+} free_area_t;
+
+// A zone is just its own set of free lists plus counters
+typedef struct {
+    const char* name;
+    const char* lock_name;   // For lock_stats_dump()
+    mcs_lock_t lock;         // Protects the free lists and free_pages (every CPU refills from here)
+    lock_stats_t lock_stats;
+    free_area_t free_area[PMM_MAX_ORDER + 1];
+    uint64_t present_pages;  // Usable RAM pages in this zone
+    uint64_t free_pages;     // Pages in the buddy free lists (not the PCP lists)
+} zone_t;
+
+static zone_t zones[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA32]  = { .name = "DMA32", .lock_name = "pmm zone DMA32" },
+    [PMM_ZONE_NORMAL] = { .name = "Normal", .lock_name = "pmm zone Normal" },
+};
+
+static page_t* pages = NULL;
+static uint64_t max_pfn = 0;  // Page array covers pfn 0 .. max_pfn-1
+
+// Per-CPU page lists (one per zone per CPU)
+// Hot pages (just freed, probably still in cache) go on the head,
+// cold ones on the tail. Allocations take from the head, drains from the tail.
+#define PCP_BATCH 16  // Pages moved per refill/drain
+#define PCP_HIGH  64  // Drain once a list grows past this
+
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t count;
+} pcp_list_t;
+
+static pcp_list_t pcp_lists[MAX_CPUS][PMM_ZONE_COUNT];
+
+// Pre-zeroed page pools (one per zone, singly linked through page_t.next)
+#define ZERO_IDLE_BATCH 8  // Pages zeroed per pmm_zero_idle_work() call
+
+typedef struct {
+    spinlock_t lock;
+    uint32_t head;
+    uint32_t count;
+    uint32_t target;  // Stop zeroing once the pool is this big
+} zero_pool_t;
+
+static zero_pool_t zero_pools[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA32]  = { .head = PMM_NO_PAGE, .target = 64 },   // 256KB for device rings
+    [PMM_ZONE_NORMAL] = { .head = PMM_NO_PAGE, .target = 256 },  // 1MB for everything else
+};
+
+static pmm_zero_stats_t zero_stats;
+
+// Usable RAM ranges collected from the memory map before the PMM is set up
+#define PMM_MAX_REGIONS 64
+typedef struct {
+    uint64_t start;  // Physical address (inclusive)
+    uint64_t end;    // Physical address (exclusive)
+} pmm_region_t;
+
+static pmm_region_t regions[PMM_MAX_REGIONS];
+static int region_count = 0;
+
+// The same list before pmm_setup carves the kernel out of it: everything
+// that is RAM, for the identity map to tell it from MMIO holes
+static pmm_region_t ram_regions[PMM_MAX_REGIONS];
+static int ram_region_count = 0;
 
 // Kernel end address (defined in linker script)
 extern uint64_t _kernel_end;
 
-// Set a bit in the bitmap (mark page as used)
-static void bitmap_set(uint64_t page) {
-    uint64_t byte = page / 8;
-    uint64_t bit = page % 8;
-    page_bitmap[byte] |= (1 << bit);
+// Multiboot 1 info structure (only the bits we care about)
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;    // KB below 1MB
+    uint32_t mem_upper;    // KB above 1MB
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;  // Total size of the mmap buffer in bytes
+    uint32_t mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct {
+    uint32_t size;         // Size of the rest of this entry (doesn't count itself)
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+#define MULTIBOOT_INFO_MEMORY (1 << 0)
+#define MULTIBOOT_INFO_MMAP   (1 << 6)
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// UEFI memory types that are plain RAM once boot services are gone
+// (LoaderCode/LoaderData stay reserved - that's our kernel and the map itself)
+#define EFI_BOOT_SERVICES_CODE  3
+#define EFI_BOOT_SERVICES_DATA  4
+#define EFI_CONVENTIONAL_MEMORY 7
+
+static inline pmm_zone_t pfn_zone(uint64_t pfn) {
+    return pfn < PMM_DMA32_LIMIT / PAGE_SIZE ? PMM_ZONE_DMA32 : PMM_ZONE_NORMAL;
 }
 
-// Clear a bit in the bitmap (mark page as free)
-static void bitmap_clear(uint64_t page) {
-    uint64_t byte = page / 8;
-    uint64_t bit = page % 8;
-    page_bitmap[byte] &= ~(1 << bit);
+// Push a block onto the front of its free list
+static void free_list_push(zone_t* zone, uint64_t pfn, uint32_t order) {
+    page_t* page = &pages[pfn];
+    page->order = order;
+    page->flags = PAGE_FREE;
+    page->prev = PMM_NO_PAGE;
+    page->next = zone->free_area[order].head;
+
+    if (page->next != PMM_NO_PAGE) {
+        pages[page->next].prev = pfn;
+    }
+    zone->free_area[order].head = pfn;
+    zone->free_area[order].count++;
 }
 
-// Test if a bit is set (check if page is used)
-static bool bitmap_test(uint64_t page) {
-    uint64_t byte = page / 8;
-    uint64_t bit = page % 8;
-    return (page_bitmap[byte] & (1 << bit)) != 0;
+// Unlink a block from the middle of its free list (O(1) thanks to prev links)
+static void free_list_remove(zone_t* zone, uint64_t pfn, uint32_t order) {
+    page_t* page = &pages[pfn];
+
+    if (page->prev != PMM_NO_PAGE) {
+        pages[page->prev].next = page->next;
+    } else {
+        zone->free_area[order].head = page->next;
+    }
+    if (page->next != PMM_NO_PAGE) {
+        pages[page->next].prev = page->prev;
+    }
+
+    page->flags &= ~PAGE_FREE;
+    zone->free_area[order].count--;
 }
 
-// Initialize the physical memory manager
-void pmm_init(uint64_t total_memory) {
-    serial_write("PMM: Initializing physical memory manager...\n");
-    
-    // Calculate how many pages we have
-    total_pages = total_memory / PAGE_SIZE;
-    
-    // Calculate bitmap size (one bit per page, so divide by 8 to get bytes)
-    uint64_t bitmap_size = total_pages / 8;
-    if (total_pages % 8) bitmap_size++;  // Round up if not exact multiple
-    
-    // Place bitmap right after the kernel in memory
-    // This is a bit sketchy but works for now (we'll improve this later)
-    page_bitmap = (uint8_t*)&_kernel_end;
-    
-    // Clear the entire bitmap (mark all pages as free initially)
-    for (uint64_t i = 0; i < bitmap_size; i++) {
-        page_bitmap[i] = 0;
-    }
-    
-    // Mark pages used by the kernel and bitmap as occupied
-    uint64_t kernel_pages = ((uint64_t)&_kernel_end) / PAGE_SIZE;
-    uint64_t bitmap_pages = bitmap_size / PAGE_SIZE;
-    if (bitmap_size % PAGE_SIZE) bitmap_pages++;
-    
-    for (uint64_t i = 0; i < kernel_pages + bitmap_pages; i++) {
-        bitmap_set(i);
-        used_pages++;
-    }
-    
-    // Mark first 1MB as used (BIOS data, VGA memory, etc.)
-    // Never allocate from here or shit will break
-    for (uint64_t i = 0; i < (0x100000 / PAGE_SIZE); i++) {
-        bitmap_set(i);
-    }
-    
+// Hand the page range [start, end) to the free lists as big aligned blocks
+// Walks from the top down so the range's lowest addresses end up at the
+// head of each list (across ranges the last one added wins, so nothing may
+// count on low memory coming first: pmm_alloc_zeroed_page_below() is for that)
+// The range must not cross a zone boundary (4GB is aligned way past
+// PMM_MAX_ORDER, so blocks never straddle zones)
+static void free_range(uint64_t start, uint64_t end) {
+    zone_t* zone = &zones[pfn_zone(start)];
+
+    while (end > start) {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0 &&
+               ((end & ((1ULL << order) - 1)) || end - (1ULL << order) < start)) {
+            order--;
+        }
+
+        end -= 1ULL << order;
+        free_list_push(zone, end, order);
+        zone->free_pages += 1ULL << order;
+    }
+}
+
+// Add a usable RAM range, keeping the list sorted and merged
+static void region_add(uint64_t start, uint64_t end) {
+    // We only deal in whole pages
+    start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    end &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (end <= start) return;
+
+    if (region_count == PMM_MAX_REGIONS) {
+        serial_write("PMM: WARNING - Too many memory regions, ignoring the rest\n");
+        return;
+    }
+
+    // Insertion sort (firmware maps are small and usually sorted anyway)
+    int i = region_count++;
+    while (i > 0 && regions[i - 1].start > start) {
+        regions[i] = regions[i - 1];
+        i--;
+    }
+    regions[i].start = start;
+    regions[i].end = end;
+
+    // Merge anything that now overlaps or touches
+    int out = 0;
+    for (int j = 1; j < region_count; j++) {
+        if (regions[j].start <= regions[out].end) {
+            if (regions[j].end > regions[out].end) regions[out].end = regions[j].end;
+        } else {
+            regions[++out] = regions[j];
+        }
+    }
+    region_count = out + 1;
+}
+
+// Find room for the page array: first usable spot that is still inside
+// the boot identity map (the kernel is already carved out of the regions)
+static uint64_t find_page_array_home(uint64_t size) {
+    for (int i = 0; i < region_count; i++) {
+        uint64_t start = regions[i].start;
+        if (regions[i].end - start >= size &&
+            start + size <= PMM_BOOT_MAPPED_END) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+// Free the part of [start, end) that isn't covered by [hole_start, hole_end)
+// and split it at the 4GB zone boundary
+static void free_region_except(uint64_t start, uint64_t end,
+                               uint64_t hole_start, uint64_t hole_end) {
+    if (hole_start < end && hole_end > start) {
+        free_region_except(start, hole_start, 0, 0);
+        free_region_except(hole_end, end, 0, 0);
+        return;
+    }
+    if (end <= start) return;
+
+    uint64_t split = PMM_DMA32_LIMIT / PAGE_SIZE;
+    if (start < split && end > split) {
+        free_range(start, split);
+        free_range(split, end);
+    } else {
+        free_range(start, end);
+    }
+}
+
+// Build zones and free lists from the collected regions
+static void pmm_setup(void) {
+    if (region_count == 0) {
+        serial_write("PMM: ERROR - No usable memory found!\n");
+        return;
+    }
+
+    for (int i = 0; i < region_count; i++) ram_regions[i] = regions[i];
+    ram_region_count = region_count;
+
+    // Never hand out the first 1MB (BIOS data, VGA memory, etc.) or the kernel
+    // Carving them out of the regions keeps the free path simple
+    uint64_t kernel_end = ((uint64_t)&_kernel_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    for (int i = 0; i < region_count; i++) {
+        if (regions[i].start < kernel_end) {
+            // Fully swallowed regions just end up empty
+            regions[i].start = regions[i].end < kernel_end ? regions[i].end : kernel_end;
+        }
+    }
+
+    max_pfn = regions[region_count - 1].end / PAGE_SIZE;
+    if (max_pfn > PMM_NO_PAGE) max_pfn = PMM_NO_PAGE;  // 16TB ought to be enough
+
+    uint64_t array_size = (max_pfn * sizeof(page_t) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t array_start = find_page_array_home(array_size);
+    if (!array_start) {
+        serial_write("PMM: ERROR - No room for the page array!\n");
+        return;
+    }
+    pages = (page_t*)array_start;
+
+    // Everything starts reserved, then the usable regions go to the free lists
+    // Holes between regions stay reserved forever
+    for (uint64_t i = 0; i < max_pfn; i++) {
+        pages[i].next = PMM_NO_PAGE;
+        pages[i].prev = PMM_NO_PAGE;
+        pages[i].order = 0;
+        pages[i].flags = PAGE_RESERVED;
+        pages[i].owner = PMM_OWNER_NONE;  // Whatever was in this RAM before isn't a tag
+    }
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            zones[z].free_area[order].head = PMM_NO_PAGE;
+            zones[z].free_area[order].count = 0;
+        }
+        zones[z].present_pages = 0;
+        zones[z].free_pages = 0;
+        mcs_lock_stats(&zones[z].lock, &zones[z].lock_stats, zones[z].lock_name);
+
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            pcp_lists[cpu][z].head = PMM_NO_PAGE;
+            pcp_lists[cpu][z].tail = PMM_NO_PAGE;
+            pcp_lists[cpu][z].count = 0;
+        }
+    }
+
+    uint64_t array_first = array_start / PAGE_SIZE;
+    uint64_t array_last = (array_start + array_size) / PAGE_SIZE;
+
+    for (int i = 0; i < region_count; i++) {
+        uint64_t start = regions[i].start / PAGE_SIZE;
+        uint64_t end = regions[i].end / PAGE_SIZE;
+        if (end > max_pfn) end = max_pfn;
+
+        for (uint64_t pfn = start; pfn < end; pfn++) {
+            pages[pfn].flags = 0;
+            zones[pfn_zone(pfn)].present_pages++;
+        }
+        free_region_except(start, end, array_first, array_last);
+    }
+
+    // The page array itself counts as present but used
+    for (uint64_t pfn = array_first; pfn < array_last; pfn++) {
+        pages[pfn].flags = PAGE_RESERVED;
+    }
+
     serial_write("PMM: Initialization complete\n");
-    serial_write("PMM: Total pages: ");
-    // TODO: Add number printing function
-    serial_write("\n");
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        serial_write("PMM: Zone ");
+        serial_write(zones[z].name);
+        serial_write(": ");
+        serial_write_dec(zones[z].present_pages);
+        serial_write(" pages, ");
+        serial_write_dec(zones[z].free_pages);
+        serial_write(" free\n");
+    }
 }
 
-// Allocate a physical page
-void* pmm_alloc_page(void) {
-    // Search through bitmap for a free page
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            // Found a free page!
-            bitmap_set(i);
-            used_pages++;
-            
-            // Return physical address of the page
-            return (void*)(i * PAGE_SIZE);
-        }
-    }
-    
+// Initialize from the multiboot memory map
+void pmm_init_multiboot(void* multiboot_info) {
+    serial_write("PMM: Initializing buddy allocator from multiboot map...\n");
+
+    multiboot_info_t* info = (multiboot_info_t*)multiboot_info;
+    region_count = 0;
+
+    if (info && (info->flags & MULTIBOOT_INFO_MMAP)) {
+        uint64_t addr = info->mmap_addr;
+        uint64_t end = addr + info->mmap_length;
+
+        // Entries are variable sized, `size` doesn't count the size field itself
+        while (addr < end) {
+            multiboot_mmap_entry_t* entry = (multiboot_mmap_entry_t*)addr;
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+                region_add(entry->base, entry->base + entry->length);
+            }
+            addr += entry->size + sizeof(entry->size);
+        }
+    } else if (info && (info->flags & MULTIBOOT_INFO_MEMORY)) {
+        // No map, just "this much RAM above 1MB" (holes and all, fingers crossed)
+        region_add(0x100000, 0x100000 + (uint64_t)info->mem_upper * 1024);
+    }
+
+    pmm_setup();
+}
+
+// Initialize from the UEFI memory map
+void pmm_init_efi(const void* map, uint64_t map_size, uint64_t desc_size) {
+    serial_write("PMM: Initializing buddy allocator from UEFI map...\n");
+
+    region_count = 0;
+
+    for (uint64_t offset = 0; offset + desc_size <= map_size; offset += desc_size) {
+        const EFI_MEMORY_DESCRIPTOR* desc = (const EFI_MEMORY_DESCRIPTOR*)((const uint8_t*)map + offset);
+
+        switch (desc->Type) {
+            case EFI_BOOT_SERVICES_CODE:
+            case EFI_BOOT_SERVICES_DATA:
+            case EFI_CONVENTIONAL_MEMORY:
+                region_add(desc->PhysicalStart,
+                           desc->PhysicalStart + desc->NumberOfPages * PAGE_SIZE);
+                break;
+        }
+    }
+
+    pmm_setup();
+}
+
+// Initialize as one flat range (first 1MB is skipped in pmm_setup)
+void pmm_init(uint64_t total_memory) {
+    serial_write("PMM: Initializing buddy allocator...\n");
+
+    region_count = 0;
+    region_add(0x100000, total_memory);
+    pmm_setup();
+}
+
+// Take a block of exactly `order` out of one zone (zone lock held)
+static uint64_t zone_alloc(zone_t* zone, uint32_t order) {
+    // Find the smallest free block that is at least as big as we need
+    uint32_t current = order;
+    while (current <= PMM_MAX_ORDER && zone->free_area[current].head == PMM_NO_PAGE) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) return PMM_NO_PAGE;
+
+    uint64_t pfn = zone->free_area[current].head;
+    free_list_remove(zone, pfn, current);
+
+    // Split it in half until it's the right size, the upper halves go
+    // back on the free lists one order down
+    while (current > order) {
+        current--;
+        free_list_push(zone, pfn + (1ULL << current), current);
+    }
+
+    pages[pfn].order = order;
+    zone->free_pages -= 1ULL << order;
+    return pfn;
+}
+
+// Give a block back to its zone and merge it with its buddies (zone lock held)
+static void zone_free(zone_t* zone, uint64_t pfn, uint32_t order) {
+    zone->free_pages += 1ULL << order;
+
+    // Merge upwards while our buddy is a free block of the same order
+    // (reserved pages and holes are never PAGE_FREE, so we stop at them)
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (buddy >= max_pfn) break;
+        if (!(pages[buddy].flags & PAGE_FREE) || pages[buddy].order != order) break;
+
+        free_list_remove(zone, buddy, order);
+        pfn &= ~(1ULL << order);  // Merged block starts at the lower buddy
+        order++;
+    }
+
+    free_list_push(zone, pfn, order);
+}
+
+// Per-CPU list helpers (interrupts off, only ever our own CPU's lists)
+
+static void pcp_push_head(pcp_list_t* list, uint64_t pfn) {
+    pages[pfn].flags = PAGE_PCP;
+    pages[pfn].order = 0;
+    pages[pfn].prev = PMM_NO_PAGE;
+    pages[pfn].next = list->head;
+    if (list->head != PMM_NO_PAGE) pages[list->head].prev = pfn;
+    else list->tail = pfn;
+    list->head = pfn;
+    list->count++;
+}
+
+static void pcp_push_tail(pcp_list_t* list, uint64_t pfn) {
+    pages[pfn].flags = PAGE_PCP;
+    pages[pfn].order = 0;
+    pages[pfn].next = PMM_NO_PAGE;
+    pages[pfn].prev = list->tail;
+    if (list->tail != PMM_NO_PAGE) pages[list->tail].next = pfn;
+    else list->head = pfn;
+    list->tail = pfn;
+    list->count++;
+}
+
+static uint64_t pcp_pop_head(pcp_list_t* list) {
+    uint64_t pfn = list->head;
+    list->head = pages[pfn].next;
+    if (list->head != PMM_NO_PAGE) pages[list->head].prev = PMM_NO_PAGE;
+    else list->tail = PMM_NO_PAGE;
+    list->count--;
+    pages[pfn].flags = 0;
+    return pfn;
+}
+
+static uint64_t pcp_pop_tail(pcp_list_t* list) {
+    uint64_t pfn = list->tail;
+    list->tail = pages[pfn].prev;
+    if (list->tail != PMM_NO_PAGE) pages[list->tail].next = PMM_NO_PAGE;
+    else list->head = PMM_NO_PAGE;
+    list->count--;
+    pages[pfn].flags = 0;
+    return pfn;
+}
+
+// Grab a batch of single pages from the zone in one lock round trip
+static void pcp_refill(pcp_list_t* list, zone_t* zone) {
+    mcs_node_t node;
+    mcs_lock(&zone->lock, &node);
+    for (int i = 0; i < PCP_BATCH; i++) {
+        uint64_t pfn = zone_alloc(zone, 0);
+        if (pfn == PMM_NO_PAGE) break;
+        pcp_push_tail(list, pfn);
+    }
+    mcs_unlock(&zone->lock, &node);
+}
+
+// Send the coldest `count` pages back to the zone
+static void pcp_drain(pcp_list_t* list, zone_t* zone, uint32_t count) {
+    mcs_node_t node;
+    mcs_lock(&zone->lock, &node);
+    while (count-- && list->count) {
+        zone_free(zone, pcp_pop_tail(list), 0);
+    }
+    mcs_unlock(&zone->lock, &node);
+}
+
+// Empty this CPU's lists back into the zones (lets their pages merge
+// into bigger blocks again when a high-order allocation is struggling)
+static void pcp_drain_local(void) {
+    uint64_t flags = cpu_irq_save();
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        pcp_list_t* list = &pcp_lists[cpu_id()][z];
+        pcp_drain(list, &zones[z], list->count);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Single page fast path: our own list, no lock
+static void* pcp_alloc(pmm_zone_t zone) {
+    uint64_t flags = cpu_irq_save();
+    uint64_t pfn = PMM_NO_PAGE;
+
+    for (int z = zone; z >= 0 && pfn == PMM_NO_PAGE; z--) {
+        pcp_list_t* list = &pcp_lists[cpu_id()][z];
+        if (!list->count) pcp_refill(list, &zones[z]);
+        if (list->count) pfn = pcp_pop_head(list);
+    }
+
+    cpu_irq_restore(flags);
+    return pfn == PMM_NO_PAGE ? NULL : (void*)(pfn * PAGE_SIZE);
+}
+
+static void pcp_free(uint64_t pfn, bool cold) {
+    uint64_t flags = cpu_irq_save();
+    pmm_zone_t zone = pfn_zone(pfn);
+    pcp_list_t* list = &pcp_lists[cpu_id()][zone];
+
+    if (cold) pcp_push_tail(list, pfn);
+    else pcp_push_head(list, pfn);
+
+    if (list->count > PCP_HIGH) {
+        pcp_drain(list, &zones[zone], PCP_BATCH);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Zero a page with normal stores (for pages the caller is about to use,
+// leaving them in the cache is exactly what we want)
+static void page_zero(void* page) {
+    void* dst = page;
+    uint64_t count = PAGE_SIZE / 8;
+    __asm__ volatile("rep stosq" : "+D"(dst), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+// Zero a page with non-temporal stores (bypass the cache, nobody is going
+// to read this page any time soon). Caller must sfence before publishing.
+static void page_zero_nt(void* page) {
+    uint64_t* p = (uint64_t*)page;
+    for (uint64_t* end = p + PAGE_SIZE / 8; p < end; p += 4) {
+        __asm__ volatile("movnti %1, 0(%0)\n\t"
+                         "movnti %1, 8(%0)\n\t"
+                         "movnti %1, 16(%0)\n\t"
+                         "movnti %1, 24(%0)"
+                         : : "r"(p), "r"(0ULL) : "memory");
+    }
+}
+
+// Take a page out of a zero pool (PMM_NO_PAGE if it's empty)
+static uint64_t zero_pool_pop(zero_pool_t* pool) {
+    uint64_t flags = spin_lock_irqsave(&pool->lock);
+    uint64_t pfn = pool->head;
+    if (pfn != PMM_NO_PAGE) {
+        pool->head = pages[pfn].next;
+        pool->count--;
+        pages[pfn].flags = 0;
+        pages[pfn].order = 0;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return pfn;
+}
+
+// Allocate 2^order contiguous pages, highest allowed zone first
+void* pmm_alloc_pages_zone(pmm_zone_t zone, uint32_t order) {
+    if (order > PMM_MAX_ORDER || zone >= PMM_ZONE_COUNT) return NULL;
+
+    if (order == 0) {
+        void* page = pcp_alloc(zone);
+        if (page) return page;
+
+        // Last resort: the zero pool is free memory too
+        for (int z = zone; z >= 0; z--) {
+            uint64_t pfn = zero_pool_pop(&zero_pools[z]);
+            if (pfn != PMM_NO_PAGE) return (void*)(pfn * PAGE_SIZE);
+        }
+    } else {
+        for (int attempt = 0; attempt < 2; attempt++) {
+            for (int z = zone; z >= 0; z--) {
+                mcs_node_t node;
+                uint64_t flags = mcs_lock_irqsave(&zones[z].lock, &node);
+                uint64_t pfn = zone_alloc(&zones[z], order);
+                mcs_unlock_irqrestore(&zones[z].lock, &node, flags);
+
+                if (pfn != PMM_NO_PAGE) return (void*)(pfn * PAGE_SIZE);
+            }
+
+            // Single pages parked in our PCP lists might be exactly the
+            // buddies we're missing, give them back and try once more
+            pcp_drain_local();
+        }
+    }
+
     // Out of memory (this is bad news)
     serial_write("PMM: ERROR - Out of memory!\n");
     return NULL;
 }
 
-// Free a physical page
-void pmm_free_page(void* page) {
-    // Calculate page number from physical address
-    uint64_t page_num = (uint64_t)page / PAGE_SIZE;
-    
+// Allocate 2^order contiguous pages from anywhere
+void* pmm_alloc_pages(uint32_t order) {
+    return pmm_alloc_pages_zone(PMM_ZONE_NORMAL, order);
+}
+
+// Check that a block really is ours to free
+static bool pmm_check_free(uint64_t pfn, uint32_t order) {
+    if (order > PMM_MAX_ORDER || pfn >= max_pfn || (pfn & ((1ULL << order) - 1))) {
+        serial_write("PMM: WARNING - Attempted to free invalid block\n");
+        return false;
+    }
+
     // Make sure it's actually allocated before freeing
-    if (!bitmap_test(page_num)) {
+    if (pages[pfn].flags & (PAGE_FREE | PAGE_RESERVED | PAGE_PCP | PAGE_ZEROED)) {
         serial_write("PMM: WARNING - Attempted to free already-free page\n");
+        return false;
+    }
+    return true;
+}
+
+// Forget who owned a block that's going back, or a later user of any of
+// its pages would look like it still belongs to the slab/heap/uvm. Free
+// blocks are always untagged, so merged and split blocks stay that way.
+static void pmm_clear_owner(uint64_t pfn, uint32_t order) {
+    for (uint64_t i = 0; i < (1ULL << order); i++) {
+        pages[pfn + i].owner = PMM_OWNER_NONE;
+    }
+}
+
+// Free a block and merge it with its buddies
+void pmm_free_pages(void* addr, uint32_t order) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (!pmm_check_free(pfn, order)) return;
+    pmm_clear_owner(pfn, order);
+
+    if (order == 0) {
+        pcp_free(pfn, false);
         return;
     }
-    
-    // Mark as free
-    bitmap_clear(page_num);
-    used_pages--;
+
+    zone_t* zone = &zones[pfn_zone(pfn)];
+    mcs_node_t node;
+    uint64_t flags = mcs_lock_irqsave(&zone->lock, &node);
+    zone_free(zone, pfn, order);
+    mcs_unlock_irqrestore(&zone->lock, &node, flags);
+}
+
+// Free an arbitrary page range as the biggest aligned buddy blocks that fit
+static void free_pages_range(uint64_t pfn, uint64_t end) {
+    while (pfn < end) {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER && !(pfn & (1ULL << order)) &&
+               pfn + (2ULL << order) <= end) {
+            order++;
+        }
+        pmm_free_pages((void*)(pfn * PAGE_SIZE), order);
+        pfn += 1ULL << order;
+    }
 }
 
-// Get total number of pages
+// Allocate exactly `count` contiguous pages: grab the next power of two
+// and hand the unused tail straight back
+void* pmm_alloc_pages_exact(uint64_t count) {
+    if (!count) return NULL;
+
+    uint32_t order = 0;
+    while ((1ULL << order) < count) order++;
+    if (order > PMM_MAX_ORDER) return NULL;
+
+    void* block = pmm_alloc_pages(order);
+    if (!block) return NULL;
+
+    uint64_t pfn = (uint64_t)block / PAGE_SIZE;
+    free_pages_range(pfn + count, pfn + (1ULL << order));
+    return block;
+}
+
+// Free pages from pmm_alloc_pages_exact
+void pmm_free_pages_exact(void* addr, uint64_t count) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    free_pages_range(pfn, pfn + count);
+}
+
+// Free a page we know isn't in the cache (e.g. a device just DMA'd into it)
+void pmm_free_page_cold(void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (!pmm_check_free(pfn, 0)) return;
+    pmm_clear_owner(pfn, 0);
+
+    pcp_free(pfn, true);
+}
+
+// Tag an allocated block with its owner (every page, so interior pointers work too)
+void pmm_set_owner(void* addr, uint32_t order, uint8_t owner) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (order > PMM_MAX_ORDER || pfn + (1ULL << order) > max_pfn) return;
+
+    for (uint64_t i = 0; i < (1ULL << order); i++) {
+        pages[pfn + i].owner = owner;
+        pages[pfn + i].order = order;
+    }
+}
+
+// Who owns the block containing addr (and how big that block is)
+uint8_t pmm_get_owner(const void* addr, uint32_t* order) {
+    uint64_t pfn = (uint64_t)addr / PAGE_SIZE;
+    if (pfn >= max_pfn || !pages[pfn].owner) return PMM_OWNER_NONE;
+
+    if (order) *order = pages[pfn].order;
+    return pages[pfn].owner;
+}
+
+// Start refcounting a freshly allocated page (count = 1)
+// An allocated page isn't on any free list, so its `next` link holds the count
+void pmm_page_ref_init(void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (pfn >= max_pfn) return;
+
+    pages[pfn].owner = PMM_OWNER_USER;
+    pages[pfn].order = 0;
+    __atomic_store_n(&pages[pfn].next, 1, __ATOMIC_RELEASE);
+}
+
+// One more mapping of a refcounted page
+void pmm_page_ref(void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (pfn >= max_pfn || pages[pfn].owner != PMM_OWNER_USER) return;
+    __atomic_fetch_add(&pages[pfn].next, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference, the page is freed when the last one goes
+uint32_t pmm_page_unref(void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (pfn >= max_pfn || pages[pfn].owner != PMM_OWNER_USER) return 0;
+
+    uint32_t count = __atomic_sub_fetch(&pages[pfn].next, 1, __ATOMIC_ACQ_REL);
+    if (!count) pmm_free_page(page);
+    return count;
+}
+
+uint32_t pmm_page_refcount(const void* page) {
+    uint64_t pfn = (uint64_t)page / PAGE_SIZE;
+    if (pfn >= max_pfn || pages[pfn].owner != PMM_OWNER_USER) return 0;
+    return __atomic_load_n(&pages[pfn].next, __ATOMIC_ACQUIRE);
+}
+
+// Fill the zero pools a few pages at a time (call this from the idle loop)
+// Returns true if it did some work, false once every pool is full
+bool pmm_zero_idle_work(void) {
+    for (int z = PMM_ZONE_COUNT - 1; z >= 0; z--) {
+        zero_pool_t* pool = &zero_pools[z];
+        if (pool->count >= pool->target || !zones[z].free_pages) continue;
+
+        // Pull cold pages straight from the buddy lists (the PCP lists are
+        // for hot pages, no point zeroing those behind the cache's back)
+        uint64_t batch[ZERO_IDLE_BATCH];
+        int n = 0;
+
+        mcs_node_t node;
+        uint64_t flags = mcs_lock_irqsave(&zones[z].lock, &node);
+        while (n < ZERO_IDLE_BATCH && pool->count + n < pool->target) {
+            uint64_t pfn = zone_alloc(&zones[z], 0);
+            if (pfn == PMM_NO_PAGE) break;
+            batch[n++] = pfn;
+        }
+        mcs_unlock_irqrestore(&zones[z].lock, &node, flags);
+
+        if (!n) continue;
+
+        // Zero with interrupts on, this is the slow part
+        for (int i = 0; i < n; i++) {
+            page_zero_nt((void*)(batch[i] * PAGE_SIZE));
+        }
+        __asm__ volatile("sfence" : : : "memory");  // NT stores must land before anyone sees the pages
+
+        flags = spin_lock_irqsave(&pool->lock);
+        for (int i = 0; i < n; i++) {
+            pages[batch[i]].flags = PAGE_ZEROED;
+            pages[batch[i]].next = pool->head;
+            pool->head = batch[i];
+        }
+        pool->count += n;
+        zero_stats.idle_zeroed += n;
+        spin_unlock_irqrestore(&pool->lock, flags);
+        return true;
+    }
+    return false;
+}
+
+// Allocate a zeroed page from `zone` or below
+void* pmm_alloc_zeroed_page_zone(pmm_zone_t zone) {
+    if (zone >= PMM_ZONE_COUNT) return NULL;
+
+    for (int z = zone; z >= 0; z--) {
+        uint64_t pfn = zero_pool_pop(&zero_pools[z]);
+        if (pfn != PMM_NO_PAGE) {
+            __atomic_fetch_add(&zero_stats.hits, 1, __ATOMIC_RELAXED);
+            return (void*)(pfn * PAGE_SIZE);
+        }
+    }
+
+    // Pool is dry, zero it ourselves
+    __atomic_fetch_add(&zero_stats.misses, 1, __ATOMIC_RELAXED);
+    void* page = pmm_alloc_pages_zone(zone, 0);
+    if (page) page_zero(page);
+    return page;
+}
+
+// Allocate a zeroed page from anywhere
+void* pmm_alloc_zeroed_page(void) {
+    return pmm_alloc_zeroed_page_zone(PMM_ZONE_NORMAL);
+}
+
+// First free block starting below `limit_pfn`, smallest orders first, split
+// down to one page like zone_alloc() does (zone lock held). A linear walk,
+// but it's only for the handful of tables vmm_init() builds.
+static uint64_t zone_alloc_below(zone_t* zone, uint64_t limit_pfn) {
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        for (uint64_t pfn = zone->free_area[order].head; pfn != PMM_NO_PAGE; pfn = pages[pfn].next) {
+            if (pfn >= limit_pfn) continue;
+
+            free_list_remove(zone, pfn, order);
+            while (order > 0) {
+                order--;
+                free_list_push(zone, pfn + (1ULL << order), order);
+            }
+            pages[pfn].order = 0;
+            zone->free_pages--;
+            return pfn;
+        }
+    }
+    return PMM_NO_PAGE;
+}
+
+// Zeroed page below `limit` (at most PMM_DMA32_LIMIT)
+void* pmm_alloc_zeroed_page_below(uint64_t limit) {
+    zone_t* zone = &zones[PMM_ZONE_DMA32];
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        mcs_node_t node;
+        uint64_t flags = mcs_lock_irqsave(&zone->lock, &node);
+        uint64_t pfn = zone_alloc_below(zone, limit / PAGE_SIZE);
+        mcs_unlock_irqrestore(&zone->lock, &node, flags);
+
+        if (pfn != PMM_NO_PAGE) {
+            void* page = (void*)(pfn * PAGE_SIZE);
+            page_zero(page);
+            return page;
+        }
+        pcp_drain_local();
+    }
+
+    serial_write("PMM: ERROR - No free page below ");
+    serial_write_hex(limit);
+    serial_write("\n");
+    return NULL;
+}
+
+// Snapshot of the zero pool counters
+void pmm_get_zero_stats(pmm_zero_stats_t* stats) {
+    *stats = zero_stats;
+    stats->pooled = 0;
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) stats->pooled += zero_pools[z].count;
+}
+
+// Print the zero pool hit rate over serial
+void pmm_dump_zero_stats(void) {
+    pmm_zero_stats_t stats;
+    pmm_get_zero_stats(&stats);
+
+    uint64_t total = stats.hits + stats.misses;
+    serial_write("PMM: Zero pool: ");
+    serial_write_dec(stats.hits);
+    serial_write(" hits, ");
+    serial_write_dec(stats.misses);
+    serial_write(" misses (");
+    serial_write_dec(total ? stats.hits * 100 / total : 0);
+    serial_write("% hit rate), ");
+    serial_write_dec(stats.pooled);
+    serial_write(" pages pooled, ");
+    serial_write_dec(stats.idle_zeroed);
+    serial_write(" zeroed at idle\n");
+}
+
+// Allocate a 2MB huge page
+void* pmm_alloc_huge_page(void) {
+    return pmm_alloc_pages(PMM_HUGE_ORDER);
+}
+
+// Free a 2MB huge page
+void pmm_free_huge_page(void* page) {
+    pmm_free_pages(page, PMM_HUGE_ORDER);
+}
+
+// Allocate a physical page
+void* pmm_alloc_page(void) {
+    return pmm_alloc_pages(0);
+}
+
+// Free a physical page
+void pmm_free_page(void* page) {
+    pmm_free_pages(page, 0);
+}
+
+// Get total number of usable pages
 uint64_t pmm_get_total_pages(void) {
-    return total_pages;
+    uint64_t total = 0;
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) total += zones[z].present_pages;
+    return total;
 }
 
-// Get number of free pages
+// Get number of free pages (buddy lists plus everything parked per-CPU)
 uint64_t pmm_get_free_pages(void) {
-    return total_pages - used_pages;
+    uint64_t free = 0;
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) free += pmm_get_zone_free_pages(z);
+    return free;
 }
 
 // Get number of used pages
 uint64_t pmm_get_used_pages(void) {
-    return used_pages;
+    return pmm_get_total_pages() - pmm_get_free_pages();
+}
+
+// Get number of free pages in one zone
+uint64_t pmm_get_zone_free_pages(pmm_zone_t zone) {
+    if (zone >= PMM_ZONE_COUNT) return 0;
+
+    // Racy snapshot of the other CPUs' lists, good enough for stats
+    uint64_t free = zones[zone].free_pages + zero_pools[zone].count;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) free += pcp_lists[cpu][zone].count;
+    return free;
+}
+
+// Highest physical address that is RAM
+uint64_t pmm_get_max_address(void) {
+    return max_pfn * PAGE_SIZE;
+}
+
+bool pmm_get_ram_range(int index, uint64_t* start, uint64_t* end) {
+    if (index < 0 || index >= ram_region_count) return false;
+    *start = ram_regions[index].start;
+    *end = ram_regions[index].end;
+    return true;
 }
@@ -14,21 +14,150 @@
 // Page size (4KB is standard for x86_64)
 #define PAGE_SIZE 4096
 
-// Bitmap-based allocator (each bit = one 4KB page)
-// If bit is 0 = page is free, if bit is 1 = page is used
-// Simple but effective (and doesn't waste much memory)
+// Buddy allocator (blocks of 2^order pages, split and merged in pairs)
+// Every block of order N is aligned to 2^N pages, so its "buddy" is just
+// one bit flip away. Alloc and free are O(log n) instead of scanning a bitmap.
 
-// Initialize physical memory manager
-// total_memory = how many bytes of RAM we have (get this from GRUB multiboot info)
+// Biggest block we hand out: 2^11 pages = 8MB (enough for a 1920x1080x4 backbuffer)
+#define PMM_MAX_ORDER 11
+
+// Memory zones (each one has its own free lists)
+// DMA32 = everything below 4GB, for devices that can only do 32-bit DMA
+// NORMAL = everything above, used first so DMA32 doesn't get eaten by the heap
+typedef enum {
+    PMM_ZONE_DMA32 = 0,
+    PMM_ZONE_NORMAL = 1,
+    PMM_ZONE_COUNT
+} pmm_zone_t;
+
+#define PMM_DMA32_LIMIT 0x100000000ULL
+
+// Initialize physical memory manager from the multiboot memory map
+// Falls back to mem_upper if GRUB didn't give us a map
+void pmm_init_multiboot(void* multiboot_info);
+
+// Initialize physical memory manager from the UEFI memory map
+// (map/map_size/desc_size exactly as GetMemoryMap returned them - the
+// descriptor stride is desc_size, not sizeof(EFI_MEMORY_DESCRIPTOR))
+// Nothing calls this yet: the UEFI loader jumps to the 32-bit multiboot
+// _start with (gop, map, size, desc_size), which that entry can't take.
+// It's for the 64-bit EFI entry once there is one.
+void pmm_init_efi(const void* map, uint64_t map_size, uint64_t desc_size);
+
+// Initialize physical memory manager as one flat range of RAM
+// total_memory = how many bytes of RAM we have (only when there's no memory map)
 void pmm_init(uint64_t total_memory);
 
+// Allocate 2^order physically contiguous pages (returns physical address)
+// The block is aligned to its own size. Returns 0 if no block is big enough.
+// Comes from ZONE_NORMAL if possible, falls back to DMA32.
+void* pmm_alloc_pages(uint32_t order);
+
+// Same thing but never from a zone above `zone`
+// (use PMM_ZONE_DMA32 for device rings/buffers that need 32-bit addresses)
+void* pmm_alloc_pages_zone(pmm_zone_t zone, uint32_t order);
+
+// Free a block from pmm_alloc_pages (order must match the allocation)
+// Neighbouring free buddies get merged back into bigger blocks
+void pmm_free_pages(void* addr, uint32_t order);
+
+// Allocate exactly `count` contiguous pages (no rounding up to a power of two,
+// the unused tail of the buddy block goes straight back to the free lists)
+// Aligned to the next power of two >= count. Free with pmm_free_pages_exact.
+void* pmm_alloc_pages_exact(uint64_t count);
+void pmm_free_pages_exact(void* addr, uint64_t count);
+
+// 2MB huge pages are just order-9 blocks (buddy blocks are naturally aligned,
+// so they're always 2MB aligned too - exactly what a PD leaf entry needs)
+#define PMM_HUGE_ORDER 9
+#define PMM_HUGE_PAGE_SIZE ((uint64_t)PAGE_SIZE << PMM_HUGE_ORDER)
+
+// Allocate/free one 2MB-aligned 2MB block (for huge page mappings)
+void* pmm_alloc_huge_page(void);
+void pmm_free_huge_page(void* page);
+
+// Owner tags for allocated blocks
+// Lets kfree() work out where a pointer came from without a header in
+// front of every object. Freeing a block clears its tag.
+#define PMM_OWNER_NONE    0  // Plain pmm_alloc_pages() user (or not allocated)
+#define PMM_OWNER_SLAB    1  // Slab of a kmem_cache (kernel/slab.c)
+#define PMM_OWNER_HEAP    2  // Segment of the boundary-tag heap (kernel/heap.c)
+#define PMM_OWNER_USER    3  // Refcounted user page (kernel/uvm.c)
+
+// Tag the 2^order block at addr (must be the address pmm_alloc_pages returned)
+void pmm_set_owner(void* addr, uint32_t order, uint8_t owner);
+
+// Owner of the block containing addr, its order goes in *order (can be NULL)
+// The block starts at addr rounded down to (PAGE_SIZE << order)
+uint8_t pmm_get_owner(const void* addr, uint32_t* order);
+
+// Page refcounts (single pages shared between address spaces, e.g. copy-on-write)
+// pmm_page_ref_init() tags a page PMM_OWNER_USER with a count of 1, the
+// page goes back to the PMM when pmm_page_unref() drops it to 0. Pages
+// that aren't PMM_OWNER_USER are ignored (refcount 0).
+void pmm_page_ref_init(void* page);
+void pmm_page_ref(void* page);
+uint32_t pmm_page_unref(void* page);  // Returns the new count
+uint32_t pmm_page_refcount(const void* page);
+
+// Smallest order whose block holds `size` bytes (e.g. 8KB -> order 1)
+static inline uint32_t pmm_size_to_order(size_t size) {
+    uint32_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < size) order++;
+    return order;
+}
+
+// Old single-page API (thin wrappers around order 0, kept so nothing breaks)
+
 // Allocate a physical page (returns physical address)
 // Returns 0 if out of memory (which would be really bad)
 void* pmm_alloc_page(void);
 
 // Free a physical page (mark it as available again)
+// Single pages go through a per-CPU cache, so this is usually lock-free
 void pmm_free_page(void* page);
 
+// Free a page that is probably not in the CPU cache (e.g. a device just
+// DMA'd into it) - it goes to the cold end of the per-CPU list so the
+// hot pages get handed out first
+void pmm_free_page_cold(void* page);
+
+// Pre-zeroed pages
+// The idle loop zeroes pages in the background (non-temporal stores, so the
+// cache doesn't get trashed) and parks them in a pool per zone. Grabbing a
+// zeroed page is then just a list pop instead of a 4KB memset.
+
+// Allocate a page that is already zeroed (from the pool if we can)
+void* pmm_alloc_zeroed_page(void);
+
+// Same but never from a zone above `zone` (PMM_ZONE_DMA32 for device rings)
+void* pmm_alloc_zeroed_page_zone(pmm_zone_t zone);
+
+// boot64.asm only identity maps the first 512MB: until vmm_init() loads the
+// real page tables, anything we write through a physical address (the page
+// array, the new tables themselves) has to live below this
+#define PMM_BOOT_MAPPED_END 0x20000000ULL
+
+// Zeroed page below `limit` for sure, however the free lists are ordered
+// (slow, for vmm_init()'s tables)
+void* pmm_alloc_zeroed_page_below(uint64_t limit);
+
+// Zero a few more pages for the pool, call this when there's nothing else to do
+// Returns false once the pools are full (time to hlt)
+bool pmm_zero_idle_work(void);
+
+typedef struct {
+    uint64_t hits;         // pmm_alloc_zeroed_page() served from the pool
+    uint64_t misses;       // ...had to zero inline
+    uint64_t idle_zeroed;  // Pages zeroed by the idle loop so far
+    uint64_t pooled;       // Pages sitting in the pools right now
+} pmm_zero_stats_t;
+
+void pmm_get_zero_stats(pmm_zero_stats_t* stats);
+
+// Print the pool hit rate over serial
+void pmm_dump_zero_stats(void);
+
 // Get total number of pages
 uint64_t pmm_get_total_pages(void);
 
@@ -38,4 +167,14 @@ uint64_t pmm_get_free_pages(void);
 // Get number of used pages
 uint64_t pmm_get_used_pages(void);
 
+// Get number of free pages in one zone
+uint64_t pmm_get_zone_free_pages(pmm_zone_t zone);
+
+// Highest physical address that is RAM (end of the last usable region)
+uint64_t pmm_get_max_address(void);
+
+// The `index`th range of RAM from the memory map, sorted and merged, kernel
+// and first 1MB included (whole pages). False past the last one.
+bool pmm_get_ram_range(int index, uint64_t* start, uint64_t* end);
+
 #endif // PMM_H
@@ -0,0 +1,103 @@
+// kernel/process.c
+// Process creation, fork and teardown
+//
+// Created by: floof<3
+
+#include "process.h"
+#include "heap.h"
+#include "spinlock.h"
+#include "../drivers/serial.h"
+
+static process_t* process_list = NULL;
+static uint64_t next_pid = 1;
+static spinlock_t process_lock = SPINLOCK_INIT;
+
+// Give a process a pid and put it on the list
+static void process_add(process_t* process) {
+    uint64_t flags = spin_lock_irqsave(&process_lock);
+    process->pid = next_pid++;
+    process->next = process_list;
+    process_list = process;
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+process_t* process_create(const char* path) {
+    process_t* process = kmalloc(sizeof(process_t));
+    if (!process) return NULL;
+
+    process->uvm = uvm_create();
+    if (!process->uvm) {
+        kfree(process);
+        return NULL;
+    }
+
+    // Stack, and the guard page under it
+    uint64_t stack_base = PROCESS_STACK_TOP - PROCESS_STACK_SIZE;
+    if (!uvm_map_anon(process->uvm, stack_base, PROCESS_STACK_SIZE, UVM_READ | UVM_WRITE) ||
+        !uvm_map_anon(process->uvm, stack_base - VMM_PAGE_4K, VMM_PAGE_4K, UVM_NONE)) {
+        uvm_destroy(process->uvm);
+        kfree(process);
+        return NULL;
+    }
+
+    // Name = last part of the path
+    const char* name = path;
+    for (const char* p = path; *p; p++) {
+        if (*p == '/' && p[1]) name = p + 1;
+    }
+    uint32_t i = 0;
+    for (; name[i] && name[i] != '/' && i < PROCESS_NAME_MAX - 1; i++) process->name[i] = name[i];
+    process->name[i] = '\0';
+
+    // TODO: load the ELF from the VFS once there is one, until then the
+    // process only has its stack and nothing to run
+    process->entry = 0;
+    process->stack_top = PROCESS_STACK_TOP;
+    process->parent = NULL;
+    process_add(process);
+
+    serial_write("PROC: Created ");
+    serial_write(process->name);
+    serial_write(" (pid ");
+    serial_write_dec(process->pid);
+    serial_write(")\n");
+    return process;
+}
+
+process_t* process_fork(process_t* parent) {
+    process_t* child = kmalloc(sizeof(process_t));
+    if (!child) return NULL;
+
+    child->uvm = uvm_fork(parent->uvm);
+    if (!child->uvm) {
+        kfree(child);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < PROCESS_NAME_MAX; i++) child->name[i] = parent->name[i];
+    child->entry = parent->entry;
+    child->stack_top = parent->stack_top;
+    child->parent = parent;
+    process_add(child);
+    return child;
+}
+
+void process_destroy(process_t* process) {
+    if (!process) return;
+
+    uint64_t flags = spin_lock_irqsave(&process_lock);
+    for (process_t** link = &process_list; *link; link = &(*link)->next) {
+        if (*link == process) {
+            *link = process->next;
+            break;
+        }
+    }
+    // Orphans lose their parent pointer (no reaping without a scheduler yet)
+    for (process_t* p = process_list; p; p = p->next) {
+        if (p->parent == process) p->parent = NULL;
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+
+    uvm_destroy(process->uvm);
+    kfree(process);
+}
@@ -0,0 +1,42 @@
+// kernel/process.h
+// Processes - an address space plus bookkeeping
+// No threads or scheduling in here (that's the scheduler's job), just
+// who owns which memory and who forked whom.
+//
+// Created by: floof<3
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdint.h>
+#include "uvm.h"
+
+// User stack: 1MB right below the top of user space, with an inaccessible
+// guard page under it so an overflow faults instead of running into
+// whatever is mapped next
+#define PROCESS_STACK_TOP  VMM_USER_END
+#define PROCESS_STACK_SIZE (1024 * 1024)
+
+#define PROCESS_NAME_MAX 32
+
+typedef struct process {
+    uint64_t pid;
+    char name[PROCESS_NAME_MAX];
+    uvm_t* uvm;               // Address space
+    uint64_t entry;           // Where ring 3 starts running (0 = nothing loaded yet)
+    uint64_t stack_top;       // Initial user RSP
+    struct process* parent;   // NULL for processes the kernel started
+    struct process* next;     // All processes
+} process_t;
+
+// New process for the program at `path`, with an empty address space and a
+// demand-zero stack. NULL if we ran out of memory.
+process_t* process_create(const char* path);
+
+// fork(): a child sharing all of parent's memory copy-on-write
+process_t* process_fork(process_t* parent);
+
+// Free a process and all of its memory (it must not be running anywhere)
+void process_destroy(process_t* process);
+
+#endif // PROCESS_H
@@ -0,0 +1,204 @@
+// kernel/rcu.c
+// Grace periods and callbacks
+//
+// Grace periods are numbered. Starting one bumps gp_started and asks every
+// online CPU that isn't idle for a quiescent state (qs_pending); the last
+// one to report sets gp_completed. A callback queued while gp_started = N
+// waits for grace period N + 1: that's the first one guaranteed to start
+// after it was queued, whether or not N was still running.
+//
+// Callbacks stay on the CPU that queued them, oldest first, and run in the
+// RCU softirq once their grace period is over.
+//
+// Created by: floof<3
+
+#include "rcu.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "percpu.h"
+#include "heap.h"
+#include "smp.h"
+#include "cpu.h"
+
+typedef struct {
+    uint64_t qs_gp;              // Last grace period we reported for
+    volatile bool idle;          // In the idle loop, quiescent until woken
+    rcu_head_t* head;            // Callbacks waiting, oldest first
+    rcu_head_t* tail;
+} __attribute__((aligned(64))) rcu_cpu_t;
+
+static rcu_cpu_t rcu_cpus[MAX_CPUS];
+
+static spinlock_t gp_lock = SPINLOCK_INIT;
+static volatile uint64_t gp_started = 0;
+static volatile uint64_t gp_completed = 0;
+static uint64_t gp_needed = 0;           // Highest grace period a callback is waiting for
+static volatile uint64_t qs_pending = 0; // CPUs the current grace period still waits for
+
+static void rcu_gp_start(void);
+
+// Last quiescent state is in (gp_lock held)
+static void rcu_gp_complete(void) {
+    __atomic_store_n(&gp_completed, gp_started, __ATOMIC_RELEASE);
+    if (gp_needed > gp_completed) rcu_gp_start();
+}
+
+// (gp_lock held)
+static void rcu_gp_start(void) {
+    __atomic_store_n(&gp_started, gp_started + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in rcu_idle_exit(): a CPU we see as idle here
+    // can only read the data after whatever was retired before this point
+    // was unlinked
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    uint64_t online = smp_online_mask();
+    uint64_t pending = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if ((online & (1ULL << cpu)) && !rcu_cpus[cpu].idle) pending |= 1ULL << cpu;
+    }
+    qs_pending = pending;
+    if (!pending) rcu_gp_complete();
+}
+
+void rcu_quiescent_state(void) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_id();
+    rcu_cpu_t* rc = &rcu_cpus[cpu];
+
+    // Nothing running, or we already reported for this one
+    uint64_t started = __atomic_load_n(&gp_started, __ATOMIC_ACQUIRE);
+    if (started == gp_completed || rc->qs_gp == started) {
+        cpu_irq_restore(flags);
+        return;
+    }
+    rc->qs_gp = started;
+
+    spin_lock(&gp_lock);
+    if (gp_started == started && (qs_pending & (1ULL << cpu))) {
+        qs_pending &= ~(1ULL << cpu);
+        if (!qs_pending) rcu_gp_complete();
+    }
+    spin_unlock_irqrestore(&gp_lock, flags);
+}
+
+void rcu_check_callbacks(void) {
+    uint64_t flags = cpu_irq_save();
+    rcu_cpu_t* rc = &rcu_cpus[cpu_id()];
+    if (rc->head && rc->head->gp <= __atomic_load_n(&gp_completed, __ATOMIC_ACQUIRE)) {
+        softirq_raise(SOFTIRQ_RCU);
+    }
+    cpu_irq_restore(flags);
+}
+
+bool rcu_needs_cpu(void) {
+    return rcu_cpus[cpu_id()].head != NULL;
+}
+
+void rcu_idle_enter(void) {
+    // Idle first, then report. Pairs with the fence in rcu_gp_start(): a
+    // grace period starting now either sees us idle and doesn't wait for
+    // us, or we see its gp_started here and report. The other way round it
+    // could mark us pending in between, and we'd go tickless owing it.
+    rcu_cpus[cpu_id()].idle = true;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    rcu_quiescent_state();
+}
+
+void rcu_idle_exit(void) {
+    rcu_cpu_t* rc = &rcu_cpus[cpu_id()];
+    if (!rc->idle) return;
+    rc->idle = false;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void rcu_irq_enter(void) {
+    rcu_idle_exit();
+}
+
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t*)) {
+    head->next = NULL;
+    head->func = func;
+
+    uint64_t flags = cpu_irq_save();
+    rcu_cpu_t* rc = &rcu_cpus[cpu_id()];
+
+    spin_lock(&gp_lock);
+    head->gp = gp_started + 1;
+    if (head->gp > gp_needed) gp_needed = head->gp;
+    if (gp_started == gp_completed) rcu_gp_start();
+    spin_unlock(&gp_lock);
+
+    if (rc->tail) rc->tail->next = head;
+    else rc->head = head;
+    rc->tail = head;
+
+    cpu_irq_restore(flags);
+
+    // Nobody else might come by to run it (e.g. we're the only CPU and
+    // the grace period ended right away)
+    rcu_check_callbacks();
+}
+
+// SOFTIRQ_RCU: run everything whose grace period is over
+static void rcu_process_callbacks(void) {
+    uint64_t flags = cpu_irq_save();
+    rcu_cpu_t* rc = &rcu_cpus[cpu_id()];
+    uint64_t completed = __atomic_load_n(&gp_completed, __ATOMIC_ACQUIRE);
+
+    // Cut off the ready part of the list (it's sorted by grace period)
+    rcu_head_t* ready = rc->head;
+    rcu_head_t* last = NULL;
+    for (rcu_head_t* head = rc->head; head && head->gp <= completed; head = head->next) last = head;
+    if (!last) {
+        cpu_irq_restore(flags);
+        return;
+    }
+    rc->head = last->next;
+    if (!rc->head) rc->tail = NULL;
+    last->next = NULL;
+    cpu_irq_restore(flags);
+
+    while (ready) {
+        rcu_head_t* next = ready->next;
+        ready->func(ready);
+        ready = next;
+    }
+}
+
+void rcu_kfree(rcu_head_t* head) {
+    kfree(head);
+}
+
+typedef struct {
+    rcu_head_t head;             // First, the callback casts back
+    thread_t* thread;
+    volatile bool done;          // Grace period over
+    volatile bool woken;         // The callback is done with us
+} rcu_sync_t;
+
+static void rcu_sync_done(rcu_head_t* head) {
+    rcu_sync_t* sync = (rcu_sync_t*)head;
+    thread_t* thread = sync->thread;
+    __atomic_store_n(&sync->done, true, __ATOMIC_RELEASE);
+    thread_wake(thread);
+    // sync lives on the waiter's stack, hands off after this
+    __atomic_store_n(&sync->woken, true, __ATOMIC_RELEASE);
+}
+
+void synchronize_rcu(void) {
+    rcu_sync_t sync = { .thread = thread_current(), .done = false, .woken = false };
+    call_rcu(&sync.head, rcu_sync_done);
+    while (!__atomic_load_n(&sync.done, __ATOMIC_ACQUIRE)) thread_block();
+
+    // We can see done before the callback's thread_wake() has happened. Let
+    // it finish (it's a few instructions), then forget the wake if it found
+    // us running: left pending, it would cut the caller's next
+    // thread_block() short.
+    while (!__atomic_load_n(&sync.woken, __ATOMIC_ACQUIRE)) thread_yield();
+    thread_clear_wake();
+}
+
+void rcu_init(void) {
+    softirq_register(SOFTIRQ_RCU, rcu_process_callbacks);
+}
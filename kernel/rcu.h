@@ -0,0 +1,75 @@
+// kernel/rcu.h
+// Read-copy-update for read-mostly data
+// Readers walk shared structures without locks or atomic writes: they just
+// keep preemption off while they look (rcu_read_lock). Writers swap in a
+// new version with rcu_assign_pointer() and free the old one only after a
+// grace period, once every CPU has passed a quiescent state (context
+// switch, idle, a tick outside any read-side section) - by then nobody can
+// still be holding a pointer to it.
+//
+// Readers can't sleep, and writers still need their own lock against each
+// other.
+//
+// Created by: floof<3
+
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+
+typedef struct rcu_head {
+    struct rcu_head* next;
+    void (*func)(struct rcu_head* head);
+    uint64_t gp;                 // Grace period that has to end first
+} rcu_head_t;
+
+// Read-side critical section
+static inline void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+static inline void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+// Load a pointer readers are going to follow / publish one (after the
+// object it points to is fully set up)
+#define rcu_dereference(p)       __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Register the RCU softirq (before softirq_init)
+void rcu_init(void);
+
+// Call func(head) after a grace period, in softirq context on this CPU
+// Embed the rcu_head in the object being retired.
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t*));
+
+// call_rcu() callback that kfree()s the object (rcu_head has to be its
+// first member)
+void rcu_kfree(rcu_head_t* head);
+
+// Wait for a grace period (sleeps, thread context only)
+void synchronize_rcu(void);
+
+// Scheduler hooks
+// This CPU holds no RCU references right now (context switch, tick that
+// interrupted preemptible code)
+void rcu_quiescent_state(void);
+
+// Tick / idle: run callbacks whose grace period is over
+void rcu_check_callbacks(void);
+
+// This CPU has callbacks waiting, so it needs its tick to notice when
+// they're ready (no tickless idle)
+bool rcu_needs_cpu(void);
+
+// Idle CPUs are quiescent for as long as they sleep, so grace periods
+// don't wait for them. Any interrupt ends it (irq_enter calls
+// rcu_irq_enter) before a handler can look at RCU data.
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+void rcu_irq_enter(void);
+
+#endif // RCU_H
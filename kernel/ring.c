@@ -0,0 +1,215 @@
+// kernel/ring.c
+// Lock-free SPSC/MPSC ring buffers
+//
+// Indices are free-running 32-bit counters, a slot is index & mask, and
+// head - tail is the fill level (wraps around fine as long as the size is
+// a power of two no bigger than 2^31).
+//
+// SPSC: each side owns one index and only ever reads the other's with an
+// acquire load, caching it so a full batch usually touches just its own
+// cache line.
+//
+// MPSC: producers claim a run of slots by CAS'ing head forward (checking
+// space against tail), fill them, then publish each slot by writing its
+// sequence word = index + 1. The consumer stops at the first slot that
+// isn't published yet, so a producer interrupted halfway only delays the
+// slots behind it, nobody ever spins on it.
+//
+// Created by: floof<3
+
+#include "ring.h"
+#include "heap.h"
+#include "memory.h"
+#include "scheduler.h"
+
+#define RING_MAX_SIZE (1u << 31)
+
+static bool ring_size_ok(uint32_t size, uint32_t elem_size) {
+    return size && size <= RING_MAX_SIZE && !(size & (size - 1)) && elem_size;
+}
+
+// Copy `count` elements into / out of slot `start` on, wrapping at the end
+static void ring_copy_in(uint8_t* data, uint32_t mask, uint32_t elem_size, uint32_t start,
+                         const void* src, uint32_t count) {
+    uint32_t index = start & mask;
+    uint32_t first = mask + 1 - index;
+    if (first > count) first = count;
+    memcpy(data + (size_t)index * elem_size, src, (size_t)first * elem_size);
+    memcpy(data, (const uint8_t*)src + (size_t)first * elem_size, (size_t)(count - first) * elem_size);
+}
+
+static void ring_copy_out(const uint8_t* data, uint32_t mask, uint32_t elem_size, uint32_t start,
+                          void* dst, uint32_t count) {
+    uint32_t index = start & mask;
+    uint32_t first = mask + 1 - index;
+    if (first > count) first = count;
+    memcpy(dst, data + (size_t)index * elem_size, (size_t)first * elem_size);
+    memcpy((uint8_t*)dst + (size_t)first * elem_size, data, (size_t)(count - first) * elem_size);
+}
+
+// Sleep until ready(ring)
+// The waiter is published before the final check and the producer reads
+// it after its store, so one of the two always sees the other (at worst
+// we get a spurious wakeup later, which thread_block() callers expect)
+static void ring_wait(struct thread* volatile* waiter, bool (*ready)(void*), void* ring) {
+    while (!ready(ring)) {
+        *waiter = thread_current();
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ready(ring)) {
+            __atomic_store_n(waiter, NULL, __ATOMIC_RELAXED);
+            break;
+        }
+        thread_block();
+    }
+}
+
+static void ring_notify(struct thread* volatile* waiter) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(waiter, __ATOMIC_RELAXED)) return;  // Usual case, no locked op
+
+    thread_t* thread = __atomic_exchange_n(waiter, NULL, __ATOMIC_ACQ_REL);
+    if (thread) thread_wake(thread);
+}
+
+bool spsc_ring_init(spsc_ring_t* ring, uint32_t size, uint32_t elem_size) {
+    if (!ring_size_ok(size, elem_size)) return false;
+
+    ring->data = kmalloc((size_t)size * elem_size);
+    if (!ring->data) return false;
+    ring->head = ring->tail = 0;
+    ring->tail_cache = ring->head_cache = 0;
+    ring->mask = size - 1;
+    ring->elem_size = elem_size;
+    ring->waiter = NULL;
+    return true;
+}
+
+void spsc_ring_destroy(spsc_ring_t* ring) {
+    kfree(ring->data);
+    ring->data = NULL;
+}
+
+uint32_t spsc_ring_enqueue_batch(spsc_ring_t* ring, const void* elems, uint32_t count) {
+    uint32_t head = ring->head;
+    uint32_t size = ring->mask + 1;
+
+    // Only look at the consumer's index when the cached one says we're full
+    if (size - (head - ring->tail_cache) < count) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint32_t space = size - (head - ring->tail_cache);
+        if (count > space) count = space;
+    }
+    if (!count) return 0;
+
+    ring_copy_in(ring->data, ring->mask, ring->elem_size, head, elems, count);
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+uint32_t spsc_ring_dequeue_batch(spsc_ring_t* ring, void* elems, uint32_t count) {
+    uint32_t tail = ring->tail;
+
+    if (ring->head_cache - tail < count) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t avail = ring->head_cache - tail;
+        if (count > avail) count = avail;
+    }
+    if (!count) return 0;
+
+    ring_copy_out(ring->data, ring->mask, ring->elem_size, tail, elems, count);
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+static bool spsc_ring_ready(void* arg) {
+    spsc_ring_t* ring = arg;
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail;
+}
+
+void spsc_ring_wait(spsc_ring_t* ring) {
+    ring_wait(&ring->waiter, spsc_ring_ready, ring);
+}
+
+void spsc_ring_notify(spsc_ring_t* ring) {
+    ring_notify(&ring->waiter);
+}
+
+bool mpsc_ring_init(mpsc_ring_t* ring, uint32_t size, uint32_t elem_size) {
+    if (!ring_size_ok(size, elem_size)) return false;
+
+    ring->slot_size = (sizeof(uint64_t) + elem_size + 7) & ~7u;
+    ring->data = kmalloc((size_t)size * ring->slot_size);
+    if (!ring->data) return false;
+
+    // Sequence 0 means "not published" for every slot's first use
+    memset(ring->data, 0, (size_t)size * ring->slot_size);
+    ring->head = ring->tail = 0;
+    ring->mask = size - 1;
+    ring->elem_size = elem_size;
+    ring->waiter = NULL;
+    return true;
+}
+
+void mpsc_ring_destroy(mpsc_ring_t* ring) {
+    kfree(ring->data);
+    ring->data = NULL;
+}
+
+static inline uint8_t* mpsc_slot(mpsc_ring_t* ring, uint32_t index) {
+    return ring->data + (size_t)(index & ring->mask) * ring->slot_size;
+}
+
+uint32_t mpsc_ring_enqueue_batch(mpsc_ring_t* ring, const void* elems, uint32_t count) {
+    uint32_t size = ring->mask + 1;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t n;
+
+    // Claim [head, head + n). Tail is read after head, and tail never passes
+    // the head we CAS against, so the space check can't come out too big.
+    do {
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint32_t space = size - (head - tail);
+        n = count < space ? count : space;
+        if (!n) return 0;
+    } while (!__atomic_compare_exchange_n(&ring->head, &head, head + n, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    const uint8_t* src = elems;
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t* slot = mpsc_slot(ring, head + i);
+        memcpy(slot + sizeof(uint64_t), src + (size_t)i * ring->elem_size, ring->elem_size);
+        __atomic_store_n((uint32_t*)slot, head + i + 1, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+uint32_t mpsc_ring_dequeue_batch(mpsc_ring_t* ring, void* elems, uint32_t count) {
+    uint32_t tail = ring->tail;
+    uint8_t* dst = elems;
+    uint32_t n = 0;
+
+    for (; n < count; n++) {
+        uint8_t* slot = mpsc_slot(ring, tail + n);
+        if (__atomic_load_n((uint32_t*)slot, __ATOMIC_ACQUIRE) != tail + n + 1) break;
+        memcpy(dst + (size_t)n * ring->elem_size, slot + sizeof(uint64_t), ring->elem_size);
+    }
+
+    // Hands the slots back to the producers (after we're done reading them)
+    if (n) __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+// The slot at tail is published (a claimed but unfilled one doesn't count)
+static bool mpsc_ring_ready(void* arg) {
+    mpsc_ring_t* ring = arg;
+    uint32_t tail = ring->tail;
+    return __atomic_load_n((uint32_t*)mpsc_slot(ring, tail), __ATOMIC_ACQUIRE) == tail + 1;
+}
+
+void mpsc_ring_wait(mpsc_ring_t* ring) {
+    ring_wait(&ring->waiter, mpsc_ring_ready, ring);
+}
+
+void mpsc_ring_notify(mpsc_ring_t* ring) {
+    ring_notify(&ring->waiter);
+}
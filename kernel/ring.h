@@ -0,0 +1,104 @@
+// kernel/ring.h
+// Lock-free ring buffers for passing events between contexts
+// Fixed-size elements, power-of-two slot count, copied in and out.
+// Producer and consumer indices sit on their own cache lines so the two
+// sides don't bounce one line back and forth on every element.
+//
+//   spsc_ring_t - one producer, one consumer. Just two indices.
+//   mpsc_ring_t - any number of producers (interrupt handlers on several
+//                 CPUs, tasklets, threads), one consumer.
+//
+// Nothing here takes a lock or sleeps on the producer side, so enqueueing
+// from an interrupt handler is fine. The consumer can block in
+// *_ring_wait() until a producer calls *_ring_notify().
+//
+// Created by: floof<3
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct thread;
+
+typedef struct {
+    // Producer side
+    volatile uint32_t head __attribute__((aligned(64)));  // Next slot to fill
+    uint32_t tail_cache;             // Last tail we saw (saves reading the consumer's line)
+
+    // Consumer side
+    volatile uint32_t tail __attribute__((aligned(64)));  // Next slot to read
+    uint32_t head_cache;
+
+    // Read-only after init
+    uint32_t mask __attribute__((aligned(64)));
+    uint32_t elem_size;
+    uint8_t* data;
+    struct thread* volatile waiter;  // Consumer sleeping in spsc_ring_wait()
+} spsc_ring_t;
+
+typedef struct {
+    // Producers (claim slots by moving head with a CAS)
+    volatile uint32_t head __attribute__((aligned(64)));
+
+    // Consumer
+    volatile uint32_t tail __attribute__((aligned(64)));
+
+    uint32_t mask __attribute__((aligned(64)));
+    uint32_t elem_size;
+    uint32_t slot_size;              // Sequence word + element, 8 byte aligned
+    uint8_t* data;
+    struct thread* volatile waiter;
+} mpsc_ring_t;
+
+// Set up a ring of `size` elements (power of two) of `elem_size` bytes
+// each. False if the size is bad or we're out of memory.
+bool spsc_ring_init(spsc_ring_t* ring, uint32_t size, uint32_t elem_size);
+bool mpsc_ring_init(mpsc_ring_t* ring, uint32_t size, uint32_t elem_size);
+void spsc_ring_destroy(spsc_ring_t* ring);
+void mpsc_ring_destroy(mpsc_ring_t* ring);
+
+// Copy up to `count` elements in/out, returns how many made it
+// (enqueue: fewer if the ring is full, dequeue: fewer if it ran dry)
+uint32_t spsc_ring_enqueue_batch(spsc_ring_t* ring, const void* elems, uint32_t count);
+uint32_t spsc_ring_dequeue_batch(spsc_ring_t* ring, void* elems, uint32_t count);
+uint32_t mpsc_ring_enqueue_batch(mpsc_ring_t* ring, const void* elems, uint32_t count);
+uint32_t mpsc_ring_dequeue_batch(mpsc_ring_t* ring, void* elems, uint32_t count);
+
+static inline bool spsc_ring_enqueue(spsc_ring_t* ring, const void* elem) {
+    return spsc_ring_enqueue_batch(ring, elem, 1) == 1;
+}
+
+static inline bool spsc_ring_dequeue(spsc_ring_t* ring, void* elem) {
+    return spsc_ring_dequeue_batch(ring, elem, 1) == 1;
+}
+
+static inline bool mpsc_ring_enqueue(mpsc_ring_t* ring, const void* elem) {
+    return mpsc_ring_enqueue_batch(ring, elem, 1) == 1;
+}
+
+static inline bool mpsc_ring_dequeue(mpsc_ring_t* ring, void* elem) {
+    return mpsc_ring_dequeue_batch(ring, elem, 1) == 1;
+}
+
+// Elements queued right now (a snapshot, only exact for the consumer's
+// lower bound on SPSC)
+static inline uint32_t spsc_ring_count(const spsc_ring_t* ring) {
+    return ring->head - ring->tail;
+}
+
+static inline uint32_t mpsc_ring_count(const mpsc_ring_t* ring) {
+    return ring->head - ring->tail;
+}
+
+// Consumer: sleep until something's queued (returns at once if it already is)
+void spsc_ring_wait(spsc_ring_t* ring);
+void mpsc_ring_wait(mpsc_ring_t* ring);
+
+// Producer: wake the consumer if it's waiting (after a batch, not per element)
+void spsc_ring_notify(spsc_ring_t* ring);
+void mpsc_ring_notify(mpsc_ring_t* ring);
+
+#endif // RING_H
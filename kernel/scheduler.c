@@ -0,0 +1,769 @@
+// kernel/scheduler.c
+// Preemptive scheduler with per-CPU run queues
+//
+// A run queue lock is held across the stack switch: whoever switches away
+// takes it, the thread we switch to drops it (sched_finish_switch). So a
+// thread that was just put back on a queue can't be stolen by another CPU
+// before its registers are saved.
+//
+// Deadline threads sit on their own list, sorted by deadline, and are
+// picked before anything on the priority queues. Their budget is a simple
+// constant bandwidth server: it's refilled (with a new deadline one period
+// out) when the period is over, or when a thread wakes up with more budget
+// left than it could use at its reserved rate before the old deadline.
+// Running out of budget puts it to sleep until the deadline.
+//
+// Created by: floof<3
+
+#include "scheduler.h"
+#include "lapic.h"
+#include "smp.h"
+#include "timer.h"
+#include "softirq.h"
+#include "rcu.h"
+#include "clock.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "heap.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "percpu.h"
+#include "fpu.h"
+#include "../drivers/serial.h"
+
+// Idle threads sit below every real priority and never go on a queue
+#define SCHED_PRIO_IDLE SCHED_PRIORITIES
+
+// Sleeps and deadlines are kept in timer wheel ticks
+_Static_assert(SCHED_HZ == TIMER_HZ, "scheduler ticks have to be timer ticks");
+
+typedef struct {
+    spinlock_t lock;
+    uint32_t bitmap;                       // Bit p set = queue p isn't empty
+    thread_t* head[SCHED_PRIORITIES];
+    thread_t* tail[SCHED_PRIORITIES];
+    thread_t* dl_head;                     // Deadline threads, earliest deadline first
+    volatile uint32_t nr_ready;            // Threads queued (read locklessly when stealing)
+    thread_t* current;
+    thread_t* idle;
+    thread_t* sleepers;                    // Sorted by wake_tick
+    thread_t* dead;                        // Exited thread to free after the switch
+    volatile uint64_t ticks;
+    volatile bool need_resched;
+    bool tick_stopped;                     // Idle with the periodic tick off
+    lock_stats_t lock_stats;               // Stealing makes this lock cross-CPU
+    char lock_name[8];                     // "rq N"
+} __attribute__((aligned(64))) run_queue_t;
+
+static run_queue_t run_queues[MAX_CPUS];
+static thread_t idle_threads[MAX_CPUS];
+static volatile uint64_t online_mask = 0;
+static volatile uint64_t next_tid = 1;
+static void (*resched_ipi)(uint32_t cpu) = NULL;
+
+// Bandwidth reserved by deadline threads (per mille of one CPU)
+static spinlock_t dl_bw_lock = SPINLOCK_INIT;
+static uint32_t dl_bw_used = 0;
+
+// New threads start with interrupts on once the kernel runs with them on
+static bool threads_irqs_on = false;
+
+// Idle CPUs turn the tick off and sleep until the next timer (needs the
+// TSC-deadline timer and a TSC that keeps ticking in sleep states)
+static bool tickless = false;
+
+// Stack switch: push the callee-saved registers, swap RSP, pop the new
+// thread's. A new thread "returns" into sched_thread_entry with its entry
+// point in RBX and argument in R12.
+void sched_switch_stacks(uint64_t* old_rsp, uint64_t new_rsp);
+void sched_thread_entry(void);
+
+__asm__(
+    ".text\n"
+    ".global sched_switch_stacks\n"
+    "sched_switch_stacks:\n"
+    "    push %rbp\n"
+    "    push %rbx\n"
+    "    push %r12\n"
+    "    push %r13\n"
+    "    push %r14\n"
+    "    push %r15\n"
+    "    mov %rsp, (%rdi)\n"
+    "    mov %rsi, %rsp\n"
+    "    pop %r15\n"
+    "    pop %r14\n"
+    "    pop %r13\n"
+    "    pop %r12\n"
+    "    pop %rbx\n"
+    "    pop %rbp\n"
+    "    ret\n"
+    ".global sched_thread_entry\n"
+    "sched_thread_entry:\n"
+    "    mov %rbx, %rdi\n"
+    "    mov %r12, %rsi\n"
+    "    call sched_thread_start\n"
+    "    ud2\n");
+
+// One clock for sleeps and deadlines, whichever CPU a thread ends up on
+static inline uint64_t sched_now(void) {
+    return timer_now();
+}
+
+static uint32_t sched_ms_to_ticks(uint64_t ms) {
+    return (uint32_t)((ms * SCHED_HZ + 999) / 1000);
+}
+
+static void rq_enqueue(run_queue_t* rq, thread_t* thread) {
+    if (thread->policy == SCHED_DEADLINE) {
+        // Sorted by deadline, FIFO among equal ones (there are only ever a few)
+        thread_t* prev = NULL;
+        thread_t* next = rq->dl_head;
+        while (next && next->dl_deadline <= thread->dl_deadline) {
+            prev = next;
+            next = next->next;
+        }
+        thread->prev = prev;
+        thread->next = next;
+        if (prev) prev->next = thread;
+        else rq->dl_head = thread;
+        if (next) next->prev = thread;
+    } else {
+        uint8_t prio = thread->priority;
+        thread->next = NULL;
+        thread->prev = rq->tail[prio];
+        if (rq->tail[prio]) rq->tail[prio]->next = thread;
+        else rq->head[prio] = thread;
+        rq->tail[prio] = thread;
+        rq->bitmap |= 1u << prio;
+    }
+    rq->nr_ready++;
+    thread->state = THREAD_READY;
+}
+
+static void rq_dequeue(run_queue_t* rq, thread_t* thread) {
+    if (thread->policy == SCHED_DEADLINE) {
+        if (thread->prev) thread->prev->next = thread->next;
+        else rq->dl_head = thread->next;
+        if (thread->next) thread->next->prev = thread->prev;
+    } else {
+        uint8_t prio = thread->priority;
+        if (thread->prev) thread->prev->next = thread->next;
+        else rq->head[prio] = thread->next;
+        if (thread->next) thread->next->prev = thread->prev;
+        else rq->tail[prio] = thread->prev;
+        if (!rq->head[prio]) rq->bitmap &= ~(1u << prio);
+    }
+    rq->nr_ready--;
+}
+
+// Most important queued thread, off the queue
+static thread_t* rq_pick(run_queue_t* rq) {
+    thread_t* thread = rq->dl_head;
+    if (!thread && rq->bitmap) thread = rq->head[__builtin_ctz(rq->bitmap)];
+    if (thread) rq_dequeue(rq, thread);
+    return thread;
+}
+
+// Should a run before b? Deadline threads beat normal ones, then earliest
+// deadline / best priority
+static bool sched_beats(const thread_t* a, const thread_t* b) {
+    if (a->policy != b->policy) return a->policy == SCHED_DEADLINE;
+    if (a->policy == SCHED_DEADLINE) return a->dl_deadline < b->dl_deadline;
+    return a->priority < b->priority;
+}
+
+// A thread just became ready on rq, does it beat what's running there?
+static void sched_check_preempt(run_queue_t* rq, uint32_t cpu, thread_t* thread) {
+    if (!sched_beats(thread, rq->current)) return;
+    rq->need_resched = true;
+    if (cpu != cpu_id() && resched_ipi) resched_ipi(cpu);
+}
+
+// New period: full budget, deadline one period from now
+static void sched_dl_replenish(thread_t* thread) {
+    thread->dl_deadline = sched_now() + thread->dl_period;
+    thread->dl_budget = thread->dl_runtime;
+}
+
+// Add a thread to rq's sleepers, sorted by wake tick (rq->lock held)
+static void rq_add_sleeper(run_queue_t* rq, thread_t* thread, uint64_t wake_tick) {
+    thread->wake_tick = wake_tick;
+    thread->state = THREAD_SLEEPING;
+
+    thread_t** link = &rq->sleepers;
+    while (*link && (*link)->wake_tick <= wake_tick) link = &(*link)->next;
+    thread->next = *link;
+    *link = thread;
+}
+
+// Out of budget: off the CPU until its deadline, when the budget comes back
+static void sched_dl_throttle(run_queue_t* rq, thread_t* thread) {
+    uint64_t now = sched_now();
+    uint64_t wait = thread->dl_deadline > now ? thread->dl_deadline - now : 1;
+    thread->dl_throttled = true;
+    rq_add_sleeper(rq, thread, now + wait);
+}
+
+// A sleeping or blocked thread can run again (rq->lock held)
+static void sched_wakeup(run_queue_t* rq, uint32_t cpu, thread_t* thread) {
+    if (thread->dl_throttled) {
+        thread->dl_throttled = false;  // Not a wakeup anybody waits on, don't count it
+    } else {
+        thread->wake_tsc = cpu_rdtsc();
+    }
+
+    // CBS wakeup rule: keep the old deadline only if the budget left fits
+    // in the time left at the reserved rate (budget / left <= runtime / period)
+    if (thread->policy == SCHED_DEADLINE) {
+        uint64_t now = sched_now();
+        if (now >= thread->dl_deadline ||
+            (uint64_t)thread->dl_budget * thread->dl_period >
+                (thread->dl_deadline - now) * thread->dl_runtime) {
+            sched_dl_replenish(thread);
+        }
+    }
+
+    rq_enqueue(rq, thread);
+    sched_check_preempt(rq, cpu, thread);
+}
+
+// Wakeup latency of a thread that's about to run
+static void sched_account_latency(thread_t* thread) {
+    if (!thread->wake_tsc) return;
+    uint64_t latency = cpu_rdtsc() - thread->wake_tsc;
+    thread->wake_tsc = 0;
+    thread->lat_count++;
+    thread->lat_total += latency;
+    if (latency > thread->lat_max) thread->lat_max = latency;
+}
+
+// Take a thread from the busiest other queue (our own lock held)
+// Trylock only: two CPUs stealing from each other would deadlock otherwise
+static thread_t* sched_steal(uint32_t self) {
+    run_queue_t* busiest = NULL;
+    uint32_t most = 0;
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu == self || !(online_mask & (1ULL << cpu))) continue;
+        if (run_queues[cpu].nr_ready > most) {
+            most = run_queues[cpu].nr_ready;
+            busiest = &run_queues[cpu];
+        }
+    }
+    if (!busiest || !spin_trylock(&busiest->lock)) return NULL;
+
+    // Deadline threads first, they're the ones that can't wait
+    thread_t* found = NULL;
+    for (thread_t* t = busiest->dl_head; t; t = t->next) {
+        if (t->affinity & (1ULL << self)) {
+            found = t;
+            break;
+        }
+    }
+    for (uint32_t bits = busiest->bitmap; bits && !found; bits &= bits - 1) {
+        for (thread_t* t = busiest->head[__builtin_ctz(bits)]; t; t = t->next) {
+            if (t->affinity & (1ULL << self)) {
+                found = t;
+                break;
+            }
+        }
+    }
+    if (found) {
+        rq_dequeue(busiest, found);
+        found->cpu = self;
+    }
+
+    spin_unlock(&busiest->lock);
+    return found;
+}
+
+// Second half of a switch, run by the thread we switched to
+// (the previous thread's schedule_locked() left its CPU's queue locked)
+static void sched_finish_switch(void) {
+    run_queue_t* rq = &run_queues[cpu_id()];
+    thread_t* dead = rq->dead;
+    rq->dead = NULL;
+    spin_unlock(&rq->lock);
+
+    if (dead) {
+        fpu_thread_free(dead);
+        vfree(dead->stack);
+        kfree(dead);
+    }
+}
+
+// Switch to the next thread (rq->lock held, interrupts off)
+// Comes back with the lock dropped, when this thread gets picked again
+// (maybe on another CPU)
+static void schedule_locked(run_queue_t* rq) {
+    uint32_t cpu = cpu_id();
+    thread_t* prev = rq->current;
+
+    // Nobody schedules inside an RCU read-side section
+    rcu_quiescent_state();
+
+    rq->need_resched = false;
+    if (prev->state == THREAD_RUNNING && prev != rq->idle) {
+        if (prev->policy == SCHED_DEADLINE && !prev->dl_budget) sched_dl_throttle(rq, prev);
+        else rq_enqueue(rq, prev);
+    }
+    if (prev->state == THREAD_DEAD) rq->dead = prev;
+
+    thread_t* next = rq_pick(rq);
+    if (!next) next = sched_steal(cpu);
+    if (!next) next = rq->idle;
+
+    next->state = THREAD_RUNNING;
+    next->cpu = cpu;
+    sched_account_latency(next);
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    rq->current = next;
+    fpu_switch(prev, next);
+    uvm_switch(next->uvm);  // Kernel threads (NULL) keep the old tables lazily
+    sched_switch_stacks(&prev->rsp, next->rsp);
+    sched_finish_switch();
+}
+
+// Where new threads come to life (see sched_thread_entry)
+__attribute__((used, noreturn)) void sched_thread_start(void (*entry)(void*), void* arg) {
+    sched_finish_switch();
+    if (threads_irqs_on) __asm__ volatile("sti" : : : "memory");
+
+    entry(arg);
+    thread_exit();
+}
+
+void schedule(void) {
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = &run_queues[cpu_id()];
+
+    if (rq->current->preempt_count) {
+        // Not now, preempt_enable() will get back to it
+        rq->need_resched = true;
+        cpu_irq_restore(flags);
+        return;
+    }
+
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+    cpu_irq_restore(flags);
+}
+
+void preempt_disable(void) {
+    uint64_t flags = cpu_irq_save();
+    run_queues[cpu_id()].current->preempt_count++;
+    cpu_irq_restore(flags);
+}
+
+void preempt_enable(void) {
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = &run_queues[cpu_id()];
+    bool resched = !--rq->current->preempt_count && rq->need_resched;
+    cpu_irq_restore(flags);
+
+    // Inside an interrupt handler the switch waits for scheduler_irq_exit()
+    if (resched && (flags & CPU_FLAGS_IF)) schedule();
+}
+
+static void sched_set_name(thread_t* thread, const char* name) {
+    uint32_t i = 0;
+    for (; name[i] && i < THREAD_NAME_MAX - 1; i++) thread->name[i] = name[i];
+    thread->name[i] = '\0';
+}
+
+static void sched_set_lock_name(run_queue_t* rq, uint32_t cpu) {
+    const char prefix[] = "rq ";
+    uint32_t i = 0;
+    for (; prefix[i]; i++) rq->lock_name[i] = prefix[i];
+    rq->lock_name[i++] = '0' + cpu;
+    rq->lock_name[i] = '\0';
+}
+
+static void sched_setup_cpu(uint32_t cpu) {
+    run_queue_t* rq = &run_queues[cpu];
+    thread_t* idle = &idle_threads[cpu];
+
+    // Whatever is running this right now becomes the idle thread
+    idle->tid = 0;
+    sched_set_name(idle, "idle");
+    idle->state = THREAD_RUNNING;
+    idle->priority = SCHED_PRIO_IDLE;
+    idle->policy = SCHED_NORMAL;
+    idle->cpu = cpu;
+    idle->affinity = 1ULL << cpu;
+    idle->fpu_cpu = FPU_CPU_NONE;
+
+    rq->lock = (spinlock_t)SPINLOCK_INIT;
+    sched_set_lock_name(rq, cpu);
+    spin_lock_stats(&rq->lock, &rq->lock_stats, rq->lock_name);
+    rq->idle = rq->current = idle;
+    __atomic_fetch_or(&online_mask, 1ULL << cpu, __ATOMIC_SEQ_CST);
+}
+
+void scheduler_init_cpu(void) {
+    sched_setup_cpu(cpu_id());
+    lapic_timer_start(SCHED_HZ);
+}
+
+void scheduler_init(void) {
+    scheduler_init_cpu();
+    tickless = lapic_timer_has_deadline() && clock_tsc_invariant();
+
+    serial_write("SCHED: ");
+    serial_write_dec(SCHED_PRIORITIES);
+    serial_write(" priorities, ");
+    serial_write_dec(SCHED_HZ);
+    serial_write(tickless ? "Hz tick, tickless idle\n" : "Hz tick\n");
+}
+
+// Periodic tick back on after a tickless sleep (interrupts off)
+static void sched_tick_restart(run_queue_t* rq) {
+    if (!rq->tick_stopped) return;
+    rq->tick_stopped = false;
+    lapic_timer_start(SCHED_HZ);
+}
+
+// Idle with nothing queued (interrupts off): instead of taking a tick every
+// millisecond, program the TSC deadline for whatever comes next - a timer
+// on our wheel or one of our sleepers - and halt until then (or until
+// something else wakes us up)
+static void sched_idle_tickless(run_queue_t* rq) {
+    uint64_t next = timer_next_expiry();
+    if (rq->sleepers && rq->sleepers->wake_tick < next) next = rq->sleepers->wake_tick;
+
+    rq->tick_stopped = true;
+    if (next == TIMER_NEVER) lapic_timer_stop();
+    else lapic_timer_deadline(clock_tsc_at(next * (NS_PER_SEC / TIMER_HZ)));
+
+    __asm__ volatile("sti; hlt" : : : "memory");
+    __asm__ volatile("cli" : : : "memory");
+    sched_tick_restart(rq);
+}
+
+void scheduler_start(void) {
+    if (cpu_irqs_enabled()) threads_irqs_on = true;
+
+    for (;;) {
+        schedule();
+        if (pmm_zero_idle_work()) continue;
+
+        // Nothing to do: sleep until the next interrupt. With interrupts
+        // on, sti's one-instruction shadow means a wakeup can't slip in
+        // between the check and the hlt. Without them (a CPU that never
+        // turned them on) nothing would wake us, so spin and pick up IPIs
+        // by hand.
+        uint64_t flags = cpu_irq_save();
+        run_queue_t* rq = &run_queues[cpu_id()];
+        rcu_check_callbacks();
+        if (!(flags & CPU_FLAGS_IF)) {
+            smp_handle_ipi();
+            cpu_pause();
+        } else if (!rq->need_resched && !rq->nr_ready) {
+            // Grace periods don't wait for us while we sleep
+            rcu_idle_enter();
+            if (tickless && !rcu_needs_cpu()) sched_idle_tickless(rq);
+            else __asm__ volatile("sti; hlt" : : : "memory");
+            rcu_idle_exit();
+        }
+        cpu_irq_restore(flags);
+    }
+}
+
+thread_t* thread_create_on(uint32_t cpu, const char* name, void (*entry)(void*), void* arg,
+                           uint8_t priority) {
+    if (priority >= SCHED_PRIORITIES) priority = SCHED_PRIORITIES - 1;
+
+    thread_t* thread = kmalloc(sizeof(thread_t));
+    if (!thread) return NULL;
+
+    // vmalloc puts a guard page after each area, and stacks grow down into
+    // the previous one's, so an overflow runs into unmapped memory rather
+    // than another stack. It doesn't get reported though: with no TSS
+    // there's no IST, the CPU pushes the #PF frame on the same overflowed
+    // stack, that faults too and the machine triple faults.
+    thread->stack = vmalloc(SCHED_STACK_SIZE);
+    if (!thread->stack) {
+        kfree(thread);
+        return NULL;
+    }
+
+    sched_set_name(thread, name);
+    thread->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    thread->priority = priority;
+    thread->affinity = (cpu == SCHED_ANY_CPU) ? ~0ULL : 1ULL << cpu;
+    thread->slice = SCHED_TIMESLICE;
+    thread->preempt_count = 0;
+    thread->wake_pending = false;
+    thread->wake_tick = 0;
+    thread->runtime = 0;
+    thread->policy = SCHED_NORMAL;
+    thread->dl_runtime = thread->dl_period = thread->dl_budget = 0;
+    thread->dl_deadline = 0;
+    thread->dl_throttled = false;
+    thread->wake_tsc = 0;
+    thread->lat_count = thread->lat_total = thread->lat_max = 0;
+    thread->uvm = NULL;
+    thread->fpu_state = NULL;
+    thread->fpu_cpu = FPU_CPU_NONE;
+
+    // First switch to it pops these (see sched_switch_stacks)
+    uint64_t* sp = (uint64_t*)((uint8_t*)thread->stack + SCHED_STACK_SIZE);
+    *--sp = (uint64_t)sched_thread_entry;  // Return address
+    *--sp = 0;                             // RBP
+    *--sp = (uint64_t)entry;               // RBX
+    *--sp = (uint64_t)arg;                 // R12
+    *--sp = 0;                             // R13
+    *--sp = 0;                             // R14
+    *--sp = 0;                             // R15
+    thread->rsp = (uint64_t)sp;
+
+    // Anywhere: start on the least loaded CPU, stealing evens it out later
+    if (cpu == SCHED_ANY_CPU) {
+        cpu = cpu_id();
+        for (uint32_t c = 0; c < MAX_CPUS; c++) {
+            if ((online_mask & (1ULL << c)) && run_queues[c].nr_ready < run_queues[cpu].nr_ready) cpu = c;
+        }
+    }
+    thread->cpu = cpu;
+
+    run_queue_t* rq = &run_queues[cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    rq_enqueue(rq, thread);
+    sched_check_preempt(rq, cpu, thread);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return thread;
+}
+
+thread_t* thread_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority) {
+    return thread_create_on(SCHED_ANY_CPU, name, entry, arg, priority);
+}
+
+// Lock the run queue a thread belongs to (stealing can move it while we look)
+// Interrupts must be off
+static run_queue_t* sched_lock_thread(thread_t* thread, uint32_t* cpu_out) {
+    for (;;) {
+        uint32_t cpu = thread->cpu;
+        run_queue_t* rq = &run_queues[cpu];
+        spin_lock(&rq->lock);
+        if (thread->cpu == cpu) {
+            *cpu_out = cpu;
+            return rq;
+        }
+        spin_unlock(&rq->lock);
+    }
+}
+
+static uint32_t sched_dl_bw(const thread_t* thread) {
+    if (thread->policy != SCHED_DEADLINE) return 0;
+    return (uint32_t)((uint64_t)thread->dl_runtime * 1000 / thread->dl_period);
+}
+
+bool thread_set_deadline(thread_t* thread, uint32_t runtime_ms, uint32_t period_ms) {
+    uint32_t runtime = runtime_ms ? sched_ms_to_ticks(runtime_ms) : 0;
+    uint32_t period = runtime_ms ? sched_ms_to_ticks(period_ms) : 0;
+    if (runtime > period) return false;
+    uint32_t bw = runtime ? (uint32_t)((uint64_t)runtime * 1000 / period) : 0;
+
+    // Admission control: the reservations have to fit
+    uint64_t flags = spin_lock_irqsave(&dl_bw_lock);
+    uint32_t old_bw = sched_dl_bw(thread);
+    if (dl_bw_used - old_bw + bw > SCHED_DL_MAX_BW) {
+        spin_unlock_irqrestore(&dl_bw_lock, flags);
+        return false;
+    }
+    dl_bw_used = dl_bw_used - old_bw + bw;
+    spin_unlock(&dl_bw_lock);
+
+    uint32_t cpu;
+    run_queue_t* rq = sched_lock_thread(thread, &cpu);
+
+    // Queued threads have to move to the other class's queue
+    bool queued = thread->state == THREAD_READY;
+    if (queued) rq_dequeue(rq, thread);
+
+    thread->policy = runtime ? SCHED_DEADLINE : SCHED_NORMAL;
+    thread->dl_runtime = runtime;
+    thread->dl_period = period;
+    if (runtime) sched_dl_replenish(thread);
+
+    if (queued) {
+        rq_enqueue(rq, thread);
+        sched_check_preempt(rq, cpu, thread);
+    } else if (thread == rq->current) {
+        // Might not be the most important thread there anymore
+        rq->need_resched = true;
+    }
+
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+    return true;
+}
+
+void thread_latency_report(thread_t* thread) {
+    serial_write("SCHED: ");
+    serial_write(thread->name);
+    serial_write(" wakeups=");
+    serial_write_dec(thread->lat_count);
+    serial_write(" avg=");
+    serial_write_dec(clock_tsc_to_ns(thread->lat_count ? thread->lat_total / thread->lat_count : 0));
+    serial_write("ns max=");
+    serial_write_dec(clock_tsc_to_ns(thread->lat_max));
+    serial_write("ns\n");
+}
+
+thread_t* thread_current(void) {
+    uint64_t flags = cpu_irq_save();
+    thread_t* thread = run_queues[cpu_id()].current;
+    cpu_irq_restore(flags);
+    return thread;
+}
+
+void thread_yield(void) {
+    schedule();
+}
+
+void thread_sleep(uint64_t ms) {
+    uint64_t ticks = (ms * SCHED_HZ + 999) / 1000;
+    if (!ticks) {
+        thread_yield();
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = &run_queues[cpu_id()];
+    spin_lock(&rq->lock);
+
+    rq_add_sleeper(rq, rq->current, sched_now() + ticks);
+    schedule_locked(rq);
+    cpu_irq_restore(flags);
+}
+
+void thread_block(void) {
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = &run_queues[cpu_id()];
+    spin_lock(&rq->lock);
+
+    thread_t* self = rq->current;
+    if (self->wake_pending) {
+        self->wake_pending = false;
+        spin_unlock(&rq->lock);
+    } else {
+        self->state = THREAD_BLOCKED;
+        schedule_locked(rq);
+    }
+    cpu_irq_restore(flags);
+}
+
+void thread_wake(thread_t* thread) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu;
+    run_queue_t* rq = sched_lock_thread(thread, &cpu);
+
+    if (thread->state == THREAD_BLOCKED) {
+        sched_wakeup(rq, cpu, thread);
+    } else {
+        thread->wake_pending = true;
+    }
+
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+}
+
+void thread_clear_wake(void) {
+    uint64_t flags = cpu_irq_save();
+    run_queue_t* rq = &run_queues[cpu_id()];
+    spin_lock(&rq->lock);
+    rq->current->wake_pending = false;
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+}
+
+void thread_exit(void) {
+    cpu_irq_save();
+
+    // Give back its deadline reservation
+    thread_t* self = run_queues[cpu_id()].current;
+    if (self->policy == SCHED_DEADLINE) {
+        spin_lock(&dl_bw_lock);
+        dl_bw_used -= sched_dl_bw(self);
+        spin_unlock(&dl_bw_lock);
+    }
+
+    run_queue_t* rq = &run_queues[cpu_id()];
+    spin_lock(&rq->lock);
+
+    rq->current->state = THREAD_DEAD;
+    schedule_locked(rq);
+
+    // Dead threads never get picked again
+    for (;;) __asm__ volatile("hlt");
+}
+
+void scheduler_tick(void) {
+    // Timer callbacks run in the softirq on the way out (irq_exit)
+    softirq_raise(SOFTIRQ_TIMER);
+
+    run_queue_t* rq = &run_queues[cpu_id()];
+    spin_lock(&rq->lock);
+    rq->ticks++;
+
+    // Sleepers whose time is up
+    uint64_t now = sched_now();
+    while (rq->sleepers && rq->sleepers->wake_tick <= now) {
+        thread_t* thread = rq->sleepers;
+        rq->sleepers = thread->next;
+        sched_wakeup(rq, cpu_id(), thread);
+    }
+
+    thread_t* current = rq->current;
+    if (current != rq->idle) {
+        current->runtime++;
+        if (current->policy == SCHED_DEADLINE) {
+            // Out of budget: throttled at the switch until its deadline
+            if (current->dl_budget) current->dl_budget--;
+            if (!current->dl_budget) rq->need_resched = true;
+        } else if (--current->slice == 0) {
+            // Time slice used up: back of the line (for its priority)
+            current->slice = SCHED_TIMESLICE;
+            if (rq->nr_ready) rq->need_resched = true;
+        }
+    }
+    bool preemptible = !current->preempt_count;
+
+    spin_unlock(&rq->lock);
+
+    // We interrupted code that could have been switched away from, so it
+    // can't be inside an RCU read-side section either
+    if (preemptible) rcu_quiescent_state();
+    rcu_check_callbacks();
+}
+
+void scheduler_irq_exit(void) {
+    run_queue_t* rq = &run_queues[cpu_id()];
+
+    // Whatever woke a tickless idle CPU, it's not idle anymore
+    sched_tick_restart(rq);
+
+    if (!rq->need_resched || rq->current->preempt_count) return;
+
+    // Interrupts stay off, the interrupt return turns them back on
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+}
+
+uint64_t scheduler_ticks(void) {
+    return run_queues[0].ticks;
+}
+
+void scheduler_set_resched_ipi(void (*send)(uint32_t cpu)) {
+    resched_ipi = send;
+}
+
+// Reschedule IPI handler, the switch happens in scheduler_irq_exit() on the way out
+void scheduler_resched_ipi(void) {
+    run_queues[cpu_id()].need_resched = true;
+}
@@ -1,7 +1,159 @@
+// kernel/scheduler.h
+// Preemptive thread scheduler
+// Every CPU has its own run queue: one FIFO per priority level plus a
+// bitmap of the non-empty ones, so picking the next thread and queueing one
+// are both O(1). A CPU that runs out of work steals from the busiest queue.
+// The LAPIC timer drives time slices, sleeps and the timer wheel; idle
+// CPUs switch it to one-shot mode for the next event instead (tickless).
+//
+// Threads that have to react quickly (input, compositor) can move into the
+// deadline class: they get a CPU budget per period, always run before
+// normal threads, earliest deadline first, and get throttled if they go
+// over budget so they can't starve everything else.
+//
+// Created by: floof<3
+
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "uvm.h"
+
+#define SCHED_HZ           1000  // Timer ticks per second (same as TIMER_HZ)
+#define SCHED_TIMESLICE    10    // Ticks a thread runs before others at its priority get a turn
+#define SCHED_PRIORITIES   32    // 0 = most important
+#define SCHED_PRIO_DEFAULT 16
+#define SCHED_STACK_SIZE   (16 * 1024)
+#define SCHED_ANY_CPU      0xFFFFFFFF
+
+// Scheduling classes
+#define SCHED_NORMAL   0   // Fixed priority, round-robin
+#define SCHED_DEADLINE 1   // EDF with a budget, beats every normal thread
+
+// Share of one CPU all deadline threads together may reserve (per mille),
+// so they can't lock out background work even if they all land on one CPU
+#define SCHED_DL_MAX_BW 900
+
+#define THREAD_NAME_MAX 32
+
+typedef enum {
+    THREAD_READY,     // On a run queue
+    THREAD_RUNNING,   // Some CPU's current thread
+    THREAD_SLEEPING,  // Waiting for a tick (thread_sleep)
+    THREAD_BLOCKED,   // Waiting for thread_wake
+    THREAD_DEAD,      // Exited, freed by the next thread on its CPU
+} thread_state_t;
+
+typedef struct thread {
+    uint64_t rsp;                 // Saved kernel stack pointer while switched out
+    uint64_t tid;
+    char name[THREAD_NAME_MAX];
+    volatile thread_state_t state;
+    uint8_t priority;
+    uint32_t cpu;                 // Run queue it belongs to
+    uint64_t affinity;            // CPUs it may run on (bit per CPU)
+    uint32_t slice;               // Ticks left in its time slice
+    uint32_t preempt_count;       // preempt_disable() nesting
+    bool wake_pending;            // thread_wake() came before thread_block()
+    uint64_t wake_tick;           // When a sleep ends (timer_now() time)
+    uint64_t runtime;             // Ticks spent running
+    uint8_t policy;               // SCHED_NORMAL or SCHED_DEADLINE
+
+    // Deadline class, in ticks (deadlines are timer_now() time)
+    uint32_t dl_runtime;          // Budget per period
+    uint32_t dl_period;
+    uint32_t dl_budget;           // Budget left in this period
+    uint64_t dl_deadline;         // End of the current period
+    bool dl_throttled;            // Out of budget, sleeping until the period ends
+
+    // Wakeup latency: thread_wake() / end of a sleep until it actually runs
+    uint64_t wake_tsc;            // When it became ready (0 = not waiting for a CPU)
+    uint64_t lat_count;
+    uint64_t lat_total;           // TSC cycles
+    uint64_t lat_max;
+    uvm_t* uvm;                   // Address space, NULL = kernel thread
+    void* fpu_state;              // XSAVE area, NULL until it first uses the FPU
+    uint32_t fpu_cpu;             // CPU that loaded its FPU state last (fpu.c)
+    void* stack;                  // vmalloc'd (NULL for boot/idle threads)
+    struct thread* next;          // Run queue / sleep list
+    struct thread* prev;
+} thread_t;
+
+// Set up the BSP's run queue, turn the boot context into its idle thread
+// and start the timer tick (needs lapic_init)
 void scheduler_init(void);
+
+// Same for an AP, called on the AP itself
+void scheduler_init_cpu(void);
+
+// Become the idle loop of this CPU (never returns)
 void scheduler_start(void);
 
-#endif
+// New kernel thread running entry(arg), ready to go
+// Priority 0..SCHED_PRIORITIES-1, lower runs first. NULL if out of memory.
+thread_t* thread_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority);
+
+// Same, but it only ever runs on `cpu` (SCHED_ANY_CPU = anywhere)
+thread_t* thread_create_on(uint32_t cpu, const char* name, void (*entry)(void*), void* arg,
+                           uint8_t priority);
+
+// Put a thread in the deadline class: up to runtime_ms of CPU every
+// period_ms, deadline at the end of each period. runtime_ms = 0 moves it
+// back to SCHED_NORMAL at its old priority. False if the parameters make
+// no sense or the deadline threads would reserve more than SCHED_DL_MAX_BW.
+bool thread_set_deadline(thread_t* thread, uint32_t runtime_ms, uint32_t period_ms);
+
+// Print a thread's wakeup latency counters over serial
+void thread_latency_report(thread_t* thread);
+
+// The thread running on this CPU
+thread_t* thread_current(void);
+
+// Let other threads of the same or higher priority run
+void thread_yield(void);
+
+// Sleep for at least `ms` milliseconds
+void thread_sleep(uint64_t ms);
+
+// Wait for a thread_wake() (returns at once if one already happened)
+void thread_block(void);
+
+// Make a blocked thread runnable, or make its next thread_block() a no-op
+void thread_wake(thread_t* thread);
+
+// Drop a thread_wake() that arrived while we weren't blocked (a wait that
+// ended some other way), so the next thread_block() really blocks
+void thread_clear_wake(void);
+
+// End the current thread
+void thread_exit(void) __attribute__((noreturn));
+
+// Pick the next thread and switch to it (the current one stays runnable
+// unless it changed its state first)
+void schedule(void);
+
+// No switching away from this thread until the matching preempt_enable()
+void preempt_disable(void);
+void preempt_enable(void);
+
+// LAPIC timer interrupt handler body (after the EOI, between irq_enter()
+// and irq_exit()): time slices, sleepers, raises the timer softirq
+void scheduler_tick(void);
+
+// End of any interrupt handler (irq_exit() calls it after the softirqs):
+// switch now if the interrupt woke something more important
+void scheduler_irq_exit(void);
+
+// Tick interrupts the BSP has taken (fewer than milliseconds passed when it
+// idles tickless, timer_now() is the clock)
+uint64_t scheduler_ticks(void);
+
+// Cross-CPU wakeups
+// The SMP code registers a function that sends the reschedule IPI, and
+// calls scheduler_resched_ipi() from its handler
+void scheduler_set_resched_ipi(void (*send)(uint32_t cpu));
+void scheduler_resched_ipi(void);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,341 @@
+// kernel/slab.c
+// Slab allocator implementation
+// A slab is one naturally aligned buddy block (2^order pages). The slab
+// header sits at the start of the block and the rest is cut into objects
+// of the cache's size. Free objects are chained through their own first
+// 8 bytes, so alloc and free are just a list pop/push - no searching.
+//
+// Every cache keeps its slabs on three lists:
+//   partial - some objects free (allocations come from here first)
+//   full    - nothing free, we never look at these until something is freed
+//   empty   - nothing allocated, a couple are kept so alloc/free ping-pong
+//             at a slab boundary doesn't hammer the PMM
+//
+// Slabs are tagged PMM_OWNER_SLAB in the page array and are aligned to
+// their own size, so any object pointer rounds down to its slab header.
+//
+// Created by: floof<3
+
+#include "slab.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "../drivers/serial.h"
+
+// Lives at the start of every slab
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    kmem_cache_t* cache;
+    void* free;        // First free object (NULL = slab is full)
+    uint32_t inuse;    // Objects handed out from this slab
+} slab_t;
+
+struct kmem_cache {
+    const char* name;
+    spinlock_t lock;         // Protects the slab lists and counters
+    uint32_t obj_size;       // Rounded up to align
+    uint32_t align;
+    uint32_t order;          // Slab size = PAGE_SIZE << order
+    uint32_t objs_per_slab;
+    uint32_t first_offset;   // Where the first object starts (after the header)
+    slab_t* partial;
+    slab_t* full;
+    slab_t* empty;
+    uint32_t empty_count;
+    uint64_t total_slabs;
+    uint64_t active_objs;
+    struct kmem_cache* next; // All caches, for stats
+};
+
+#define SLAB_MIN_OBJS   8  // Try to fit at least this many objects per slab...
+#define SLAB_MAX_ORDER  3  // ...but don't go past 32KB slabs to get there
+#define SLAB_KEEP_EMPTY 2  // Empty slabs kept per cache before going back to the PMM
+
+// kmem_cache_t structs come out of a cache too (this one is static so
+// there's something to allocate the first cache from)
+static kmem_cache_t cache_cache;
+
+static kmem_cache_t* size_caches[SLAB_CLASS_COUNT];
+static const char* size_cache_names[SLAB_CLASS_COUNT] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1k", "kmalloc-2k", "kmalloc-4k",
+};
+
+static kmem_cache_t* cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+
+// Doubly linked slab list helpers (cache lock held)
+
+static void slab_list_push(slab_t** head, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(slab_t** head, slab_t* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+// Fill in a cache's geometry, false if the object can't fit in any slab
+static bool cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align) {
+    if (!align) align = 8;
+    if (align & (align - 1)) return false;  // Not a power of two
+    if (size < sizeof(void*)) size = sizeof(void*);  // Room for the free list link
+    size = (size + align - 1) & ~(align - 1);
+
+    uint32_t offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+
+    // Smallest slab that holds SLAB_MIN_OBJS objects, or failing that the
+    // first one past SLAB_MAX_ORDER that holds anything at all
+    uint32_t order = 0;
+    for (; order <= PMM_MAX_ORDER; order++) {
+        uint64_t slab_size = (uint64_t)PAGE_SIZE << order;
+        if (offset >= slab_size) continue;
+
+        uint64_t count = (slab_size - offset) / size;
+        if (count >= SLAB_MIN_OBJS || (order >= SLAB_MAX_ORDER && count >= 1)) break;
+    }
+    if (order > PMM_MAX_ORDER) return false;
+
+    cache->name = name;
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+    cache->obj_size = size;
+    cache->align = align;
+    cache->order = order;
+    cache->objs_per_slab = (((uint64_t)PAGE_SIZE << order) - offset) / size;
+    cache->first_offset = offset;
+    cache->partial = cache->full = cache->empty = NULL;
+    cache->empty_count = 0;
+    cache->total_slabs = 0;
+    cache->active_objs = 0;
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    return true;
+}
+
+// Get a fresh slab from the PMM and chain all its objects together
+// (called without the cache lock, the PMM can take a while)
+static slab_t* slab_new(kmem_cache_t* cache) {
+    slab_t* slab = (slab_t*)pmm_alloc_pages(cache->order);
+    if (!slab) return NULL;
+
+    pmm_set_owner(slab, cache->order, PMM_OWNER_SLAB);
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    // Link back to front so the list comes out in address order
+    uint8_t* base = (uint8_t*)slab + cache->first_offset;
+    for (uint32_t i = cache->objs_per_slab; i-- > 0;) {
+        void** obj = (void**)(base + (uint64_t)i * cache->obj_size);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+    return slab;
+}
+
+static inline slab_t* slab_of(const void* obj, uint32_t order) {
+    return (slab_t*)((uint64_t)obj & ~(((uint64_t)PAGE_SIZE << order) - 1));
+}
+
+// Create a cache for fixed-size objects
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
+    kmem_cache_t* cache = kmem_cache_alloc(&cache_cache);
+    if (!cache) return NULL;
+
+    if (!cache_setup(cache, name, size, align)) {
+        serial_write("Slab: ERROR - Bad size/alignment for cache ");
+        serial_write(name);
+        serial_write("\n");
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// Tear down a cache (every object has to be back already)
+bool kmem_cache_destroy(kmem_cache_t* cache) {
+    if (!cache) return false;
+
+    // Live objects still point into the partial and full slabs, and freeing
+    // them later needs the cache. Leave the lot alone and say so.
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    if (cache->partial || cache->full) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        serial_write("Slab: WARNING - Not destroying cache ");
+        serial_write(cache->name);
+        serial_write(", it still has objects allocated\n");
+        return false;
+    }
+    slab_t* empty = cache->empty;
+    cache->empty = NULL;
+    cache->empty_count = 0;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    while (empty) {
+        slab_t* slab = empty;
+        empty = slab->next;
+        pmm_free_pages(slab, cache->order);
+    }
+
+    flags = spin_lock_irqsave(&cache_list_lock);
+    kmem_cache_t** link = &cache_list;
+    while (*link && *link != cache) link = &(*link)->next;
+    if (*link) *link = cache->next;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+
+    kmem_cache_free(&cache_cache, cache);
+    return true;
+}
+
+// Allocate one object
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            // Nothing cached, go to the PMM with the lock dropped
+            spin_unlock_irqrestore(&cache->lock, flags);
+            slab = slab_new(cache);
+            if (!slab) {
+                serial_write("Slab: ERROR - Out of memory in cache ");
+                serial_write(cache->name);
+                serial_write("\n");
+                return NULL;
+            }
+            flags = spin_lock_irqsave(&cache->lock);
+            cache->total_slabs++;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void** obj = (void**)slab->free;
+    slab->free = *obj;
+    slab->inuse++;
+    cache->active_objs++;
+
+    if (!slab->free) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+// Free one object into its slab
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) return;
+
+    slab_t* slab = slab_of(obj, cache->order);
+    uint64_t offset = (uint64_t)obj - (uint64_t)slab;
+    if (slab->cache != cache || offset < cache->first_offset ||
+        (offset - cache->first_offset) % cache->obj_size) {
+        serial_write("Slab: WARNING - Freeing a pointer that isn't an object of ");
+        serial_write(cache->name);
+        serial_write("\n");
+        return;
+    }
+
+    slab_t* release = NULL;
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    // Full slabs get a free object now, move them back where alloc looks
+    if (!slab->free) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->active_objs--;
+
+    if (!slab->inuse) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty_count < SLAB_KEEP_EMPTY) {
+            slab_list_push(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            release = slab;
+            cache->total_slabs--;
+        }
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (release) pmm_free_pages(release, cache->order);
+}
+
+// Size class for kmalloc: 16 -> 0, 17..32 -> 1, ..., 2049..4096 -> 8
+kmem_cache_t* slab_size_cache(size_t size) {
+    if (size > SLAB_MAX_SIZE) return NULL;
+    if (size <= SLAB_MIN_SIZE) return size_caches[0];
+
+    uint32_t index = 64 - __builtin_clzll(size - 1) - 4;
+    return size_caches[index];
+}
+
+// Free an object without knowing its cache
+void slab_free(void* obj) {
+    uint32_t order;
+    if (pmm_get_owner(obj, &order) != PMM_OWNER_SLAB) {
+        serial_write("Slab: WARNING - slab_free() on a non-slab pointer\n");
+        return;
+    }
+    kmem_cache_free(slab_of(obj, order)->cache, obj);
+}
+
+size_t slab_object_size(const void* obj) {
+    uint32_t order;
+    if (pmm_get_owner(obj, &order) != PMM_OWNER_SLAB) return 0;
+    return slab_of(obj, order)->cache->obj_size;
+}
+
+// Set up the kmalloc size classes
+void slab_init(void) {
+    serial_write("Slab: Creating kmalloc size classes...\n");
+
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0);
+
+    // Power-of-two classes are aligned to their own size, so kmalloc(64)
+    // is cache line aligned and kmalloc(4096) is page aligned. That's not
+    // free: the header then takes a whole object slot instead of 40 bytes.
+    // Negligible up to 128 bytes, 1/16 of every slab for 256 to 2K (15
+    // objects where 16 would fit) and 1/8 for 4K (7 per 32KB slab).
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        size_t size = (size_t)SLAB_MIN_SIZE << i;
+        size_caches[i] = kmem_cache_create(size_cache_names[i], size, size);
+    }
+}
+
+// Print every cache's usage
+void slab_dump_stats(void) {
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        serial_write("Slab: ");
+        serial_write(cache->name);
+        serial_write(": ");
+        serial_write_dec(cache->obj_size);
+        serial_write(" byte objects, ");
+        serial_write_dec(cache->active_objs);
+        serial_write(" active, ");
+        serial_write_dec(cache->total_slabs);
+        serial_write(" slabs (");
+        serial_write_dec((cache->total_slabs * ((uint64_t)PAGE_SIZE << cache->order)) >> 10);
+        serial_write("KB)\n");
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
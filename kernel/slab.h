@@ -0,0 +1,51 @@
+// kernel/slab.h
+// Slab allocator - O(1) caches of fixed-size objects
+// Each cache carves naturally aligned buddy blocks ("slabs") into equal
+// objects and keeps the free ones on a list inside the slab itself.
+//
+// Created by: floof<3
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// kmalloc() size classes: powers of two from 16 bytes to 4KB
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 4096
+#define SLAB_CLASS_COUNT 9  // 16, 32, 64, 128, 256, 512, 1K, 2K, 4K
+
+typedef struct kmem_cache kmem_cache_t;
+
+// Set up the kmalloc size classes (called from heap_init)
+void slab_init(void);
+
+// Create a cache for objects of `size` bytes, aligned to `align`
+// (0 = 8 bytes, otherwise a power of two). `name` must stay around forever.
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align);
+
+// Free every slab of a cache and the cache itself. All objects must be
+// freed first: if some aren't, nothing happens and it returns false.
+bool kmem_cache_destroy(kmem_cache_t* cache);
+
+// Grab one object (NOT zeroed), NULL if out of memory
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+// Give an object back to the cache it came from
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Size class cache for a kmalloc of `size` bytes (NULL if size > SLAB_MAX_SIZE)
+kmem_cache_t* slab_size_cache(size_t size);
+
+// Free an object from any cache (finds the cache from the slab it lives in)
+void slab_free(void* obj);
+
+// Object size of the cache obj belongs to (0 if it isn't a slab object)
+size_t slab_object_size(const void* obj);
+
+// Print per-cache usage over serial
+void slab_dump_stats(void);
+
+#endif // SLAB_H
@@ -0,0 +1,326 @@
+// kernel/smp.c
+// AP bring-up, IPIs and cross-CPU function calls
+//
+// IPIs don't carry any data, so the sender first sets a bit in the target's
+// percpu_t.ipi_pending and then sends the vector. smp_handle_ipi() drains
+// every bit at once, so whichever vector arrives first does all the work
+// and the rest find nothing left.
+//
+// The vectors go through irq.c like any other interrupt. A CPU that waits
+// on another one with interrupts off (smp_call_function, TLB shootdowns)
+// calls smp_handle_ipi() itself so the two can't deadlock.
+//
+// Created by: floof<3
+
+#include "smp.h"
+#include "percpu.h"
+#include "idt.h"
+#include "fpu.h"
+#include "acpi.h"
+#include "lapic.h"
+#include "pit.h"
+#include "vmm.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "memory.h"
+#include "cpu.h"
+#include "../drivers/serial.h"
+
+// Address of something inside the trampoline once it's copied to
+// SMP_TRAMPOLINE_ADDR (it runs from there, not from where we linked it)
+#define TRAMP(sym) #sym " - smp_trampoline_start + 0x8000"
+
+// AP trampoline
+// SIPI starts the AP in real mode at 0800:0000 with no stack and nothing
+// set up. It loads its own GDT, goes to protected mode, turns on PAE, the
+// kernel page tables and long mode, then calls smp_ap_entry(cpu) on the
+// stack the BSP left in the data slots at the end.
+// It's only ever copied, never run in place, so it lives with the rodata.
+__asm__(
+    ".pushsection .rodata\n"
+    ".balign 16\n"
+    ".global smp_trampoline_start\n"
+    "smp_trampoline_start:\n"
+    ".code16\n"
+    "    cli\n"
+    "    cld\n"
+    "    xorw %ax, %ax\n"
+    "    movw %ax, %ds\n"
+    "    lgdtl " TRAMP(smp_tramp_gdt_ptr) "\n"
+    "    movl %cr0, %eax\n"
+    "    orl $1, %eax\n"                            // PE
+    "    movl %eax, %cr0\n"
+    "    ljmpl $0x18, $" TRAMP(smp_tramp_32) "\n"
+
+    ".code32\n"
+    "smp_tramp_32:\n"
+    "    movw $0x10, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    movl %cr4, %eax\n"
+    "    orl $0x20, %eax\n"                         // PAE
+    "    movl %eax, %cr4\n"
+    "    movl " TRAMP(smp_tramp_cr3) ", %eax\n"
+    "    movl %eax, %cr3\n"
+    "    movl $0xC0000080, %ecx\n"                  // EFER (LME, NXE like the BSP)
+    "    movl " TRAMP(smp_tramp_efer) ", %eax\n"
+    "    xorl %edx, %edx\n"
+    "    wrmsr\n"
+    "    movl %cr0, %eax\n"
+    "    orl $0x80010000, %eax\n"                   // PG, WP
+    "    movl %eax, %cr0\n"
+    "    ljmp $0x08, $" TRAMP(smp_tramp_64) "\n"
+
+    ".code64\n"
+    "smp_tramp_64:\n"
+    "    movw $0x10, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    xorl %eax, %eax\n"
+    "    movw %ax, %fs\n"
+    "    movw %ax, %gs\n"
+    "    movq " TRAMP(smp_tramp_stack) ", %rsp\n"
+    "    movl " TRAMP(smp_tramp_cpu) ", %edi\n"
+    "    movq " TRAMP(smp_tramp_entry) ", %rax\n"
+    "    callq *%rax\n"
+    "1:  hlt\n"
+    "    jmp 1b\n"
+
+    ".balign 8\n"
+    "smp_tramp_gdt:\n"
+    "    .quad 0\n"
+    "    .quad 0x00AF9A000000FFFF\n"                // 0x08: 64-bit code
+    "    .quad 0x00CF92000000FFFF\n"                // 0x10: data
+    "    .quad 0x00CF9A000000FFFF\n"                // 0x18: 32-bit code
+    "smp_tramp_gdt_ptr:\n"
+    "    .word 31\n"
+    "    .long " TRAMP(smp_tramp_gdt) "\n"
+
+    // Filled in by the BSP for each AP
+    ".balign 8\n"
+    ".global smp_tramp_stack, smp_tramp_entry, smp_tramp_cr3, smp_tramp_efer, smp_tramp_cpu\n"
+    "smp_tramp_stack: .quad 0\n"
+    "smp_tramp_entry: .quad 0\n"
+    "smp_tramp_cr3:   .long 0\n"
+    "smp_tramp_efer:  .long 0\n"
+    "smp_tramp_cpu:   .long 0\n"
+    ".global smp_trampoline_end\n"
+    "smp_trampoline_end:\n"
+    ".popsection\n"
+);
+
+extern const uint8_t smp_trampoline_start[], smp_trampoline_end[];
+extern const uint8_t smp_tramp_stack[], smp_tramp_entry[], smp_tramp_cr3[];
+extern const uint8_t smp_tramp_efer[], smp_tramp_cpu[];
+
+// A trampoline data slot in the copy
+#define TRAMP_SLOT(type, sym) \
+    ((volatile type*)(SMP_TRAMPOLINE_ADDR + (uint64_t)((sym) - smp_trampoline_start)))
+
+// Only one cross-CPU call per target at a time: the next sender waits until
+// the target finished the last one (done catches up with requested)
+typedef struct {
+    spinlock_t lock;
+    void (*func)(void*);
+    void* arg;
+    volatile uint64_t requested;  // Calls handed to this CPU
+    volatile uint64_t done;       // Calls it finished
+} __attribute__((aligned(64))) smp_call_t;
+
+static smp_call_t call_slots[MAX_CPUS];
+static volatile uint64_t online_mask = 0;
+static uint32_t online_count = 1;
+
+// Where the AP lands in long mode (on the stack smp_start_ap gave it)
+static void smp_ap_entry(uint32_t cpu) {
+    percpu_init(cpu);
+    idt_load();
+    fpu_init_cpu();
+    vmm_init_cpu();
+    lapic_init();
+    scheduler_init_cpu();
+
+    percpu_t* self = this_cpu();
+    self->apic_id = lapic_id();
+    __atomic_fetch_or(&online_mask, 1ULL << cpu, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self->online, true, __ATOMIC_RELEASE);
+
+    __asm__ volatile("sti" : : : "memory");
+    scheduler_start();
+}
+
+// INIT-SIPI-SIPI one AP and wait for it to check in
+static bool smp_start_ap(uint32_t cpu, uint32_t apic_id) {
+    void* stack = vmalloc(SCHED_STACK_SIZE);
+    if (!stack) return false;
+
+    percpu_t* target = percpu_get(cpu);
+    target->apic_id = apic_id;
+    *TRAMP_SLOT(uint64_t, smp_tramp_stack) = (uint64_t)stack + SCHED_STACK_SIZE;
+    *TRAMP_SLOT(uint32_t, smp_tramp_cpu) = cpu;
+
+    lapic_send_init(apic_id);
+    pit_delay_us(10000);
+
+    // The second SIPI is for CPUs that missed the first one (the spec says
+    // to send two), a CPU that's already running ignores it
+    for (int sipi = 0; sipi < 2 && !target->online; sipi++) {
+        lapic_send_startup(apic_id, SMP_TRAMPOLINE_ADDR >> 12);
+        pit_delay_us(200);
+    }
+
+    // Give it 100ms to get through the trampoline
+    for (int i = 0; i < 1000 && !__atomic_load_n(&target->online, __ATOMIC_ACQUIRE); i++) {
+        pit_delay_us(100);
+    }
+
+    if (!target->online) {
+        // It might still wake up late and run on that stack, so it stays allocated
+        serial_write("SMP: WARNING - CPU with APIC ID ");
+        serial_write_dec(apic_id);
+        serial_write(" didn't start\n");
+        return false;
+    }
+    return true;
+}
+
+void smp_init(void) {
+    percpu_t* self = this_cpu();
+    self->apic_id = lapic_id();
+    self->online = true;
+    online_mask = 1ULL << self->cpu_id;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) call_slots[i].lock = (spinlock_t)SPINLOCK_INIT;
+
+    vmm_set_tlb_ipi(smp_send_tlb_shootdown);
+    scheduler_set_resched_ipi(smp_send_reschedule);
+
+    const acpi_madt_info_t* madt = acpi_madt();
+    if (!madt || madt->lapic_count < 2) {
+        serial_write("SMP: Single CPU\n");
+        return;
+    }
+
+    // Trampoline below 1MB, plus what every AP needs from us
+    memcpy((void*)SMP_TRAMPOLINE_ADDR, smp_trampoline_start,
+           smp_trampoline_end - smp_trampoline_start);
+    *TRAMP_SLOT(uint32_t, smp_tramp_cr3) = (uint32_t)(uint64_t)vmm_get_kernel_pml4();
+    *TRAMP_SLOT(uint32_t, smp_tramp_efer) =
+        (uint32_t)(cpu_rdmsr(CPU_MSR_EFER) & ~(uint64_t)CPU_EFER_LMA);
+    *TRAMP_SLOT(uint64_t, smp_tramp_entry) = (uint64_t)smp_ap_entry;
+
+    // One at a time, they all share the trampoline's data slots
+    uint32_t next = 1;
+    for (uint32_t i = 0; i < madt->lapic_count; i++) {
+        if (madt->lapic_ids[i] == self->apic_id) continue;
+        if (next == MAX_CPUS) {
+            serial_write("SMP: WARNING - More CPUs than MAX_CPUS, ignoring the rest\n");
+            break;
+        }
+        if (smp_start_ap(next, madt->lapic_ids[i])) next++;
+    }
+    online_count = next;
+
+    serial_write("SMP: ");
+    serial_write_dec(online_count);
+    serial_write(" CPUs online\n");
+}
+
+uint32_t smp_cpu_count(void) {
+    return online_count;
+}
+
+uint64_t smp_online_mask(void) {
+    return online_mask;
+}
+
+// Leave `ipi` for a CPU and poke it
+static void smp_send(uint32_t cpu, uint32_t ipi, uint8_t vector) {
+    percpu_t* target = percpu_get(cpu);
+    if (!target || !target->online) return;
+
+    __atomic_fetch_or(&target->ipi_pending, ipi, __ATOMIC_SEQ_CST);
+    lapic_send_ipi(target->apic_id, vector);
+}
+
+void smp_send_reschedule(uint32_t cpu) {
+    smp_send(cpu, SMP_IPI_RESCHED, SMP_RESCHED_VECTOR);
+}
+
+void smp_send_tlb_shootdown(uint32_t cpu) {
+    smp_send(cpu, SMP_IPI_TLB, SMP_TLB_VECTOR);
+}
+
+// Run the call waiting in this CPU's slot, if there is one
+static void smp_run_call(void) {
+    smp_call_t* slot = &call_slots[cpu_id()];
+
+    spin_lock(&slot->lock);
+    if (slot->done == slot->requested) {
+        spin_unlock(&slot->lock);
+        return;
+    }
+    void (*func)(void*) = slot->func;
+    void* arg = slot->arg;
+    uint64_t ticket = slot->requested;
+    spin_unlock(&slot->lock);
+
+    func(arg);
+    __atomic_store_n(&slot->done, ticket, __ATOMIC_RELEASE);
+}
+
+void smp_call_function(uint64_t cpus, void (*func)(void*), void* arg, bool wait) {
+    uint64_t tickets[MAX_CPUS];
+
+    // Interrupts off so we stay on this CPU, which also means the IPIs sent
+    // to us while we wait have to be handled by hand
+    uint64_t flags = cpu_irq_save();
+    uint32_t self = cpu_id();
+    cpus &= online_mask;
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu == self || !(cpus & (1ULL << cpu))) continue;
+        smp_call_t* slot = &call_slots[cpu];
+
+        // Wait for its previous call to finish
+        for (;;) {
+            spin_lock(&slot->lock);
+            if (slot->done == slot->requested) break;
+            spin_unlock(&slot->lock);
+            smp_handle_ipi();
+            cpu_pause();
+        }
+        slot->func = func;
+        slot->arg = arg;
+        tickets[cpu] = ++slot->requested;
+        spin_unlock(&slot->lock);
+
+        smp_send(cpu, SMP_IPI_CALL, SMP_CALL_VECTOR);
+    }
+
+    if (cpus & (1ULL << self)) func(arg);
+
+    if (wait) {
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (cpu == self || !(cpus & (1ULL << cpu))) continue;
+            while (__atomic_load_n(&call_slots[cpu].done, __ATOMIC_ACQUIRE) < tickets[cpu]) {
+                smp_handle_ipi();
+                cpu_pause();
+            }
+        }
+    }
+
+    cpu_irq_restore(flags);
+}
+
+void smp_handle_ipi(void) {
+    percpu_t* self = this_cpu();
+    if (!self->ipi_pending) return;
+
+    uint32_t pending = __atomic_exchange_n(&self->ipi_pending, 0, __ATOMIC_ACQ_REL);
+    if (pending & SMP_IPI_TLB) vmm_tlb_ipi();
+    if (pending & SMP_IPI_CALL) smp_run_call();
+    if (pending & SMP_IPI_RESCHED) scheduler_resched_ipi();
+}
@@ -0,0 +1,52 @@
+// kernel/smp.h
+// Multi-core bring-up and inter-processor interrupts
+// The BSP finds the other CPUs in the ACPI MADT and wakes them one by one
+// with INIT-SIPI-SIPI. Each AP goes real mode -> protected mode -> long mode
+// in a small trampoline copied below 1MB, picks up the kernel page tables
+// and ends up in its own idle thread.
+//
+// Created by: floof<3
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Where the AP trampoline gets copied (the PMM never hands out the first 1MB)
+#define SMP_TRAMPOLINE_ADDR 0x8000
+
+// IPI vectors (right above the LAPIC timer)
+#define SMP_RESCHED_VECTOR 0xF1
+#define SMP_TLB_VECTOR     0xF2
+#define SMP_CALL_VECTOR    0xF3
+
+// What a CPU has been asked to do (percpu_t.ipi_pending)
+#define SMP_IPI_RESCHED (1 << 0)
+#define SMP_IPI_TLB     (1 << 1)
+#define SMP_IPI_CALL    (1 << 2)
+
+// Start every AP listed in the MADT (after acpi_init, lapic_init and
+// scheduler_init). Without a MADT we just stay single CPU.
+void smp_init(void);
+
+// Number of CPUs up and running, BSP included
+uint32_t smp_cpu_count(void);
+
+// Bit per online CPU
+uint64_t smp_online_mask(void);
+
+// Kick a CPU into the scheduler / its TLB shootdown mailbox
+void smp_send_reschedule(uint32_t cpu);
+void smp_send_tlb_shootdown(uint32_t cpu);
+
+// Run func(arg) on every CPU in `cpus` (bit per CPU, ours included, offline
+// ones skipped). With wait, returns once they're all done.
+// Runs in interrupt context on the other CPUs, so func mustn't sleep.
+void smp_call_function(uint64_t cpus, void (*func)(void*), void* arg, bool wait);
+
+// Handle whatever IPIs are pending for this CPU
+// Body of the IPI vectors' handlers, also polled while interrupts are off
+void smp_handle_ipi(void);
+
+#endif // SMP_H
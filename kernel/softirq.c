@@ -0,0 +1,191 @@
+// kernel/softirq.c
+// Softirqs, tasklets and ksoftirqd
+//
+// Pending softirqs are a bitmask in this CPU's percpu_t, only ever touched
+// with interrupts off on that CPU, so raising one is a single OR. They run
+// with preemption off: a softirq can be interrupted, but never moved to
+// another CPU or switched away from halfway through.
+//
+// Created by: floof<3
+
+#include "softirq.h"
+#include "scheduler.h"
+#include "percpu.h"
+#include "smp.h"
+#include "rcu.h"
+#include "cpu.h"
+#include "../drivers/serial.h"
+
+#define TASKLET_SCHEDULED (1 << 0)  // On some CPU's list
+#define TASKLET_RUNNING   (1 << 1)  // Its function is running right now
+
+// ksoftirqd only gets the leftovers, but they shouldn't wait behind
+// background work either
+#define KSOFTIRQD_PRIORITY 4
+
+typedef struct {
+    tasklet_t* head;
+    tasklet_t* tail;
+} __attribute__((aligned(64))) tasklet_list_t;
+
+static void (*softirq_handlers[SOFTIRQ_COUNT])(void);
+static tasklet_list_t tasklet_lists[MAX_CPUS];
+static thread_t* ksoftirqd[MAX_CPUS];
+
+void softirq_register(uint32_t nr, void (*handler)(void)) {
+    if (nr < SOFTIRQ_COUNT) softirq_handlers[nr] = handler;
+}
+
+void softirq_raise(uint32_t nr) {
+    uint64_t flags = cpu_irq_save();
+    percpu_t* self = this_cpu();
+    self->softirq_pending |= 1u << nr;
+
+    // Nobody's going to call irq_exit() for us, let the thread run it
+    if (!self->irq_depth && !self->in_softirq && ksoftirqd[self->cpu_id]) {
+        thread_wake(ksoftirqd[self->cpu_id]);
+    }
+    cpu_irq_restore(flags);
+}
+
+// Run pending softirqs (interrupts off, comes back with them off)
+// Handlers run with interrupts on if irqs_on. True if there's still work
+// left after SOFTIRQ_MAX_RESTART rounds.
+static bool softirq_do(percpu_t* self, bool irqs_on) {
+    for (uint32_t round = 0; round < SOFTIRQ_MAX_RESTART; round++) {
+        uint32_t pending = self->softirq_pending;
+        if (!pending) return false;
+        self->softirq_pending = 0;
+
+        if (irqs_on) __asm__ volatile("sti" : : : "memory");
+        while (pending) {
+            uint32_t nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+            if (softirq_handlers[nr]) softirq_handlers[nr]();
+        }
+        __asm__ volatile("cli" : : : "memory");
+    }
+    return self->softirq_pending != 0;
+}
+
+void irq_enter(void) {
+    this_cpu()->irq_depth++;
+    rcu_irq_enter();  // Woke up an idle CPU: it's not quiescent anymore
+}
+
+void irq_exit(void) {
+    percpu_t* self = this_cpu();
+
+    // Softirqs run on the way out of the outermost interrupt, unless it
+    // interrupted a softirq (that one picks up the new bits itself)
+    if (--self->irq_depth == 0 && self->softirq_pending && !self->in_softirq) {
+        preempt_disable();
+        self->in_softirq = true;
+        bool more = softirq_do(self, true);
+        self->in_softirq = false;
+        preempt_enable();  // Interrupts are off, so no switch here
+
+        if (more && ksoftirqd[self->cpu_id]) thread_wake(ksoftirqd[self->cpu_id]);
+    }
+
+    scheduler_irq_exit();
+}
+
+bool in_interrupt(void) {
+    uint64_t flags = cpu_irq_save();
+    percpu_t* self = this_cpu();
+    bool inside = self->irq_depth || self->in_softirq;
+    cpu_irq_restore(flags);
+    return inside;
+}
+
+// Softirqs that didn't fit into irq_exit() or were raised outside interrupts
+static void ksoftirqd_main(void* arg) {
+    (void)arg;
+    percpu_t* self = this_cpu();  // We're pinned, this never changes
+
+    for (;;) {
+        preempt_disable();
+        uint64_t flags = cpu_irq_save();
+        bool more = false;
+        if (self->softirq_pending) {
+            self->in_softirq = true;
+            more = softirq_do(self, flags & CPU_FLAGS_IF);
+            self->in_softirq = false;
+        }
+        cpu_irq_restore(flags);
+        preempt_enable();
+
+        // Let everyone else have a go between batches
+        if (more) thread_yield();
+        else thread_block();
+    }
+}
+
+void tasklet_init(tasklet_t* tasklet, void (*func)(void*), void* arg) {
+    tasklet->next = NULL;
+    tasklet->func = func;
+    tasklet->arg = arg;
+    tasklet->state = 0;
+}
+
+// Append to this CPU's list and raise the softirq (interrupts off)
+static void tasklet_enqueue(tasklet_t* tasklet) {
+    tasklet_list_t* list = &tasklet_lists[cpu_id()];
+    tasklet->next = NULL;
+    if (list->tail) list->tail->next = tasklet;
+    else list->head = tasklet;
+    list->tail = tasklet;
+    softirq_raise(SOFTIRQ_TASKLET);
+}
+
+void tasklet_schedule(tasklet_t* tasklet) {
+    if (__atomic_fetch_or(&tasklet->state, TASKLET_SCHEDULED, __ATOMIC_ACQ_REL) & TASKLET_SCHEDULED) {
+        return;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    tasklet_enqueue(tasklet);
+    cpu_irq_restore(flags);
+}
+
+static void tasklet_action(void) {
+    uint64_t flags = cpu_irq_save();
+    tasklet_list_t* list = &tasklet_lists[cpu_id()];
+    tasklet_t* tasklet = list->head;
+    list->head = list->tail = NULL;
+    cpu_irq_restore(flags);
+
+    while (tasklet) {
+        tasklet_t* next = tasklet->next;
+
+        if (__atomic_fetch_or(&tasklet->state, TASKLET_RUNNING, __ATOMIC_ACQUIRE) & TASKLET_RUNNING) {
+            // Still running on another CPU (it was rescheduled from there):
+            // try again next round
+            flags = cpu_irq_save();
+            tasklet_enqueue(tasklet);
+            cpu_irq_restore(flags);
+        } else {
+            // Unscheduled before it runs, so it can schedule itself again
+            __atomic_and_fetch(&tasklet->state, ~TASKLET_SCHEDULED, __ATOMIC_ACQ_REL);
+            tasklet->func(tasklet->arg);
+            __atomic_and_fetch(&tasklet->state, ~TASKLET_RUNNING, __ATOMIC_RELEASE);
+        }
+
+        tasklet = next;
+    }
+}
+
+void softirq_init(void) {
+    softirq_register(SOFTIRQ_TASKLET, tasklet_action);
+
+    uint64_t online = smp_online_mask();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(online & (1ULL << cpu))) continue;
+
+        char name[] = "ksoftirqd/0";
+        name[sizeof(name) - 2] = '0' + cpu;
+        ksoftirqd[cpu] = thread_create_on(cpu, name, ksoftirqd_main, NULL, KSOFTIRQD_PRIORITY);
+        if (!ksoftirqd[cpu]) serial_write("SOFTIRQ: ERROR - Can't create ksoftirqd\n");
+    }
+}
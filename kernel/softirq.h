@@ -0,0 +1,63 @@
+// kernel/softirq.h
+// Deferred interrupt work (bottom halves)
+// Interrupt handlers should only acknowledge the device and queue work.
+// The real processing then happens in one of three places:
+//
+//   softirq   - fixed list of handlers, run on the way out of the outermost
+//               interrupt with interrupts back on (or by ksoftirqd when
+//               there's too much of it). Can't sleep.
+//   tasklet   - dynamically created softirq work, a given tasklet never
+//               runs on two CPUs at once. Can't sleep. Good for drivers.
+//   workqueue - see workqueue.h, runs in a kernel thread and can sleep.
+//
+// Created by: floof<3
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Softirqs, in the order they run
+#define SOFTIRQ_TIMER   0   // Timer wheel
+#define SOFTIRQ_NET_RX  1   // Network receive
+#define SOFTIRQ_NET_TX  2   // Network transmit completions
+#define SOFTIRQ_TASKLET 3   // Tasklets
+#define SOFTIRQ_RCU     4   // RCU callbacks past their grace period
+#define SOFTIRQ_COUNT   5
+
+// Rounds of softirqs on interrupt exit before the rest goes to ksoftirqd
+#define SOFTIRQ_MAX_RESTART 10
+
+typedef struct tasklet {
+    struct tasklet* next;
+    void (*func)(void* arg);
+    void* arg;
+    volatile uint32_t state;    // TASKLET_* bits (softirq.c)
+} tasklet_t;
+
+// Interrupt handler prologue/epilogue: irq_exit() runs pending softirqs
+// (outermost interrupt only) and then lets the scheduler switch
+void irq_enter(void);
+void irq_exit(void);
+
+// In an interrupt handler or a softirq? (can't sleep then)
+bool in_interrupt(void);
+
+// Set up the tasklet softirq and a ksoftirqd thread per online CPU
+// (after smp_init)
+void softirq_init(void);
+
+// Handler for softirq `nr` (at init, before it's ever raised)
+void softirq_register(uint32_t nr, void (*handler)(void));
+
+// Ask for softirq `nr` to run on this CPU
+// From an interrupt it runs at irq_exit(), otherwise ksoftirqd runs it.
+void softirq_raise(uint32_t nr);
+
+void tasklet_init(tasklet_t* tasklet, void (*func)(void*), void* arg);
+
+// Run the tasklet soon on this CPU (no-op if it's already scheduled)
+void tasklet_schedule(tasklet_t* tasklet);
+
+#endif // SOFTIRQ_H
@@ -0,0 +1,59 @@
+// kernel/spinlock.c
+// Lock contention counters
+// The locks themselves are all inline (spinlock.h), this just keeps the
+// list of counted locks and prints it.
+//
+// Created by: floof<3
+
+#include "spinlock.h"
+#include "clock.h"
+#include "../drivers/serial.h"
+
+static lock_stats_t* stats_list = NULL;
+static spinlock_t stats_list_lock = SPINLOCK_INIT;
+
+static void lock_stats_register(lock_stats_t* stats, const char* name) {
+    stats->name = name;
+    stats->acquisitions = 0;
+    stats->contended = 0;
+    stats->spins = 0;
+    stats->max_hold = 0;
+    stats->hold_start = 0;
+
+    uint64_t flags = spin_lock_irqsave(&stats_list_lock);
+    stats->next = stats_list;
+    stats_list = stats;
+    spin_unlock_irqrestore(&stats_list_lock, flags);
+}
+
+void spin_lock_stats(spinlock_t* lock, lock_stats_t* stats, const char* name) {
+    lock_stats_register(stats, name);
+    lock->stats = stats;
+}
+
+void mcs_lock_stats(mcs_lock_t* lock, lock_stats_t* stats, const char* name) {
+    lock_stats_register(stats, name);
+    lock->stats = stats;
+}
+
+void lock_stats_dump(void) {
+    uint64_t flags = spin_lock_irqsave(&stats_list_lock);
+
+    serial_write("LOCK: name acquisitions contended spins/wait max-hold-ns\n");
+    for (lock_stats_t* stats = stats_list; stats; stats = stats->next) {
+        // Racy reads of someone else's counters, good enough for a dump
+        serial_write("LOCK: ");
+        serial_write(stats->name);
+        serial_write(" ");
+        serial_write_dec(stats->acquisitions);
+        serial_write(" ");
+        serial_write_dec(stats->contended);
+        serial_write(" ");
+        serial_write_dec(stats->contended ? stats->spins / stats->contended : 0);
+        serial_write(" ");
+        serial_write_dec(clock_tsc_to_ns(stats->max_hold));
+        serial_write("\n");
+    }
+
+    spin_unlock_irqrestore(&stats_list_lock, flags);
+}
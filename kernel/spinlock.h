@@ -0,0 +1,188 @@
+// kernel/spinlock.h
+// Spinlocks for the kernel
+//
+// spinlock_t is a ticket lock: taking it draws a number, unlocking serves
+// the next one, so CPUs get the lock in the order they asked (no starving
+// one CPU because another keeps winning the cache line race). Good for
+// locks that are mostly uncontended.
+//
+// mcs_lock_t is a queue lock for the contended ones: every waiter spins on
+// its own node (on its own stack) instead of everyone hammering the lock's
+// cache line, so a release only touches the next waiter's line.
+//
+// Either kind can carry contention counters (lock_stats_t), see
+// spin_lock_stats() / mcs_lock_stats() and lock_stats_dump().
+//
+// Created by: floof<3
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+// Contention counters of one lock (only touched by whoever holds it)
+typedef struct lock_stats {
+    const char* name;
+    uint64_t acquisitions;
+    uint64_t contended;       // Acquisitions that had to wait
+    uint64_t spins;           // Pause loops spent waiting, all together
+    uint64_t max_hold;        // Longest it was held (TSC cycles)
+    uint64_t hold_start;
+    struct lock_stats* next;  // All registered stats, for lock_stats_dump()
+} lock_stats_t;
+
+typedef struct {
+    union {
+        volatile uint32_t value;
+        struct {
+            volatile uint16_t owner;  // Ticket being served
+            volatile uint16_t next;   // Next ticket to hand out
+        };
+    };
+    lock_stats_t* stats;              // NULL = no counters
+} spinlock_t;
+
+#define SPINLOCK_INIT { { 0 }, NULL }
+
+static inline void lock_stats_acquired(lock_stats_t* stats, bool contended, uint64_t spins) {
+    stats->acquisitions++;
+    if (contended) stats->contended++;
+    stats->spins += spins;
+    stats->hold_start = cpu_rdtsc();
+}
+
+static inline void lock_stats_released(lock_stats_t* stats) {
+    uint64_t held = cpu_rdtsc() - stats->hold_start;
+    if (held > stats->max_hold) stats->max_hold = held;
+}
+
+// Take the lock, calling relax() while waiting (answering IPIs the holder
+// might be waiting on), NULL = just spin
+static inline void spin_lock_relax(spinlock_t* lock, void (*relax)(void)) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+
+    // Spin on a plain read so we don't hammer the cache line with writes
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        if (relax) relax();
+        cpu_pause();
+        spins++;
+    }
+
+    if (lock->stats) lock_stats_acquired(lock->stats, spins != 0, spins);
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    spin_lock_relax(lock, NULL);
+}
+
+// One shot, true if we got it (for taking a second lock without deadlocking)
+static inline bool spin_trylock(spinlock_t* lock) {
+    uint32_t value = lock->value;
+    if ((uint16_t)value != (uint16_t)(value >> 16)) return false;
+
+    // Free: take the next ticket, which is also the one being served
+    if (!__atomic_compare_exchange_n(&lock->value, &value, value + (1u << 16), false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    if (lock->stats) lock_stats_acquired(lock->stats, false, 0);
+    return true;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    if (lock->stats) lock_stats_released(lock->stats);
+    // Only the holder writes owner, no need for a locked add
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(spinlock_t* lock) {
+    uint32_t value = lock->value;
+    return (uint16_t)value != (uint16_t)(value >> 16);
+}
+
+// Lock + disable interrupts (for data that interrupt handlers touch too)
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = cpu_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spin_unlock(lock);
+    cpu_irq_restore(flags);
+}
+
+// MCS queue lock
+// Every lock/unlock pair needs a node that stays put until the unlock,
+// usually a local: mcs_node_t node; mcs_lock(&lock, &node); ... mcs_unlock(&lock, &node);
+typedef struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile uint32_t waiting;
+} mcs_node_t;
+
+typedef struct {
+    mcs_node_t* volatile tail;  // Last in line, NULL = free
+    lock_stats_t* stats;
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT { NULL, NULL }
+
+static inline void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    node->next = NULL;
+    node->waiting = 1;
+
+    mcs_node_t* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    uint64_t spins = 0;
+    if (prev) {
+        // Get in line behind prev, it clears our flag when it's done
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->waiting, __ATOMIC_ACQUIRE)) {
+            cpu_pause();
+            spins++;
+        }
+    }
+
+    if (lock->stats) lock_stats_acquired(lock->stats, prev != NULL, spins);
+}
+
+static inline void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    if (lock->stats) lock_stats_released(lock->stats);
+
+    mcs_node_t* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        // Nobody behind us, unless someone is between the exchange and
+        // linking in: then wait for the link
+        mcs_node_t* expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) cpu_pause();
+    }
+    __atomic_store_n(&next->waiting, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node) {
+    uint64_t flags = cpu_irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, uint64_t flags) {
+    mcs_unlock(lock, node);
+    cpu_irq_restore(flags);
+}
+
+// Start counting contention on a lock (stats has to live as long as the
+// lock, usually a static next to it). Do it before the lock is shared.
+void spin_lock_stats(spinlock_t* lock, lock_stats_t* stats, const char* name);
+void mcs_lock_stats(mcs_lock_t* lock, lock_stats_t* stats, const char* name);
+
+// Print every counted lock over serial
+void lock_stats_dump(void);
+
+#endif // SPINLOCK_H
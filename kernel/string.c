@@ -0,0 +1,625 @@
+// kernel/string.c
+// memset/memcpy and friends for the kernel (no libc in here)
+// GCC calls these behind our backs for struct copies, so they have to exist
+// (and be fast, they're on every path). Three size classes:
+//   <= 64 bytes   a few overlapping 8-byte moves, no loop, no setup
+//   mid           rep movsb/stosb on ERMS CPUs (Ivy Bridge and newer), else
+//                 rep movsq or an SSE2/AVX2 loop
+//   huge          non-temporal stores, so a multi-megabyte copy doesn't
+//                 flush everything else out of the cache
+// string_init() picks the mid/huge flavors with CPUID, until then it's the
+// plain rep string versions (which work everywhere).
+//
+// The vector loops use XMM/YMM registers in inline asm without listing them
+// as clobbers: with -mgeneral-regs-only GCC keeps nothing in there (and
+// refuses to hear about them), kernel_fpu_begin() keeps everyone else off.
+//
+// Created by: floof<3
+
+#include "memory.h"
+#include "fpu.h"
+#include "cpu.h"
+#include "../drivers/serial.h"
+
+#define STRING_SMALL       64            // Up to here: copy_small()/set_small()
+#define STRING_SIMD_MIN    512           // Vector loops only win past kernel_fpu_begin()'s cost
+#define STRING_NT_DEFAULT  (1024 * 1024) // Non-temporal from here if CPUID won't say the cache size
+#define STRING_NT_MIN      (256 * 1024)
+
+#define CPUID_7_EBX_ERMS   (1 << 9)      // Enhanced rep movsb/stosb
+
+typedef uint64_t unaligned_u64 __attribute__((aligned(1), may_alias));
+typedef uint32_t unaligned_u32 __attribute__((aligned(1), may_alias));
+
+typedef void (*copy_fn_t)(uint8_t* d, const uint8_t* s, size_t n);
+typedef void (*set_fn_t)(uint8_t* d, uint64_t v, size_t n);  // v = the byte, 8 times
+
+static inline uint64_t load64(const uint8_t* p) { return *(const unaligned_u64*)p; }
+static inline void store64(uint8_t* p, uint64_t v) { *(unaligned_u64*)p = v; }
+static inline uint32_t load32(const uint8_t* p) { return *(const unaligned_u32*)p; }
+static inline void store32(uint8_t* p, uint32_t v) { *(unaligned_u32*)p = v; }
+
+// Up to 64 bytes. Everything is loaded before anything is stored, so this
+// is overlap safe too (memmove uses it as is).
+static inline void copy_small(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n > 32) {
+        uint64_t a = load64(s), b = load64(s + 8), c = load64(s + 16), e = load64(s + 24);
+        uint64_t w = load64(s + n - 32), x = load64(s + n - 24), y = load64(s + n - 16), z = load64(s + n - 8);
+        store64(d, a); store64(d + 8, b); store64(d + 16, c); store64(d + 24, e);
+        store64(d + n - 32, w); store64(d + n - 24, x); store64(d + n - 16, y); store64(d + n - 8, z);
+    } else if (n >= 16) {
+        uint64_t a = load64(s), b = load64(s + 8), y = load64(s + n - 16), z = load64(s + n - 8);
+        store64(d, a); store64(d + 8, b); store64(d + n - 16, y); store64(d + n - 8, z);
+    } else if (n >= 8) {
+        uint64_t a = load64(s), z = load64(s + n - 8);
+        store64(d, a); store64(d + n - 8, z);
+    } else if (n >= 4) {
+        uint32_t a = load32(s), z = load32(s + n - 4);
+        store32(d, a); store32(d + n - 4, z);
+    } else if (n) {
+        uint8_t a = s[0], b = s[n / 2], z = s[n - 1];
+        d[0] = a; d[n / 2] = b; d[n - 1] = z;
+    }
+}
+
+static inline void set_small(uint8_t* d, uint64_t v, size_t n) {
+    if (n > 32) {
+        store64(d, v); store64(d + 8, v); store64(d + 16, v); store64(d + 24, v);
+        store64(d + n - 32, v); store64(d + n - 24, v); store64(d + n - 16, v); store64(d + n - 8, v);
+    } else if (n >= 16) {
+        store64(d, v); store64(d + 8, v); store64(d + n - 16, v); store64(d + n - 8, v);
+    } else if (n >= 8) {
+        store64(d, v); store64(d + n - 8, v);
+    } else if (n >= 4) {
+        store32(d, v); store32(d + n - 4, v);
+    } else if (n) {
+        d[0] = v; d[n / 2] = v; d[n - 1] = v;
+    }
+}
+
+// Whatever's left after a 128-byte loop
+static inline void copy_tail(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n > STRING_SMALL) {
+        copy_small(d, s, STRING_SMALL);
+        d += STRING_SMALL; s += STRING_SMALL; n -= STRING_SMALL;
+    }
+    copy_small(d, s, n);
+}
+
+static inline void set_tail(uint8_t* d, uint64_t v, size_t n) {
+    if (n > STRING_SMALL) {
+        set_small(d, v, STRING_SMALL);
+        d += STRING_SMALL; n -= STRING_SMALL;
+    }
+    set_small(d, v, n);
+}
+
+// ---- Mid sizes ----
+
+static void copy_erms(uint8_t* d, const uint8_t* s, size_t n) {
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static void copy_movsq(uint8_t* d, const uint8_t* s, size_t n) {
+    size_t words = n / 8;
+    __asm__ volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+    copy_small(d, s, n & 7);
+}
+
+static void copy_sse2(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n < STRING_SIMD_MIN || !kernel_fpu_usable()) {
+        copy_movsq(d, s, n);
+        return;
+    }
+
+    size_t blocks = n / 64;
+    kernel_fpu_begin();
+    __asm__ volatile(
+        "1:\n\t"
+        "movdqu (%1), %%xmm0\n\t"
+        "movdqu 16(%1), %%xmm1\n\t"
+        "movdqu 32(%1), %%xmm2\n\t"
+        "movdqu 48(%1), %%xmm3\n\t"
+        "movdqu %%xmm0, (%0)\n\t"
+        "movdqu %%xmm1, 16(%0)\n\t"
+        "movdqu %%xmm2, 32(%0)\n\t"
+        "movdqu %%xmm3, 48(%0)\n\t"
+        "add $64, %1\n\t"
+        "add $64, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b"
+        : "+r"(d), "+r"(s), "+r"(blocks) : : "memory");
+    kernel_fpu_end();
+    copy_small(d, s, n & 63);
+}
+
+static void copy_avx2(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n < STRING_SIMD_MIN || !kernel_fpu_usable()) {
+        copy_movsq(d, s, n);
+        return;
+    }
+
+    size_t blocks = n / 128;
+    kernel_fpu_begin();
+    __asm__ volatile(
+        "1:\n\t"
+        "vmovdqu (%1), %%ymm0\n\t"
+        "vmovdqu 32(%1), %%ymm1\n\t"
+        "vmovdqu 64(%1), %%ymm2\n\t"
+        "vmovdqu 96(%1), %%ymm3\n\t"
+        "vmovdqu %%ymm0, (%0)\n\t"
+        "vmovdqu %%ymm1, 32(%0)\n\t"
+        "vmovdqu %%ymm2, 64(%0)\n\t"
+        "vmovdqu %%ymm3, 96(%0)\n\t"
+        "add $128, %1\n\t"
+        "add $128, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b\n\t"
+        "vzeroupper"                 // Dirty upper halves make later SSE code crawl
+        : "+r"(d), "+r"(s), "+r"(blocks) : : "memory");
+    kernel_fpu_end();
+    copy_tail(d, s, n & 127);
+}
+
+static void set_erms(uint8_t* d, uint64_t v, size_t n) {
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(v) : "memory");
+}
+
+static void set_stosq(uint8_t* d, uint64_t v, size_t n) {
+    size_t words = n / 8;
+    __asm__ volatile("rep stosq" : "+D"(d), "+c"(words) : "a"(v) : "memory");
+    set_small(d, v, n & 7);
+}
+
+// ---- Non-temporal ----
+// The destination gets aligned with a normal copy first, then the stores go
+// around the cache. They're weakly ordered: whoever calls these owes an
+// sfence (memory_nt_fence()) before anyone else looks at the data.
+
+static void copy_nt_movnti(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n <= STRING_SMALL) {
+        copy_small(d, s, n);
+        return;
+    }
+    size_t head = -(uintptr_t)d & 7;
+    copy_small(d, s, head);
+    d += head; s += head; n -= head;
+
+    size_t blocks = n / 32;
+    __asm__ volatile(
+        "1:\n\t"
+        "mov (%1), %%rax\n\t"
+        "mov 8(%1), %%rcx\n\t"
+        "mov 16(%1), %%rdx\n\t"
+        "mov 24(%1), %%r8\n\t"
+        "movnti %%rax, (%0)\n\t"
+        "movnti %%rcx, 8(%0)\n\t"
+        "movnti %%rdx, 16(%0)\n\t"
+        "movnti %%r8, 24(%0)\n\t"
+        "add $32, %1\n\t"
+        "add $32, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b"
+        : "+r"(d), "+r"(s), "+r"(blocks) : : "rax", "rcx", "rdx", "r8", "memory");
+    copy_small(d, s, n & 31);
+}
+
+static void copy_nt_sse2(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n < STRING_SIMD_MIN || !kernel_fpu_usable()) {
+        copy_nt_movnti(d, s, n);
+        return;
+    }
+    size_t head = -(uintptr_t)d & 15;
+    copy_small(d, s, head);
+    d += head; s += head; n -= head;
+
+    size_t blocks = n / 64;
+    kernel_fpu_begin();
+    __asm__ volatile(
+        "1:\n\t"
+        "movdqu (%1), %%xmm0\n\t"
+        "movdqu 16(%1), %%xmm1\n\t"
+        "movdqu 32(%1), %%xmm2\n\t"
+        "movdqu 48(%1), %%xmm3\n\t"
+        "movntdq %%xmm0, (%0)\n\t"
+        "movntdq %%xmm1, 16(%0)\n\t"
+        "movntdq %%xmm2, 32(%0)\n\t"
+        "movntdq %%xmm3, 48(%0)\n\t"
+        "add $64, %1\n\t"
+        "add $64, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b"
+        : "+r"(d), "+r"(s), "+r"(blocks) : : "memory");
+    kernel_fpu_end();
+    copy_small(d, s, n & 63);
+}
+
+static void copy_nt_avx2(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n < STRING_SIMD_MIN || !kernel_fpu_usable()) {
+        copy_nt_movnti(d, s, n);
+        return;
+    }
+    size_t head = -(uintptr_t)d & 31;
+    copy_small(d, s, head);
+    d += head; s += head; n -= head;
+
+    size_t blocks = n / 128;
+    kernel_fpu_begin();
+    __asm__ volatile(
+        "1:\n\t"
+        "vmovdqu (%1), %%ymm0\n\t"
+        "vmovdqu 32(%1), %%ymm1\n\t"
+        "vmovdqu 64(%1), %%ymm2\n\t"
+        "vmovdqu 96(%1), %%ymm3\n\t"
+        "vmovntdq %%ymm0, (%0)\n\t"
+        "vmovntdq %%ymm1, 32(%0)\n\t"
+        "vmovntdq %%ymm2, 64(%0)\n\t"
+        "vmovntdq %%ymm3, 96(%0)\n\t"
+        "add $128, %1\n\t"
+        "add $128, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b\n\t"
+        "vzeroupper"
+        : "+r"(d), "+r"(s), "+r"(blocks) : : "memory");
+    kernel_fpu_end();
+    copy_tail(d, s, n & 127);
+}
+
+static void set_nt_movnti(uint8_t* d, uint64_t v, size_t n) {
+    if (n <= STRING_SMALL) {
+        set_small(d, v, n);
+        return;
+    }
+    size_t head = -(uintptr_t)d & 7;
+    set_small(d, v, head);
+    d += head; n -= head;
+
+    size_t blocks = n / 32;
+    __asm__ volatile(
+        "1:\n\t"
+        "movnti %2, (%0)\n\t"
+        "movnti %2, 8(%0)\n\t"
+        "movnti %2, 16(%0)\n\t"
+        "movnti %2, 24(%0)\n\t"
+        "add $32, %0\n\t"
+        "dec %1\n\t"
+        "jnz 1b"
+        : "+r"(d), "+r"(blocks) : "r"(v) : "memory");
+    set_small(d, v, n & 31);
+}
+
+static void set_nt_sse2(uint8_t* d, uint64_t v, size_t n) {
+    if (n < STRING_SIMD_MIN || !kernel_fpu_usable()) {
+        set_nt_movnti(d, v, n);
+        return;
+    }
+    size_t head = -(uintptr_t)d & 15;
+    set_small(d, v, head);
+    d += head; n -= head;
+
+    size_t blocks = n / 64;
+    kernel_fpu_begin();
+    __asm__ volatile(
+        "movq %2, %%xmm0\n\t"
+        "punpcklqdq %%xmm0, %%xmm0\n\t"
+        "1:\n\t"
+        "movntdq %%xmm0, (%0)\n\t"
+        "movntdq %%xmm0, 16(%0)\n\t"
+        "movntdq %%xmm0, 32(%0)\n\t"
+        "movntdq %%xmm0, 48(%0)\n\t"
+        "add $64, %0\n\t"
+        "dec %1\n\t"
+        "jnz 1b"
+        : "+r"(d), "+r"(blocks) : "r"(v) : "memory");
+    kernel_fpu_end();
+    set_small(d, v, n & 63);
+}
+
+static void set_nt_avx2(uint8_t* d, uint64_t v, size_t n) {
+    if (n < STRING_SIMD_MIN || !kernel_fpu_usable()) {
+        set_nt_movnti(d, v, n);
+        return;
+    }
+    size_t head = -(uintptr_t)d & 31;
+    set_small(d, v, head);
+    d += head; n -= head;
+
+    size_t blocks = n / 128;
+    kernel_fpu_begin();
+    __asm__ volatile(
+        "vmovq %2, %%xmm0\n\t"
+        "vpbroadcastq %%xmm0, %%ymm0\n\t"
+        "1:\n\t"
+        "vmovntdq %%ymm0, (%0)\n\t"
+        "vmovntdq %%ymm0, 32(%0)\n\t"
+        "vmovntdq %%ymm0, 64(%0)\n\t"
+        "vmovntdq %%ymm0, 96(%0)\n\t"
+        "add $128, %0\n\t"
+        "dec %1\n\t"
+        "jnz 1b\n\t"
+        "vzeroupper"
+        : "+r"(d), "+r"(blocks) : "r"(v) : "memory");
+    kernel_fpu_end();
+    set_tail(d, v, n & 127);
+}
+
+// ---- Dispatch ----
+
+static bool has_erms = false;
+static size_t nt_threshold = STRING_NT_DEFAULT;
+static copy_fn_t copy_mid = copy_erms;
+static copy_fn_t copy_huge = copy_nt_movnti;
+static set_fn_t set_mid = set_erms;
+static set_fn_t set_huge = set_nt_movnti;
+
+static inline uint64_t set_pattern(int val) {
+    return (uint8_t)val * 0x0101010101010101ULL;
+}
+
+void* memset(void* dest, int val, size_t count) {
+    uint64_t v = set_pattern(val);
+    if (count <= STRING_SMALL) set_small(dest, v, count);
+    else if (count < nt_threshold) set_mid(dest, v, count);
+    else {
+        set_huge(dest, v, count);
+        memory_nt_fence();
+    }
+    return dest;
+}
+
+void* memcpy(void* dest, const void* src, size_t count) {
+    if (count <= STRING_SMALL) copy_small(dest, src, count);
+    else if (count < nt_threshold) copy_mid(dest, src, count);
+    else {
+        copy_huge(dest, src, count);
+        memory_nt_fence();
+    }
+    return dest;
+}
+
+void* memcpy_nt(void* dest, const void* src, size_t count) {
+    copy_huge(dest, src, count);
+    return dest;
+}
+
+void* memset_nt(void* dest, int val, size_t count) {
+    set_huge(dest, set_pattern(val), count);
+    return dest;
+}
+
+// Top down, 32 bytes at a time. With dest above src, a block's stores can
+// only land on bytes that were already read.
+static void move_backward(uint8_t* d, const uint8_t* s, size_t n) {
+    while (n >= 32) {
+        n -= 32;
+        uint64_t a = load64(s + n), b = load64(s + n + 8), c = load64(s + n + 16), e = load64(s + n + 24);
+        store64(d + n, a); store64(d + n + 8, b); store64(d + n + 16, c); store64(d + n + 24, e);
+    }
+    copy_small(d, s, n);
+}
+
+// Overlap-safe copy: forwards if dest is below src, backwards otherwise
+void* memmove(void* dest, const void* src, size_t count) {
+    uintptr_t d = (uintptr_t)dest;
+    uintptr_t s = (uintptr_t)src;
+
+    if (count <= STRING_SMALL) {
+        copy_small(dest, src, count);
+    } else if (d + count <= s || s + count <= d) {
+        memcpy(dest, src, count);
+    } else if (d < s) {
+        // rep movs go up one element at a time, which is exactly what this needs
+        if (has_erms) copy_erms(dest, src, count);
+        else copy_movsq(dest, src, count);
+    } else if (d > s) {
+        move_backward(dest, src, count);
+    }
+    return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t count) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    // Skip the equal words, then find the byte that differs
+    while (count >= 8 && load64(x) == load64(y)) {
+        x += 8;
+        y += 8;
+        count -= 8;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (x[i] != y[i]) return x[i] - y[i];
+    }
+    return 0;
+}
+
+// Biggest data/unified cache: CPUID leaf 4 on Intel, 0x80000006 on AMD
+static size_t string_cache_size(void) {
+    uint32_t eax, ebx, ecx, edx;
+    size_t best = 0;
+
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 4) {
+        for (uint32_t i = 0; i < 16; i++) {
+            cpu_cpuid(4, i, &eax, &ebx, &ecx, &edx);
+            uint32_t type = eax & 0x1F;
+            if (!type) break;
+            if (type == 2) continue;  // Instruction cache
+
+            size_t ways = (ebx >> 22) + 1;
+            size_t partitions = ((ebx >> 12) & 0x3FF) + 1;
+            size_t line = (ebx & 0xFFF) + 1;
+            size_t sets = (size_t)ecx + 1;
+            size_t size = ways * partitions * line * sets;
+            if (size > best) best = size;
+        }
+    }
+    if (best) return best;
+
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000006) {
+        cpu_cpuid(0x80000006, 0, &eax, &ebx, &ecx, &edx);
+        size_t l3 = (size_t)(edx >> 18) * 512 * 1024;
+        size_t l2 = (size_t)(ecx >> 16) * 1024;
+        best = l3 ? l3 : l2;
+    }
+    return best;
+}
+
+void string_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t fpu = fpu_features();
+
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        has_erms = ebx & CPUID_7_EBX_ERMS;
+    }
+
+    // ERMS microcode beats any loop we could write for in-cache sizes
+    if (has_erms) {
+        copy_mid = copy_erms;
+        set_mid = set_erms;
+    } else {
+        copy_mid = (fpu & FPU_FEATURE_AVX2) ? copy_avx2 : (fpu & FPU_FEATURE_SSE2) ? copy_sse2 : copy_movsq;
+        set_mid = set_stosq;
+    }
+
+    if (fpu & FPU_FEATURE_AVX2) {
+        copy_huge = copy_nt_avx2;
+        set_huge = set_nt_avx2;
+    } else if (fpu & FPU_FEATURE_SSE2) {
+        copy_huge = copy_nt_sse2;
+        set_huge = set_nt_sse2;
+    }
+
+    // Past half the last level cache, caching the destination only evicts
+    // things somebody still wants
+    size_t cache = string_cache_size();
+    nt_threshold = cache ? cache / 2 : STRING_NT_DEFAULT;
+    if (nt_threshold < STRING_NT_MIN) nt_threshold = STRING_NT_MIN;
+
+    serial_write("STRING: ");
+    serial_write(has_erms ? "erms" : copy_mid == copy_avx2 ? "avx2" : copy_mid == copy_sse2 ? "sse2" : "movsq");
+    serial_write(", non-temporal (");
+    serial_write(copy_huge == copy_nt_avx2 ? "avx2" : copy_huge == copy_nt_sse2 ? "sse2" : "movnti");
+    serial_write(") from ");
+    serial_write_dec(nt_threshold / 1024);
+    serial_write("KB\n");
+}
+
+#ifdef STRING_BENCH
+#include "vmm.h"
+#include "clock.h"
+
+#define BENCH_MAX    (8 * 1024 * 1024)
+#define BENCH_BYTES  (32 * 1024 * 1024)  // Per measurement, however many calls that takes
+
+typedef struct {
+    const char* name;
+    copy_fn_t copy;
+    set_fn_t set;
+    uint32_t needs;  // FPU_FEATURE_* bits
+} bench_variant_t;
+
+// What stubs.c/network.c/framebuffer.c used to do (volatile, or GCC turns it
+// back into a memcpy call)
+static void bench_copy_bytes(uint8_t* d, const uint8_t* s, size_t n) {
+    volatile uint8_t* vd = d;
+    for (size_t i = 0; i < n; i++) vd[i] = s[i];
+}
+
+static void bench_set_bytes(uint8_t* d, uint64_t v, size_t n) {
+    volatile uint8_t* vd = d;
+    for (size_t i = 0; i < n; i++) vd[i] = v;
+}
+
+static void bench_memcpy(uint8_t* d, const uint8_t* s, size_t n) {
+    memcpy(d, s, n);
+}
+
+static void bench_memset(uint8_t* d, uint64_t v, size_t n) {
+    memset(d, v, n);
+}
+
+static const bench_variant_t bench_variants[] = {
+    { "bytes",   bench_copy_bytes, bench_set_bytes, 0 },
+    { "movsq",   copy_movsq,       set_stosq,       0 },
+    { "erms",    copy_erms,        set_erms,        0 },
+    { "sse2",    copy_sse2,        NULL,            FPU_FEATURE_SSE2 },
+    { "avx2",    copy_avx2,        NULL,            FPU_FEATURE_AVX2 },
+    { "movnti",  copy_nt_movnti,   set_nt_movnti,   0 },
+    { "nt-sse2", copy_nt_sse2,     set_nt_sse2,     FPU_FEATURE_SSE2 },
+    { "nt-avx2", copy_nt_avx2,     set_nt_avx2,     FPU_FEATURE_AVX2 },
+    { "dispatch", bench_memcpy,    bench_memset,    0 },  // What memcpy()/memset() pick
+};
+
+static const size_t bench_sizes[] = {
+    8, 64, 512, 4096, 32 * 1024, 256 * 1024, 2 * 1024 * 1024, BENCH_MAX,
+};
+
+static void bench_write_size(size_t size) {
+    if (size >= 1024 * 1024) {
+        serial_write_dec(size / (1024 * 1024));
+        serial_write("M");
+    } else if (size >= 1024) {
+        serial_write_dec(size / 1024);
+        serial_write("K");
+    } else {
+        serial_write_dec(size);
+    }
+}
+
+// MB/s for one variant at one size
+static uint64_t bench_run(const bench_variant_t* variant, bool copy, uint8_t* dst, uint8_t* src, size_t size) {
+    size_t calls = BENCH_BYTES / size;
+    uint64_t start = clock_ns();
+    for (size_t i = 0; i < calls; i++) {
+        if (copy) variant->copy(dst, src, size);
+        else variant->set(dst, 0x5A, size);
+    }
+    memory_nt_fence();
+    uint64_t ns = clock_ns() - start;
+    return ns ? (uint64_t)calls * size * 1000 / ns : 0;
+}
+
+// Throughput of every flavor from 8 bytes to 8MB (make STRING_BENCH=1).
+// Needs the heap, the clock and a current thread (for the vector ones).
+void string_benchmark(void) {
+    uint8_t* src = vmalloc(BENCH_MAX);
+    uint8_t* dst = vmalloc(BENCH_MAX);
+    if (!src || !dst) {
+        serial_write("STRING: ERROR - No memory for the benchmark\n");
+        if (src) vfree(src);
+        if (dst) vfree(dst);
+        return;
+    }
+    // Fault everything in first
+    memset(src, 0xA5, BENCH_MAX);
+    memset(dst, 0, BENCH_MAX);
+
+    uint32_t fpu = fpu_features();
+    for (int copy = 1; copy >= 0; copy--) {
+        serial_write(copy ? "STRING: memcpy MB/s\n" : "STRING: memset MB/s\n");
+        for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+            serial_write("  ");
+            bench_write_size(bench_sizes[i]);
+            serial_write(":");
+            for (size_t v = 0; v < sizeof(bench_variants) / sizeof(bench_variants[0]); v++) {
+                const bench_variant_t* variant = &bench_variants[v];
+                if ((variant->needs & fpu) != variant->needs) continue;
+                if (copy ? !variant->copy : !variant->set) continue;
+
+                serial_write(" ");
+                serial_write(variant->name);
+                serial_write("=");
+                serial_write_dec(bench_run(variant, copy, dst, src, bench_sizes[i]));
+            }
+            serial_write("\n");
+        }
+    }
+
+    vfree(src);
+    vfree(dst);
+}
+#endif
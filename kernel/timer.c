@@ -0,0 +1,242 @@
+// kernel/timer.c
+// Hierarchical timer wheel (one per CPU)
+//
+// All slots live in one array: 0-255 is level 0 (one tick each), then 64
+// slots per coarser level. A timer goes on the finest level whose range
+// covers how far away it is. Whenever level 0 wraps, the next slot of level
+// 1 is emptied and its timers re-added, which spreads them over level 0;
+// level 1 wrapping does the same with level 2, and so on.
+//
+// Bitmaps of the non-empty slots make finding the next expiry (tickless
+// idle) a handful of bit scans instead of walking 512 lists.
+//
+// Created by: floof<3
+
+#include "timer.h"
+#include "clock.h"
+#include "spinlock.h"
+#include "percpu.h"
+#include "softirq.h"
+#include "cpu.h"
+
+#define WHEEL_L0_BITS   8
+#define WHEEL_LN_BITS   6
+#define WHEEL_L0_SIZE   (1 << WHEEL_L0_BITS)
+#define WHEEL_LN_SIZE   (1 << WHEEL_LN_BITS)
+#define WHEEL_LEVELS    5
+#define WHEEL_SLOTS     (WHEEL_L0_SIZE + (WHEEL_LEVELS - 1) * WHEEL_LN_SIZE)
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_L0_BITS + (WHEEL_LEVELS - 1) * WHEEL_LN_BITS)) - 1)
+
+// First tick bit of level l >= 1
+#define LEVEL_SHIFT(l) (WHEEL_L0_BITS + ((l) - 1) * WHEEL_LN_BITS)
+// First slot of level l >= 1
+#define LEVEL_START(l) (WHEEL_L0_SIZE + ((l) - 1) * WHEEL_LN_SIZE)
+
+typedef struct timer_base {
+    spinlock_t lock;
+    uint64_t clk;                       // Next tick to process
+    uint32_t count;                     // Timers pending
+    ktimer_t* slots[WHEEL_SLOTS];
+    uint64_t map[WHEEL_SLOTS / 64];     // Bit per non-empty slot
+} __attribute__((aligned(64))) timer_base_t;
+
+static timer_base_t bases[MAX_CPUS];
+
+uint64_t timer_now(void) {
+    return clock_ns() / (NS_PER_SEC / TIMER_HZ);
+}
+
+void timer_init(void) {
+    uint64_t now = timer_now();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        bases[cpu].lock = (spinlock_t)SPINLOCK_INIT;
+        bases[cpu].clk = now;
+    }
+    softirq_register(SOFTIRQ_TIMER, timer_run);
+}
+
+void timer_setup(ktimer_t* timer, void (*func)(void*), void* arg) {
+    timer->expires = 0;
+    timer->func = func;
+    timer->arg = arg;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->base = NULL;
+    timer->slot = 0;
+}
+
+// Slot for a timer, seen from base->clk
+static uint32_t wheel_slot(timer_base_t* base, uint64_t expires) {
+    if (expires < base->clk) expires = base->clk;
+    uint64_t delta = expires - base->clk;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        expires = base->clk + delta;
+    }
+
+    if (delta < WHEEL_L0_SIZE) return expires & (WHEEL_L0_SIZE - 1);
+    uint32_t level = 1;
+    while (delta >> (LEVEL_SHIFT(level) + WHEEL_LN_BITS)) level++;
+    return LEVEL_START(level) + ((expires >> LEVEL_SHIFT(level)) & (WHEEL_LN_SIZE - 1));
+}
+
+static void wheel_insert(timer_base_t* base, ktimer_t* timer) {
+    uint32_t slot = wheel_slot(base, timer->expires);
+    timer->slot = slot;
+    timer->base = base;
+    timer->next = base->slots[slot];
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = &base->slots[slot];
+    base->slots[slot] = timer;
+    base->map[slot / 64] |= 1ULL << (slot % 64);
+    base->count++;
+}
+
+static void wheel_remove(timer_base_t* base, ktimer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    if (!base->slots[timer->slot]) base->map[timer->slot / 64] &= ~(1ULL << (timer->slot % 64));
+    timer->next = NULL;
+    timer->pprev = NULL;
+    base->count--;
+}
+
+bool timer_cancel(ktimer_t* timer) {
+    for (;;) {
+        timer_base_t* base = timer->base;
+        if (!base) return false;
+
+        uint64_t flags = spin_lock_irqsave(&base->lock);
+        if (timer->base != base) {
+            // Moved to another CPU's wheel while we were locking
+            spin_unlock_irqrestore(&base->lock, flags);
+            continue;
+        }
+        bool pending = timer->pprev != NULL;
+        if (pending) wheel_remove(base, timer);
+        spin_unlock_irqrestore(&base->lock, flags);
+        return pending;
+    }
+}
+
+void timer_add(ktimer_t* timer, uint64_t expires) {
+    timer_cancel(timer);
+
+    uint64_t flags = cpu_irq_save();
+    timer_base_t* base = &bases[cpu_id()];
+    spin_lock(&base->lock);
+    timer->expires = expires;
+    wheel_insert(base, timer);
+    spin_unlock(&base->lock);
+    cpu_irq_restore(flags);
+}
+
+void timer_add_ms(ktimer_t* timer, uint64_t ms) {
+    timer_add(timer, timer_now() + ms * TIMER_HZ / 1000);
+}
+
+// Level 0 wrapped: push the next slot of each coarser level down
+// (a level only moves on when the one below it wrapped too)
+static void wheel_cascade(timer_base_t* base) {
+    for (uint32_t level = 1; level < WHEEL_LEVELS; level++) {
+        uint32_t index = (base->clk >> LEVEL_SHIFT(level)) & (WHEEL_LN_SIZE - 1);
+        uint32_t slot = LEVEL_START(level) + index;
+
+        ktimer_t* list = base->slots[slot];
+        base->slots[slot] = NULL;
+        base->map[slot / 64] &= ~(1ULL << (slot % 64));
+        while (list) {
+            ktimer_t* timer = list;
+            list = timer->next;
+            base->count--;
+            wheel_insert(base, timer);
+        }
+
+        if (index) break;
+    }
+}
+
+void timer_run(void) {
+    uint64_t now = timer_now();
+    uint64_t flags = cpu_irq_save();
+    timer_base_t* base = &bases[cpu_id()];
+    spin_lock(&base->lock);
+
+    // Nothing pending: no need to walk the ticks we missed
+    if (!base->count) base->clk = now + 1;
+
+    while (base->clk <= now) {
+        uint32_t slot = base->clk & (WHEEL_L0_SIZE - 1);
+        if (!slot) wheel_cascade(base);
+
+        // Move on first, so a callback re-adding its timer for "now" lands
+        // in the next tick's slot instead of this one
+        base->clk++;
+
+        while (base->slots[slot]) {
+            ktimer_t* timer = base->slots[slot];
+            wheel_remove(base, timer);
+
+            // Callbacks get interrupts back (we're a softirq, the wheel
+            // shouldn't hold off the hardware)
+            spin_unlock_irqrestore(&base->lock, flags);
+            timer->func(timer->arg);
+            flags = spin_lock_irqsave(&base->lock);
+        }
+    }
+
+    spin_unlock(&base->lock);
+    cpu_irq_restore(flags);
+}
+
+// First set bit at or after `start` in a bitmap of `bits` bits, wrapping
+// around (the map isn't empty)
+static uint32_t map_next(const uint64_t* map, uint32_t bits, uint32_t start) {
+    for (uint32_t i = 0; i < bits; ) {
+        uint32_t bit = (start + i) % bits;
+        uint64_t word = map[bit / 64] >> (bit % 64);
+        if (word) return (bit + __builtin_ctzll(word)) % bits;
+        i += 64 - bit % 64;
+    }
+    return start;
+}
+
+uint64_t timer_next_expiry(void) {
+    uint64_t flags = cpu_irq_save();
+    timer_base_t* base = &bases[cpu_id()];
+    spin_lock(&base->lock);
+
+    uint64_t next = TIMER_NEVER;
+    if (!base->count) goto out;
+
+    // Level 0 is exact: the first non-empty slot from clk on
+    uint64_t clk = base->clk;
+    uint32_t start = clk & (WHEEL_L0_SIZE - 1);
+    bool any = false;
+    for (uint32_t w = 0; w < WHEEL_L0_SIZE / 64; w++) any |= base->map[w] != 0;
+    if (any) {
+        uint32_t slot = map_next(base->map, WHEEL_L0_SIZE, start);
+        next = clk + ((slot - start) & (WHEEL_L0_SIZE - 1));
+    }
+
+    // Coarser levels: wake up when their first non-empty slot cascades.
+    // The slot clk is in hasn't been cascaded yet only if clk is exactly
+    // on its boundary.
+    for (uint32_t level = 1; level < WHEEL_LEVELS; level++) {
+        uint64_t word = base->map[LEVEL_START(level) / 64];
+        if (!word) continue;
+
+        uint32_t shift = LEVEL_SHIFT(level);
+        uint32_t first = (clk & ((1ULL << shift) - 1)) ? 1 : 0;
+        uint32_t index = ((clk >> shift) + first) & (WHEEL_LN_SIZE - 1);
+        uint32_t slot = map_next(&word, WHEEL_LN_SIZE, index);
+        uint64_t ahead = first + ((slot - index) & (WHEEL_LN_SIZE - 1));
+        uint64_t when = ((clk >> shift) + ahead) << shift;
+        if (when < next) next = when;
+    }
+
+out:
+    spin_unlock(&base->lock);
+    cpu_irq_restore(flags);
+    return next;
+}
@@ -0,0 +1,67 @@
+// kernel/timer.h
+// Kernel timers on a hierarchical timer wheel
+// Each CPU has a wheel: 256 one-millisecond slots for the next 256ms, then
+// four levels of 64 slots, each level 64 times coarser. Adding and
+// cancelling a timer is a list insert/unlink (O(1)); timers on the coarse
+// levels get pushed down a level ("cascaded") as their time comes closer.
+// Good for lots of timers that mostly get cancelled (TCP retransmits,
+// gesture timeouts) as well as periodic ones (animation ticks).
+//
+// Callbacks run in the timer softirq on the CPU the timer was added on:
+// keep them short and don't sleep.
+//
+// Created by: floof<3
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_HZ    1000           // Wheel resolution (1ms)
+#define TIMER_NEVER (~0ULL)        // timer_next_expiry(): nothing pending
+
+struct timer_base;
+
+typedef struct ktimer {
+    uint64_t expires;              // timer_now() tick it fires at
+    void (*func)(void* arg);
+    void* arg;
+    struct ktimer* next;
+    struct ktimer** pprev;         // Link pointing at us, NULL = not pending
+    struct timer_base* base;       // Wheel it was last added to
+    uint16_t slot;
+} ktimer_t;
+
+// Set up the wheels (after clock_init)
+void timer_init(void);
+
+// Prepare a timer (before the first timer_add)
+void timer_setup(ktimer_t* timer, void (*func)(void*), void* arg);
+
+// Fire at tick `expires` (timer_now() time, already passed = next tick)
+// A pending timer is moved. Timers longer than ~49 days fire at 49 days.
+void timer_add(ktimer_t* timer, uint64_t expires);
+
+// Fire `ms` milliseconds from now
+void timer_add_ms(ktimer_t* timer, uint64_t ms);
+
+// Take a timer off its wheel, true if it was still pending
+// (doesn't wait for a callback that's already running on another CPU)
+bool timer_cancel(ktimer_t* timer);
+
+static inline bool timer_pending(const ktimer_t* timer) {
+    return timer->pprev != 0;
+}
+
+// Milliseconds since boot (the wheel's clock)
+uint64_t timer_now(void);
+
+// SOFTIRQ_TIMER handler: fire everything on this CPU's wheel that's due
+void timer_run(void);
+
+// Earliest tick this CPU's wheel needs to run at (TIMER_NEVER if it's empty)
+// Exact for the next 256ms, a cascade point for timers further out.
+uint64_t timer_next_expiry(void);
+
+#endif // TIMER_H
@@ -0,0 +1,303 @@
+// kernel/uvm.c
+// User virtual memory - areas, demand paging and copy-on-write
+//
+// Every user page is refcounted (pmm_page_ref_init), one reference per
+// page table entry pointing at it. Fresh memory starts out unmapped: a read
+// maps the shared zero page, a write maps a zeroed page of its own. fork()
+// gives the child the same entries with VMM_WRITE swapped for VMM_COW, and
+// a write fault on a VMM_COW entry copies the page - unless we're the last
+// one holding it, then we just make it writable again.
+//
+// Lock order: uvm->lock, then vmm_lock (inside the vmm_* calls), then the PMM.
+//
+// Created by: floof<3
+
+#include "uvm.h"
+#include "pmm.h"
+#include "heap.h"
+#include "memory.h"
+#include "percpu.h"
+#include "../drivers/serial.h"
+
+// Shared page of zeroes behind every read-before-write (we hold one reference
+// forever so copy-on-write never hands it to anyone as writable)
+static void* zero_page = NULL;
+
+// Address space each CPU is running (NULL = kernel thread)
+static uvm_t* current_uvm[MAX_CPUS];
+
+void uvm_init(void) {
+    zero_page = pmm_alloc_zeroed_page();
+    if (!zero_page) {
+        serial_write("UVM: ERROR - Can't allocate the zero page!\n");
+        return;
+    }
+    pmm_page_ref_init(zero_page);
+}
+
+// Leaf flags for an area's protection
+static uint64_t uvm_pte_flags(uint32_t prot) {
+    uint64_t flags = VMM_PRESENT | VMM_USER;
+    if (prot & UVM_WRITE) flags |= VMM_WRITE;
+    if (!(prot & UVM_EXEC)) flags |= VMM_NX;
+    return flags;
+}
+
+// Area containing addr (uvm->lock held)
+static uvm_area_t* uvm_find_area(uvm_t* uvm, uint64_t addr) {
+    uvm_area_t* area = uvm->cache;
+    if (area && addr >= area->start && addr < area->end) return area;
+
+    for (area = uvm->areas; area && area->start <= addr; area = area->next) {
+        if (addr < area->end) {
+            uvm->cache = area;
+            return area;
+        }
+    }
+    return NULL;
+}
+
+// Is [start, end) something a user area can cover?
+static bool uvm_range_ok(uint64_t start, uint64_t size) {
+    uint64_t end = start + size;
+    if (!size || ((start | size) & (VMM_PAGE_4K - 1))) return false;
+    return start >= vmm_user_start() && end <= VMM_USER_END && end > start;
+}
+
+uvm_t* uvm_create(void) {
+    uvm_t* uvm = kmalloc(sizeof(uvm_t));
+    if (!uvm) return NULL;
+
+    uvm->space = vmm_space_create();
+    if (!uvm->space) {
+        kfree(uvm);
+        return NULL;
+    }
+    uvm->areas = NULL;
+    uvm->cache = NULL;
+    uvm->lock = (spinlock_t)SPINLOCK_INIT;
+    return uvm;
+}
+
+void uvm_destroy(uvm_t* uvm) {
+    if (!uvm) return;
+
+    if (current_uvm[cpu_id()] == uvm) current_uvm[cpu_id()] = NULL;
+
+    uvm_area_t* area = uvm->areas;
+    while (area) {
+        uvm_area_t* next = area->next;
+        vmm_unmap_user_range(uvm->space, area->start, area->end - area->start);
+        kfree(area);
+        area = next;
+    }
+
+    vmm_space_destroy(uvm->space);
+    kfree(uvm);
+}
+
+bool uvm_map_anon(uvm_t* uvm, uint64_t start, uint64_t size, uint32_t prot) {
+    if (!uvm_range_ok(start, size)) {
+        serial_write("UVM: ERROR - Bad user mapping at ");
+        serial_write_hex(start);
+        serial_write("\n");
+        return false;
+    }
+
+    uvm_area_t* area = kmalloc(sizeof(uvm_area_t));
+    if (!area) return false;
+    area->start = start;
+    area->end = start + size;
+    area->prot = prot;
+
+    uint64_t flags = spin_lock_irqsave(&uvm->lock);
+
+    // Find the spot in the sorted list, refusing overlaps
+    uvm_area_t** link = &uvm->areas;
+    while (*link && (*link)->end <= start) link = &(*link)->next;
+    if (*link && (*link)->start < area->end) {
+        spin_unlock_irqrestore(&uvm->lock, flags);
+        kfree(area);
+        return false;
+    }
+
+    area->next = *link;
+    *link = area;
+
+    spin_unlock_irqrestore(&uvm->lock, flags);
+    return true;
+}
+
+bool uvm_unmap(uvm_t* uvm, uint64_t start, uint64_t size) {
+    if (!uvm_range_ok(start, size)) return false;
+    uint64_t end = start + size;
+
+    // Punching a hole in the middle of an area makes two of it, get the
+    // second one before taking the lock
+    uvm_area_t* spare = kmalloc(sizeof(uvm_area_t));
+    if (!spare) return false;
+
+    uint64_t flags = spin_lock_irqsave(&uvm->lock);
+
+    uvm_area_t** link = &uvm->areas;
+    while (*link && (*link)->start < end) {
+        uvm_area_t* area = *link;
+
+        if (area->end <= start) {
+            link = &area->next;
+        } else if (area->start < start && area->end > end) {
+            spare->start = end;
+            spare->end = area->end;
+            spare->prot = area->prot;
+            spare->next = area->next;
+            area->end = start;
+            area->next = spare;
+            spare = NULL;
+            break;
+        } else if (area->start < start) {
+            area->end = start;
+            link = &area->next;
+        } else if (area->end > end) {
+            area->start = end;
+            break;
+        } else {
+            *link = area->next;
+            if (uvm->cache == area) uvm->cache = NULL;
+            kfree(area);
+        }
+    }
+
+    vmm_unmap_user_range(uvm->space, start, size);
+
+    spin_unlock_irqrestore(&uvm->lock, flags);
+    if (spare) kfree(spare);
+    return true;
+}
+
+uvm_t* uvm_fork(uvm_t* parent) {
+    uvm_t* child = uvm_create();
+    if (!child) return NULL;
+
+    // Holding the parent's lock keeps its areas (and refcounts) still, so
+    // a fault can't take a page back as "last owner" halfway through
+    uint64_t flags = spin_lock_irqsave(&parent->lock);
+
+    bool ok = true;
+    uvm_area_t** tail = &child->areas;
+    for (uvm_area_t* area = parent->areas; area; area = area->next) {
+        uvm_area_t* copy = kmalloc(sizeof(uvm_area_t));
+        if (!copy) {
+            ok = false;
+            break;
+        }
+        *copy = *area;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+
+        if (!vmm_copy_range_cow(child->space, parent->space, area->start, area->end)) {
+            ok = false;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&parent->lock, flags);
+
+    if (!ok) {
+        serial_write("UVM: ERROR - Out of memory in fork\n");
+        uvm_destroy(child);
+        return NULL;
+    }
+    return child;
+}
+
+// Not present: map zeroes
+static bool uvm_fault_missing(uvm_t* uvm, uvm_area_t* area, uint64_t page, uint64_t err) {
+    uint64_t entry;
+
+    if (!(err & UVM_FAULT_WRITE) && zero_page) {
+        // Reads share the zero page, a write later copies it
+        entry = (uint64_t)zero_page | (uvm_pte_flags(area->prot) & ~VMM_WRITE);
+        if (area->prot & UVM_WRITE) entry |= VMM_COW;
+        pmm_page_ref(zero_page);
+    } else {
+        void* frame = pmm_alloc_zeroed_page();
+        if (!frame) return false;
+        pmm_page_ref_init(frame);
+        entry = (uint64_t)frame | uvm_pte_flags(area->prot);
+    }
+
+    if (vmm_set_pte(uvm->space, page, 0, entry)) return true;
+
+    // Another thread got there first (fine, retry) or no memory for page tables
+    pmm_page_unref((void*)(entry & VMM_ADDR_MASK));
+    return vmm_get_pte(uvm->space, page) != 0;
+}
+
+// Write to a VMM_COW page: copy it, or take it over if nobody else has it
+static bool uvm_fault_cow(uvm_t* uvm, uvm_area_t* area, uint64_t page, uint64_t pte) {
+    void* old = (void*)(pte & VMM_ADDR_MASK);
+    uint64_t entry;
+
+    // Only a fork (which holds our lock) could add a reference, so 1 stays 1
+    if (pmm_page_refcount(old) == 1) {
+        entry = (pte | VMM_WRITE) & ~VMM_COW;
+    } else {
+        void* copy = (old == zero_page) ? pmm_alloc_zeroed_page() : pmm_alloc_page();
+        if (!copy) return false;
+        if (old != zero_page) memcpy(copy, old, VMM_PAGE_4K);
+        pmm_page_ref_init(copy);
+        entry = (uint64_t)copy | uvm_pte_flags(area->prot);
+    }
+
+    // vmm_set_pte drops our reference on the old page after the flush
+    if (vmm_set_pte(uvm->space, page, pte, entry)) return true;
+
+    // The entry changed under us (accessed bit, another thread), retry
+    if ((entry & VMM_ADDR_MASK) != (uint64_t)old) pmm_page_unref((void*)(entry & VMM_ADDR_MASK));
+    return vmm_get_pte(uvm->space, page) != pte;
+}
+
+bool uvm_handle_fault(uvm_t* uvm, uint64_t addr, uint64_t err) {
+    // Reserved bits mean broken page tables, nothing to fix up here
+    if (err & UVM_FAULT_RSVD) return false;
+
+    uint64_t page = addr & ~(VMM_PAGE_4K - 1);
+    uint64_t flags = spin_lock_irqsave(&uvm->lock);
+    bool ok = false;
+
+    uvm_area_t* area = uvm_find_area(uvm, addr);
+    if (!area || area->prot == UVM_NONE) goto out;
+    if ((err & UVM_FAULT_WRITE) && !(area->prot & UVM_WRITE)) goto out;
+    if ((err & UVM_FAULT_FETCH) && !(area->prot & UVM_EXEC)) goto out;
+
+    uint64_t pte = vmm_get_pte(uvm->space, page);
+    if (!(pte & VMM_PRESENT)) {
+        ok = uvm_fault_missing(uvm, area, page, err);
+    } else if ((err & UVM_FAULT_WRITE) && !(pte & VMM_WRITE)) {
+        ok = (pte & VMM_COW) && uvm_fault_cow(uvm, area, page, pte);
+    } else {
+        // Already fixed up (by another thread, or the TLB was stale and the
+        // fault itself dropped the old entry), just go again
+        ok = !((err & UVM_FAULT_FETCH) && (pte & VMM_NX));
+    }
+
+out:
+    spin_unlock_irqrestore(&uvm->lock, flags);
+    return ok;
+}
+
+void uvm_switch(uvm_t* uvm) {
+    current_uvm[cpu_id()] = uvm;
+    vmm_switch_space(uvm ? uvm->space : NULL);
+}
+
+uvm_t* uvm_current(void) {
+    return current_uvm[cpu_id()];
+}
+
+bool uvm_page_fault(uint64_t addr, uint64_t err) {
+    uvm_t* uvm = current_uvm[cpu_id()];
+    if (!uvm || addr >= VMM_USER_END) return false;
+    return uvm_handle_fault(uvm, addr, err);
+}
@@ -0,0 +1,84 @@
+// kernel/uvm.h
+// User virtual memory - process address spaces on top of the VMM
+// A process's memory is a list of areas (start, end, protection). Nothing
+// is backed by RAM until it's touched: the page fault handler looks up the
+// area and maps a page right then (demand paging). fork() shares every
+// page read-only and copies a page only when one side writes to it.
+//
+// Created by: floof<3
+
+#ifndef UVM_H
+#define UVM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmm.h"
+#include "spinlock.h"
+
+// Area protection
+#define UVM_READ  (1 << 0)
+#define UVM_WRITE (1 << 1)
+#define UVM_EXEC  (1 << 2)
+#define UVM_NONE  0         // Reserved but inaccessible (guard pages)
+
+// #PF error code bits (what the CPU pushes for a page fault)
+#define UVM_FAULT_PRESENT (1 << 0)  // Protection violation (0 = page not present)
+#define UVM_FAULT_WRITE   (1 << 1)  // Write access
+#define UVM_FAULT_USER    (1 << 2)  // Happened in ring 3
+#define UVM_FAULT_RSVD    (1 << 3)  // Reserved bit set in a paging entry
+#define UVM_FAULT_FETCH   (1 << 4)  // Instruction fetch
+
+// One mapped area of a process (page aligned, end exclusive)
+typedef struct uvm_area {
+    uint64_t start;
+    uint64_t end;
+    uint32_t prot;          // UVM_READ | UVM_WRITE | UVM_EXEC
+    struct uvm_area* next;  // Sorted by address
+} uvm_area_t;
+
+// A process's address space
+typedef struct {
+    vmm_space_t* space;     // Page tables (PCID, shootdown tracking)
+    uvm_area_t* areas;      // Sorted, non-overlapping
+    uvm_area_t* cache;      // Area the last fault hit (faults come in runs)
+    spinlock_t lock;        // Protects the area list, held across a fault
+} uvm_t;
+
+// Set up the shared zero page (after heap_init)
+void uvm_init(void);
+
+// Empty address space / free one with all its memory
+// (uvm_destroy: nobody may be running it)
+uvm_t* uvm_create(void);
+void uvm_destroy(uvm_t* uvm);
+
+// Reserve [start, start + size) as anonymous memory (zero filled on first touch)
+// Page aligned, above vmm_user_start(), not overlapping anything already
+// mapped. False otherwise or out of memory.
+bool uvm_map_anon(uvm_t* uvm, uint64_t start, uint64_t size, uint32_t prot);
+
+// Remove a range (areas sticking out of it get trimmed or split)
+bool uvm_unmap(uvm_t* uvm, uint64_t start, uint64_t size);
+
+// Copy of an address space sharing every page copy-on-write
+// NULL if we ran out of memory
+uvm_t* uvm_fork(uvm_t* parent);
+
+// Resolve a page fault at addr in uvm (err = #PF error code)
+// True if it's fixed and the instruction can be retried, false if the
+// access is really invalid (or we're out of memory) and the process has
+// to go
+bool uvm_handle_fault(uvm_t* uvm, uint64_t addr, uint64_t err);
+
+// Run uvm on this CPU (NULL for a kernel thread, keeps the old tables lazily)
+void uvm_switch(uvm_t* uvm);
+
+// Address space of whatever this CPU is running (NULL for kernel threads)
+uvm_t* uvm_current(void);
+
+// #PF entry point: fault in the current address space
+// False for kernel addresses and kernel threads, the caller panics/kills
+bool uvm_page_fault(uint64_t addr, uint64_t err);
+
+#endif // UVM_H
@@ -1,8 +1,9 @@
 #ifndef VFS_H
 #define VFS_H
 
+#include "process.h"  // process_create()
+
 void vfs_init(void);
 void initrd_load(void);
-void process_create(const char* path);
 
 #endif
@@ -0,0 +1,1277 @@
+// kernel/vmm.c
+// Virtual Memory Manager Implementation
+// Walks/builds x86_64 page tables. Page tables live in physical memory
+// that is identity mapped, so a table's physical address is also a pointer
+// we can use directly.
+//
+// Everything that changes mappings goes through a TLB batch: leaves are
+// written without touching the TLB, and when the operation is done we do
+// one round of invlpg (or one full flush if too much changed). Pages and
+// page tables that were unmapped are only handed back to the PMM after that
+// flush, so nobody can write into them through a stale TLB entry.
+//
+// Address spaces are tagged with a PCID, so switching between them doesn't
+// throw the TLB away. The price is that a space's entries stay cached on
+// every CPU that ever ran it, so a shootdown does two things: CPUs running
+// the space right now get an IPI (one per batch), everyone else gets a bit
+// in the space's stale_mask and flushes its PCID when they switch back in.
+//
+// Created by: floof<3
+
+#include "vmm.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "percpu.h"
+#include "heap.h"
+#include "../drivers/serial.h"
+
+// Global variables (yes I know globals are bad but this is a kernel so shut up)
+static vmm_space_t kernel_space;
+static uint64_t* kernel_pml4 = NULL;
+static bool has_1g_pages = false;
+static bool has_pcid = false;
+static bool has_nx = false;
+
+// PML4 slots below this hold the identity map (shared by every space)
+static uint32_t identity_slots = 1;
+static uint64_t identity_end = 0;  // What's actually mapped in them
+
+// Protects the page tables of every space
+static spinlock_t vmm_lock = SPINLOCK_INIT;
+static lock_stats_t vmm_lock_stats;
+
+// PCIDs in use (0 is the kernel's)
+#define PCID_COUNT 4096
+static uint64_t pcid_bitmap[PCID_COUNT / 64];
+static spinlock_t pcid_lock = SPINLOCK_INIT;
+
+// Next free spot in the huge buffer window (we never run out of 1TB of
+// virtual space on this machine, so freed ranges aren't recycled yet)
+static uint64_t huge_buf_next = VMM_HUGE_BUF_BASE;
+
+// Same deal for MMIO, drivers map their registers once at init
+static uint64_t mmio_next = VMM_MMIO_BASE;
+static spinlock_t mmio_lock = SPINLOCK_INIT;
+
+// vmalloc address space: bump pointer plus a small table of freed holes
+// (vmalloc churns a lot more than huge buffers, so holes get reused first-fit)
+#define VMALLOC_MAX_HOLES 64
+
+typedef struct {
+    uint64_t start;
+    uint64_t size;  // 0 = unused slot
+} vmalloc_hole_t;
+
+static uint64_t vmalloc_next = VMM_VMALLOC_BASE;
+static vmalloc_hole_t vmalloc_holes[VMALLOC_MAX_HOLES];
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+
+// Levels: 0 = PT (4KB leaves), 1 = PD (2MB), 2 = PDPT (1GB), 3 = PML4
+#define LEVEL_SHIFT(level)       (12 + 9 * (level))
+#define LEVEL_SIZE(level)        (1ULL << LEVEL_SHIFT(level))
+#define LEVEL_INDEX(addr, level) (((addr) >> LEVEL_SHIFT(level)) & 0x1FF)
+
+// Past this many changed leaves a full flush is cheaper than invlpg'ing each one
+#define TLB_BATCH_ADDRS 32
+#define TLB_BATCH_FREES 64
+
+// Batched free that drops a page reference instead of freeing outright
+// (orders only need the low bits, so this rides along in the same word)
+#define TLB_FREE_UNREF 0x800
+
+// What unmapping does with the memory behind each leaf
+typedef enum {
+    UNMAP_KEEP,    // Nothing, it isn't ours (vmm_unmap_range)
+    UNMAP_FREE,    // Back to the PMM (vmalloc, huge buffers)
+    UNMAP_UNREF,   // Drop the mapping's reference on refcounted user pages
+} unmap_mode_t;
+
+// Pending TLB work for one operation
+typedef struct {
+    vmm_space_t* space;               // Space whose tables we're changing
+    uint64_t addrs[TLB_BATCH_ADDRS];  // Leaves to invlpg
+    uint32_t addr_count;
+    bool flush_all;                   // Too many, flush everything
+    bool freed_tables;                // Page tables are going away (lazy CPUs care about that)
+    uint64_t frees[TLB_BATCH_FREES];  // Physical blocks to free after the flush (addr | order)
+    uint32_t free_count;
+} tlb_batch_t;
+
+// Per-CPU TLB state, with the shootdown mailbox other CPUs post into
+typedef struct {
+    vmm_space_t* loaded;              // Space in CR3
+    spinlock_t lock;                  // Protects the mailbox
+    uint64_t addrs[TLB_BATCH_ADDRS];
+    uint32_t addr_count;
+    bool flush_all;
+    bool flush_global;                // Kernel mappings changed (needs the PGE toggle)
+    bool leave_lazy;                  // Stop lazily holding a user space
+    volatile bool pending;            // An IPI is on its way, don't send another
+    uint64_t requested;               // Tickets handed out / finished
+    volatile uint64_t done;
+} __attribute__((aligned(64))) tlb_cpu_t;
+
+static tlb_cpu_t tlb_cpus[MAX_CPUS];
+static volatile uint64_t tlb_online_mask = 0;
+static volatile uint64_t tlb_lazy_mask = 0;  // CPUs running a kernel thread on a borrowed space
+static void (*tlb_send_ipi)(uint32_t cpu) = NULL;
+
+static inline void tlb_batch_init(tlb_batch_t* batch, vmm_space_t* space) {
+    batch->space = space;
+    batch->addr_count = batch->free_count = 0;
+    batch->flush_all = batch->freed_tables = false;
+}
+
+// Flush the whole TLB, global entries included
+void vmm_flush_tlb_all(void) {
+    uint64_t cr4 = cpu_read_cr4();
+    if (cr4 & CPU_CR4_PGE) {
+        // Toggling PGE is the only thing that drops global entries
+        // (and it drops every PCID's entries too)
+        cpu_write_cr4(cr4 & ~CPU_CR4_PGE);
+        cpu_write_cr4(cr4);
+    } else {
+        cpu_write_cr3(cpu_read_cr3());
+    }
+}
+
+// Flush this CPU: invlpg each address, or everything
+// invlpg only hits the current PCID plus global entries, which is all we need:
+// kernel mappings are global and user ones are only flushed here when loaded
+static void tlb_flush_local(const uint64_t* addrs, uint32_t count, bool flush_all, bool global) {
+    if (flush_all) {
+        if (global) vmm_flush_tlb_all();
+        else cpu_write_cr3(cpu_read_cr3());  // No NOFLUSH bit: drops the current PCID
+        return;
+    }
+    // invlpg on any address inside a huge leaf drops the whole leaf
+    for (uint32_t i = 0; i < count; i++) cpu_invlpg(addrs[i]);
+}
+
+// Do whatever other CPUs asked of us (IPI handler, also polled while we spin)
+static void tlb_process_mailbox(void) {
+    tlb_cpu_t* tc = &tlb_cpus[cpu_id()];
+    if (!tc->pending) return;
+
+    uint64_t addrs[TLB_BATCH_ADDRS];
+    spin_lock(&tc->lock);
+    uint32_t count = tc->addr_count;
+    bool flush_all = tc->flush_all;
+    bool global = tc->flush_global;
+    bool leave_lazy = tc->leave_lazy;
+    for (uint32_t i = 0; i < count; i++) addrs[i] = tc->addrs[i];
+    uint64_t ticket = tc->requested;
+    tc->addr_count = 0;
+    tc->flush_all = tc->flush_global = tc->leave_lazy = false;
+    tc->pending = false;
+    spin_unlock(&tc->lock);
+
+    // A space is going away, stop borrowing it if we are
+    uint64_t bit = 1ULL << cpu_id();
+    if (leave_lazy && (tlb_lazy_mask & bit) && tc->loaded != &kernel_space) {
+        vmm_space_t* old = tc->loaded;
+        tc->loaded = &kernel_space;
+        __atomic_fetch_or(&kernel_space.cpu_mask, bit, __ATOMIC_SEQ_CST);
+        cpu_write_cr3((uint64_t)kernel_pml4);
+        __atomic_fetch_and(&old->cpu_mask, ~bit, __ATOMIC_SEQ_CST);
+    }
+
+    tlb_flush_local(addrs, count, flush_all, global);
+    __atomic_store_n(&tc->done, ticket, __ATOMIC_RELEASE);
+}
+
+// Post the batch to every CPU in targets and wait until they've all done it
+// At most one IPI per CPU: if one is already pending the work just merges in
+static void tlb_send(const tlb_batch_t* batch, uint64_t targets, bool global, bool leave_lazy) {
+    uint64_t tickets[MAX_CPUS];
+    if (!tlb_send_ipi) return;  // No SMP yet, nobody else to tell
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(targets & (1ULL << cpu))) continue;
+        tlb_cpu_t* tc = &tlb_cpus[cpu];
+
+        spin_lock(&tc->lock);
+        if (batch->flush_all || tc->addr_count + batch->addr_count > TLB_BATCH_ADDRS) {
+            tc->flush_all = true;
+        } else {
+            for (uint32_t i = 0; i < batch->addr_count; i++) tc->addrs[tc->addr_count++] = batch->addrs[i];
+        }
+        tc->flush_global |= global;
+        tc->leave_lazy |= leave_lazy;
+        bool kick = !tc->pending;
+        tc->pending = true;
+        tickets[cpu] = ++tc->requested;
+        spin_unlock(&tc->lock);
+
+        if (kick) tlb_send_ipi(cpu);
+    }
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(targets & (1ULL << cpu))) continue;
+        // Keep answering our own mailbox, they might be waiting on us too
+        while (__atomic_load_n(&tlb_cpus[cpu].done, __ATOMIC_ACQUIRE) < tickets[cpu]) {
+            tlb_process_mailbox();
+            cpu_pause();
+        }
+    }
+}
+
+// Flush this batch everywhere it's cached
+static void tlb_shootdown(tlb_batch_t* batch) {
+    uint64_t self = 1ULL << cpu_id();
+    vmm_space_t* space = batch->space;
+
+    if (space == &kernel_space) {
+        // Kernel mappings are global and shared by every space: everyone flushes
+        tlb_flush_local(batch->addrs, batch->addr_count, batch->flush_all, true);
+        tlb_send(batch, tlb_online_mask & ~self, true, false);
+        return;
+    }
+
+    // Mark everyone stale before looking at who's running it. A CPU switching
+    // in at the same time either shows up in cpu_mask (and gets the IPI) or
+    // sees its stale bit (and flushes itself), never neither.
+    bool loaded_here = tlb_cpus[cpu_id()].loaded == space;
+    __atomic_fetch_or(&space->stale_mask, loaded_here ? ~self : ~0ULL, __ATOMIC_SEQ_CST);
+    uint64_t targets = __atomic_load_n(&space->cpu_mask, __ATOMIC_SEQ_CST) & ~self;
+
+    // CPUs only borrowing the space for a kernel thread never touch user
+    // addresses, their stale bit is enough. Unless page tables are being
+    // freed: the CPU can still walk those speculatively.
+    if (!batch->freed_tables) targets &= ~tlb_lazy_mask;
+
+    if (loaded_here) tlb_flush_local(batch->addrs, batch->addr_count, batch->flush_all, false);
+    tlb_send(batch, targets, false, false);
+}
+
+// Do the flush and free whatever was waiting on it
+static void tlb_batch_flush(tlb_batch_t* batch) {
+    if (batch->addr_count || batch->flush_all || batch->free_count) tlb_shootdown(batch);
+
+    for (uint32_t i = 0; i < batch->free_count; i++) {
+        uint64_t entry = batch->frees[i];
+        void* page = (void*)(entry & ~(VMM_PAGE_4K - 1));
+        if (entry & TLB_FREE_UNREF) pmm_page_unref(page);
+        else pmm_free_pages(page, entry & (TLB_FREE_UNREF - 1));
+    }
+
+    batch->addr_count = 0;
+    batch->free_count = 0;
+    batch->flush_all = batch->freed_tables = false;
+}
+
+// Remember that the leaf covering virt changed
+static void tlb_batch_add(tlb_batch_t* batch, uint64_t virt) {
+    if (batch->flush_all) return;
+    if (batch->addr_count == TLB_BATCH_ADDRS) {
+        batch->flush_all = true;
+        return;
+    }
+    batch->addrs[batch->addr_count++] = virt;
+}
+
+// Free a physical block once the TLB can't reach it anymore
+static void tlb_batch_free(tlb_batch_t* batch, uint64_t phys, uint32_t order) {
+    if (batch->free_count == TLB_BATCH_FREES) tlb_batch_flush(batch);
+    batch->frees[batch->free_count++] = phys | order;
+}
+
+// Take vmm_lock with interrupts off
+// While spinning we keep answering shootdowns: whoever holds the lock may be
+// sitting in tlb_send() waiting for us
+static uint64_t vmm_lock_irqsave(void) {
+    uint64_t flags = cpu_irq_save();
+    spin_lock_relax(&vmm_lock, tlb_process_mailbox);
+    return flags;
+}
+
+static inline void vmm_unlock_irqrestore(uint64_t flags) {
+    spin_unlock_irqrestore(&vmm_lock, flags);
+}
+
+// Page tables come from DMA32. Until vmm_init() loads its own tables we
+// can only write to what boot64.asm identity mapped, so those have to come
+// from below PMM_BOOT_MAPPED_END (the free lists' order is no promise).
+static bool boot_tables = true;
+
+static uint64_t* vmm_alloc_table(void) {
+    if (boot_tables) return (uint64_t*)pmm_alloc_zeroed_page_below(PMM_BOOT_MAPPED_END);
+    return (uint64_t*)pmm_alloc_zeroed_page_zone(PMM_ZONE_DMA32);
+}
+
+// Intermediate entries are permissive, the leaf decides the real access rights
+static inline uint64_t vmm_table_entry(uint64_t* table, uint64_t flags) {
+    return (uint64_t)table | VMM_PRESENT | VMM_WRITE | (flags & VMM_USER);
+}
+
+// Turn a huge leaf into a table of the next size down mapping the same memory
+// (so part of it can be remapped or unmapped)
+static bool vmm_split_leaf(uint64_t* entry, int level, tlb_batch_t* batch, uint64_t virt) {
+    uint64_t* table = vmm_alloc_table();
+    if (!table) return false;
+
+    uint64_t old = *entry;
+    uint64_t phys = old & VMM_ADDR_MASK & ~(LEVEL_SIZE(level) - 1);
+    uint64_t flags = old & ~VMM_ADDR_MASK;
+
+    // The PAT bit sits in bit 12 of huge leaves and bit 7 (where PS would
+    // be) of 4KB leaves, carry it over so the memory type stays the same
+    if (level == 1) {
+        flags &= ~VMM_HUGE;
+        if (old & VMM_PAT_HUGE) flags |= VMM_PAT;
+    } else {
+        flags |= old & VMM_PAT_HUGE;
+    }
+
+    for (uint64_t i = 0; i < 512; i++) {
+        table[i] = (phys + i * LEVEL_SIZE(level - 1)) | flags;
+    }
+
+    *entry = vmm_table_entry(table, old);
+    tlb_batch_add(batch, virt);
+    return true;
+}
+
+// Free a table and everything below it (the leaves' memory isn't ours, only the tables)
+static void vmm_free_tables(uint64_t* table, int level, tlb_batch_t* batch) {
+    if (level > 0) {
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & VMM_PRESENT) && !(table[i] & VMM_HUGE)) {
+                vmm_free_tables((uint64_t*)(table[i] & VMM_ADDR_MASK), level - 1, batch);
+            }
+        }
+    }
+    tlb_batch_free(batch, (uint64_t)table, 0);
+    batch->freed_tables = true;
+}
+
+// Get the table holding level `level` entries for virt, building missing
+// tables and splitting huge leaves on the way down
+static uint64_t* vmm_walk_create(uint64_t* pml, uint64_t virt, int level, uint64_t flags,
+                                 tlb_batch_t* batch) {
+    uint64_t* table = pml;
+
+    for (int l = 3; l > level; l--) {
+        uint64_t* entry = &table[LEVEL_INDEX(virt, l)];
+
+        if (!(*entry & VMM_PRESENT)) {
+            uint64_t* next = vmm_alloc_table();
+            if (!next) return NULL;
+            *entry = vmm_table_entry(next, flags);
+        } else if (*entry & VMM_HUGE) {
+            if (!vmm_split_leaf(entry, l, batch, virt)) return NULL;
+        } else if ((flags & VMM_USER) && !(*entry & VMM_USER)) {
+            *entry |= VMM_USER;
+        }
+
+        table = (uint64_t*)(*entry & VMM_ADDR_MASK);
+    }
+    return table;
+}
+
+// PWT/PCD/PAT bits selecting a memory type in a leaf at `level`
+static uint64_t vmm_cache_bits(vmm_cache_t cache, int level) {
+    uint64_t bits = 0;
+    if (cache & 1) bits |= VMM_PWT;
+    if (cache & 2) bits |= VMM_PCD;
+    if (cache & 4) bits |= level ? VMM_PAT_HUGE : VMM_PAT;
+    return bits;
+}
+
+// Install one leaf at `level` (vmm_lock held)
+static bool vmm_set_leaf(uint64_t* pml, uint64_t virt, uint64_t phys, uint64_t flags,
+                         vmm_cache_t cache, int level, tlb_batch_t* batch) {
+    uint64_t* table = vmm_walk_create(pml, virt, level, flags, batch);
+    if (!table) {
+        serial_write("VMM: ERROR - Out of memory for page tables mapping ");
+        serial_write_hex(virt);
+        serial_write("\n");
+        return false;
+    }
+
+    uint64_t* entry = &table[LEVEL_INDEX(virt, level)];
+    uint64_t old = *entry;
+
+    // A huge leaf going over a table of smaller mappings replaces the lot
+    // (unlinked first, the free list can flush before we're done)
+    if (level > 0 && (old & VMM_PRESENT) && !(old & VMM_HUGE)) {
+        *entry = 0;
+        batch->flush_all = true;  // Could be up to 512 leaves under there
+        vmm_free_tables((uint64_t*)(old & VMM_ADDR_MASK), level - 1, batch);
+    }
+
+    flags = (flags & ~(VMM_HUGE | VMM_PAT_HUGE)) | vmm_cache_bits(cache, level);
+    if (level > 0) flags |= VMM_HUGE;
+    if (!has_nx) flags &= ~VMM_NX;  // Reserved bit without EFER.NXE
+    *entry = (phys & VMM_ADDR_MASK) | flags | VMM_PRESENT;
+
+    // Not-present entries are never cached, only changed ones need flushing
+    if (old & VMM_PRESENT) tlb_batch_add(batch, virt);
+    return true;
+}
+
+// Biggest leaf that fits at virt/phys with `left` bytes to go
+static int vmm_pick_level(uint64_t virt, uint64_t phys, uint64_t left) {
+    if (has_1g_pages && !((virt | phys) & (VMM_PAGE_1G - 1)) && left >= VMM_PAGE_1G) return 2;
+    if (!((virt | phys) & (VMM_PAGE_2M - 1)) && left >= VMM_PAGE_2M) return 1;
+    return 0;
+}
+
+// Map a range, caller holds vmm_lock and flushes the batch
+static bool vmm_map_range_locked(uint64_t* pml, uint64_t virt, uint64_t phys, uint64_t size,
+                                 uint64_t flags, vmm_cache_t cache, tlb_batch_t* batch) {
+    uint64_t end = virt + size;
+    flags &= ~(VMM_PWT | VMM_PCD);
+
+    while (virt < end) {
+        int level = vmm_pick_level(virt, phys, end - virt);
+        if (!vmm_set_leaf(pml, virt, phys, flags, cache, level, batch)) return false;
+        virt += LEVEL_SIZE(level);
+        phys += LEVEL_SIZE(level);
+    }
+    return true;
+}
+
+// User spaces share the kernel's PML4 slots (identity map and upper half),
+// they can only change what's in between
+static bool vmm_range_allowed(vmm_space_t* space, uint64_t virt, uint64_t size) {
+    if (space == &kernel_space) return true;
+
+    uint64_t start = (uint64_t)identity_slots << LEVEL_SHIFT(3);
+    if (virt >= start && virt + size <= VMM_USER_END && virt + size >= virt) return true;
+
+    serial_write("VMM: ERROR - User space mapping over kernel addresses at ");
+    serial_write_hex(virt);
+    serial_write("\n");
+    return false;
+}
+
+// Map a physical range with the biggest pages that fit
+bool vmm_map_range(vmm_space_t* space, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags,
+                   vmm_cache_t cache) {
+    if ((virt | phys | size) & (VMM_PAGE_4K - 1)) {
+        serial_write("VMM: WARNING - Misaligned range mapping ignored\n");
+        return false;
+    }
+    if (!vmm_range_allowed(space, virt, size)) return false;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+
+    uint64_t irq = vmm_lock_irqsave();
+    bool ok = vmm_map_range_locked(space->pml4, virt, phys, size, flags, cache, &batch);
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+    return ok;
+}
+
+// After clearing an entry in tables[level], free tables that are now empty
+// Only PTs and PDs are freed: PDPTs stay forever so kernel PML4 entries
+// never point at a freed table
+static void vmm_prune(uint64_t** tables, int level, uint64_t virt, tlb_batch_t* batch) {
+    for (; level < 2; level++) {
+        uint64_t* table = tables[level];
+        for (int i = 0; i < 512; i++) {
+            if (table[i]) return;
+        }
+        tables[level + 1][LEVEL_INDEX(virt, level + 1)] = 0;
+        tlb_batch_free(batch, (uint64_t)table, 0);
+        batch->freed_tables = true;
+    }
+}
+
+// Unmap a range, caller holds vmm_lock and flushes the batch
+// `mode` says what happens to the memory behind each leaf (see unmap_mode_t)
+static void vmm_unmap_range_locked(uint64_t* pml, uint64_t virt, uint64_t size,
+                                   unmap_mode_t mode, tlb_batch_t* batch) {
+    uint64_t end = virt + size;
+    uint64_t* tables[4];
+    tables[3] = pml;
+
+    while (virt < end) {
+        int level = 3;
+
+        for (;;) {
+            uint64_t* entry = &tables[level][LEVEL_INDEX(virt, level)];
+            uint64_t span = LEVEL_SIZE(level);
+
+            if (!(*entry & VMM_PRESENT)) {
+                // Nothing mapped down there, skip the whole subtree
+                uint64_t skipped = virt;
+                virt = (virt + span) & ~(span - 1);
+                if (virt >= end || !LEVEL_INDEX(virt, level)) {
+                    vmm_prune(tables, level, skipped, batch);
+                }
+                break;
+            }
+
+            if (level > 0 && !(*entry & VMM_HUGE)) {
+                tables[level - 1] = (uint64_t*)(*entry & VMM_ADDR_MASK);
+                level--;
+                continue;
+            }
+
+            // A leaf. If the range only covers part of it, split and go down
+            if ((virt & (span - 1)) || end - virt < span) {
+                if (!vmm_split_leaf(entry, level, batch, virt)) {
+                    serial_write("VMM: ERROR - Out of memory splitting a huge page at ");
+                    serial_write_hex(virt);
+                    serial_write("\n");
+                    return;
+                }
+                continue;
+            }
+
+            uint64_t old = *entry;
+            *entry = 0;
+            tlb_batch_add(batch, virt);
+            if (mode == UNMAP_FREE) {
+                tlb_batch_free(batch, old & VMM_ADDR_MASK & ~(span - 1), level * 9);
+            } else if (mode == UNMAP_UNREF && level == 0) {
+                tlb_batch_free(batch, (old & VMM_ADDR_MASK) | TLB_FREE_UNREF, 0);
+            }
+
+            virt += span;
+
+            // Only check for an empty table when we're leaving it
+            if (virt >= end || !LEVEL_INDEX(virt, level)) {
+                vmm_prune(tables, level, virt - span, batch);
+            }
+            break;
+        }
+    }
+}
+
+// Unmap a range (huge pages that stick out of it get split)
+void vmm_unmap_range(vmm_space_t* space, uint64_t virt, uint64_t size) {
+    uint64_t start = virt & ~(VMM_PAGE_4K - 1);
+    size = (size + (virt & (VMM_PAGE_4K - 1)) + VMM_PAGE_4K - 1) & ~(VMM_PAGE_4K - 1);
+    if (!vmm_range_allowed(space, start, size)) return;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+
+    uint64_t irq = vmm_lock_irqsave();
+    vmm_unmap_range_locked(space->pml4, start, size, UNMAP_KEEP, &batch);
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+}
+
+// Unmap user memory, dropping the references the mappings held
+void vmm_unmap_user_range(vmm_space_t* space, uint64_t virt, uint64_t size) {
+    uint64_t start = virt & ~(VMM_PAGE_4K - 1);
+    size = (size + (virt & (VMM_PAGE_4K - 1)) + VMM_PAGE_4K - 1) & ~(VMM_PAGE_4K - 1);
+    if (space == &kernel_space || !vmm_range_allowed(space, start, size)) return;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+
+    uint64_t irq = vmm_lock_irqsave();
+    vmm_unmap_range_locked(space->pml4, start, size, UNMAP_UNREF, &batch);
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+}
+
+// Map a single leaf of a given level
+static void vmm_map(vmm_space_t* space, uint64_t virt, uint64_t phys, uint64_t flags, int level) {
+    if ((virt | phys) & (LEVEL_SIZE(level) - 1)) {
+        serial_write("VMM: WARNING - Misaligned mapping ignored\n");
+        return;
+    }
+    if (!vmm_range_allowed(space, virt, LEVEL_SIZE(level))) return;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+
+    uint64_t irq = vmm_lock_irqsave();
+    vmm_set_leaf(space->pml4, virt, phys, flags, VMM_CACHE_WB, level, &batch);
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+}
+
+// Map a virtual page to physical page
+void vmm_map_page(vmm_space_t* space, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
+    vmm_map(space, virtual_addr, physical_addr, flags, 0);
+}
+
+// Map a 2MB page
+void vmm_map_huge_page(vmm_space_t* space, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
+    vmm_map(space, virtual_addr, physical_addr, flags, 1);
+}
+
+// Map a 1GB page
+void vmm_map_giant_page(vmm_space_t* space, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
+    if (!has_1g_pages) {
+        serial_write("VMM: ERROR - CPU doesn't support 1GB pages\n");
+        return;
+    }
+    vmm_map(space, virtual_addr, physical_addr, flags, 2);
+}
+
+// Walk the page tables and find the physical address behind a virtual one
+uint64_t vmm_translate(vmm_space_t* space, uint64_t virtual_addr) {
+    uint64_t* table = space->pml4;
+
+    for (int level = 3; level >= 0; level--) {
+        uint64_t entry = table[LEVEL_INDEX(virtual_addr, level)];
+        if (!(entry & VMM_PRESENT)) return 0;
+
+        if (level == 0 || (entry & VMM_HUGE)) {
+            uint64_t mask = LEVEL_SIZE(level) - 1;
+            return (entry & VMM_ADDR_MASK & ~mask) + (virtual_addr & mask);
+        }
+        table = (uint64_t*)(entry & VMM_ADDR_MASK);
+    }
+    return 0;
+}
+
+// Remove a 4KB leaf
+uint64_t vmm_unmap_page(vmm_space_t* space, uint64_t virtual_addr) {
+    uint64_t phys = vmm_translate(space, virtual_addr) & ~(VMM_PAGE_4K - 1);
+    vmm_unmap_range(space, virtual_addr & ~(VMM_PAGE_4K - 1), VMM_PAGE_4K);
+    return phys;
+}
+
+// Raw leaf entry covering virt (0 if nothing is mapped there)
+uint64_t vmm_get_pte(vmm_space_t* space, uint64_t virt) {
+    uint64_t* table = space->pml4;
+
+    for (int level = 3; level >= 0; level--) {
+        uint64_t entry = __atomic_load_n(&table[LEVEL_INDEX(virt, level)], __ATOMIC_RELAXED);
+        if (!(entry & VMM_PRESENT)) return 0;
+        if (level == 0 || (entry & VMM_HUGE)) return entry;
+        table = (uint64_t*)(entry & VMM_ADDR_MASK);
+    }
+    return 0;
+}
+
+// Swap one 4KB leaf, if it still holds what the caller saw
+bool vmm_set_pte(vmm_space_t* space, uint64_t virt, uint64_t expected, uint64_t entry) {
+    virt &= ~(VMM_PAGE_4K - 1);
+    if (!vmm_range_allowed(space, virt, VMM_PAGE_4K)) return false;
+    if (!has_nx) entry &= ~VMM_NX;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+
+    uint64_t irq = vmm_lock_irqsave();
+    bool ok = false;
+    uint64_t* table = vmm_walk_create(space->pml4, virt, 0, entry, &batch);
+    if (table) {
+        uint64_t* pte = &table[LEVEL_INDEX(virt, 0)];
+        uint64_t old = *pte;
+        if (old == expected) {
+            *pte = entry;
+            if (old & VMM_PRESENT) {
+                tlb_batch_add(&batch, virt);
+                // The old frame loses this mapping's reference, but only
+                // once no TLB can still reach it through the old entry
+                if ((old & VMM_ADDR_MASK) != (entry & VMM_ADDR_MASK)) {
+                    tlb_batch_free(&batch, (old & VMM_ADDR_MASK) | TLB_FREE_UNREF, 0);
+                }
+            }
+            ok = true;
+        }
+    }
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+    return ok;
+}
+
+// Find the next leaf at or after *virt and below end, skipping empty subtrees
+// Returns its entry (and moves *virt to the start of it), NULL if there's none
+static uint64_t* vmm_next_leaf(uint64_t* pml, uint64_t* virt, uint64_t end, int* level_out) {
+    while (*virt < end) {
+        uint64_t* table = pml;
+        int level = 3;
+
+        for (;;) {
+            uint64_t* entry = &table[LEVEL_INDEX(*virt, level)];
+            uint64_t span = LEVEL_SIZE(level);
+
+            if (!(*entry & VMM_PRESENT)) {
+                *virt = (*virt + span) & ~(span - 1);
+                break;
+            }
+            if (level == 0 || (*entry & VMM_HUGE)) {
+                *virt &= ~(span - 1);
+                *level_out = level;
+                return entry;
+            }
+            table = (uint64_t*)(*entry & VMM_ADDR_MASK);
+            level--;
+        }
+    }
+    return NULL;
+}
+
+// Share [start, end) of src with dst for fork()
+bool vmm_copy_range_cow(vmm_space_t* dst, vmm_space_t* src, uint64_t start, uint64_t end) {
+    if (!vmm_range_allowed(src, start, end - start) || !vmm_range_allowed(dst, start, end - start)) {
+        return false;
+    }
+
+    tlb_batch_t src_batch, dst_batch;
+    tlb_batch_init(&src_batch, src);
+    tlb_batch_init(&dst_batch, dst);
+
+    uint64_t irq = vmm_lock_irqsave();
+    bool ok = true;
+    uint64_t virt = start;
+    int level;
+    uint64_t* entry;
+
+    while ((entry = vmm_next_leaf(src->pml4, &virt, end, &level))) {
+        // A writable huge leaf can't be copied on write as a whole (the
+        // fault handler copies 4KB pages), so split the parent's down to
+        // 4KB leaves and share those one by one like everything else
+        if (level > 0 && (*entry & VMM_WRITE)) {
+            if (!vmm_split_leaf(entry, level, &src_batch, virt)) {
+                ok = false;
+                break;
+            }
+            continue;  // Same virt again, one level down
+        }
+
+        // Get the child's table first so running out of memory leaves the
+        // parent's entry alone
+        uint64_t* table = vmm_walk_create(dst->pml4, virt, level, VMM_USER, &dst_batch);
+        if (!table) {
+            ok = false;
+            break;
+        }
+
+        uint64_t pte = *entry;
+        void* frame = (void*)(pte & VMM_ADDR_MASK);
+
+        // Refcounted pages get shared read-only, the first write copies them.
+        // Anything else (device memory, read-only huge leaves) is shared as
+        // it is.
+        if (level == 0 && pmm_page_refcount(frame)) {
+            pmm_page_ref(frame);
+            if (pte & VMM_WRITE) {
+                pte = (pte & ~VMM_WRITE) | VMM_COW;
+                *entry = pte;
+                tlb_batch_add(&src_batch, virt);
+            }
+        }
+        table[LEVEL_INDEX(virt, level)] = pte;
+
+        virt += LEVEL_SIZE(level);
+        if (!virt) break;
+    }
+
+    // The parent's threads must stop writing through the old entries now
+    tlb_batch_flush(&src_batch);
+    tlb_batch_flush(&dst_batch);
+    vmm_unlock_irqrestore(irq);
+    return ok;
+}
+
+// Page attribute table, one memory type per byte (PA0 in the low byte)
+// Same layout as Linux: WB, WC, UC-, UC, WB, WP, UC-, WT. Entries 0, 2 and
+// 3 keep their power-on types so anything mapped with plain PCD/PWT before
+// this runs doesn't change meaning.
+#define PAT_UC       0x00ULL
+#define PAT_WC       0x01ULL
+#define PAT_WT       0x04ULL
+#define PAT_WP       0x05ULL
+#define PAT_WB       0x06ULL
+#define PAT_UC_MINUS 0x07ULL
+
+#define PAT_LAYOUT (PAT_WB | (PAT_WC << 8) | (PAT_UC_MINUS << 16) | (PAT_UC << 24) | \
+                    (PAT_WB << 32) | (PAT_WP << 40) | (PAT_UC_MINUS << 48) | (PAT_WT << 56))
+
+// Load our PAT layout (every CPU has to use the same one)
+static void vmm_setup_pat(void) {
+    if (cpu_rdmsr(CPU_MSR_PAT) == PAT_LAYOUT) return;
+
+    // The SDM wants caches and TLBs flushed around a PAT change so no line
+    // hangs around with the old type (the CR3 load in vmm_init does the TLB)
+    cpu_wbinvd();
+    cpu_wrmsr(CPU_MSR_PAT, PAT_LAYOUT);
+    cpu_wbinvd();
+}
+
+// Paging setup every CPU needs (the BSP from vmm_init, APs when they come up)
+void vmm_init_cpu(void) {
+    uint32_t cpu = cpu_id();
+    uint64_t bit = 1ULL << cpu;
+
+    // Memory types have to be in place before anything maps WC
+    vmm_setup_pat();
+
+    // Load CR3 with new page table (tell the CPU about our fancy new page tables)
+    // PCID 0, which CR4.PCIDE insists on while turning it on
+    cpu_write_cr3((uint64_t)kernel_pml4);
+
+    // NX bits in our entries are reserved (and fault) until EFER.NXE is on
+    if (has_nx) cpu_wrmsr(CPU_MSR_EFER, cpu_rdmsr(CPU_MSR_EFER) | CPU_EFER_NXE);
+
+    // Global pages: kernel mappings stay in the TLB across CR3 switches
+    uint64_t cr4 = cpu_read_cr4() | CPU_CR4_PGE;
+    if (has_pcid) cr4 |= CPU_CR4_PCIDE;
+    cpu_write_cr4(cr4);
+
+    tlb_cpus[cpu].loaded = &kernel_space;
+    __atomic_fetch_or(&kernel_space.cpu_mask, bit, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&tlb_online_mask, bit, __ATOMIC_SEQ_CST);
+}
+
+// VMM (Virtual Memory Manager) initialization
+void vmm_init(void) {
+    serial_write("VMM: Building kernel page tables...\n");
+    spin_lock_stats(&vmm_lock, &vmm_lock_stats, "vmm");
+
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpu_cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        has_1g_pages = (edx & (1 << 26)) != 0;
+        has_nx = (edx & (1 << 20)) != 0;
+    }
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    has_pcid = (ecx & (1 << 17)) != 0;
+
+    // Allocate PML4 (Page Map Level 4) table from the PMM (no more hardcoded 0x1000)
+    kernel_pml4 = vmm_alloc_table();
+    if (!kernel_pml4) {
+        serial_write("VMM: ERROR - Can't allocate PML4!\n");
+        return;
+    }
+    kernel_space.pml4 = kernel_pml4;
+    kernel_space.pcid = 0;
+    pcid_bitmap[0] = 1;
+
+    // Identity map all of RAM, and at least the first 4GB so what's below
+    // it (ACPI tables, the BIOS area) stays reachable. Rounded up to 2MB
+    // so the tail doesn't turn into 4KB pages.
+    uint64_t end = pmm_get_max_address();
+    if (end < 0x100000000ULL) end = 0x100000000ULL;
+    end = (end + VMM_PAGE_2M - 1) & ~(VMM_PAGE_2M - 1);
+    identity_slots = (end + LEVEL_SIZE(3) - 1) >> LEVEL_SHIFT(3);
+    identity_end = end;
+
+    // RAM is write-back, the holes between it uncached. Devices in there
+    // get UC/WC mappings in the MMIO window, and the SDM says not to map a
+    // page with two different memory types, so a hole must never be WB
+    // here (vmm_map_mmio drops the alias for anything that isn't UC).
+    // These tables aren't live yet, so no flushing needed.
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, &kernel_space);
+    uint64_t flags = VMM_PRESENT | VMM_WRITE | VMM_GLOBAL;
+    uint64_t addr = 0;
+    bool ok = true;
+    for (int i = 0; ok && addr < end; i++) {
+        uint64_t ram_start, ram_end;
+        if (!pmm_get_ram_range(i, &ram_start, &ram_end) || ram_start >= end) {
+            ram_start = ram_end = end;
+        }
+        if (ram_end > end) ram_end = end;
+
+        ok = vmm_map_range_locked(kernel_pml4, addr, addr, ram_start - addr, flags,
+                                  VMM_CACHE_UC, &batch) &&
+             vmm_map_range_locked(kernel_pml4, ram_start, ram_start, ram_end - ram_start, flags,
+                                  VMM_CACHE_WB, &batch);
+        addr = ram_end;
+    }
+    if (!ok) {
+        serial_write("VMM: ERROR - Can't build the identity map!\n");
+        return;
+    }
+
+    // User spaces copy the kernel's PML4 entries when they're created, so
+    // the kernel windows need their PDPTs now or later mappings in them
+    // wouldn't show up everywhere (PDPTs are never freed, see vmm_prune)
+    for (uint64_t addr = VMM_KERNEL_BASE; addr; addr += LEVEL_SIZE(3)) {
+        uint64_t* entry = &kernel_pml4[LEVEL_INDEX(addr, 3)];
+        if (*entry & VMM_PRESENT) continue;
+
+        uint64_t* pdpt = vmm_alloc_table();
+        if (!pdpt) {
+            serial_write("VMM: ERROR - Can't allocate kernel PDPTs!\n");
+            return;
+        }
+        *entry = vmm_table_entry(pdpt, 0);
+    }
+
+    vmm_init_cpu();
+    boot_tables = false;  // All of RAM is reachable now
+
+    serial_write("VMM: Identity mapped ");
+    serial_write_dec(end >> 20);
+    serial_write(has_1g_pages ? "MB with 1GB pages" : "MB with 2MB pages");
+    serial_write(has_pcid ? ", PCIDs on\n" : ", no PCIDs\n");
+}
+
+uint64_t* vmm_get_kernel_pml4(void) {
+    return kernel_pml4;
+}
+
+vmm_space_t* vmm_kernel_space(void) {
+    return &kernel_space;
+}
+
+bool vmm_has_1g_pages(void) {
+    return has_1g_pages;
+}
+
+bool vmm_has_pcid(void) {
+    return has_pcid;
+}
+
+uint64_t vmm_user_start(void) {
+    return (uint64_t)identity_slots << LEVEL_SHIFT(3);
+}
+
+// Grab a free PCID, 0 if they're all taken (or the CPU has none)
+static uint16_t pcid_alloc(void) {
+    if (!has_pcid) return 0;
+
+    uint16_t pcid = 0;
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    for (uint32_t i = 0; i < PCID_COUNT / 64; i++) {
+        if (~pcid_bitmap[i]) {
+            uint32_t bit = __builtin_ctzll(~pcid_bitmap[i]);
+            pcid_bitmap[i] |= 1ULL << bit;
+            pcid = i * 64 + bit;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    return pcid;
+}
+
+static void pcid_free(uint16_t pcid) {
+    if (!pcid) return;
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    pcid_bitmap[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+// New address space sharing the kernel's mappings
+vmm_space_t* vmm_space_create(void) {
+    vmm_space_t* space = kmalloc(sizeof(vmm_space_t));
+    if (!space) return NULL;
+
+    space->pml4 = vmm_alloc_table();
+    if (!space->pml4) {
+        kfree(space);
+        return NULL;
+    }
+
+    // Identity map and kernel half point at the kernel's own tables
+    for (uint32_t i = 0; i < identity_slots; i++) space->pml4[i] = kernel_pml4[i];
+    for (uint32_t i = 256; i < 512; i++) space->pml4[i] = kernel_pml4[i];
+
+    space->pcid = pcid_alloc();
+    space->cpu_mask = 0;
+
+    // The PCID may have belonged to a dead space, and its entries can still
+    // be cached anywhere: everyone flushes it the first time they load us
+    space->stale_mask = ~0ULL;
+    return space;
+}
+
+// Free a user space's tables (not the kernel's shared ones)
+void vmm_space_destroy(vmm_space_t* space) {
+    if (!space || space == &kernel_space) return;
+
+    // CPUs lazily holding it (kernel threads) have to let go first
+    uint64_t self = 1ULL << cpu_id();
+    uint64_t irq = cpu_irq_save();
+    if (tlb_cpus[cpu_id()].loaded == space) {
+        tlb_cpus[cpu_id()].loaded = &kernel_space;
+        __atomic_fetch_or(&kernel_space.cpu_mask, self, __ATOMIC_SEQ_CST);
+        cpu_write_cr3((uint64_t)kernel_pml4);
+        __atomic_fetch_and(&space->cpu_mask, ~self, __ATOMIC_SEQ_CST);
+    }
+    uint64_t others = __atomic_load_n(&space->cpu_mask, __ATOMIC_SEQ_CST);
+    if (others) {
+        tlb_batch_t batch;
+        tlb_batch_init(&batch, space);
+        tlb_send(&batch, others, false, true);
+    }
+    cpu_irq_restore(irq);
+
+    if (space->cpu_mask) {
+        serial_write("VMM: WARNING - Destroying an address space that's still running\n");
+    }
+
+    // Nobody runs it anymore, so the "flush" just frees the tables (a stale
+    // PCID gets flushed by whoever gets it next)
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space);
+    for (uint32_t i = identity_slots; i < 256; i++) {
+        if (space->pml4[i] & VMM_PRESENT) {
+            vmm_free_tables((uint64_t*)(space->pml4[i] & VMM_ADDR_MASK), 2, &batch);
+        }
+    }
+    tlb_batch_flush(&batch);
+
+    pmm_free_page(space->pml4);
+    pcid_free(space->pcid);
+    kfree(space);
+}
+
+// Switch this CPU to another address space
+void vmm_switch_space(vmm_space_t* next) {
+    uint32_t cpu = cpu_id();
+    uint64_t bit = 1ULL << cpu;
+    tlb_cpu_t* tc = &tlb_cpus[cpu];
+
+    // Kernel thread: keep whatever is loaded, we won't touch user memory
+    if (!next) {
+        __atomic_fetch_or(&tlb_lazy_mask, bit, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    uint64_t irq = cpu_irq_save();
+    __atomic_fetch_and(&tlb_lazy_mask, ~bit, __ATOMIC_SEQ_CST);
+
+    vmm_space_t* prev = tc->loaded;
+    if (prev != next) __atomic_fetch_or(&next->cpu_mask, bit, __ATOMIC_SEQ_CST);
+
+    // Missed shootdowns while we weren't running it (or the PCID is recycled)?
+    bool stale = __atomic_fetch_and(&next->stale_mask, ~bit, __ATOMIC_SEQ_CST) & bit;
+
+    if (prev != next || stale) {
+        uint64_t cr3 = (uint64_t)next->pml4 | next->pcid;
+        // PCID 0 user spaces (we ran out) share it with the kernel, always flush those
+        if (has_pcid && !stale && (next->pcid || next == &kernel_space)) cr3 |= VMM_CR3_NOFLUSH;
+        tc->loaded = next;
+        cpu_write_cr3(cr3);
+    }
+
+    if (prev != next) __atomic_fetch_and(&prev->cpu_mask, ~bit, __ATOMIC_SEQ_CST);
+    cpu_irq_restore(irq);
+}
+
+vmm_space_t* vmm_current_space(void) {
+    return tlb_cpus[cpu_id()].loaded;
+}
+
+// Hook up the IPI that makes other CPUs run vmm_tlb_ipi()
+void vmm_set_tlb_ipi(void (*send)(uint32_t cpu)) {
+    tlb_send_ipi = send;
+}
+
+// Shootdown IPI handler
+void vmm_tlb_ipi(void) {
+    tlb_process_mailbox();
+}
+
+// Map device memory into the MMIO window
+void* vmm_map_mmio(uint64_t phys, size_t size, vmm_cache_t cache) {
+    uint64_t offset = phys & (VMM_PAGE_4K - 1);
+    uint64_t base = phys - offset;
+    uint64_t bytes = (size + offset + VMM_PAGE_4K - 1) & ~(VMM_PAGE_4K - 1);
+    if (!bytes || !kernel_pml4) return NULL;
+
+    // The identity map has this UC (it's not RAM). Any other type would
+    // make the two aliases disagree, so the window becomes the only way in.
+    if (cache != VMM_CACHE_UC && base < identity_end) {
+        uint64_t alias_end = base + bytes < identity_end ? base + bytes : identity_end;
+        vmm_unmap_range(&kernel_space, base, alias_end - base);
+    }
+
+    // Big BARs get a virtual address with the same offset inside a 2MB page
+    // as the physical one, so vmm_map_range can use 2MB leaves
+    uint64_t irq = spin_lock_irqsave(&mmio_lock);
+    uint64_t virt = mmio_next;
+    if (bytes >= VMM_PAGE_2M) {
+        virt = ((virt + VMM_PAGE_2M - 1) & ~(VMM_PAGE_2M - 1)) | (base & (VMM_PAGE_2M - 1));
+    }
+    if (virt + bytes > VMM_MMIO_END) {
+        spin_unlock_irqrestore(&mmio_lock, irq);
+        serial_write("VMM: ERROR - MMIO window exhausted\n");
+        return NULL;
+    }
+    mmio_next = virt + bytes;
+    spin_unlock_irqrestore(&mmio_lock, irq);
+
+    if (!vmm_map_range(&kernel_space, virt, base, bytes,
+                       VMM_PRESENT | VMM_WRITE | VMM_GLOBAL | VMM_NX, cache)) {
+        vmm_unmap_range(&kernel_space, virt, bytes);
+        return NULL;
+    }
+    return (void*)(virt + offset);
+}
+
+// Drop an MMIO mapping (the virtual range isn't reused)
+void vmm_unmap_mmio(void* addr, size_t size) {
+    vmm_unmap_range(&kernel_space, (uint64_t)addr, size);
+}
+
+// Allocate a buffer backed by 2MB pages
+void* vmm_alloc_huge_buffer(size_t size) {
+    uint64_t bytes = (size + VMM_PAGE_2M - 1) & ~(VMM_PAGE_2M - 1);
+    if (!bytes) return NULL;
+
+    // Claim the virtual range first so two callers never get the same one
+    // (like the MMIO window, it isn't reused after a free)
+    uint64_t irq = vmm_lock_irqsave();
+    uint64_t base = huge_buf_next;
+    bool fits = bytes <= VMM_HUGE_BUF_END - base;
+    if (fits) huge_buf_next += bytes;
+    vmm_unlock_irqrestore(irq);
+    if (!fits) {
+        serial_write("VMM: ERROR - Huge buffer window exhausted\n");
+        return NULL;
+    }
+
+    // The physical 2MB blocks don't need to be next to each other,
+    // only the virtual range has to be contiguous
+    for (uint64_t offset = 0; offset < bytes; offset += VMM_PAGE_2M) {
+        void* phys = pmm_alloc_huge_page();
+        if (!phys) {
+            serial_write("VMM: ERROR - Out of 2MB pages for huge buffer\n");
+            vmm_free_huge_buffer((void*)base, offset);
+            return NULL;
+        }
+        if (!vmm_map_range(&kernel_space, base + offset, (uint64_t)phys, VMM_PAGE_2M,
+                           VMM_PRESENT | VMM_WRITE | VMM_GLOBAL | VMM_NX, VMM_CACHE_WB)) {
+            // Not mapped yet, so the unmap below won't give this one back
+            pmm_free_huge_page(phys);
+            vmm_free_huge_buffer((void*)base, offset);
+            return NULL;
+        }
+    }
+    return (void*)base;
+}
+
+// Unmap a huge buffer and give its 2MB pages back (one flush for the lot)
+void vmm_free_huge_buffer(void* buffer, size_t size) {
+    uint64_t bytes = (size + VMM_PAGE_2M - 1) & ~(VMM_PAGE_2M - 1);
+    if (!bytes) return;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, &kernel_space);
+
+    uint64_t irq = vmm_lock_irqsave();
+    vmm_unmap_range_locked(kernel_pml4, (uint64_t)buffer, bytes, UNMAP_FREE, &batch);
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+}
+
+// Reserve `size` bytes of vmalloc address space (caller adds the guard page)
+static uint64_t vmalloc_reserve(uint64_t size) {
+    uint64_t addr = 0;
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    for (int i = 0; i < VMALLOC_MAX_HOLES; i++) {
+        if (vmalloc_holes[i].size >= size) {
+            addr = vmalloc_holes[i].start;
+            vmalloc_holes[i].start += size;
+            vmalloc_holes[i].size -= size;
+            break;
+        }
+    }
+
+    if (!addr && vmalloc_next + size <= VMM_VMALLOC_END) {
+        addr = vmalloc_next;
+        vmalloc_next += size;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return addr;
+}
+
+// Give vmalloc address space back, merging with a neighbouring hole if there is one
+static void vmalloc_release(uint64_t start, uint64_t size) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    int empty = -1;
+    for (int i = 0; i < VMALLOC_MAX_HOLES; i++) {
+        vmalloc_hole_t* hole = &vmalloc_holes[i];
+        if (!hole->size) {
+            if (empty < 0) empty = i;
+        } else if (hole->start + hole->size == start) {
+            hole->size += size;
+            empty = -2;
+            break;
+        } else if (start + size == hole->start) {
+            hole->start = start;
+            hole->size += size;
+            empty = -2;
+            break;
+        }
+    }
+
+    // Table full? Leak the address space, there's a terabyte of it
+    if (empty >= 0) {
+        vmalloc_holes[empty].start = start;
+        vmalloc_holes[empty].size = size;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+}
+
+// Unmap and free the pages of an area up to its guard page, returns its size
+static uint64_t vmalloc_unmap(uint64_t base) {
+    uint64_t bytes = 0;
+    while (vmm_translate(&kernel_space, base + bytes)) bytes += VMM_PAGE_4K;
+    if (!bytes) return 0;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, &kernel_space);
+
+    uint64_t irq = vmm_lock_irqsave();
+    vmm_unmap_range_locked(kernel_pml4, base, bytes, UNMAP_FREE, &batch);
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+    return bytes;
+}
+
+// Allocate virtually contiguous memory backed by single pages
+void* vmalloc(size_t size) {
+    uint64_t bytes = (size + VMM_PAGE_4K - 1) & ~(VMM_PAGE_4K - 1);
+    if (!bytes || !kernel_pml4) return NULL;
+
+    uint64_t base = vmalloc_reserve(bytes + VMM_PAGE_4K);  // + guard page
+    if (!base) {
+        serial_write("VMM: ERROR - vmalloc address space exhausted\n");
+        return NULL;
+    }
+
+    // Fresh mappings over not-present entries, nothing to flush
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, &kernel_space);
+    bool ok = true;
+
+    uint64_t irq = vmm_lock_irqsave();
+    for (uint64_t offset = 0; offset < bytes && ok; offset += VMM_PAGE_4K) {
+        void* page = pmm_alloc_page();
+        if (!page) {
+            serial_write("VMM: ERROR - Out of memory in vmalloc\n");
+            ok = false;
+        } else if (!vmm_set_leaf(kernel_pml4, base + offset, (uint64_t)page,
+                                 VMM_PRESENT | VMM_WRITE | VMM_GLOBAL | VMM_NX,
+                                 VMM_CACHE_WB, 0, &batch)) {
+            pmm_free_page(page);
+            ok = false;
+        }
+    }
+    tlb_batch_flush(&batch);
+    vmm_unlock_irqrestore(irq);
+
+    if (!ok) {
+        vmalloc_unmap(base);
+        vmalloc_release(base, bytes + VMM_PAGE_4K);
+        return NULL;
+    }
+    return (void*)base;
+}
+
+// Unmap and free a vmalloc area (runs until the guard page)
+void vfree(void* addr) {
+    uint64_t base = (uint64_t)addr;
+    if (!addr) return;
+    if (base < VMM_VMALLOC_BASE || base >= VMM_VMALLOC_END || (base & (VMM_PAGE_4K - 1))) {
+        serial_write("VMM: WARNING - vfree() of a non-vmalloc address\n");
+        return;
+    }
+
+    vmalloc_release(base, vmalloc_unmap(base) + VMM_PAGE_4K);
+}
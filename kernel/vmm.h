@@ -0,0 +1,194 @@
+// kernel/vmm.h
+// Virtual Memory Manager - x86_64 4-level page tables
+// PML4 -> PDPT -> PD -> PT, with 4KB, 2MB and 1GB leaf pages
+//
+// Created by: floof<3
+
+#ifndef VMM_H
+#define VMM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Page table entry flags
+#define VMM_PRESENT  (1ULL << 0)   // Page is in memory
+#define VMM_WRITE    (1ULL << 1)   // Page is writable
+#define VMM_USER     (1ULL << 2)   // Ring 3 can touch it
+#define VMM_PWT      (1ULL << 3)   // Write-through
+#define VMM_PCD      (1ULL << 4)   // Cache disable
+#define VMM_ACCESSED (1ULL << 5)
+#define VMM_DIRTY    (1ULL << 6)
+#define VMM_HUGE     (1ULL << 7)   // PS bit: 2MB leaf in a PD, 1GB leaf in a PDPT
+#define VMM_PAT      (1ULL << 7)   // PAT index bit 2 in a 4KB leaf (same bit as PS)
+#define VMM_GLOBAL   (1ULL << 8)   // Survives CR3 reloads
+#define VMM_COW      (1ULL << 9)   // Software bit: read-only because it's shared copy-on-write
+#define VMM_PAT_HUGE (1ULL << 12)  // PAT index bit 2 in a 2MB/1GB leaf
+#define VMM_NX       (1ULL << 63)  // No execute
+
+#define VMM_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Leaf page sizes
+#define VMM_PAGE_4K 0x1000ULL
+#define VMM_PAGE_2M 0x200000ULL
+#define VMM_PAGE_1G 0x40000000ULL
+
+// Memory types (value = PAT index, see vmm_init for the PAT layout)
+// PAT/PCD/PWT bits pick a PAT entry: index = PAT*4 + PCD*2 + PWT.
+// Entries 0-3 match the power-on defaults apart from 1 (WT -> WC).
+typedef enum {
+    VMM_CACHE_WB = 0,        // Write-back, normal RAM
+    VMM_CACHE_WC = 1,        // Write-combining, framebuffers
+    VMM_CACHE_UC_MINUS = 2,  // Uncached, MTRRs can still make it WC
+    VMM_CACHE_UC = 3,        // Uncached, device registers
+    VMM_CACHE_WP = 5,        // Write-protect
+    VMM_CACHE_WT = 7,        // Write-through
+} vmm_cache_t;
+
+// CR3 bit 63: keep the new PCID's TLB entries (needs CR4.PCIDE)
+#define VMM_CR3_NOFLUSH (1ULL << 63)
+
+// Kernel virtual address layout
+// 0 .. top of RAM                    identity map (virtual == physical)
+// top of RAM (512GB slot) .. VMM_USER_END   user space (per address space)
+// VMM_KERNEL_BASE .. top             kernel half, shared by every space
+// VMM_HUGE_BUF_BASE (1TB window)     huge-page backed driver buffers
+// VMM_VMALLOC_BASE  (1TB window)     vmalloc (virtually contiguous, 4KB pages)
+// VMM_MMIO_BASE     (1TB window)     device registers (vmm_map_mmio)
+#define VMM_USER_END      0x0000800000000000ULL
+#define VMM_KERNEL_BASE   0xFFFF800000000000ULL
+#define VMM_HUGE_BUF_BASE 0xFFFFA00000000000ULL
+#define VMM_HUGE_BUF_END  0xFFFFA10000000000ULL
+#define VMM_VMALLOC_BASE  0xFFFFB00000000000ULL
+#define VMM_VMALLOC_END   0xFFFFB10000000000ULL
+#define VMM_MMIO_BASE     0xFFFFC00000000000ULL
+#define VMM_MMIO_END      0xFFFFC10000000000ULL
+
+// An address space: a PML4 plus who has it cached
+// Every space shares the identity map and the kernel half with the kernel
+// space, only the user part in between is its own.
+typedef struct vmm_space {
+    uint64_t* pml4;
+    uint16_t pcid;                 // TLB tag, 0 = kernel (or PCIDs off/ran out)
+    volatile uint64_t cpu_mask;    // CPUs with it in CR3 (running it or lazily)
+    volatile uint64_t stale_mask;  // CPUs that have to flush its PCID before using it again
+} vmm_space_t;
+
+// Build the kernel page tables and switch to them
+// Identity maps all RAM (and at least the first 4GB for MMIO) with 1GB
+// pages if the CPU has them, 2MB pages otherwise, and turns on global
+// pages and PCIDs
+void vmm_init(void);
+
+// Per-CPU part of vmm_init (PAT, CR3, CR4), for APs as they come up
+void vmm_init_cpu(void);
+
+// The kernel's PML4 (physical == virtual, it lives in the identity map)
+uint64_t* vmm_get_kernel_pml4(void);
+
+// The kernel's address space (kernel threads, all kernel mappings)
+vmm_space_t* vmm_kernel_space(void);
+
+// Does this CPU support 1GB pages? (CPUID 0x80000001 EDX bit 26)
+bool vmm_has_1g_pages(void);
+
+// Does this CPU support PCIDs? (CPUID 1 ECX bit 17)
+bool vmm_has_pcid(void);
+
+// Lowest address a user space can map (the first PML4 slot past the identity map)
+uint64_t vmm_user_start(void);
+
+// Make a new user address space / free one (nobody may be running it)
+vmm_space_t* vmm_space_create(void);
+void vmm_space_destroy(vmm_space_t* space);
+
+// Switch this CPU to `next`, keeping its TLB entries if it has a PCID
+// NULL means a kernel thread is running: the old space stays loaded
+// ("lazy") and shootdowns for it skip this CPU until it comes back
+void vmm_switch_space(vmm_space_t* next);
+
+// Space currently in this CPU's CR3
+vmm_space_t* vmm_current_space(void);
+
+// TLB shootdowns
+// The SMP code registers a function that sends the shootdown IPI to a
+// CPU, and calls vmm_tlb_ipi() from that IPI's handler. Until then there's
+// nobody else to shoot down.
+void vmm_set_tlb_ipi(void (*send)(uint32_t cpu));
+void vmm_tlb_ipi(void);
+
+// Map `size` bytes of physical memory at virt (everything 4KB aligned)
+// Each piece gets the biggest page that fits (1GB, 2MB, then 4KB), missing
+// tables come from the PMM, huge pages in the way get split, and the TLB is
+// flushed once at the end. False if we ran out of memory for page tables.
+// `cache` replaces whatever PWT/PCD bits are in flags.
+bool vmm_map_range(vmm_space_t* space, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags,
+                   vmm_cache_t cache);
+
+// Unmap a range with one TLB flush at the end
+// Huge pages that only partly overlap it are split, page tables that end up
+// empty are freed. The memory that was mapped is NOT freed.
+void vmm_unmap_range(vmm_space_t* space, uint64_t virt, uint64_t size);
+
+// Unmap user memory (kernel/uvm.c), each 4KB leaf drops its reference on
+// the page behind it (pmm_page_unref) once the TLB flush is done
+void vmm_unmap_user_range(vmm_space_t* space, uint64_t virt, uint64_t size);
+
+// Single-entry access for the page fault handler
+// vmm_get_pte returns the raw leaf entry covering virt (0 if not mapped).
+// vmm_set_pte replaces a 4KB leaf, but only if it still equals `expected`
+// (false if it changed under us or page tables ran out). When the new entry
+// points at another frame, the old frame's reference is dropped after the
+// flush.
+uint64_t vmm_get_pte(vmm_space_t* space, uint64_t virt);
+bool vmm_set_pte(vmm_space_t* space, uint64_t virt, uint64_t expected, uint64_t entry);
+
+// fork(): map everything src has in [start, end) into dst (a fresh space)
+// Refcounted pages get an extra reference and lose VMM_WRITE in both spaces
+// (marked VMM_COW instead), so the first write faults and copies them.
+// Writable huge leaves in src are split to 4KB first.
+// False if page tables ran out (dst is then half built, destroy it).
+bool vmm_copy_range_cow(vmm_space_t* dst, vmm_space_t* src, uint64_t start, uint64_t end);
+
+// Flush every TLB entry on this CPU, global ones included
+void vmm_flush_tlb_all(void);
+
+// Map a virtual page to a physical page
+// Intermediate tables are allocated from the PMM on demand
+void vmm_map_page(vmm_space_t* space, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
+
+// Map a 2MB page (both addresses must be 2MB aligned)
+void vmm_map_huge_page(vmm_space_t* space, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
+
+// Map a 1GB page (both addresses must be 1GB aligned, needs vmm_has_1g_pages())
+void vmm_map_giant_page(vmm_space_t* space, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
+
+// Remove a 4KB mapping, returns the physical address it pointed to (0 if none)
+uint64_t vmm_unmap_page(vmm_space_t* space, uint64_t virtual_addr);
+
+// Walk the page tables, returns the physical address or 0 if not mapped
+uint64_t vmm_translate(vmm_space_t* space, uint64_t virtual_addr);
+
+// Map device memory into the MMIO window
+// VMM_CACHE_UC for registers, VMM_CACHE_WC for framebuffers.
+// phys/size don't need to be page aligned, the returned pointer has the
+// same offset into its page as phys. NULL on failure.
+void* vmm_map_mmio(uint64_t phys, size_t size, vmm_cache_t cache);
+void vmm_unmap_mmio(void* addr, size_t size);
+
+// Huge-page backed buffers for drivers
+// Big, hot, linearly scanned buffers (compositor backbuffer, page cache)
+// get 2MB mappings so they only need a handful of TLB entries.
+// Size is rounded up to 2MB. Memory is NOT zeroed. Returns NULL on failure.
+void* vmm_alloc_huge_buffer(size_t size);
+void vmm_free_huge_buffer(void* buffer, size_t size);
+
+// Virtually contiguous memory from scattered single pages
+// For big allocations when the buddy allocator has no contiguous block left.
+// Not physically contiguous - never hand this to a device for DMA.
+// Every area is followed by an unmapped guard page (overruns fault instead
+// of trashing the next area), which is also how vfree() finds the end.
+void* vmalloc(size_t size);
+void vfree(void* addr);
+
+#endif // VMM_H
@@ -0,0 +1,97 @@
+// kernel/workqueue.c
+// Per-CPU work queues and their worker threads
+//
+// Created by: floof<3
+
+#include "workqueue.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "percpu.h"
+#include "smp.h"
+#include "cpu.h"
+#include "../drivers/serial.h"
+
+typedef struct {
+    spinlock_t lock;
+    work_t* head;
+    work_t* tail;
+    thread_t* worker;
+} __attribute__((aligned(64))) workqueue_t;
+
+static workqueue_t queues[MAX_CPUS];
+
+void work_init(work_t* work, void (*func)(work_t*)) {
+    work->next = NULL;
+    work->func = func;
+    work->pending = 0;
+}
+
+bool work_queue_on(uint32_t cpu, work_t* work) {
+    if (cpu >= MAX_CPUS) return false;
+    if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL)) return false;
+
+    workqueue_t* wq = &queues[cpu];
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    work->next = NULL;
+    if (wq->tail) wq->tail->next = work;
+    else wq->head = work;
+    wq->tail = work;
+    thread_t* worker = wq->worker;
+    spin_unlock_irqrestore(&wq->lock, flags);
+
+    // Before workqueue_init it just waits on the list
+    if (worker) thread_wake(worker);
+    return true;
+}
+
+bool work_queue(work_t* work) {
+    uint64_t flags = cpu_irq_save();
+    uint32_t cpu = cpu_id();
+    cpu_irq_restore(flags);
+    return work_queue_on(cpu, work);
+}
+
+static void worker_main(void* arg) {
+    workqueue_t* wq = arg;
+
+    for (;;) {
+        // Take everything queued so far in one go
+        uint64_t flags = spin_lock_irqsave(&wq->lock);
+        work_t* work = wq->head;
+        wq->head = wq->tail = NULL;
+        spin_unlock_irqrestore(&wq->lock, flags);
+
+        if (!work) {
+            // A work_queue() between the check and here makes this return at once
+            thread_block();
+            continue;
+        }
+
+        while (work) {
+            work_t* next = work->next;
+            // Not pending anymore once it starts, so it can queue itself again
+            __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+            work->func(work);
+            work = next;
+        }
+    }
+}
+
+void workqueue_init(void) {
+    uint64_t online = smp_online_mask();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!(online & (1ULL << cpu))) continue;
+
+        char name[] = "kworker/0";
+        name[sizeof(name) - 2] = '0' + cpu;
+        thread_t* worker = thread_create_on(cpu, name, worker_main, &queues[cpu], SCHED_PRIO_DEFAULT);
+        if (!worker) {
+            serial_write("WORKQUEUE: ERROR - Can't create kworker\n");
+            continue;
+        }
+
+        uint64_t flags = spin_lock_irqsave(&queues[cpu].lock);
+        queues[cpu].worker = worker;
+        spin_unlock_irqrestore(&queues[cpu].lock, flags);
+    }
+}
@@ -0,0 +1,33 @@
+// kernel/workqueue.h
+// Per-CPU work queues
+// Every CPU has a worker thread ("kworker/N") running queued work items in
+// order. Unlike softirqs and tasklets, work runs in a normal thread: it can
+// sleep, block and take its time. Queueing is fine from anywhere,
+// interrupt handlers included.
+//
+// Created by: floof<3
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct work {
+    struct work* next;
+    void (*func)(struct work* work);   // Embed the work_t, get back to the container from it
+    volatile uint32_t pending;         // Queued and not started yet
+} work_t;
+
+// Start a worker thread per online CPU (after smp_init)
+void workqueue_init(void);
+
+void work_init(work_t* work, void (*func)(work_t*));
+
+// Run func on this CPU's / `cpu`'s worker
+// False if it's already queued (it'll still run once). Work can queue
+// itself again once it has started.
+bool work_queue(work_t* work);
+bool work_queue_on(uint32_t cpu, work_t* work);
+
+#endif // WORKQUEUE_H
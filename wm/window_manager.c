@@ -3,6 +3,11 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "../kernel/heap.h"
+#include "../kernel/clock.h"
+#include "../kernel/ring.h"
+#include "../kernel/scheduler.h"
+#include "../kernel/rcu.h"
+#include "../kernel/spinlock.h"
 
 // Missing type definitions
 typedef struct {
@@ -21,7 +26,8 @@ typedef enum {
 
 typedef enum {
     INPUT_TYPE_TOUCHSCREEN,
-    INPUT_TYPE_MOUSE
+    INPUT_TYPE_MOUSE,
+    INPUT_TYPE_COUNT
 } input_type_t;
 
 typedef enum {
@@ -33,7 +39,8 @@ typedef enum {
 
 typedef enum {
     EV_ABS,
-    EV_KEY
+    EV_KEY,
+    EV_SYN   // End of one report (input_sync)
 } event_type_t;
 
 typedef enum {
@@ -54,6 +61,7 @@ typedef struct {
     event_type_t type;
     uint32_t code;
     int value;
+    input_type_t source;  // Device type it came from (0 = touchscreen)
 } input_event_t;
 
 typedef struct {
@@ -116,7 +124,8 @@ typedef struct window {
 } window_t;
 
 typedef struct {
-    window_t* windows;
+    window_t* windows;         // Top first. RCU: readers only follow next
+    spinlock_t windows_lock;   // Writers (add/remove)
     window_t* focused_window;
     
     // Touch gesture recognition
@@ -141,7 +150,18 @@ typedef struct {
 
 static window_manager_t wm = {0};
 
+// Input events cross from the drivers (interrupt/tasklet context, any CPU)
+// to the input thread through a lock-free ring
+#define INPUT_QUEUE_SIZE  256
+#define INPUT_BATCH       32
+#define INPUT_THREAD_PRIO 8   // Ahead of normal threads, input lag is what you feel
+
+static mpsc_ring_t input_queue;
+static void (*input_handlers[INPUT_TYPE_COUNT])(input_event_t*);
+static volatile uint32_t input_dropped;  // Queue was full
+
 // Forward declarations for WM functions
+void input_init(void);
 void wm_handle_touch(input_event_t* event);
 void wm_handle_mouse(input_event_t* event);
 void wm_handle_touch_down(int slot);
@@ -152,6 +172,8 @@ void osk_handle_touch(int x, int y);
 void osk_show_for_window(window_t* win);
 void osk_render(void);
 window_t* wm_window_at_point(int x, int y);
+void wm_add_window(window_t* win);
+void wm_remove_window(window_t* win);
 void wm_focus_window(window_t* win);
 bool wm_is_on_resize_edge(window_t* win, int x, int y);
 int wm_get_resize_edge(window_t* win, int x, int y);
@@ -163,11 +185,15 @@ void wm_resize_window_edge(window_t* win, int x, int y, int edge);
 
 void wm_init(void) {
     wm.windows = NULL;
+    wm.windows_lock = (spinlock_t)SPINLOCK_INIT;
     wm.focused_window = NULL;
     
     // Initialize on-screen keyboard
     osk_init();
     
+    // Event queue + the thread that drains it
+    input_init();
+    
     // Register input handlers
     input_register_handler(INPUT_TYPE_TOUCHSCREEN, wm_handle_touch);
     input_register_handler(INPUT_TYPE_MOUSE, wm_handle_mouse);
@@ -409,24 +435,53 @@ void osk_render(void) {
         }
     }
 }
-// Stub implementations for missing functions
+// Input thread: sleep until a driver syncs, then hand everything queued
+// to the handlers in order
+static void input_thread(void* arg) {
+    (void)arg;
+    input_event_t batch[INPUT_BATCH];
+    
+    for (;;) {
+        mpsc_ring_wait(&input_queue);
+        
+        uint32_t count;
+        while ((count = mpsc_ring_dequeue_batch(&input_queue, batch, INPUT_BATCH))) {
+            for (uint32_t i = 0; i < count; i++) {
+                input_event_t* event = &batch[i];
+                if (event->source < INPUT_TYPE_COUNT && input_handlers[event->source]) {
+                    input_handlers[event->source](event);
+                }
+            }
+        }
+    }
+}
+
+void input_init(void) {
+    if (!mpsc_ring_init(&input_queue, INPUT_QUEUE_SIZE, sizeof(input_event_t))) return;
+    thread_create("input", input_thread, NULL, INPUT_THREAD_PRIO);
+}
+
 void input_register_handler(input_type_t type, void (*handler)(input_event_t*)) {
-    (void)type; (void)handler;
-    // TODO: Implement input handler registration
+    if (type < INPUT_TYPE_COUNT) input_handlers[type] = handler;
 }
 
+// Safe from interrupt handlers and tasklets: no locks, no sleeping
+// Events just queue up, input_sync() wakes the input thread for the lot
 void input_report_event(input_event_t* event) {
-    (void)event;
-    // TODO: Implement event reporting
+    if (!mpsc_ring_enqueue(&input_queue, event)) {
+        __atomic_fetch_add(&input_dropped, 1, __ATOMIC_RELAXED);
+    }
 }
 
 void input_sync(void) {
-    // TODO: Implement sync
+    input_event_t sync = { .type = EV_SYN };
+    input_report_event(&sync);
+    mpsc_ring_notify(&input_queue);
 }
 
+// Microseconds since boot (monotonic)
 uint64_t get_system_time(void) {
-    // TODO: Implement system time
-    return 0;
+    return clock_ns() / NS_PER_US;
 }
 
 void compositor_damage_region(int x, int y, int width, int height) {
@@ -460,9 +515,46 @@ key_code_t osk_char_to_keycode(char c) {
     return KEY_SPACE;
 }
 
+// Topmost window under (x, y)
+// Called for every touch, walks the list lock-free. The window stays valid
+// as long as the caller is on the WM thread (only it removes windows).
 window_t* wm_window_at_point(int x, int y) {
-    (void)x; (void)y;
-    return NULL;
+    window_t* found = NULL;
+    
+    rcu_read_lock();
+    for (window_t* win = rcu_dereference(wm.windows); win; win = rcu_dereference(win->next)) {
+        if (rect_contains(&win->bounds, x, y)) {
+            found = win;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    
+    return found;
+}
+
+// Put a window on top
+void wm_add_window(window_t* win) {
+    uint64_t flags = spin_lock_irqsave(&wm.windows_lock);
+    win->prev = NULL;
+    win->next = wm.windows;
+    if (wm.windows) wm.windows->prev = win;
+    rcu_assign_pointer(wm.windows, win);  // win is fully set up before anyone can see it
+    spin_unlock_irqrestore(&wm.windows_lock, flags);
+}
+
+// Take a window off the list, the caller can free it when this returns
+void wm_remove_window(window_t* win) {
+    uint64_t flags = spin_lock_irqsave(&wm.windows_lock);
+    if (win->prev) rcu_assign_pointer(win->prev->next, win->next);
+    else rcu_assign_pointer(wm.windows, win->next);
+    if (win->next) win->next->prev = win->prev;
+    if (wm.focused_window == win) wm.focused_window = NULL;
+    spin_unlock_irqrestore(&wm.windows_lock, flags);
+    
+    // win->next stays intact, so a reader standing on win can walk on.
+    // Wait until nobody is.
+    synchronize_rcu();
 }
 
 void wm_focus_window(window_t* win) {